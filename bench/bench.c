@@ -0,0 +1,303 @@
+#include "CPU.h"
+#include "asm.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Interpreter throughput benchmarks. Each kernel is assembled in-tree with
+// AsmSource, run to its closing ebreak through CPUStep, and timed over a
+// number of trials after a warmup run.
+
+#define CODE_BASE 0x0002'0000
+#define DATA_BASE 0x0010'0000
+
+typedef struct {
+  const char *name;
+  const char *source;
+  void (*setup)();
+} Kernel;
+
+static const char alu[] =
+  "  lui   t0, 0x400\n"
+  "  addi  a0, zero, 1\n"
+  "  addi  a1, zero, 3\n"
+  "loop:\n"
+  "  add   a0, a0, a1\n"
+  "  xor   a1, a1, a0\n"
+  "  slli  a2, a0, 3\n"
+  "  sub   a0, a2, a1\n"
+  "  or    a3, a0, a1\n"
+  "  and   a1, a3, a2\n"
+  "  addi  t0, t0, -1\n"
+  "  bne   t0, zero, loop\n"
+  "  ebreak\n";
+
+// xorshift32 driving two unpredictable branches per iteration
+static const char branchy[] =
+  "  lui   t0, 0x200\n"
+  "  addi  a0, zero, 1234\n"
+  "loop:\n"
+  "  slli  a2, a0, 13\n"
+  "  xor   a0, a0, a2\n"
+  "  srli  a2, a0, 17\n"
+  "  xor   a0, a0, a2\n"
+  "  slli  a2, a0, 5\n"
+  "  xor   a0, a0, a2\n"
+  "  andi  a3, a0, 1\n"
+  "  beq   a3, zero, even\n"
+  "  addi  s0, s0, 1\n"
+  "  jal   zero, next\n"
+  "even:\n"
+  "  addi  s1, s1, 1\n"
+  "next:\n"
+  "  andi  a3, a0, 6\n"
+  "  bne   a3, zero, skip\n"
+  "  addi  s2, s2, 1\n"
+  "skip:\n"
+  "  addi  t0, t0, -1\n"
+  "  bne   t0, zero, loop\n"
+  "  ebreak\n";
+
+// 64 KiB word copy, four words per iteration
+static const char memcpy_[] =
+  "  addi  s0, zero, 256\n"
+  "outer:\n"
+  "  lui   a0, 0x100\n"
+  "  lui   a1, 0x110\n"
+  "  lui   a2, 0x10\n"
+  "  add   a2, a0, a2\n"
+  "copy:\n"
+  "  lw    t0, 0(a0)\n"
+  "  lw    t1, 4(a0)\n"
+  "  lw    t2, 8(a0)\n"
+  "  lw    t3, 12(a0)\n"
+  "  sw    t0, 0(a1)\n"
+  "  sw    t1, 4(a1)\n"
+  "  sw    t2, 8(a1)\n"
+  "  sw    t3, 12(a1)\n"
+  "  addi  a0, a0, 16\n"
+  "  addi  a1, a1, 16\n"
+  "  bltu  a0, a2, copy\n"
+  "  addi  s0, s0, -1\n"
+  "  bne   s0, zero, outer\n"
+  "  ebreak\n";
+
+// Walks the random cyclic list built by SetupChase
+static const char chase[] =
+  "  lui   a0, 0x100\n"
+  "  lui   t0, 0x100\n"
+  "loop:\n"
+  "  lw    a0, 0(a0)\n"
+  "  lw    a0, 0(a0)\n"
+  "  lw    a0, 0(a0)\n"
+  "  lw    a0, 0(a0)\n"
+  "  addi  t0, t0, -1\n"
+  "  bne   t0, zero, loop\n"
+  "  ebreak\n";
+
+// Calls, stack traffic, loads/stores and data-dependent branches in the
+// proportions of a Dhrystone or CoreMark style workload
+static const char mix[] =
+  "  addi  s0, zero, 1000\n"
+  "  lui   sp, 0xF0\n"
+  "outer:\n"
+  "  lui   s1, 0x100\n"
+  "  addi  s2, zero, 1024\n"
+  "inner:\n"
+  "  lw    a0, 0(s1)\n"
+  "  jal   ra, mix\n"
+  "  sw    a0, 0(s1)\n"
+  "  addi  s1, s1, 4\n"
+  "  addi  s2, s2, -1\n"
+  "  bne   s2, zero, inner\n"
+  "  addi  s0, s0, -1\n"
+  "  bne   s0, zero, outer\n"
+  "  ebreak\n"
+  "mix:\n"
+  "  addi  sp, sp, -8\n"
+  "  sw    s3, 0(sp)\n"
+  "  sw    s4, 4(sp)\n"
+  "  andi  s3, a0, 0xFF\n"
+  "  slti  s4, s3, 128\n"
+  "  beq   s4, zero, high\n"
+  "  add   a0, a0, s3\n"
+  "  jal   zero, done\n"
+  "high:\n"
+  "  xor   a0, a0, s3\n"
+  "  srli  a0, a0, 1\n"
+  "done:\n"
+  "  slli  t1, a0, 7\n"
+  "  xor   a0, a0, t1\n"
+  "  lw    s4, 4(sp)\n"
+  "  lw    s3, 0(sp)\n"
+  "  addi  sp, sp, 8\n"
+  "  jalr  zero, 0(ra)\n";
+
+
+static uint32_t Random(uint32_t *state) {
+  uint32_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return *state = x;
+}
+
+
+static void SetupData() {
+  uint32_t seed = 0x1234'5678;
+  for(uint32_t a = DATA_BASE; a < DATA_BASE + 0x2'0000; a += 4)
+    CPUWrite32(a, Random(&seed));
+}
+
+
+static void SetupChase() {
+  // One node per 64-byte line, visited in a random cyclic order
+  enum { NODES = 1 << 16, STRIDE = 64 };
+  uint32_t *order = malloc(NODES * sizeof *order);
+  uint32_t seed = 0x9E37'79B9;
+  for(uint32_t i = 0; i < NODES; i++)
+    order[i] = i;
+  for(uint32_t i = NODES - 1; i > 0; i--) {
+    uint32_t j = Random(&seed) % (i + 1), t = order[i];
+    order[i] = order[j];
+    order[j] = t;
+  }
+  for(uint32_t i = 0; i < NODES; i++)
+    CPUWrite32(DATA_BASE + order[i] * STRIDE, DATA_BASE + order[(i + 1) % NODES] * STRIDE);
+  free(order);
+}
+
+
+static const Kernel kernels[] = {
+  { "alu",     alu,     NULL       },
+  { "branchy", branchy, NULL       },
+  { "memcpy",  memcpy_, SetupData  },
+  { "chase",   chase,   SetupChase },
+  { "mix",     mix,     SetupData  },
+};
+
+
+static int LoadKernel(const Kernel *k) {
+  AsmImage image;
+  if(AsmSource(k->source, k->name, CODE_BASE, &image))
+    return -1;
+  memcpy(&mem[image.base], image.data, image.size);
+  AsmFree(&image);
+  return 0;
+}
+
+
+static double Now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+static uint64_t HostCycles() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+
+typedef struct {
+  uint64_t instructions;
+  double   seconds;
+  uint64_t cycles;
+} Trial;
+
+
+// Sets the data up again first, as kernels store into it, so that every
+// trial starts from the same state
+static int RunTrial(const Kernel *k, Trial *t) {
+  if(k->setup)
+    k->setup();
+  Reset();
+  reg[ZERO] = 0;
+  reg[PC] = CODE_BASE;
+
+  const unsigned budget = ~0u;
+  double start = Now();
+  uint64_t c0 = HostCycles();
+  unsigned remaining = CPUStep(budget);
+  t->cycles = HostCycles() - c0;
+  t->seconds = Now() - start;
+  t->instructions = budget - remaining;
+
+  // Every kernel ends on ebreak; stopping anywhere else is a failure
+  if(CPURead32(reg[PC]) != Assemble("ebreak")) {
+    fprintf(stderr, "stopped at %08X\n", reg[PC]);
+    return -1;
+  }
+  return 0;
+}
+
+
+static int CompareTrials(const void *a, const void *b) {
+  const Trial *ta = a, *tb = b;
+  return (ta->seconds > tb->seconds) - (ta->seconds < tb->seconds);
+}
+
+
+static int RunKernel(const Kernel *k, int trials, int warmup) {
+  memset(mem, 0, MEM_SIZE);
+  if(LoadKernel(k))
+    return -1;
+
+  Trial t[trials];
+  for(int i = 0; i < warmup; i++)
+    if(RunTrial(k, &t[0]))
+      return -1;
+  for(int i = 0; i < trials; i++)
+    if(RunTrial(k, &t[i]))
+      return -1;
+  qsort(t, trials, sizeof *t, CompareTrials);
+
+  const Trial *best = &t[0], *median = &t[trials / 2];
+  printf("%-8s %12llu %9.1f %9.1f %8.2f %8.2f\n", k->name,
+      (unsigned long long)median->instructions,
+      median->instructions / median->seconds * 1e-6,
+      best->instructions / best->seconds * 1e-6,
+      median->seconds * 1e9 / median->instructions,
+      (double)median->cycles / median->instructions);
+  return 0;
+}
+
+
+int main(int argc, char *argv[]) {
+  int trials = 5, warmup = 1, opt;
+  const char *only = NULL;
+  while((opt = getopt(argc, argv, "n:w:k:")) != -1) {
+    switch(opt) {
+    case 'n': trials = atoi(optarg); break;
+    case 'w': warmup = atoi(optarg); break;
+    case 'k': only = optarg;         break;
+    default:
+      fprintf(stderr, "usage: %s [-n trials] [-w warmup] [-k kernel]\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  if(trials < 1)
+    trials = 1;
+
+  printf("%-8s %12s %9s %9s %8s %8s\n",
+      "kernel", "instructions", "MIPS", "best", "ns/ins", "cyc/ins");
+  int failed = 0;
+  for(size_t i = 0; i < sizeof kernels / sizeof *kernels; i++) {
+    if(only && strcmp(only, kernels[i].name))
+      continue;
+    if(RunKernel(&kernels[i], trials, warmup)) {
+      printf("%-8s failed\n", kernels[i].name);
+      failed = 1;
+    }
+  }
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -1,13 +1,49 @@
 #include "CPU.h"
+#include "breakpoint.h"
+#include "clint.h"
+#include "events.h"
+#include "gdbstub.h"
+#include "heatmap.h"
+#include "lockstep.h"
+#include "mmio.h"
+#include "mmu.h"
+#include "profile.h"
+#include "stats.h"
+#include "symbols.h"
+#include "timing.h"
 #include <ctype.h>
-#include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+static uint8_t ram[MEM_SIZE]; // Until a machine is bound
 
 uint32_t reg[NUM_REGS];
-uint8_t  mem[MEM_SIZE];
-bool     breakpoint[MEM_SIZE / 4];
+uint8_t *mem = ram;
+CSRs     csr;
+uint64_t cpuTime;
+bool     cpuRealTime;
+bool     cpuSyncPoints;
+bool     cpuSynced;
+unsigned cpuHooks;
+
+static bool     yielded;  // The executor returned early for CPUStep to deliver interrupts
+static bool     polled;   // It returned after a load from a device
+static unsigned polledRd; // The register that load wrote
+static bool     waiting;  // It returned after wfi
+static uint64_t runEnd;   // cpuTime at the end of the executor's run
+static uint64_t idleTime; // Ticks of cpuTime that retired nothing
+static unsigned dataPriv; // The privilege level of paged loads and stores in this run
+static PollState poll;    // Polling's, saved with the hart
+
+#define POLL_LOOP    32          // Most instructions in a polling loop
+#define POLL_REPEATS 8           // Unchanged iterations before it counts as idle
+#define IDLE_SLICE   10'000      // Most ticks slept or skipped at once, 1 ms
+
+// How the hart stands after a run
+enum { AWAKE, IDLE, POLLING_CLOCK };
 
 const char *reg_names[NUM_REGS] = {
   "x0",  "x1",  "x2",  "x3",  "x4",  "x5",  "x6",  "x7",
@@ -33,28 +69,273 @@ int GetRegisterIndex(const char *name) {
 }
 
 
+static const struct {
+  uint16_t    number;
+  const char *name;
+} csrNames[] = {
+  { CSR_SSTATUS,   "sstatus"   }, { CSR_SIE,       "sie"       },
+  { CSR_STVEC,     "stvec"     }, { CSR_SSCRATCH,  "sscratch"  },
+  { CSR_SEPC,      "sepc"      }, { CSR_SCAUSE,    "scause"    },
+  { CSR_STVAL,     "stval"     }, { CSR_SIP,       "sip"       },
+  { CSR_SATP,      "satp"      }, { CSR_MEDELEG,   "medeleg"   },
+  { CSR_MIDELEG,   "mideleg"   },
+  { CSR_MSTATUS,   "mstatus"   }, { CSR_MISA,      "misa"      },
+  { CSR_MIE,       "mie"       }, { CSR_MTVEC,     "mtvec"     },
+  { CSR_MSCRATCH,  "mscratch"  }, { CSR_MEPC,      "mepc"      },
+  { CSR_MCAUSE,    "mcause"    }, { CSR_MTVAL,     "mtval"     },
+  { CSR_MIP,       "mip"       }, { CSR_MCYCLE,    "mcycle"    },
+  { CSR_MINSTRET,  "minstret"  }, { CSR_MCYCLEH,   "mcycleh"   },
+  { CSR_MINSTRETH, "minstreth" }, { CSR_CYCLE,     "cycle"     },
+  { CSR_TIME,      "time"      }, { CSR_INSTRET,   "instret"   },
+  { CSR_CYCLEH,    "cycleh"    }, { CSR_TIMEH,     "timeh"     },
+  { CSR_INSTRETH,  "instreth"  }, { CSR_MVENDORID, "mvendorid" },
+  { CSR_MARCHID,   "marchid"   }, { CSR_MIMPID,    "mimpid"    },
+  { CSR_MHARTID,   "mhartid"   },
+};
+
+int GetCSRNumber(const char *name) {
+  for(size_t i = 0; i < sizeof csrNames / sizeof *csrNames; i++)
+    if(!strcmp(csrNames[i].name, name))
+      return csrNames[i].number;
+  return -1;
+}
+
+
 void Reset() {
   for(int i = 0; i < NUM_REGS; i++)
     reg[i] = 0xDEAD'BEEF;
+  reg[ZERO] = 0;
+  csr = (CSRs){ .priv = PRIV_M, .mstatus = MSTATUS_MPP };
+  idleTime = 0;
+  MMUFlush();
+}
+
+
+void CPUSave(Hart *hart) {
+  memcpy(hart->reg, reg, sizeof reg);
+  hart->mem = mem;
+  hart->csr = csr;
+  hart->time = cpuTime;
+  hart->idleTime = idleTime;
+  hart->poll = poll;
+}
+
+
+void CPURestore(const Hart *hart) {
+  memcpy(reg, hart->reg, sizeof reg);
+  mem = hart->mem;
+  csr = hart->csr;
+  cpuTime = hart->time;
+  idleTime = hart->idleTime;
+  poll = hart->poll;
+  MMUFlush();
+}
+
+
+// The counters are views of the clock and ignore writes. Returns false for
+// a CSR that doesn't exist.
+static bool CSRRead(uint32_t n, uint32_t *value) {
+  switch(n) {
+  case CSR_SSTATUS:  *value = csr.mstatus & SSTATUS_MASK;         break;
+  case CSR_SIE:      *value = csr.mie & csr.mideleg;              break;
+  case CSR_STVEC:    *value = csr.stvec;                          break;
+  case CSR_SSCRATCH: *value = csr.sscratch;                       break;
+  case CSR_SEPC:     *value = csr.sepc;                           break;
+  case CSR_SCAUSE:   *value = csr.scause;                         break;
+  case CSR_STVAL:    *value = csr.stval;                          break;
+  case CSR_SIP:      *value = csr.mip & csr.mideleg;              break;
+  case CSR_SATP:     *value = csr.satp;                           break;
+  case CSR_MSTATUS:  *value = csr.mstatus;                        break;
+  case CSR_MISA:     *value = 1u << 30 | 1 << ('I' - 'A') | 1 << ('S' - 'A') | 1 << ('U' - 'A'); break;
+  case CSR_MEDELEG:  *value = csr.medeleg;                        break;
+  case CSR_MIDELEG:  *value = csr.mideleg;                        break;
+  case CSR_MIE:      *value = csr.mie;                            break;
+  case CSR_MTVEC:    *value = csr.mtvec;                          break;
+  case CSR_MSCRATCH: *value = csr.mscratch;                       break;
+  case CSR_MEPC:     *value = csr.mepc;                           break;
+  case CSR_MCAUSE:   *value = csr.mcause;                         break;
+  case CSR_MTVAL:    *value = csr.mtval;                          break;
+  case CSR_MIP:      *value = csr.mip;                            break;
+  case CSR_MCYCLE:   case CSR_CYCLE:     *value = cpuTime;             break;
+  case CSR_MCYCLEH:  case CSR_CYCLEH:    *value = cpuTime >> 32;       break;
+  case CSR_MINSTRET: case CSR_INSTRET:   *value = cpuTime - idleTime;  break;
+  case CSR_MINSTRETH: case CSR_INSTRETH: *value = (cpuTime - idleTime) >> 32; break;
+  case CSR_TIME:     *value = ClintTime();                        break;
+  case CSR_TIMEH:    *value = ClintTime() >> 32;                  break;
+  case CSR_MVENDORID: case CSR_MARCHID: case CSR_MIMPID: case CSR_MHARTID:
+                     *value = 0;                                  break;
+  default:           return false;
+  }
+  return true;
+}
+
+
+// Replaces the bits of mask in *r
+static void Update(uint32_t *r, uint32_t mask, uint32_t value) {
+  *r = (*r & ~mask) | (value & mask);
+}
+
+
+// Writes mstatus, keeping MPP to a level that exists. Changes to SUM and
+// MXR change what the TLBs allow.
+static void WriteStatus(uint32_t mask, uint32_t value) {
+  if((value & MSTATUS_MPP) == 2 << 11)
+    mask &= ~MSTATUS_MPP;
+  uint32_t old = csr.mstatus;
+  Update(&csr.mstatus, mask, value);
+  if((old ^ csr.mstatus) & (MSTATUS_SUM | MSTATUS_MXR))
+    MMUFlush();
+}
+
+
+// Returns false for a CSR that doesn't exist or is read-only
+static bool CSRWrite(uint32_t n, uint32_t value) {
+  if(n >> 10 == 3)
+    return false;
+  switch(n) {
+  case CSR_SSTATUS:  WriteStatus(SSTATUS_MASK, value);                                  break;
+  case CSR_SIE:      Update(&csr.mie, csr.mideleg, value);                              break;
+  case CSR_STVEC:    csr.stvec = value & ~2;                                            break;
+  case CSR_SSCRATCH: csr.sscratch = value;                                              break;
+  case CSR_SEPC:     csr.sepc = value & ~3;                                             break;
+  case CSR_SCAUSE:   csr.scause = value;                                                break;
+  case CSR_STVAL:    csr.stval = value;                                                 break;
+  case CSR_SIP:      Update(&csr.mip, csr.mideleg & MIP_SSIP, value);                   break;
+  case CSR_SATP:
+    // Sv32 or bare, without address space identifiers
+    csr.satp = value & (SATP_MODE | SATP_PPN);
+    MMUFlush();
+    break;
+  case CSR_MSTATUS:
+    WriteStatus(SSTATUS_MASK | MSTATUS_MIE | MSTATUS_MPIE | MSTATUS_MPP | MSTATUS_MPRV, value);
+    break;
+  case CSR_MEDELEG:  csr.medeleg = value & 0xB3FF; // Not ecall from machine mode
+                     break;
+  case CSR_MIDELEG:  csr.mideleg = value & MIP_S;                                       break;
+  case CSR_MIE:      csr.mie = value & (MIP_S | MIP_MSIP | MIP_MTIP | MIP_MEIP);        break;
+  case CSR_MIP:      Update(&csr.mip, MIP_S, value);                                    break;
+  case CSR_MTVEC:    csr.mtvec = value & ~2;                                             break;
+  case CSR_MSCRATCH: csr.mscratch = value;                                               break;
+  case CSR_MEPC:     csr.mepc = value & ~3;                                              break;
+  case CSR_MCAUSE:   csr.mcause = value;                                                 break;
+  case CSR_MTVAL:    csr.mtval = value;                                                  break;
+  case CSR_MISA:
+  case CSR_MCYCLE: case CSR_MINSTRET: case CSR_MCYCLEH: case CSR_MINSTRETH:
+    break;
+  default:
+    return false;
+  }
+  return true;
+}
+
+
+void CPUInterrupt(uint32_t mip, bool level) {
+  csr.mip = level ? csr.mip | mip : csr.mip & ~mip;
+}
+
+
+// Traps below machine mode that machine mode delegated go to the supervisor
+static bool Delegated(uint32_t cause) {
+  uint32_t delegated = cause & CAUSE_INTERRUPT ? csr.mideleg : csr.medeleg;
+  return csr.priv <= PRIV_S && delegated >> (cause & 31) & 1;
+}
+
+
+// The handler's address for a trap vector, which for interrupts in
+// vectored mode is indexed by the cause
+static uint32_t Vector(uint32_t tvec, uint32_t cause) {
+  uint32_t base = tvec & ~3;
+  if(cause & CAUSE_INTERRUPT && tvec & 1)
+    base += 4 * (cause & ~CAUSE_INTERRUPT);
+  return base;
+}
+
+
+// Enters the handler at mtvec, or at stvec if delegated, saving the
+// interrupt enable and privilege level to return to
+static void Trap(uint32_t cause, uint32_t tval) {
+  if(Delegated(cause)) {
+    csr.sepc = reg[PC];
+    csr.scause = cause;
+    csr.stval = tval;
+    Update(&csr.mstatus, MSTATUS_SIE | MSTATUS_SPIE | MSTATUS_SPP,
+           (csr.mstatus & MSTATUS_SIE ? MSTATUS_SPIE : 0) | csr.priv << 8);
+    csr.priv = PRIV_S;
+    reg[PC] = Vector(csr.stvec, cause);
+  } else {
+    csr.mepc = reg[PC];
+    csr.mcause = cause;
+    csr.mtval = tval;
+    Update(&csr.mstatus, MSTATUS_MIE | MSTATUS_MPIE | MSTATUS_MPP,
+           (csr.mstatus & MSTATUS_MIE ? MSTATUS_MPIE : 0) | csr.priv << 11);
+    csr.priv = PRIV_M;
+    reg[PC] = Vector(csr.mtvec, cause);
+  }
+}
+
+
+// Traps if the guest installed a handler. Otherwise returns false, and the
+// executor stops at the instruction as it did before traps existed.
+static __attribute__((noinline, cold)) bool Exception(uint32_t cause, uint32_t tval) {
+  if(!(Delegated(cause) ? csr.stvec : csr.mtvec))
+    return false;
+  Trap(cause, tval);
+  return true;
+}
+
+
+// Returns from a trap: mret or sret
+static void Return(bool machine) {
+  if(machine) {
+    reg[PC] = csr.mepc;
+    csr.priv = csr.mstatus >> 11 & 3;
+    Update(&csr.mstatus, MSTATUS_MIE | MSTATUS_MPIE | MSTATUS_MPP,
+           (csr.mstatus & MSTATUS_MPIE ? MSTATUS_MIE : 0) | MSTATUS_MPIE);
+  } else {
+    reg[PC] = csr.sepc;
+    csr.priv = csr.mstatus >> 8 & 1;
+    Update(&csr.mstatus, MSTATUS_SIE | MSTATUS_SPIE | MSTATUS_SPP,
+           (csr.mstatus & MSTATUS_SPIE ? MSTATUS_SIE : 0) | MSTATUS_SPIE);
+  }
+  if(csr.priv != PRIV_M)
+    csr.mstatus &= ~MSTATUS_MPRV;
+}
+
+
+// The interrupt to take now, or 0. Interrupts for machine mode come first,
+// then external, software and timer interrupts in that order.
+static uint32_t PendingInterrupt() {
+  static const uint8_t order[] = { 11, 3, 7, 9, 1, 5 };
+  uint32_t pending = csr.mip & csr.mie;
+  uint32_t machine = pending & ~csr.mideleg, supervisor = pending & csr.mideleg;
+  if(csr.priv == PRIV_M && !(csr.mstatus & MSTATUS_MIE))
+    machine = 0;
+  if(csr.priv == PRIV_M || (csr.priv == PRIV_S && !(csr.mstatus & MSTATUS_SIE)))
+    supervisor = 0;
+  pending = machine ? machine : supervisor;
+  for(unsigned i = 0; pending && i < sizeof order; i++)
+    if(pending >> order[i] & 1)
+      return CAUSE_INTERRUPT | order[i];
+  return 0;
 }
 
 void CPUWrite32(uint32_t a, uint32_t v) {
-  if(a + 3 < MEM_SIZE) {
+  if(a < MEM_SIZE - 3) {
     mem[a+0] = v;
     mem[a+1] = v >> 8;
     mem[a+2] = v >> 16;
     mem[a+3] = v >> 24;
   } else {
-    // TODO: Exception
+    MMIOWrite(a, v, 4);
   }
 }
 
 void CPUWrite16(uint32_t a, uint16_t v) {
-  if(a + 1 < MEM_SIZE) {
+  if(a < MEM_SIZE - 1) {
     mem[a+0] = v;
     mem[a+1] = v >> 8;
   } else {
-    // TODO: Exception
+    MMIOWrite(a, v, 2);
   }
 }
 
@@ -62,7 +343,7 @@ void CPUWrite8(uint32_t a, uint8_t v) {
   if(a < MEM_SIZE) {
     mem[a] = v;
   } else {
-    // TODO: Exception
+    MMIOWrite(a, v, 1);
   }
 }
 
@@ -70,37 +351,34 @@ static uint32_t CPURead32_Unchecked(uint32_t a) {
   return mem[a+0] | mem[a+1] << 8 | mem[a+2] << 16 | mem[a+3] << 24;
 }
 
-static uint16_t CPURead16_Unchecked(uint16_t a) {
+static uint16_t CPURead16_Unchecked(uint32_t a) {
   return mem[a+0] | mem[a+1] << 8;
 }
 
 uint32_t CPURead32(uint32_t a) {
-  if(a + 3 < MEM_SIZE) {
+  if(a < MEM_SIZE - 3) {
     return CPURead32_Unchecked(a);
   } else {
-    // TODO: Exception
-    return 0;
+    return MMIORead(a, 4);
   }
 }
 
 uint16_t CPURead16(uint32_t a) {
-  if(a + 1 < MEM_SIZE) {
+  if(a < MEM_SIZE - 1) {
     return CPURead16_Unchecked(a);
   } else {
-    // TODO: Exception
-    return 0;
+    return MMIORead(a, 2);
   }
 }
 
 uint32_t CPURead16SE32(uint32_t a) {
-  if(a + 1 < MEM_SIZE) {
+  if(a < MEM_SIZE - 1) {
     uint32_t h = CPURead16_Unchecked(a);
     if(h & 0x0000'8000)
       h |= 0xFFFF'0000;
     return h;
   } else {
-    // TODO: Exception
-    return 0;
+    return (int16_t)MMIORead(a, 2);
   }
 }
 
@@ -108,8 +386,7 @@ uint8_t CPURead8(uint32_t a) {
   if(a < MEM_SIZE) {
     return mem[a];
   } else {
-    // TODO: Exception
-    return 0;
+    return MMIORead(a, 1);
   }
 }
 
@@ -120,8 +397,7 @@ uint32_t CPURead8SE32(uint32_t a) {
       b |= 0xFFFF'FF00;
     return b;
   } else {
-    // TODO: Exception
-    return 0;
+    return (int8_t)MMIORead(a, 1);
   }
 }
 
@@ -134,8 +410,8 @@ static int32_t DecodeIMMJ(uint32_t ins) {
   if(ins & 0x8000'0000)
     imm |= 0xFFF0'0000;
   imm |=  ins & 0x000F'F000;
-  imm |= (ins & 0x0001'0000) >> 9;
-  imm |= (ins & 0x07FE'0000) >> 20;
+  imm |= (ins & 0x0010'0000) >> 9;
+  imm |= (ins & 0x7FE0'0000) >> 20;
   return imm;
 }
 
@@ -161,7 +437,7 @@ static int32_t DecodeIMMB(uint32_t ins) {
   if(ins & 0x8000'0000)
     imm |= 0xFFFF'F000;
   imm |= (ins & 0x7E00'0000) >> 20;
-  imm |= (ins & 0x0000'0F00) >> 6;
+  imm |= (ins & 0x0000'0F00) >> 7;
   imm |= (ins & 0x0000'0080) << 4;
   return imm;
 }
@@ -180,354 +456,851 @@ static int32_t DecodeIMMB(uint32_t ins) {
 #define sreg (int32_t)reg
 #define uimm (uint32_t)imm
 
-unsigned CPUStep(unsigned cycles) {
-  if(cycles == 0)
-    return 0;
-  if(reg[PC] & 3) // TODO: Misaligned
-    goto invalid;
-  uint32_t ins = CPURead32(reg[PC]);
-  uint32_t opc = ins & 0x7F;
+#define STAT(C) do {\
+    if(hooked && cpuHooks & CPU_HOOK_STATS) {\
+      stats.retired[STAT_##C]++;\
+      stats.blockEnd |= STAT_##C >= STAT_BRANCH_TAKEN;\
+    }\
+  } while(0)
 
-  if((opc & 0b11) != 0b11)
-    goto invalid;
-  RD RS1 RS2
-  switch(opc >> 2) { 
-  case 0b01101: {IMM_U reg[rd] = imm_u; reg[PC] += 4; }         break; // lui
-  case 0b00101: {IMM_U reg[rd] = reg[PC] + imm_u; reg[PC] += 4;}break; // auipc
-  case 0b11011: {IMM_J reg[rd] = reg[PC] + 4; reg[PC] += imm_j;}break; // jal
-  case 0b11001: {IMM_I reg[rd] = reg[PC] + 4; reg[PC] = (reg[rs1] + imm_i) & ~1; } break; // jalr
-  case 0b11000: {IMM_B F3 
-    switch(f3) {
-    case 0b000: reg[PC] += reg [rs1] == reg [rs2] ? imm_b : 4;  break; // beq
-    case 0b001: reg[PC] += reg [rs1] != reg [rs2] ? imm_b : 4;  break; // bne
-    case 0b100: reg[PC] += sreg[rs1] <  sreg[rs2] ? imm_b : 4;  break; // blt
-    case 0b101: reg[PC] += sreg[rs1] >= sreg[rs2] ? imm_b : 4;  break; // bge
-    case 0b110: reg[PC] += reg [rs1] <  reg [rs2] ? imm_b : 4;  break; // bltu
-    case 0b111: reg[PC] += reg [rs1] >= reg [rs2] ? imm_b : 4;  break; // bgeu
-    default: goto invalid;
-    }
-  } break;
-  case 0b00000: {IMM_I F3
-    switch(f3) {
-    case 0b000: reg[rd] = CPURead8SE32 (reg[rs1] + imm_i);      break; // lb
-    case 0b001: reg[rd] = CPURead16SE32(reg[rs1] + imm_i);      break; // lh
-    case 0b010: reg[rd] = CPURead32    (reg[rs1] + imm_i);      break; // lw
-    case 0b100: reg[rd] = CPURead8     (reg[rs1] + imm_i);      break; // lbu
-    case 0b101: reg[rd] = CPURead16    (reg[rs1] + imm_i);      break; // lhu
-    default: goto invalid;
-    } reg[PC] += 4;
-  } break;
-  case 0b01000: {IMM_S F3
-    switch(f3) {
-    case 0b000: CPUWrite8 (reg[rs1] + imm_s, reg[rs2]);         break; // sb
-    case 0b001: CPUWrite16(reg[rs1] + imm_s, reg[rs2]);         break; // sh
-    case 0b010: CPUWrite32(reg[rs1] + imm_s, reg[rs2]);         break; // sw
-    default: goto invalid;
-    } reg[PC] += 4;
-  } break;
-  case 0b00100: {IMM_I F3
-    switch(f3) {
-    case 0b000: reg[rd] = reg [rs1] +  imm_i;                   break; // addi
-    case 0b001: reg[rd] = reg [rs1] << rs2;                     break; // slli
-    case 0b010: reg[rd] = sreg[rs1] <  imm_i;                   break; // slti
-    case 0b011: reg[rd] = reg [rs1] <  (uint32_t)imm_i;         break; // sltiu
-    case 0b100: reg[rd] = reg [rs1] &  imm_i;                   break; // xori
-    case 0b101: { F7
-      if(f7 & 0x40) reg[rd] = reg [rs1] >> rs2;                        // srli
-      else          reg[rd] = sreg[rs1] >> rs2;                        // srai
+// Brings cpuTime up to the current instruction for the devices it accesses
+#define SYNC() (cpuTime = runEnd - cycles)
+
+// Returns after the current instruction, which may have raised an
+// interrupt, unless a hook stops there anyway
+#define YIELD() do {\
+    reg[0] = 0;\
+    if(hooked && cpuHooks & CPU_HOOK_STATS)\
+      stats.instructions++;\
+    cycles--;\
+    yielded = !stop;\
+    goto done;\
+  } while(0)
+
+// Returns after an instruction that trapped, which also ends the run
+#define TRAPPED() do {\
+    cycles--;\
+    yielded = true;\
+    goto done;\
+  } while(0)
+
+// Translates the address A of a paged access, or raises the fault and
+// returns
+#define TRANSLATE(A, SIZE, ACCESS, PRIV) do {\
+    uint32_t va = A, cause = MMUTranslate(&A, SIZE, ACCESS, PRIV);\
+    if(cause) {\
+      if(Exception(cause, va))\
+        TRAPPED();\
+      goto done;\
+    }\
+  } while(0)
+
+// Raises a misaligned fetch for a jump or taken branch to TARGET, which
+// then isn't taken
+#define MISALIGNED(TARGET) do {\
+    if(Exception(CAUSE_MISALIGNED_FETCH, TARGET))\
+      TRAPPED();\
+    goto done;\
+  } while(0)
+
+// Executes up to `cycles` instructions. The body is instantiated by CPUStep
+// with hooked == false, where every hook compiles away, and with the
+// instrumentation enabled by cpuHooks, each with and without paging. Paged
+// runs translate loads and stores at dataPriv, and instruction fetches
+// below machine mode.
+static inline __attribute__((always_inline))
+unsigned Execute(unsigned cycles, const bool hooked, const bool paged) {
+  bool stop = false; // Set by hooks to return after the current instruction
+  for(; cycles; cycles--) {
+    uint32_t pc = reg[PC];
+    if(pc & 3) // Jumps check their targets; this catches a PC set from outside
+      MISALIGNED(pc);
+    if(hooked && cpuHooks & CPU_HOOK_BREAK && IsBreakpoint(pc) && BreakpointHit(pc))
+      goto done;
+    if(hooked && cpuHooks & CPU_HOOK_PROFILE && --profileCountdown == 0)
+      ProfileSample(reg[PC]);
+    if(hooked && cpuHooks & CPU_HOOK_STATS && stats.blockEnd)
+      StatsBlock(reg[PC]);
+    if(hooked && cpuHooks & CPU_HOOK_TIMING)
+      TimingFetch(reg[PC]);
+    if(hooked && cpuHooks & CPU_HOOK_HEAT)
+      HeatmapCount(HEAT_EXEC, reg[PC]);
+    uint32_t fetch = pc;
+    if(paged && csr.priv != PRIV_M)
+      TRANSLATE(fetch, 4, ACCESS_EXEC, csr.priv);
+    uint32_t ins = CPURead32(fetch);
+    uint32_t opc = ins & 0x7F;
+
+    if((opc & 0b11) != 0b11)
+      goto invalid;
+    RD RS1 RS2
+    switch(opc >> 2) { 
+    case 0b01101: {IMM_U reg[rd] = imm_u; reg[PC] += 4; STAT(ALU); }  break; // lui
+    case 0b00101: {IMM_U reg[rd] = reg[PC] + imm_u; reg[PC] += 4; STAT(ALU); } break; // auipc
+    case 0b11011: {IMM_J if(imm_j & 3) MISALIGNED(reg[PC] + imm_j);
+      reg[rd] = reg[PC] + 4; reg[PC] += imm_j; STAT(JUMP);  // jal
+      if(hooked && rd == RA && cpuHooks & CPU_HOOK_PROFILE)
+        ProfileCall(reg[PC], reg[RA]);
+    } break;
+    case 0b11001: {IMM_I F3 uint32_t t = (reg[rs1] + imm_i) & ~1;       // jalr
+      if(f3) goto invalid;
+      if(t & 3) MISALIGNED(t);
+      reg[rd] = reg[PC] + 4; reg[PC] = t; STAT(JUMP);
+      if(hooked && cpuHooks & CPU_HOOK_PROFILE) {
+        if(rd == RA)
+          ProfileCall(t, reg[RA]);
+        else if(rd == ZERO && rs1 == RA)
+          ProfileReturn(t);
+      }
     } break;
-    case 0b110: reg[rd] = reg[rs1] | imm_i;                     break; // ori
-    case 0b111: reg[rd] = reg[rs1] & imm_i;                     break; // andi
-    } reg[PC] += 4;
-  } break;
-  case 0b01100: {F3
-    switch(f3) {
-    case 0b000: { F7
-      if(f7 & 0x40) reg[rd] = reg[rs1] - reg[rs2];                     // sub
-      else          reg[rd] = reg[rs1] + reg[rs2];                     // add
+    case 0b11000: {IMM_B F3 bool taken;
+      switch(f3) {
+      case 0b000: taken = reg [rs1] == reg [rs2];                 break; // beq
+      case 0b001: taken = reg [rs1] != reg [rs2];                 break; // bne
+      case 0b100: taken = sreg[rs1] <  sreg[rs2];                 break; // blt
+      case 0b101: taken = sreg[rs1] >= sreg[rs2];                 break; // bge
+      case 0b110: taken = reg [rs1] <  reg [rs2];                 break; // bltu
+      case 0b111: taken = reg [rs1] >= reg [rs2];                 break; // bgeu
+      default: goto invalid;
+      }
+      if(taken && imm_b & 3)
+        MISALIGNED(reg[PC] + imm_b);
+      if(hooked && cpuHooks & CPU_HOOK_TIMING)
+        TimingBranch(reg[PC], taken);
+      reg[PC] += taken ? imm_b : 4;
+      if(taken) STAT(BRANCH_TAKEN);
+      else      STAT(BRANCH_NOT_TAKEN);
     } break;
-    case 0b001: reg[rd] = reg [rs1]  << (reg [rs2] & 0x1F);     break; // sll
-    case 0b010: reg[rd] = sreg[rs1]  <   sreg[rs2];             break; // slt
-    case 0b011: reg[rd] = reg [rs1]  <   reg [rs2];             break; // sltu
-    case 0b100: reg[rd] = reg [rs1]  ^   reg [rs2];             break; // xor
-    case 0b101: { F7
-      if(f7 & 0x40) reg[rd] =  reg[rs1] >> (reg[rs2] & 0x1f);          // srl
-      else          reg[rd] = sreg[rs1] >> (reg[rs2] & 0x1f);          // sra
+    case 0b00000: {IMM_I F3 uint32_t a = reg[rs1] + imm_i;
+      if(paged)
+        TRANSLATE(a, 1 << (f3 & 3), ACCESS_READ, dataPriv);
+      if(a >= MEM_SIZE - 3) SYNC();
+      switch(f3) {
+      case 0b000: reg[rd] = CPURead8SE32 (a);                     break; // lb
+      case 0b001: reg[rd] = CPURead16SE32(a);                     break; // lh
+      case 0b010: reg[rd] = CPURead32    (a);                     break; // lw
+      case 0b100: reg[rd] = CPURead8     (a);                     break; // lbu
+      case 0b101: reg[rd] = CPURead16    (a);                     break; // lhu
+      default: goto invalid;
+      } reg[PC] += 4; STAT(LOAD);
+      if(hooked && cpuHooks & CPU_HOOK_TIMING) TimingData(a);
+      if(hooked && cpuHooks & CPU_HOOK_STATS) stats.bytesRead += 1 << (f3 & 3);
+      if(hooked && cpuHooks & CPU_HOOK_WATCH) stop |= GdbWatch(a, 1 << (f3 & 3), false);
+      if(hooked && cpuHooks & CPU_HOOK_HEAT) HeatmapCount(HEAT_READ, a);
+      if(a >= MEM_SIZE - 3) {
+        polled = true;
+        polledRd = rd;
+        YIELD();
+      }
     } break;
-    case 0b110: reg[rd] = reg[rs1] | reg[rs2];                  break; // or
-    case 0b111: reg[rd] = reg[rs1] & reg[rs2];                  break; // and
-    } reg[PC] += 4;
-  }
-  default:
-  invalid:
-    return cycles;
+    case 0b01000: {IMM_S F3 uint32_t a = reg[rs1] + imm_s;
+      if(paged)
+        TRANSLATE(a, 1 << (f3 & 3), ACCESS_WRITE, dataPriv);
+      if(a >= MEM_SIZE - 3) SYNC();
+      if(hooked && cpuHooks & CPU_HOOK_LOCKSTEP && f3 <= 0b010)
+        LockstepWrite(a, 1 << f3, reg[rs2]);
+      switch(f3) {
+      case 0b000: CPUWrite8 (a, reg[rs2]);                        break; // sb
+      case 0b001: CPUWrite16(a, reg[rs2]);                        break; // sh
+      case 0b010: CPUWrite32(a, reg[rs2]);                        break; // sw
+      default: goto invalid;
+      } reg[PC] += 4; STAT(STORE);
+      if(hooked && cpuHooks & CPU_HOOK_TIMING) TimingData(a);
+      if(hooked && cpuHooks & CPU_HOOK_STATS) stats.bytesWritten += 1 << (f3 & 3);
+      if(hooked && cpuHooks & CPU_HOOK_WATCH) stop |= GdbWatch(a, 1 << f3, true);
+      if(hooked && cpuHooks & CPU_HOOK_HEAT) HeatmapCount(HEAT_WRITE, a);
+      if(a >= MEM_SIZE - 3) YIELD();
+    } break;
+    case 0b00100: {IMM_I F3
+      switch(f3) {
+      case 0b000: reg[rd] = reg [rs1] +  imm_i;                   break; // addi
+      case 0b001: if(ins >> 25) goto invalid;
+                  reg[rd] = reg [rs1] << rs2;                     break; // slli
+      case 0b010: reg[rd] = sreg[rs1] <  imm_i;                   break; // slti
+      case 0b011: reg[rd] = reg [rs1] <  (uint32_t)imm_i;         break; // sltiu
+      case 0b100: reg[rd] = reg [rs1] ^  imm_i;                   break; // xori
+      case 0b101: { F7
+        if(f7 & ~0x20) goto invalid;
+        if(f7 & 0x20) reg[rd] = sreg[rs1] >> rs2;                        // srai
+        else          reg[rd] = reg [rs1] >> rs2;                        // srli
+      } break;
+      case 0b110: reg[rd] = reg[rs1] | imm_i;                     break; // ori
+      case 0b111: reg[rd] = reg[rs1] & imm_i;                     break; // andi
+      } reg[PC] += 4; STAT(ALU);
+    } break;
+    case 0b01100: {F3 F7
+      // Only add and srl have a second form, sub and sra
+      if(f7 & ~(f3 == 0b000 || f3 == 0b101 ? 0x20 : 0))
+        goto invalid;
+      switch(f3) {
+      case 0b000:
+        if(f7 & 0x20) reg[rd] = reg[rs1] - reg[rs2];                     // sub
+        else          reg[rd] = reg[rs1] + reg[rs2];                     // add
+        break;
+      case 0b001: reg[rd] = reg [rs1]  << (reg [rs2] & 0x1F);     break; // sll
+      case 0b010: reg[rd] = sreg[rs1]  <   sreg[rs2];             break; // slt
+      case 0b011: reg[rd] = reg [rs1]  <   reg [rs2];             break; // sltu
+      case 0b100: reg[rd] = reg [rs1]  ^   reg [rs2];             break; // xor
+      case 0b101:
+        if(f7 & 0x20) reg[rd] = sreg[rs1] >> (reg[rs2] & 0x1f);          // sra
+        else          reg[rd] =  reg[rs1] >> (reg[rs2] & 0x1f);          // srl
+        break;
+      case 0b110: reg[rd] = reg[rs1] | reg[rs2];                  break; // or
+      case 0b111: reg[rd] = reg[rs1] & reg[rs2];                  break; // and
+      } reg[PC] += 4; STAT(ALU);
+    } break;
+    case 0b00011: {F3                                             // fence, fence.i
+      // Accesses are in order and nothing caches instructions, so these
+      // have nothing to do
+      if(f3 == 0 ? ins & 0xF00F'8F80 : ins != 0x0000'100F)
+        goto invalid;
+      reg[PC] += 4; STAT(ALU);
+    } break;
+    case 0b11100: {F3 SYNC();
+      if(f3 == 0) {
+        switch(ins) {
+        case 0x0000'0073:                                                // ecall
+          if(Exception(CAUSE_ECALL_U + csr.priv, 0))
+            TRAPPED();
+          goto done;
+        case 0x0010'0073:                                                // ebreak
+          goto done; // Stops as for a debugger, without a trap
+        case 0x3020'0073:                                                // mret
+        case 0x1020'0073:                                                // sret
+          if(csr.priv < (ins == 0x3020'0073 ? PRIV_M : PRIV_S))
+            goto invalid;
+          Return(ins == 0x3020'0073);
+          STAT(JUMP);
+          YIELD();
+        case 0x1050'0073:                                                // wfi
+          reg[PC] += 4; STAT(ALU);
+          waiting = true;
+          YIELD();
+        default:
+          if(ins >> 25 != 0b0001001 || rd != ZERO || csr.priv == PRIV_U)
+            goto invalid;
+          MMUFlush();                                                    // sfence.vma
+          reg[PC] += 4; STAT(ALU);
+          YIELD();
+        }
+      }
+      // csrrw, csrrs, csrrc and their immediate forms, which take rs1 as
+      // the value. Only csrrw writes with x0 or 0.
+      uint32_t n = ins >> 20, value = f3 & 4 ? rs1 : reg[rs1], old;
+      bool write = (f3 & 3) == 1 || rs1 != ZERO;
+      if(f3 == 4 || (n >> 8 & 3) > csr.priv || !CSRRead(n, &old))
+        goto invalid;
+      switch(f3 & 3) {
+      case 0b10: value |= old;         break;
+      case 0b11: value = old & ~value; break;
+      }
+      if(write && !CSRWrite(n, value))
+        goto invalid;
+      reg[rd] = old; reg[PC] += 4; STAT(ALU);
+      YIELD();
+    } break;
+    default:
+    invalid:
+      if(Exception(CAUSE_ILLEGAL, ins))
+        TRAPPED();
+      goto done;
+    }
+    reg[0] = 0;
+    if(hooked && cpuHooks & CPU_HOOK_STATS)
+      stats.instructions++;
+    // Lockstep compares state at the end of every block
+    if(hooked && (stop || (cpuHooks & CPU_HOOK_LOCKSTEP && reg[PC] != pc + 4))) {
+      cycles--;
+      goto done;
+    }
   }
-  reg[0] = 0;
 
-  return CPUStep(cycles - 1);
+done:
+  return cycles;
 }
 
-int AssembleScan(const char *str, const char *fmt, ...) {
-  va_list args;
-  va_start(args, fmt);
+#undef STAT
+#undef SYNC
+#undef YIELD
+#undef TRAPPED
+#undef TRANSLATE
 
-  const char *f = fmt;
-  const char *s = str;
-  while(*f) {
-    // Any number of spaces
-    if(*f == ' ') {
-      while(*s && isspace(*s))
-        s++;
-      f++;
-    }
+// Kept apart from CPUStep's loop, whose state would otherwise compete for
+// registers with the executor's
+static __attribute__((noinline)) unsigned ExecutePlain(unsigned cycles) {
+  return Execute(cycles, false, false);
+}
 
-    // Format specifier
-    else if(*f == '%') {
-      if(!*s)
-        return -1;
-      if(f[1] == 'r') { // Register name
-        const char *end = s;
-        while(*end && isalnum(*end))
-          end++;
-        size_t len = end - s;
-        if(len == 0 || len >= 16)
-          return -1;
-        char tmp[16];
-        strncpy(tmp, s, len);
-        tmp[len] = 0;
-        int idx = 0;
-        for(; idx < NUM_BASE_REGS; idx++)
-          if(!strcmp(tmp, reg_names[idx]) || !strcmp(tmp, reg_anames[idx]))
-            break;
-        if(idx == NUM_BASE_REGS)
-          return -1;
-        *va_arg(args, uint32_t*) = idx;
-        s = end;
-      }
+static __attribute__((noinline)) unsigned ExecuteHooked(unsigned cycles) {
+  return Execute(cycles, true, false);
+}
 
-      else if(f[1] == 'i') { // Immediate value
-        int32_t imm = 0;
-        if(!strncmp(s, "0x", 2)) {
-          s += 2;
-          int i = 0;
-          for(; i < 8; i++) {
-            const char *hex = "0123456789ABCDEF";
-            const char *idx = strchr(hex, toupper(*s));
-            if(idx) {
-              s++;
-              imm <<= 4;
-              imm |= (idx - hex) & 0xF;
-            } else
-              break;
-          }
-          if(i == 0)
-            return -1;
-          *va_arg(args, int32_t*) = imm;
-        } else {
-          bool neg = false;
-          if(*s == '-') {
-            neg = true;
-            s++;
-          }
-          int64_t val = 0;
-          while(isdigit(*s)) {
-            val *= 10;
-            val += *s - '0';
-            s++;
-          }
-          if(neg)
-            val = -val;
-          if(val > UINT32_MAX || val < INT32_MIN)
-            return -1;
-          *va_arg(args, int32_t*) = val;
-        } 
-      }
+static __attribute__((noinline)) unsigned ExecutePaged(unsigned cycles) {
+  return Execute(cycles, false, true);
+}
+
+static __attribute__((noinline)) unsigned ExecutePagedHooked(unsigned cycles) {
+  return Execute(cycles, true, true);
+}
+
+// After a run ended on a load from a device, tells whether the hart is
+// polling: back at the same load within a few instructions, with only the
+// loaded register changed since, several times over. If the value itself
+// keeps changing, the device is a clock.
+static int Polling() {
+  unsigned rd = polledRd;
+  uint32_t loaded = reg[rd];
+  uint64_t retired = cpuTime - idleTime;
+  reg[rd] = poll.reg[rd];
+  bool same = retired - poll.retired <= POLL_LOOP && !memcmp(reg, poll.reg, sizeof reg);
+  reg[rd] = loaded;
+  bool clock = rd != ZERO && loaded != poll.reg[rd];
+  memcpy(poll.reg, reg, sizeof reg);
+  poll.retired = retired;
+  poll.repeats = same ? poll.repeats + 1 : 0;
+  return poll.repeats < POLL_REPEATS ? AWAKE : clock ? POLLING_CLOCK : IDLE;
+}
 
-      else
-        return -1;
 
-      f += 2;
+// Sleeps for the time between cpuTime and target at CPU_TIME_HZ. Back to
+// back sleeps continue from where the last should have ended, so that the
+// host's lateness in waking doesn't add up.
+static void Sleep(uint64_t target) {
+  enum { NS = 1'000'000'000, NS_PER_TICK = NS / CPU_TIME_HZ };
+  static uint64_t wake; // In ns on the monotonic clock
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  uint64_t now = t.tv_sec * (uint64_t)NS + t.tv_nsec;
+  if(wake + IDLE_SLICE * NS_PER_TICK < now)
+    wake = now;
+  wake += (target - cpuTime) * NS_PER_TICK;
+  t = (struct timespec){ wake / NS, wake % NS };
+  clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL);
+}
+
+
+// Lets time pass without executing anything, up to the next event or the
+// end of the budget, or for a clock by a slice at a time so as not to
+// overshoot what the guest waits for. Guest deadlines and clocks can be
+// skipped to at once, but host input arrives in real time. Returns the
+// ticks passed.
+static unsigned Idle(unsigned cycles, int state) {
+  const Event *next = EventsFirst();
+  uint64_t target = cpuTime + cycles;
+  if(state == POLLING_CLOCK && cycles > IDLE_SLICE)
+    target = cpuTime + IDLE_SLICE;
+  if(next && next->when < target)
+    target = next->when;
+  if(cpuRealTime || (state != POLLING_CLOCK && (!next || next->host))) {
+    if(target > cpuTime + IDLE_SLICE)
+      target = cpuTime + IDLE_SLICE;
+    Sleep(target);
+  }
+  unsigned ticks = target - cpuTime;
+  cpuTime = target;
+  idleTime += ticks;
+  return ticks;
+}
+
+
+// Runs until the next event is due, then fires it and takes any interrupt
+// that is pending and enabled, so the executor itself never polls devices.
+// Returns early, like Execute, only where execution stopped.
+unsigned CPUStep(unsigned cycles) {
+  int state = AWAKE;
+  unsigned start = cycles;
+  cpuSynced = false;
+  while(cycles) {
+    EventsRun();
+    uint32_t pending = csr.mip & csr.mie, interrupt = PendingInterrupt();
+    if(interrupt) {
+      // A sync point of its own, taken at the start of the next call
+      if(cpuSyncPoints && cycles != start)
+        return cycles;
+      Trap(interrupt, 0);
+      if(cpuSyncPoints) {
+        cpuSynced = true;
+        return cycles;
+      }
+    }
+    // An idle hart wakes for any interrupt it enables, even with mstatus.MIE
+    // clear, and otherwise after each wait, as wfi is allowed to
+    if(state != AWAKE && !pending) {
+      cycles -= Idle(cycles, state);
+      state = AWAKE;
+      continue;
     }
+    uint64_t next = EventsNext() - cpuTime;
+    unsigned budget = next < cycles ? next : cycles;
+    runEnd = cpuTime + budget;
+    // Every change of privilege level or paging ends a run
+    dataPriv = csr.mstatus & MSTATUS_MPRV && csr.priv == PRIV_M ? csr.mstatus >> 11 & 3 : csr.priv;
+    unsigned remaining = !(csr.satp & SATP_MODE) || dataPriv == PRIV_M ?
+                           (cpuHooks ? ExecuteHooked(budget) : ExecutePlain(budget)) :
+                           (cpuHooks ? ExecutePagedHooked(budget) : ExecutePaged(budget));
+    cycles -= budget - remaining;
+    cpuTime = runEnd - remaining;
+    if(yielded && cpuSyncPoints) {
+      yielded = polled = waiting = false;
+      cpuSynced = true;
+      return cycles;
+    }
+    bool stopped = remaining && !yielded;
+    state = !yielded ? AWAKE : waiting ? IDLE : polled ? Polling() : AWAKE;
+    yielded = polled = waiting = false;
+    if(stopped)
+      return cycles;
+  }
+  return 0;
+}
+
+// The instruction table shared by the assembler and disassembler. Operand
+// formats are strings over d (rd), s (rs1), t (rs2), i (immediate), c (a
+// CSR by name or number), u (a 5-bit immediate in place of rs1) and p and
+// q (the predecessor and successor sets of a fence); any other character
+// must appear literally. Spaces are allowed around every
+// token when assembling.
+typedef struct {
+  const char *mne;
+  const char *operands;
+  uint8_t     type;
+  uint8_t     opc, f3, f7;
+  int32_t     imm; // The fixed immediate of ENC_E instructions
+} Opcode;
+
+enum { ENC_U, ENC_J, ENC_I, ENC_K, ENC_S, ENC_B, ENC_R, ENC_E, ENC_C, ENC_F };
+
+static const Opcode opcodes[] = {
+  { "lui",    "d,i",    ENC_U, 0b0110111                   },
+  { "auipc",  "d,i",    ENC_U, 0b0010111                   },
+  { "jal",    "d,i",    ENC_J, 0b1101111                   },
+  { "jalr",   "d,i(s)", ENC_I, 0b1100111, 0b000            },
+  { "beq",    "s,t,i",  ENC_B, 0b1100011, 0b000            },
+  { "bne",    "s,t,i",  ENC_B, 0b1100011, 0b001            },
+  { "blt",    "s,t,i",  ENC_B, 0b1100011, 0b100            },
+  { "bge",    "s,t,i",  ENC_B, 0b1100011, 0b101            },
+  { "bltu",   "s,t,i",  ENC_B, 0b1100011, 0b110            },
+  { "bgeu",   "s,t,i",  ENC_B, 0b1100011, 0b111            },
+  { "lb",     "d,i(s)", ENC_I, 0b0000011, 0b000            },
+  { "lh",     "d,i(s)", ENC_I, 0b0000011, 0b001            },
+  { "lw",     "d,i(s)", ENC_I, 0b0000011, 0b010            },
+  { "lbu",    "d,i(s)", ENC_I, 0b0000011, 0b100            },
+  { "lhu",    "d,i(s)", ENC_I, 0b0000011, 0b101            },
+  { "sb",     "t,i(s)", ENC_S, 0b0100011, 0b000            },
+  { "sh",     "t,i(s)", ENC_S, 0b0100011, 0b001            },
+  { "sw",     "t,i(s)", ENC_S, 0b0100011, 0b010            },
+  { "addi",   "d,s,i",  ENC_I, 0b0010011, 0b000            },
+  { "slti",   "d,s,i",  ENC_I, 0b0010011, 0b010            },
+  { "sltiu",  "d,s,i",  ENC_I, 0b0010011, 0b011            },
+  { "xori",   "d,s,i",  ENC_I, 0b0010011, 0b100            },
+  { "ori",    "d,s,i",  ENC_I, 0b0010011, 0b110            },
+  { "andi",   "d,s,i",  ENC_I, 0b0010011, 0b111            },
+  { "slli",   "d,s,i",  ENC_K, 0b0010011, 0b001, 0b0000000 },
+  { "srli",   "d,s,i",  ENC_K, 0b0010011, 0b101, 0b0000000 },
+  { "srai",   "d,s,i",  ENC_K, 0b0010011, 0b101, 0b0100000 },
+  { "add",    "d,s,t",  ENC_R, 0b0110011, 0b000, 0b0000000 },
+  { "sub",    "d,s,t",  ENC_R, 0b0110011, 0b000, 0b0100000 },
+  { "sll",    "d,s,t",  ENC_R, 0b0110011, 0b001, 0b0000000 },
+  { "slt",    "d,s,t",  ENC_R, 0b0110011, 0b010, 0b0000000 },
+  { "sltu",   "d,s,t",  ENC_R, 0b0110011, 0b011, 0b0000000 },
+  { "xor",    "d,s,t",  ENC_R, 0b0110011, 0b100, 0b0000000 },
+  { "srl",    "d,s,t",  ENC_R, 0b0110011, 0b101, 0b0000000 },
+  { "sra",    "d,s,t",  ENC_R, 0b0110011, 0b101, 0b0100000 },
+  { "or",     "d,s,t",  ENC_R, 0b0110011, 0b110, 0b0000000 },
+  { "and",    "d,s,t",  ENC_R, 0b0110011, 0b111, 0b0000000 },
+  { "fence",  "p,q",    ENC_F, 0b0001111, 0b000            },
+  { "fence.i", "",      ENC_E, 0b0001111, 0b001, 0b0000000, 0 },
+  { "ecall",  "",       ENC_E, 0b1110011, 0b000, 0b0000000, 0 },
+  { "ebreak", "",       ENC_E, 0b1110011, 0b000, 0b0000000, 1 },
+  { "mret",   "",       ENC_E, 0b1110011, 0b000, 0b0000000, 0x302 },
+  { "wfi",    "",       ENC_E, 0b1110011, 0b000, 0b0000000, 0x105 },
+  { "sret",   "",       ENC_E, 0b1110011, 0b000, 0b0000000, 0x102 },
+  { "sfence.vma", "s,t", ENC_R, 0b1110011, 0b000, 0b0001001 },
+  { "csrrw",  "d,c,s",  ENC_C, 0b1110011, 0b001            },
+  { "csrrs",  "d,c,s",  ENC_C, 0b1110011, 0b010            },
+  { "csrrc",  "d,c,s",  ENC_C, 0b1110011, 0b011            },
+  { "csrrwi", "d,c,u",  ENC_C, 0b1110011, 0b101            },
+  { "csrrsi", "d,c,u",  ENC_C, 0b1110011, 0b110            },
+  { "csrrci", "d,c,u",  ENC_C, 0b1110011, 0b111            },
+};
+
+#define NUM_OPCODES (sizeof opcodes / sizeof *opcodes)
+#define ASM_MNE_MAX     10
+#define REG_HASH_SIZE   128
+#define DECODE_SLOTS    8 // Most instructions sharing an opcode and funct3
+
+static const Opcode *asmSorted[NUM_OPCODES];
+static const Opcode *decodeTable[32][8][DECODE_SLOTS]; // By opcode[6:2] and funct3
+static int8_t           regHash[REG_HASH_SIZE]; // Register index + 1
+static uint32_t         regKeys[REG_HASH_SIZE];
+
+
+static int CompareOpcodes(const void *a, const void *b) {
+  return strcmp((*(const Opcode**)a)->mne, (*(const Opcode**)b)->mne);
+}
+
+
+static int CompareAsmMnemonic(const void *key, const void *b) {
+  return strcmp(key, (*(const Opcode**)b)->mne);
+}
 
-    // Literal character
-    else {
-      if(!*s || *f != *s)
-        goto done;
-      else
-        s++;
-      f++;
+
+// Register names are at most four characters, packed into a key
+static uint32_t RegisterKey(const char *s, size_t len) {
+  uint32_t key = 0;
+  for(size_t i = 0; i < len; i++)
+    key = key << 8 | (uint8_t)s[i];
+  return key;
+}
+
+
+static unsigned RegisterSlot(uint32_t key) {
+  unsigned slot = (key * 0x9E37'79B1u) >> 25;
+  while(regHash[slot] && regKeys[slot] != key)
+    slot = (slot + 1) % REG_HASH_SIZE;
+  return slot;
+}
+
+
+static void OpcodesInit() {
+  if(asmSorted[0])
+    return;
+  for(size_t i = 0; i < NUM_OPCODES; i++)
+    asmSorted[i] = &opcodes[i];
+  qsort(asmSorted, NUM_OPCODES, sizeof *asmSorted, CompareOpcodes);
+  for(size_t i = 0; i < NUM_OPCODES; i++) {
+    const Opcode *op = &opcodes[i];
+    // funct3 is part of the immediate in U and J formats
+    bool any = op->type == ENC_U || op->type == ENC_J;
+    for(int f3 = any ? 0 : op->f3; f3 <= (any ? 7 : op->f3); f3++) {
+      const Opcode **slot = decodeTable[op->opc >> 2][f3];
+      while(*slot)
+        slot++;
+      *slot = op;
     }
   }
+  for(int i = 0; i < NUM_BASE_REGS; i++) {
+    const char *names[] = { reg_names[i], reg_anames[i] };
+    for(int n = 0; n < 2; n++) {
+      uint32_t key = RegisterKey(names[n], strlen(names[n]));
+      unsigned slot = RegisterSlot(key);
+      regKeys[slot] = key;
+      regHash[slot] = i + 1;
+    }
+  }
+}
 
-done:
-  va_end(args);
-  if(!*f && !*s)
-    return 0;
-  return -1;
+
+static const char *SkipSpace(const char *s) {
+  while(isspace(*s))
+    s++;
+  return s;
+}
+
+
+static bool ScanRegister(const char **s, uint32_t *out) {
+  const char *end = *s;
+  while(isalnum(*end))
+    end++;
+  size_t len = end - *s;
+  if(len == 0 || len > 4)
+    return false;
+  unsigned slot = RegisterSlot(RegisterKey(*s, len));
+  if(!regHash[slot])
+    return false;
+  *out = regHash[slot] - 1;
+  *s = end;
+  return true;
+}
+
+
+// Accepts 0x-prefixed hex of up to eight digits or signed decimal
+static bool ScanImmediate(const char **s, int32_t *out) {
+  const char *p = *s;
+  bool neg = *p == '-';
+  if(neg)
+    p++;
+  if(p[0] == '0' && p[1] == 'x') {
+    p += 2;
+    uint32_t v = 0;
+    int digits = 0;
+    for(; digits < 8 && isxdigit(*p); digits++, p++)
+      v = v << 4 | (isdigit(*p) ? *p - '0' : (toupper(*p) - 'A' + 10));
+    if(digits == 0)
+      return false;
+    *out = neg ? -v : v;
+  } else {
+    if(!isdigit(*p))
+      return false;
+    int64_t v = 0;
+    while(isdigit(*p) && v <= UINT32_MAX)
+      v = v * 10 + (*p++ - '0');
+    if(neg)
+      v = -v;
+    if(v > UINT32_MAX || v < INT32_MIN)
+      return false;
+    *out = v;
+  }
+  *s = p;
+  return true;
+}
+
+
+static bool ScanCSR(const char **s, int32_t *out) {
+  char name[16];
+  size_t len = 0;
+  while(isalnum((*s)[len]) && len < sizeof name - 1)
+    name[len] = (*s)[len], len++;
+  name[len] = '\0';
+  int n = GetCSRNumber(name);
+  if(n >= 0) {
+    *s += len;
+    *out = n;
+    return true;
+  }
+  return ScanImmediate(s, out) && (uint32_t)*out < 4096;
+}
+
+
+// The sets of a fence are some of iorw, which are bits 3 to 0, or 0
+static const char fenceSets[] = "wroi";
+
+static bool ScanFenceSet(const char **s, int32_t *set) {
+  *set = 0;
+  if(**s == '0') {
+    ++*s;
+    return true;
+  }
+  for(const char *c; **s && (c = strchr(fenceSets, **s)); ++*s) {
+    if(*set >> (c - fenceSets) & 1)
+      return false;
+    *set |= 1 << (c - fenceSets);
+  }
+  return *set;
 }
 
+
 uint32_t Assemble(const char *line) {
-  enum { U, J, I, S, B, R } type;
-  uint32_t opc = 0;
-  uint32_t rd = 0, f3 = 0, rs1 = 0, rs2 = 0, f7 = 0;
-  int32_t imm = 0;
+  OpcodesInit();
+
+  // Mnemonic
+  const char *s = SkipSpace(line);
+  char mne[ASM_MNE_MAX + 1];
+  size_t len = 0;
+  while(isalnum(s[len]) || s[len] == '.') {
+    if(len == ASM_MNE_MAX)
+      return 0;
+    mne[len] = s[len];
+    len++;
+  }
+  mne[len] = '\0';
+  const Opcode **found = bsearch(mne, asmSorted, NUM_OPCODES, sizeof *asmSorted, CompareAsmMnemonic);
+  if(!found || (len && s[len] && !isspace(s[len])))
+    return 0;
+  const Opcode *op = *found;
+  s += len;
 
-  #define S(FMT, ...) if(AssembleScan(line, " "FMT" " __VA_OPT__(,)__VA_ARGS__) == 0)
-  #define UTYPE(MNE, OPC) S(#MNE" %r , %i", &rd, &imm) { type = U; opc = OPC; }
-  #define JTYPE(MNE, OPC) S(#MNE" %r , %i", &rd, &imm) { type = J; opc = OPC; }
-  #define ITYPE(MNE, OPC) S(#MNE" %r , %i ( %r )", &rd, &imm, &rs1) { type = I; opc = OPC; }
-  #define BTYPE(MNE, OPC, F3) S(#MNE"%r , %r , %i", &rs1, &rs2, &imm) { type = B; opc = OPC; f3 = F3; }
-  #define LTYPE(MNE, OPC, F3) S(#MNE"%r , %r , %i", &rd, &rs1, &imm) { type = I; opc = OPC; f3 = F3; }
-  #define STYPE(MNE, OPC, F3) S(#MNE"%r , %i(%r)", &rs2, &imm, &rs1) { type = S; opc = OPC; f3 = F3; }
-  #define KTYPE(MNE, OPC, F3, F7) S(#MNE"%r , %r , %i", &rd, &rs1, &imm) { type = I; opc = OPC; f3 = F3; f7 = F7; }
-  #define RTYPE(MNE, OPC, F3, F7) S(#MNE"%r , %r , %r", &rd, &rs1, &rs2) { type = R; opc = OPC; f3 = F3; f7 = F7; }
-  #define ETYPE(MNE, OPC, IMM) S(#MNE) { type = I; opc = OPC, rd = rs1 = 0; imm = IMM; }
-       UTYPE(lui,   0b0110111)
-  else UTYPE(auipc, 0b0010111)
-  else JTYPE(jal,   0b1101111)
-  else ITYPE(jalr,  0b1100111)
-  else BTYPE(beq,   0b1100011, 0b000)
-  else BTYPE(bne,   0b1100011, 0b001)
-  else BTYPE(blt,   0b1100011, 0b100)
-  else BTYPE(bge,   0b1100011, 0b101)
-  else BTYPE(bltu,  0b1100011, 0b110)
-  else BTYPE(bgeu,  0b1100011, 0b111)
-  else LTYPE(lb,    0b0000011, 0b000)
-  else LTYPE(lh,    0b0000011, 0b001)
-  else LTYPE(lw,    0b0000011, 0b010)
-  else LTYPE(lbu,   0b0000011, 0b100)
-  else LTYPE(lhu,   0b0000011, 0b101)
-  else STYPE(sb,    0b0100011, 0b000)
-  else STYPE(sh,    0b0100011, 0b001)
-  else STYPE(sw,    0b0100011, 0b010)
-  else LTYPE(addi,  0b0010011, 0b000)
-  else LTYPE(slti,  0b0010011, 0b010)
-  else LTYPE(sltiu, 0b0010011, 0b011)
-  else LTYPE(xori,  0b0010011, 0b100)
-  else LTYPE(ori,   0b0010011, 0b110)
-  else LTYPE(andi,  0b0010011, 0b111)
-  else KTYPE(slli,  0b0010011, 0b001, 0b0000000)
-  else KTYPE(srli,  0b0010011, 0b101, 0b0000000)
-  else KTYPE(srai,  0b0010011, 0b101, 0b0100000)
-  else RTYPE(add,   0b0110011, 0b000, 0b0000000)
-  else RTYPE(sub,   0b0110011, 0b000, 0b0100000)
-  else RTYPE(sll,   0b0110011, 0b001, 0b0000000)
-  else RTYPE(slt,   0b0110011, 0b010, 0b0000000)
-  else RTYPE(sltu,  0b0110011, 0b011, 0b0000000)
-  else RTYPE(xor,   0b0110011, 0b100, 0b0000000)
-  else RTYPE(srl,   0b0110011, 0b101, 0b0000000)
-  else RTYPE(sra,   0b0110011, 0b101, 0b0100000)
-  else RTYPE(or,    0b0110011, 0b110, 0b0000000)
-  else RTYPE(and,   0b0110011, 0b111, 0b0000000)
-  else ETYPE(ecall, 0b1110011, 0)
-  else ETYPE(ebreak,0b1110011, 1)
-  else return 0;
-  #undef ETYPE
-  #undef RTYPE
-  #undef KTYPE
-  #undef STYPE
-  #undef LTYPE
-  #undef BTYPE
-  #undef ITYPE
-  #undef JTYPE
-  #undef UTYPE
-  #undef S
-
-  uint32_t imm2 = 0;
-  switch(type) {
-  case U:
-    imm2 = imm << 12;
+  // Operands
+  uint32_t rd = 0, rs1 = 0, rs2 = 0;
+  int32_t imm = op->imm;
+  for(const char *f = op->operands; *f; f++) {
+    s = SkipSpace(s);
+    bool ok;
+    switch(*f) {
+    case 'd': ok = ScanRegister(&s, &rd);  break;
+    case 's': ok = ScanRegister(&s, &rs1); break;
+    case 't': ok = ScanRegister(&s, &rs2); break;
+    case 'i': ok = ScanImmediate(&s, &imm); break;
+    case 'c': ok = ScanCSR(&s, &imm);       break;
+    case 'p':
+    case 'q': {
+      int32_t set;
+      ok = ScanFenceSet(&s, &set);
+      imm |= *f == 'p' ? set << 4 : set;
+    } break;
+    case 'u': {
+      int32_t u;
+      ok = ScanImmediate(&s, &u) && (uint32_t)u < 32;
+      rs1 = u;
+    } break;
+    default:  ok = *s++ == *f;            break;
+    }
+    if(!ok)
+      return 0;
+  }
+  // Unassemble's annotations are comments
+  s = SkipSpace(s);
+  if(*s && *s != '#')
+    return 0;
+
+  uint32_t enc = 0;
+  switch(op->type) {
+  case ENC_U:
+    enc = uimm << 12;
     break;
-  case J:
-    imm2 = 0;
-    if(imm & 0x8000'0000)
-      imm2 |= 0xFFF0'0000;
-    imm2 |= imm & 0x000F'F000;
-    imm2 |= (imm & 0x0000'0800) << 8;
-    imm2 |= (imm & 0x7FFE'0000) >> 20;
+  case ENC_J:
+    enc = (uimm & 0x0010'0000) << 11 | (uimm & 0x0000'07FE) << 20 |
+          (uimm & 0x0000'0800) << 9  | (uimm & 0x000F'F000);
     break;
-  case I:
-    imm2 = 0;
-    if(imm & 0x8000'0000)
-      imm2 |= 0xFFFF'F000;
-    imm2 |= (imm & 0x7FF0'0000) >> 20;
+  case ENC_I:
+  case ENC_E:
+  case ENC_C:
+    enc = (uimm & 0x0000'0FFF) << 20;
     break;
-  default:
+  case ENC_K:
+    if(uimm > 31)
+      return 0;
+    enc = uimm << 20;
     break;
+  case ENC_F:
+    enc = (uimm & 0xFF) << 20;
+    break;
+  case ENC_S:
+    enc = (uimm & 0x0000'0FE0) << 20 | (uimm & 0x0000'001F) << 7;
+    break;
+  case ENC_B:
+    enc = (uimm & 0x0000'1000) << 19 | (uimm & 0x0000'07E0) << 20 |
+          (uimm & 0x0000'001E) << 7  | (uimm & 0x0000'0800) >> 4;
+    break;
+  }
+
+  return op->opc | enc |
+    rd      << 7  |
+    op->f3  << 12 |
+    rs1     << 15 |
+    rs2     << 20 |
+    op->f7  << 25;
+}
+
+static const Opcode *Decode(uint32_t ins) {
+  if((ins & 0b11) != 0b11)
+    return NULL;
+  const Opcode **slot = decodeTable[(ins >> 2) & 0x1F][(ins >> 12) & 0x7];
+  for(int i = 0; i < DECODE_SLOTS && slot[i]; i++) {
+    const Opcode *op = slot[i];
+    if((op->type == ENC_K || op->type == ENC_R) && ins >> 25 != op->f7)
+      continue;
+    // sfence.vma has no rd, whose field must be zero
+    if(op->type == ENC_R && !strchr(op->operands, 'd') && ins >> 7 & 0x1F)
+      continue;
+    if(op->type == ENC_E && ins != (op->opc | op->f3 << 12 | (uint32_t)op->imm << 20))
+      continue;
+    // Of fences, only the sets may be nonzero
+    if(op->type == ENC_F && ins & 0xF00F'8F80)
+      continue;
+    return op;
   }
+  return NULL;
+}
 
-  return opc | imm2 |
-    (rd  & 0x1F) << 7 |
-    (f3  & 0x03) << 12 |
-    (rs1 & 0x1F) << 15 |
-    (rs2 & 0x1F) << 20 |
-    (f7  & 0x3F) << 25;
+
+static char *PutString(char *out, const char *s) {
+  while(*s)
+    *out++ = *s++;
+  return out;
 }
 
-int Unassemble(uint32_t ins, char buf[64]) {
-  const char *(*r)[NUM_REGS] = &reg_anames;
-  uint32_t opc = ins & 0x7F;
-  if((opc & 0b11) != 0b11)
+
+static char *PutDecimal(char *out, int32_t v) {
+  char tmp[12];
+  int n = 0;
+  uint32_t u = v < 0 ? -(uint32_t)v : (uint32_t)v;
+  do
+    tmp[n++] = '0' + u % 10;
+  while(u /= 10);
+  if(v < 0)
+    *out++ = '-';
+  while(n)
+    *out++ = tmp[--n];
+  return out;
+}
+
+
+static char *PutFenceSet(char *out, unsigned set) {
+  if(!set)
+    *out++ = '0';
+  for(int bit = 3; bit >= 0; bit--)
+    if(set >> bit & 1)
+      *out++ = fenceSets[bit];
+  return out;
+}
+
+
+static char *PutHex(char *out, uint32_t v) {
+  int shift = 28;
+  while(shift && !(v >> shift))
+    shift -= 4;
+  *out++ = '0';
+  *out++ = 'x';
+  for(; shift >= 0; shift -= 4)
+    *out++ = "0123456789ABCDEF"[(v >> shift) & 0xF];
+  return out;
+}
+
+
+// Output is accepted by Assemble. Jump and branch targets and the
+// addresses formed by auipc pairs are annotated in a trailing comment.
+int Unassemble(uint32_t addr, uint32_t ins, char buf[UNASSEMBLE_MAX]) {
+  OpcodesInit();
+  const Opcode *op = Decode(ins);
+  if(!op)
     return -1;
-  RD F3 RS1 RS2 F7 IMM_U IMM_J IMM_I IMM_S IMM_B
-  switch(opc >> 2) {
-  #define P(...) do { snprintf(buf, 64, __VA_ARGS__); return 0; } while(0);
-  #define U(MNE) P("%-5s %s,%d", #MNE, (*r)[rd], imm_u)
-  #define J(MNE) P("%-5s %s,%d", #MNE, (*r)[rd], imm_j)
-  #define I(MNE) P("%-5s %s,%d(%s)", #MNE, (*r)[rd], imm_i, (*r)[rs1])
-  #define L(MNE) P("%-5s %s,%s,%d", #MNE, (*r)[rd], (*r)[rs1], imm_i)
-  #define S(MNE) P("%-5s %s,%d(%s)", #MNE, (*r)[rs2], imm_s, (*r)[rs1])
-  #define B(MNE) P("%-5s %s,%s,%d", #MNE, (*r)[rs1], (*r)[rs2], imm_b)
-  case 0b01101: U(lui)
-  case 0b00101: U(auipc)
-  case 0b11011: J(jal)
-  case 0b11001: I(jalr)
-  case 0b11000:
-    switch(f3) {
-    case 0b000: B(beq)
-    case 0b001: B(bne)
-    case 0b100: B(blt)
-    case 0b101: B(bge)
-    case 0b110: B(bltu)
-    case 0b111: B(bgeu)
-    default: return -1;
-    }
-  case 0b00000:
-    switch(f3) {
-    case 0b000: I(lb)
-    case 0b001: I(lh)
-    case 0b010: I(lw)
-    case 0b100: I(lbu)
-    case 0b101: I(lhu)
-    default: return -1;
-    }
-  case 0b01000:
-    switch(f3) {
-    case 0b000: S(sb)
-    case 0b001: S(sh)
-    case 0b010: S(sw)
-    default: return -1;
+
+  RD RS1 RS2
+  int32_t imm = 0;
+  switch(op->type) {
+  case ENC_U: imm = (uint32_t)DecodeIMMU(ins) >> 12; break;
+  case ENC_J: imm = DecodeIMMJ(ins);                break;
+  case ENC_I: imm = DecodeIMMI(ins);                break;
+  case ENC_K: imm = rs2;                            break;
+  case ENC_S: imm = DecodeIMMS(ins);                break;
+  case ENC_B: imm = DecodeIMMB(ins);                break;
+  case ENC_C: imm = ins >> 20;                      break;
+  case ENC_F: imm = ins >> 20 & 0xFF;               break;
+  }
+
+  char *out = PutString(buf, op->mne);
+  if(*op->operands)
+    do
+      *out++ = ' ';
+    while(out - buf < 6);
+  for(const char *f = op->operands; *f; f++) {
+    switch(*f) {
+    case 'd': out = PutString(out, reg_anames[rd]);  break;
+    case 's': out = PutString(out, reg_anames[rs1]); break;
+    case 't': out = PutString(out, reg_anames[rs2]); break;
+    case 'i': out = op->type == ENC_U ? PutHex(out, imm) : PutDecimal(out, imm); break;
+    case 'u': out = PutDecimal(out, rs1);            break;
+    case 'p': out = PutFenceSet(out, imm >> 4);      break;
+    case 'q': out = PutFenceSet(out, imm & 0xF);     break;
+    case 'c': {
+      size_t i = 0;
+      while(i < sizeof csrNames / sizeof *csrNames && csrNames[i].number != imm)
+        i++;
+      out = i < sizeof csrNames / sizeof *csrNames ? PutString(out, csrNames[i].name) : PutHex(out, imm);
+    } break;
+    default:  *out++ = *f;                           break;
     }
-  case 0b00100:
-    switch(f3) {
-    case 0b000: L(addi)
-    case 0b001: L(slli)
-    case 0b010: L(slti)
-    case 0b011: L(sltiu)
-    case 0b100: L(xori)
-    case 0b101:
-      if(f7 & 0x40) L(srli)
-      else          L(srai)
-    case 0b110: L(ori)
-    case 0b111: L(andi)
+  }
+
+  // PC-relative addresses are auipc followed by an I or S format
+  // instruction using the auipc's result as its base
+  bool annotate = op->type == ENC_J || op->type == ENC_B;
+  uint32_t target = addr + imm;
+  // The previous word is read from RAM only, since reading a device can
+  // change it
+  if((op->type == ENC_I || op->type == ENC_S) && rs1 != ZERO && addr - 4 < MEM_SIZE - 3) {
+    uint32_t prev = CPURead32_Unchecked(addr - 4);
+    if((prev & 0x7F) == 0b0010111 && ((prev >> 7) & 0x1F) == rs1) {
+      annotate = true;
+      target = addr - 4 + DecodeIMMU(prev) + imm;
     }
-  #undef B
-  #undef S
-  #undef L
-  #undef I
-  #undef J
-  #undef U
-  #undef P
   }
-  return -1;
+  if(annotate) {
+    char sym[64];
+    out = PutString(out, "  # ");
+    out = PutString(out, FormatSymbol(target, sym));
+  }
+  *out = '\0';
+  return 0;
 }
@@ -8,6 +8,7 @@
 #endif
 
 #define NUM_BASE_REGS 32
+#define UNASSEMBLE_MAX 128
 
 enum {
   X0,   ZERO = X0,
@@ -46,16 +47,147 @@ enum {
   NUM_REGS
 };
 
+// Control and status registers by number
+enum {
+  CSR_SSTATUS   = 0x100,
+  CSR_SIE       = 0x104,
+  CSR_STVEC     = 0x105,
+  CSR_SSCRATCH  = 0x140,
+  CSR_SEPC      = 0x141,
+  CSR_SCAUSE    = 0x142,
+  CSR_STVAL     = 0x143,
+  CSR_SIP       = 0x144,
+  CSR_SATP      = 0x180,
+  CSR_MSTATUS   = 0x300,
+  CSR_MISA      = 0x301,
+  CSR_MEDELEG   = 0x302,
+  CSR_MIDELEG   = 0x303,
+  CSR_MIE       = 0x304,
+  CSR_MTVEC     = 0x305,
+  CSR_MSCRATCH  = 0x340,
+  CSR_MEPC      = 0x341,
+  CSR_MCAUSE    = 0x342,
+  CSR_MTVAL     = 0x343,
+  CSR_MIP       = 0x344,
+  CSR_MCYCLE    = 0xB00,
+  CSR_MINSTRET  = 0xB02,
+  CSR_MCYCLEH   = 0xB80,
+  CSR_MINSTRETH = 0xB82,
+  CSR_CYCLE     = 0xC00,
+  CSR_TIME      = 0xC01,
+  CSR_INSTRET   = 0xC02,
+  CSR_CYCLEH    = 0xC80,
+  CSR_TIMEH     = 0xC81,
+  CSR_INSTRETH  = 0xC82,
+  CSR_MVENDORID = 0xF11,
+  CSR_MARCHID   = 0xF12,
+  CSR_MIMPID    = 0xF13,
+  CSR_MHARTID   = 0xF14,
+};
+
+// Privilege levels
+enum { PRIV_U = 0, PRIV_S = 1, PRIV_M = 3 };
+
+enum {
+  MSTATUS_SIE  = 1 << 1,
+  MSTATUS_MIE  = 1 << 3,
+  MSTATUS_SPIE = 1 << 5,
+  MSTATUS_MPIE = 1 << 7,
+  MSTATUS_SPP  = 1 << 8,
+  MSTATUS_MPP  = 3 << 11,
+  MSTATUS_MPRV = 1 << 17,
+  MSTATUS_SUM  = 1 << 18,
+  MSTATUS_MXR  = 1 << 19,
+  SSTATUS_MASK = MSTATUS_SIE | MSTATUS_SPIE | MSTATUS_SPP | MSTATUS_SUM | MSTATUS_MXR,
+};
+
+// Bits of mip and mie
+enum {
+  MIP_SSIP = 1 << 1,
+  MIP_MSIP = 1 << 3,
+  MIP_STIP = 1 << 5,
+  MIP_MTIP = 1 << 7,
+  MIP_SEIP = 1 << 9,
+  MIP_MEIP = 1 << 11,
+  MIP_S    = MIP_SSIP | MIP_STIP | MIP_SEIP,
+};
+
+enum {
+  SATP_MODE = 1u << 31, // Sv32
+  SATP_PPN  = 0x3F'FFFF,
+};
+
+// mcause values; interrupts have the top bit set as well
+enum {
+  CAUSE_MISALIGNED_FETCH = 0,
+  CAUSE_ILLEGAL          = 2,
+  CAUSE_BREAKPOINT       = 3,
+  CAUSE_MISALIGNED_LOAD  = 4,
+  CAUSE_MISALIGNED_STORE = 6,
+  CAUSE_ECALL_U          = 8, // Plus the privilege level
+  CAUSE_ECALL_M          = 11,
+  CAUSE_FETCH_PAGE_FAULT = 12,
+  CAUSE_LOAD_PAGE_FAULT  = 13,
+  CAUSE_STORE_PAGE_FAULT = 15,
+  CAUSE_INTERRUPT        = 1u << 31,
+};
+
+// The supervisor's status, interrupt enable and pending registers are
+// views of the machine's. mip is driven by the interrupt controllers
+// through CPUInterrupt, and by software for the supervisor's bits.
+typedef struct {
+  uint32_t priv; // The privilege level the hart runs at, saved with the CSRs
+  uint32_t mstatus, mie, mip, mtvec, mscratch, mepc, mcause, mtval, medeleg, mideleg;
+  uint32_t stvec, sscratch, sepc, scause, stval, satp;
+} CSRs;
+
 extern uint32_t    reg[NUM_REGS];
-extern uint8_t     mem[MEM_SIZE];
-extern bool        breakpoint[MEM_SIZE / 4];
+extern uint8_t    *mem;    // MEM_SIZE bytes, the bound machine's RAM
+extern CSRs        csr;
+extern uint64_t    cpuTime; // Instructions executed plus ticks idle, the clock of mtime and events
+extern bool        cpuRealTime; // Idle time is slept on the host rather than skipped
+extern bool        cpuSyncPoints; // CPUStep returns at each sync point, setting cpuSynced
+extern bool        cpuSynced;
+extern unsigned    cpuHooks;
 extern const char *reg_names [NUM_REGS];
 extern const char *reg_anames[NUM_REGS];
 
+// Bits of cpuHooks; any set bit selects the instrumented executor
+enum {
+  CPU_HOOK_PROFILE  = 1 << 0,
+  CPU_HOOK_STATS    = 1 << 1,
+  CPU_HOOK_TIMING   = 1 << 2,
+  CPU_HOOK_LOCKSTEP = 1 << 3,
+  CPU_HOOK_WATCH    = 1 << 4,
+  CPU_HOOK_BREAK    = 1 << 5,
+  CPU_HOOK_HEAT     = 1 << 6,
+};
+
 int GetRegisterIndex(const char *name);
+int GetCSRNumber(const char *name);
 
 void Reset();
 
+// The state at the hart's last load from a device, to tell if it polls
+typedef struct {
+  uint32_t reg[NUM_REGS];
+  uint64_t retired;
+  unsigned repeats;
+} PollState;
+
+// Everything a hart holds, for switching machines: the globals above are
+// the bound one's, and the others wait in their Hart
+typedef struct {
+  uint32_t  reg[NUM_REGS];
+  uint8_t  *mem;
+  CSRs      csr;
+  uint64_t  time, idleTime;
+  PollState poll;
+} Hart;
+
+void CPUSave(Hart *hart);
+void CPURestore(const Hart *hart);
+
 void CPUWrite32(uint32_t addr, uint32_t v32);
 void CPUWrite16(uint32_t addr, uint16_t v16);
 void CPUWrite8 (uint32_t addr, uint8_t  v8 );
@@ -64,8 +196,24 @@ uint32_t CPURead32(uint32_t addr);
 uint16_t CPURead16(uint32_t addr);
 uint8_t  CPURead8 (uint32_t addr);
 
+void CPUInterrupt(uint32_t mip, bool level);
+
+// The rate of cpuTime while the hart waits on the host
+#define CPU_TIME_HZ 10'000'000
+
+// Runs up to `cycles` instructions. After wfi, or in a loop polling a device
+// with nothing else changing, the hart is idle: time skips to the next
+// event instead, counting against the budget. It passes in host time while
+// waiting for host input, when nothing is scheduled, or with cpuRealTime.
+//
+// Sync points are the instructions that access a device or a CSR, trap or
+// return from a trap, and the taking of an interrupt. With cpuSyncPoints,
+// CPUStep returns right after one, without idling, and sets cpuSynced. It
+// then takes interrupts only before running any instruction.
 unsigned CPUStep(unsigned cycles);
+// Assembles one instruction, which may be followed by a # comment.
+// Returns 0 if the line is invalid.
 uint32_t Assemble(const char *line);
-int Unassemble(uint32_t ins, char buf[64]);
+int Unassemble(uint32_t addr, uint32_t ins, char buf[UNASSEMBLE_MAX]);
 
 #endif
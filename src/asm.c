@@ -0,0 +1,792 @@
+#include "asm.h"
+#include "CPU.h"
+#include "symbols.h"
+#include <ctype.h>
+#include <elf.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LINE_MAX_LEN 256
+#define LABEL_HASH   4096 // Power of two; grows when half full
+
+enum { SEC_TEXT, SEC_DATA, NUM_SECTIONS };
+
+typedef struct {
+  char    *name;
+  int      section;
+  uint32_t offset;
+} Label;
+
+typedef struct {
+  const char *file;
+  int         line;
+  int         pass;
+  int         errors;
+  int         section;
+  uint32_t    lc[NUM_SECTIONS];   // Offsets into each section
+  uint32_t    size[NUM_SECTIONS];
+  uint32_t    addr[NUM_SECTIONS]; // Known once pass 1 is done
+  uint8_t    *out;
+  uint32_t    base;
+  Label      *labels;
+  unsigned    numLabels;
+  unsigned    capLabels;
+  int32_t    *hash;              // Label index + 1
+  unsigned    hashSize;
+} Asm;
+
+
+static void Error(Asm *a, const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  fprintf(stderr, "%s:%d: ", a->file, a->line);
+  vfprintf(stderr, fmt, args);
+  fprintf(stderr, "\n");
+  va_end(args);
+  a->errors++;
+}
+
+
+static uint32_t HashName(const char *s, size_t len) {
+  uint32_t h = 0x811C'9DC5;
+  for(size_t i = 0; i < len; i++)
+    h = (h ^ (uint8_t)s[i]) * 0x0100'0193;
+  return h;
+}
+
+
+static int32_t *FindSlot(Asm *a, const char *name, size_t len) {
+  for(uint32_t i = HashName(name, len); ; i++) {
+    int32_t *slot = &a->hash[i & (a->hashSize - 1)];
+    if(!*slot)
+      return slot;
+    const char *n = a->labels[*slot - 1].name;
+    if(!strncmp(n, name, len) && !n[len])
+      return slot;
+  }
+}
+
+
+static const Label *FindLabel(Asm *a, const char *name, size_t len) {
+  if(!a->hash)
+    return NULL;
+  int32_t *slot = FindSlot(a, name, len);
+  return *slot ? &a->labels[*slot - 1] : NULL;
+}
+
+
+static void DefineLabel(Asm *a, const char *name, size_t len) {
+  if(a->numLabels * 2 >= a->hashSize) {
+    free(a->hash);
+    a->hashSize = a->hashSize ? a->hashSize * 2 : LABEL_HASH;
+    a->hash = calloc(a->hashSize, sizeof *a->hash);
+    for(unsigned i = 0; i < a->numLabels; i++)
+      *FindSlot(a, a->labels[i].name, strlen(a->labels[i].name)) = i + 1;
+  }
+  int32_t *slot = FindSlot(a, name, len);
+  if(*slot) {
+    Error(a, "'%.*s' is already defined", (int)len, name);
+    return;
+  }
+  if(a->numLabels == a->capLabels) {
+    a->capLabels = a->capLabels ? a->capLabels * 2 : 64;
+    a->labels = realloc(a->labels, a->capLabels * sizeof *a->labels);
+  }
+  a->labels[a->numLabels] = (Label){ strndup(name, len), a->section, a->lc[a->section] };
+  *slot = ++a->numLabels;
+}
+
+
+static uint32_t Here(const Asm *a) {
+  return a->addr[a->section] + a->lc[a->section];
+}
+
+
+static const char *SkipSpace(const char *s) {
+  while(isspace(*s))
+    s++;
+  return s;
+}
+
+
+static bool IsIdentStart(char c) {
+  return isalpha(c) || c == '_' || c == '.' || c == '$';
+}
+
+
+static bool IsIdent(char c) {
+  return IsIdentStart(c) || isdigit(c);
+}
+
+
+// Expressions are sums of numbers, labels, '.' and %hi()/%lo() terms.
+// Sets *symbolic if a label or '.' is involved; in pass 1 labels that are
+// not yet defined evaluate to 0.
+static bool Eval(Asm *a, const char **str, int32_t *value, bool *symbolic);
+
+// A character literal, which may be a comma or #
+static bool IsCharLiteral(const char *s) {
+  return s[0] == '\'' && s[1] && s[2] == '\'';
+}
+
+
+static bool Term(Asm *a, const char **str, int32_t *value, bool *symbolic) {
+  const char *s = SkipSpace(*str);
+  bool neg = false;
+  if(*s == '-' || *s == '+') {
+    neg = *s == '-';
+    s = SkipSpace(s + 1);
+  }
+
+  uint32_t v;
+  if(!strncmp(s, "%hi(", 4) || !strncmp(s, "%lo(", 4)) {
+    bool hi = s[1] == 'h';
+    int32_t inner = 0;
+    s += 4;
+    if(!Eval(a, &s, &inner, symbolic))
+      return false;
+    s = SkipSpace(s);
+    if(*s++ != ')')
+      return false;
+    // %lo is sign extended, so %hi rounds to compensate
+    v = hi ? ((uint32_t)inner + 0x800) >> 12 : (((uint32_t)inner & 0xFFF) ^ 0x800) - 0x800;
+  } else if(s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) {
+    char *end;
+    v = strtoul(s + 2, &end, 16);
+    if(end == s + 2)
+      return false;
+    s = end;
+  } else if(isdigit(*s)) {
+    char *end;
+    v = strtoul(s, &end, 10);
+    s = end;
+  } else if(IsCharLiteral(s)) {
+    v = (uint8_t)s[1];
+    s += 3;
+  } else if(*s == '.' && !IsIdent(s[1])) {
+    v = Here(a);
+    *symbolic = true;
+    s++;
+  } else if(IsIdentStart(*s)) {
+    const char *start = s;
+    while(IsIdent(*s))
+      s++;
+    const Label *l = FindLabel(a, start, s - start);
+    if(l)
+      v = a->addr[l->section] + l->offset;
+    else if(a->pass == 0)
+      v = 0;
+    else {
+      Error(a, "undefined symbol '%.*s'", (int)(s - start), start);
+      return false;
+    }
+    *symbolic = true;
+  } else {
+    return false;
+  }
+  *value = neg ? -v : v;
+  *str = s;
+  return true;
+}
+
+
+static bool Eval(Asm *a, const char **str, int32_t *value, bool *symbolic) {
+  int32_t sum, t;
+  if(!Term(a, str, &sum, symbolic))
+    return false;
+  for(;;) {
+    const char *s = SkipSpace(*str);
+    if(*s != '+' && *s != '-')
+      break;
+    *str = s;
+    if(!Term(a, str, &t, symbolic))
+      return false;
+    sum += t;
+  }
+  *str = SkipSpace(*str);
+  *value = sum;
+  return true;
+}
+
+
+// Evaluates a whole operand, which must be nothing but an expression
+static bool EvalOperand(Asm *a, const char *s, int32_t *value, bool *symbolic) {
+  bool dummy = false;
+  if(!symbolic)
+    symbolic = &dummy;
+  if(!Eval(a, &s, value, symbolic) || *s) {
+    if(!a->errors)
+      Error(a, "bad expression");
+    return false;
+  }
+  return true;
+}
+
+
+static void Emit8(Asm *a, uint8_t v) {
+  if(a->pass == 1)
+    a->out[a->addr[a->section] - a->base + a->lc[a->section]] = v;
+  a->lc[a->section]++;
+}
+
+
+static void Emit32(Asm *a, uint32_t v) {
+  for(int i = 0; i < 4; i++)
+    Emit8(a, v >> (8 * i));
+}
+
+
+// Assembles one canonical instruction line
+static void EmitIns(Asm *a, const char *fmt, ...) {
+  uint32_t ins = 0;
+  char line[LINE_MAX_LEN];
+  if(a->pass == 1) {
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(line, sizeof line, fmt, args);
+    va_end(args);
+    if(!(ins = Assemble(line)))
+      Error(a, "can't assemble '%s'", line);
+  }
+  Emit32(a, ins);
+}
+
+
+static bool IsRegister(const char *s) {
+  return GetRegisterIndex(s) >= 0 && GetRegisterIndex(s) < NUM_BASE_REGS;
+}
+
+
+// Rewrites an operand for Assemble: registers pass through, expressions
+// become numbers and imm(reg) forms keep their base register. Jump and
+// branch targets are addresses, as listings show them, and become offsets
+// from the current instruction.
+static bool Operand(Asm *a, const char *op, bool target, char out[64]) {
+  if(IsRegister(op)) {
+    snprintf(out, 64, "%s", op);
+    return true;
+  }
+  size_t len = strlen(op);
+  const char *base = NULL;
+  char r[16];
+  if(len && op[len - 1] == ')') {
+    const char *open = strrchr(op, '(');
+    bool reloc = open && open - op >= 3 && open[-3] == '%';
+    if(open && open > op && !reloc &&
+       sscanf(open, "( %15[a-z0-9] )", r) == 1 && IsRegister(r)) {
+      base = r;
+      len = open - op;
+    }
+    // A lone (reg) has an implied 0 offset
+    if(open == op && sscanf(open, "( %15[a-z0-9] )", r) == 1 && IsRegister(r)) {
+      snprintf(out, 64, "0(%s)", r);
+      return true;
+    }
+  }
+
+  char expr[LINE_MAX_LEN];
+  snprintf(expr, sizeof expr, "%.*s", (int)len, op);
+  int32_t v = 0;
+  bool symbolic = false;
+  if(!EvalOperand(a, expr, &v, &symbolic))
+    return false;
+  if(target)
+    v -= Here(a);
+  if(base)
+    snprintf(out, 64, "%d(%s)", v, base);
+  else
+    snprintf(out, 64, "%d", v);
+  return true;
+}
+
+
+static bool Fits12(int32_t v) {
+  return v >= -2048 && v <= 2047;
+}
+
+
+static void PCRelative(Asm *a, const char *op, int32_t *hi, int32_t *lo) {
+  int32_t v = 0;
+  bool symbolic = false;
+  if(EvalOperand(a, op, &v, &symbolic)) {
+    uint32_t off = v - Here(a);
+    *hi = (off + 0x800) >> 12;
+    *lo = off - (*hi << 12);
+    *hi &= 0xFFFFF;
+  }
+}
+
+
+// Splits operands on top level commas, trimming spaces around each
+static int SplitOperands(char *s, char *ops[3]) {
+  int n = 0;
+  s = (char*)SkipSpace(s);
+  if(!*s)
+    return 0;
+  for(;;) {
+    if(n == 3)
+      return -1;
+    ops[n++] = s;
+    int depth = 0;
+    while(*s && (depth || *s != ',')) {
+      if(IsCharLiteral(s)) {
+        s += 3;
+        continue;
+      }
+      depth += (*s == '(') - (*s == ')');
+      s++;
+    }
+    char *end = s;
+    while(end > ops[n - 1] && isspace(end[-1]))
+      end--;
+    bool more = *s == ',';
+    *end = '\0';
+    if(!more)
+      return n;
+    s = (char*)SkipSpace(s + 1);
+  }
+}
+
+
+static void Instruction(Asm *a, const char *mne, char *rest) {
+  char *ops[3];
+  int n = SplitOperands(rest, ops);
+  char o[3][64];
+  if(n < 0) {
+    Error(a, "too many operands");
+    return;
+  }
+
+  // CSR pseudo-instructions: csrr rd, csr and csrw, csrs and csrc csr, rs
+  // or their immediate forms, which discard the old value
+  char real[8];
+  if(!strcmp(mne, "csrr") && n == 2) {
+    mne = "csrrs";
+    ops[n++] = (char*)"zero";
+  } else if(!strncmp(mne, "csr", 3) && mne[3] && strchr("wsc", mne[3]) &&
+            (!mne[4] || !strcmp(mne + 4, "i")) && n == 2) {
+    snprintf(real, sizeof real, "csrr%.2s", mne + 3);
+    mne = real;
+    ops[2] = ops[1];
+    ops[1] = ops[0];
+    ops[0] = (char*)"zero";
+    n = 3;
+  }
+  bool csrOp = !strncmp(mne, "csrr", 4), fence = !strcmp(mne, "fence");
+
+  #define IS(M, N) (!strcmp(mne, M) && n == N)
+  if(IS("nop", 0))
+    EmitIns(a, "addi zero, zero, 0");
+  else if(IS("fence", 0))
+    EmitIns(a, "fence iorw, iorw");
+  else if(IS("ret", 0))
+    EmitIns(a, "jalr zero, 0(ra)");
+  else if(!strcmp(mne, "sfence.vma") && n < 2)
+    EmitIns(a, "sfence.vma %s, zero", n ? ops[0] : "zero");
+  else if(IS("mv", 2))
+    EmitIns(a, "addi %s, %s, 0", ops[0], ops[1]);
+  else if(IS("j", 1) || IS("jal", 1)) {
+    if(Operand(a, ops[0], true, o[0]))
+      EmitIns(a, "jal %s, %s", mne[1] ? "ra" : "zero", o[0]);
+  } else if(IS("call", 1) || IS("la", 2)) {
+    bool call = n == 1;
+    const char *rd = call ? "ra" : ops[0];
+    int32_t hi = 0, lo = 0;
+    PCRelative(a, ops[n - 1], &hi, &lo);
+    EmitIns(a, "auipc %s, %d", rd, hi);
+    if(call)
+      EmitIns(a, "jalr ra, %d(ra)", lo);
+    else
+      EmitIns(a, "addi %s, %s, %d", rd, rd, lo);
+  } else if(IS("li", 2)) {
+    // The size depends only on the syntax so both passes agree: one addi
+    // for a small constant, otherwise lui and addi
+    int32_t v = 0;
+    bool symbolic = false;
+    if(!EvalOperand(a, ops[1], &v, &symbolic))
+      return;
+    if(!symbolic && Fits12(v))
+      EmitIns(a, "addi %s, zero, %d", ops[0], v);
+    else {
+      uint32_t hi = (((uint32_t)v + 0x800) >> 12) & 0xFFFFF;
+      EmitIns(a, "lui %s, %u", ops[0], hi);
+      EmitIns(a, "addi %s, %s, %d", ops[0], ops[0], (int32_t)(((uint32_t)v & 0xFFF) ^ 0x800) - 0x800);
+    }
+  } else {
+    // Real instructions; the last operand of jal and branches is a target
+    bool branch = mne[0] == 'b' || !strcmp(mne, "jal");
+    if(a->pass == 0) {
+      a->lc[a->section] += 4;
+      return;
+    }
+    for(int i = 0; i < n; i++) {
+      if((csrOp && i == 1 && GetCSRNumber(ops[i]) >= 0) || fence)
+        snprintf(o[i], sizeof o[i], "%s", ops[i]);
+      else if(!Operand(a, ops[i], branch && i == n - 1, o[i]))
+        return;
+    }
+    switch(n) {
+    case 0: EmitIns(a, "%s", mne);                             break;
+    case 1: EmitIns(a, "%s %s", mne, o[0]);                    break;
+    case 2: EmitIns(a, "%s %s, %s", mne, o[0], o[1]);          break;
+    case 3: EmitIns(a, "%s %s, %s, %s", mne, o[0], o[1], o[2]); break;
+    }
+  }
+  #undef IS
+}
+
+
+static void Ascii(Asm *a, const char *s, bool terminate) {
+  s = SkipSpace(s);
+  if(*s++ != '"') {
+    Error(a, "expected a string");
+    return;
+  }
+  while(*s && *s != '"') {
+    char c = *s++;
+    if(c == '\\') {
+      switch(c = *s++) {
+      case 'n': c = '\n'; break;
+      case 't': c = '\t'; break;
+      case 'r': c = '\r'; break;
+      case '0': c = '\0'; break;
+      case 'x': {
+        char *end;
+        c = strtoul(s, &end, 16);
+        s = end;
+      } break;
+      case '\0':
+        Error(a, "unterminated string");
+        return;
+      }
+    }
+    Emit8(a, c);
+  }
+  if(*s++ != '"' || *SkipSpace(s))
+    Error(a, "bad string");
+  if(terminate)
+    Emit8(a, 0);
+}
+
+
+static void Directive(Asm *a, const char *name, char *rest) {
+  char *ops[3];
+  int32_t v = 0;
+  if(!strcmp(name, ".text"))
+    a->section = SEC_TEXT;
+  else if(!strcmp(name, ".data"))
+    a->section = SEC_DATA;
+  else if(!strcmp(name, ".ascii"))
+    Ascii(a, rest, false);
+  else if(!strcmp(name, ".asciz") || !strcmp(name, ".string"))
+    Ascii(a, rest, true);
+  else if(!strcmp(name, ".word") || !strcmp(name, ".byte")) {
+    bool word = name[1] == 'w';
+    // Operands are split by hand since there may be more than three
+    for(char *s = rest; *SkipSpace(s); ) {
+      char *comma = s;
+      while(*comma && *comma != ',')
+        comma += IsCharLiteral(comma) ? 3 : 1;
+      if(*comma)
+        *comma = '\0';
+      else
+        comma = NULL;
+      v = 0;
+      if(a->pass == 1 && !EvalOperand(a, s, &v, NULL))
+        return;
+      if(word) Emit32(a, v);
+      else     Emit8 (a, v);
+      if(!comma)
+        break;
+      s = comma + 1;
+    }
+  } else if(!strcmp(name, ".align") || !strcmp(name, ".org")) {
+    bool symbolic = false;
+    if(SplitOperands(rest, ops) != 1 || !EvalOperand(a, ops[0], &v, &symbolic))
+      return;
+    if(symbolic) {
+      Error(a, "%s needs a constant", name);
+      return;
+    }
+    if(name[1] == 'a' && (v < 0 || v > 12)) {
+      Error(a, "bad alignment");
+      return;
+    }
+    uint32_t *lc = &a->lc[a->section];
+    uint32_t to = name[1] == 'a' ? (*lc + (1u << v) - 1) & -(1u << v) : (uint32_t)v;
+    if(to < *lc) {
+      Error(a, ".org moves backwards");
+      return;
+    }
+    // Code is padded with nops once it is word aligned
+    while(*lc < to) {
+      if(a->section == SEC_TEXT && !(*lc & 3) && to - *lc >= 4)
+        Emit32(a, 0x0000'0013);
+      else
+        Emit8(a, 0);
+    }
+  } else if(!strcmp(name, ".globl") || !strcmp(name, ".global"))
+    ;
+  else
+    Error(a, "unknown directive '%s'", name);
+}
+
+
+static void Line(Asm *a, char *line) {
+  // Comments, outside of strings
+  bool quoted = false;
+  for(char *c = line; *c; c++) {
+    if(*c == '"' && (c == line || c[-1] != '\\'))
+      quoted = !quoted;
+    else if(!quoted && IsCharLiteral(c))
+      c += 2;
+    else if(*c == '#' && !quoted) {
+      *c = '\0';
+      break;
+    }
+  }
+
+  char *s = (char*)SkipSpace(line);
+  // Any number of labels
+  for(;;) {
+    char *start = s;
+    while(IsIdent(*s))
+      s++;
+    char *colon = (char*)SkipSpace(s);
+    if(s == start || !IsIdentStart(*start) || *colon != ':') {
+      s = start;
+      break;
+    }
+    if(a->pass == 0)
+      DefineLabel(a, start, s - start);
+    s = (char*)SkipSpace(colon + 1);
+  }
+  if(!*s)
+    return;
+
+  char name[32];
+  size_t len = 0;
+  while(IsIdent(s[len]) && len < sizeof name - 1) {
+    name[len] = tolower(s[len]);
+    len++;
+  }
+  name[len] = '\0';
+  if(len == 0 || (s[len] && !isspace(s[len]))) {
+    Error(a, "syntax error");
+    return;
+  }
+  if(name[0] == '.')
+    Directive(a, name, s + len);
+  else
+    Instruction(a, name, s + len);
+}
+
+
+static void Pass(Asm *a, const char *source) {
+  a->section = SEC_TEXT;
+  memset(a->lc, 0, sizeof a->lc);
+  a->line = 0;
+  for(const char *s = source; *s; ) {
+    const char *end = strchr(s, '\n');
+    size_t len = end ? (size_t)(end - s) : strlen(s);
+    char line[LINE_MAX_LEN];
+    a->line++;
+    if(len >= sizeof line)
+      Error(a, "line too long");
+    else {
+      memcpy(line, s, len);
+      line[len] = '\0';
+      Line(a, line);
+    }
+    s += len + (end != NULL);
+  }
+  for(int i = 0; i < NUM_SECTIONS; i++)
+    if(a->lc[i] > a->size[i])
+      a->size[i] = a->lc[i];
+}
+
+
+int AsmSource(const char *source, const char *name, uint32_t base, AsmImage *image) {
+  Asm a = { .file = name, .base = base };
+  memset(image, 0, sizeof *image);
+
+  a.addr[SEC_TEXT] = base;
+  Pass(&a, source);
+  a.addr[SEC_DATA] = (base + a.size[SEC_TEXT] + 15) & ~15u;
+  uint64_t end = (uint64_t)a.addr[SEC_DATA] + a.size[SEC_DATA];
+  if(!a.errors && end > MEM_SIZE) {
+    a.line = 0;
+    Error(&a, "image does not fit in memory");
+  }
+
+  if(!a.errors) {
+    a.pass = 1;
+    a.out = calloc(end - base, 1);
+    Pass(&a, source);
+  }
+
+  if(!a.errors) {
+    *image = (AsmImage){
+      .base = base, .size = end - base, .data = a.out, .entry = base,
+      .textSize = a.size[SEC_TEXT], .dataBase = a.addr[SEC_DATA],
+      .symbols = malloc(a.numLabels * sizeof *image->symbols),
+      .numSymbols = a.numLabels,
+    };
+    for(unsigned i = 0; i < a.numLabels; i++) {
+      const Label *l = &a.labels[i];
+      image->symbols[i] = (AsmSymbol){ l->name, a.addr[l->section] + l->offset };
+      if(!strcmp(l->name, "_start"))
+        image->entry = image->symbols[i].addr;
+    }
+  } else {
+    for(unsigned i = 0; i < a.numLabels; i++)
+      free(a.labels[i].name);
+    free(a.out);
+  }
+  free(a.labels);
+  free(a.hash);
+  return a.errors ? -1 : 0;
+}
+
+
+int AsmFile(const char *filename, uint32_t base, AsmImage *image) {
+  FILE *f = fopen(filename, "rb");
+  if(!f)
+    return -1;
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  char *source = malloc(size + 1);
+  bool ok = size >= 0 && fread(source, 1, size, f) == (size_t)size;
+  fclose(f);
+  int result = -1;
+  if(ok) {
+    source[size] = '\0';
+    result = AsmSource(source, filename, base, image);
+  }
+  free(source);
+  return result;
+}
+
+
+void AsmFree(AsmImage *image) {
+  for(unsigned i = 0; i < image->numSymbols; i++)
+    free(image->symbols[i].name);
+  free(image->symbols);
+  free(image->data);
+  memset(image, 0, sizeof *image);
+}
+
+
+// Copies the image into memory and adds its labels to the symbol table
+void AsmLoad(const AsmImage *image) {
+  memcpy(&mem[image->base], image->data, image->size);
+  for(unsigned i = 0; i < image->numSymbols; i++)
+    SymbolAdd(image->symbols[i].name, image->symbols[i].addr, 0);
+}
+
+
+// Builds an executable ELF with one loadable segment per section and a
+// symbol table, so the result also works with SymbolsLoadELF
+uint8_t *AsmELF(const AsmImage *image, size_t *size) {
+  enum { SH_NULL, SH_TEXT, SH_DATA, SH_SYMTAB, SH_STRTAB, SH_SHSTRTAB, NUM_SH };
+  static const char shstr[] = "\0.text\0.data\0.symtab\0.strtab\0.shstrtab";
+  uint32_t dataSize = image->base + image->size - image->dataBase;
+
+  size_t strSize = 1;
+  for(unsigned i = 0; i < image->numSymbols; i++)
+    strSize += strlen(image->symbols[i].name) + 1;
+
+  size_t phOff   = sizeof(Elf32_Ehdr);
+  size_t textOff = (phOff + 2 * sizeof(Elf32_Phdr) + 15) & ~(size_t)15;
+  size_t dataOff = textOff + image->textSize;
+  size_t symOff  = (dataOff + dataSize + 3) & ~(size_t)3;
+  size_t symSize = (image->numSymbols + 1) * sizeof(Elf32_Sym);
+  size_t strOff  = symOff + symSize;
+  size_t shstrOff = strOff + strSize;
+  size_t shOff   = (shstrOff + sizeof shstr + 3) & ~(size_t)3;
+  *size = shOff + NUM_SH * sizeof(Elf32_Shdr);
+
+  uint8_t *elf = calloc(*size, 1);
+  if(!elf)
+    return NULL;
+
+  Elf32_Ehdr *eh = (Elf32_Ehdr*)elf;
+  memcpy(eh->e_ident, ELFMAG, SELFMAG);
+  eh->e_ident[EI_CLASS]   = ELFCLASS32;
+  eh->e_ident[EI_DATA]    = ELFDATA2LSB;
+  eh->e_ident[EI_VERSION] = EV_CURRENT;
+  eh->e_type      = ET_EXEC;
+  eh->e_machine   = EM_RISCV;
+  eh->e_version   = EV_CURRENT;
+  eh->e_entry     = image->entry;
+  eh->e_phoff     = phOff;
+  eh->e_shoff     = shOff;
+  eh->e_ehsize    = sizeof(Elf32_Ehdr);
+  eh->e_phentsize = sizeof(Elf32_Phdr);
+  eh->e_phnum     = 2;
+  eh->e_shentsize = sizeof(Elf32_Shdr);
+  eh->e_shnum     = NUM_SH;
+  eh->e_shstrndx  = SH_SHSTRTAB;
+
+  Elf32_Phdr *ph = (Elf32_Phdr*)(elf + phOff);
+  ph[0] = (Elf32_Phdr){ PT_LOAD, textOff, image->base, image->base,
+                        image->textSize, image->textSize, PF_R | PF_X, 4 };
+  ph[1] = (Elf32_Phdr){ PT_LOAD, dataOff, image->dataBase, image->dataBase,
+                        dataSize, dataSize, PF_R | PF_W, 4 };
+  memcpy(elf + textOff, image->data, image->textSize);
+  memcpy(elf + dataOff, image->data + (image->dataBase - image->base), dataSize);
+
+  Elf32_Sym *sym = (Elf32_Sym*)(elf + symOff);
+  char *str = (char*)elf + strOff;
+  size_t strPos = 1;
+  for(unsigned i = 0; i < image->numSymbols; i++) {
+    const AsmSymbol *s = &image->symbols[i];
+    bool text = s->addr < image->base + image->textSize;
+    sym[i + 1] = (Elf32_Sym){
+      .st_name  = strPos,
+      .st_value = s->addr,
+      .st_info  = ELF32_ST_INFO(STB_GLOBAL, text ? STT_FUNC : STT_OBJECT),
+      .st_shndx = text ? SH_TEXT : SH_DATA,
+    };
+    strcpy(str + strPos, s->name);
+    strPos += strlen(s->name) + 1;
+  }
+  memcpy(elf + shstrOff, shstr, sizeof shstr);
+
+  Elf32_Shdr *sh = (Elf32_Shdr*)(elf + shOff);
+  sh[SH_TEXT]     = (Elf32_Shdr){ 1,  SHT_PROGBITS, SHF_ALLOC | SHF_EXECINSTR, image->base,
+                                  textOff, image->textSize, 0, 0, 4, 0 };
+  sh[SH_DATA]     = (Elf32_Shdr){ 7,  SHT_PROGBITS, SHF_ALLOC | SHF_WRITE, image->dataBase,
+                                  dataOff, dataSize, 0, 0, 4, 0 };
+  sh[SH_SYMTAB]   = (Elf32_Shdr){ 13, SHT_SYMTAB, 0, 0, symOff, symSize,
+                                  SH_STRTAB, 1, 4, sizeof(Elf32_Sym) };
+  sh[SH_STRTAB]   = (Elf32_Shdr){ 21, SHT_STRTAB, 0, 0, strOff, strSize, 0, 0, 1, 0 };
+  sh[SH_SHSTRTAB] = (Elf32_Shdr){ 29, SHT_STRTAB, 0, 0, shstrOff, sizeof shstr, 0, 0, 1, 0 };
+  return elf;
+}
+
+
+// Writes an ELF if the filename ends in .elf, otherwise a flat image
+int AsmWrite(const AsmImage *image, const char *filename) {
+  size_t len = strlen(filename), size = image->size;
+  uint8_t *elf = NULL;
+  const uint8_t *data = image->data;
+  if(len >= 4 && !strcmp(filename + len - 4, ".elf")) {
+    if(!(data = elf = AsmELF(image, &size)))
+      return -1;
+  }
+  FILE *f = fopen(filename, "wb");
+  int result = -1;
+  if(f) {
+    if(fwrite(data, 1, size, f) == size)
+      result = 0;
+    if(fclose(f))
+      result = -1;
+  }
+  free(elf);
+  return result;
+}
@@ -0,0 +1,33 @@
+#ifndef ASM_H
+#define ASM_H
+#include <stddef.h>
+#include <stdint.h>
+
+// A two-pass assembler for whole source files, built on Assemble. .text is
+// placed at the base address and .data follows it, aligned to 16 bytes.
+
+typedef struct {
+  char    *name;
+  uint32_t addr;
+} AsmSymbol;
+
+typedef struct {
+  uint32_t   base;     // Address of data[0]
+  uint32_t   size;
+  uint8_t   *data;
+  uint32_t   entry;    // _start if defined, otherwise base
+  uint32_t   textSize; // .text is [base, base + textSize)
+  uint32_t   dataBase;
+  AsmSymbol *symbols;
+  unsigned   numSymbols;
+} AsmImage;
+
+int  AsmSource(const char *source, const char *name, uint32_t base, AsmImage *image);
+int  AsmFile(const char *filename, uint32_t base, AsmImage *image);
+void AsmFree(AsmImage *image);
+void AsmLoad(const AsmImage *image);
+
+uint8_t *AsmELF(const AsmImage *image, size_t *size);
+int      AsmWrite(const AsmImage *image, const char *filename);
+
+#endif
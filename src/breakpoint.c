@@ -0,0 +1,242 @@
+#include "breakpoint.h"
+#include <ctype.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CODE_MAX  64 // Words of bytecode per condition
+#define STACK_MAX 16
+
+uint64_t breakpoints[MEM_SIZE / 4 / 64];
+
+// Conditions are compiled to a stack bytecode of one word per operation,
+// with the operation in the low byte and a register number above it.
+// OP_IMM is followed by its operand.
+enum {
+  OP_END, OP_IMM, OP_REG, OP_LOAD, OP_NEG, OP_NOT, OP_INV,
+  OP_ADD, OP_SUB, OP_AND, OP_OR, OP_XOR,
+  OP_EQ, OP_NE, OP_LT, OP_LE, OP_GT, OP_GE, OP_LAND, OP_LOR,
+};
+
+typedef struct {
+  uint32_t addr;
+  uint32_t count;
+  uint64_t hits;      // Times reached with the condition true
+  char    *condition; // NULL if unconditional
+  uint32_t code[CODE_MAX];
+} Breakpoint;
+
+static Breakpoint *table;
+static unsigned    numBreakpoints;
+
+
+// Binary operators by increasing precedence, longer spellings first
+static const struct {
+  char    name[3];
+  uint8_t prec;
+  uint8_t op;
+} binaryOps[] = {
+  {"||", 1, OP_LOR}, {"&&", 2, OP_LAND},
+  {"==", 3, OP_EQ},  {"!=", 3, OP_NE},
+  {"<=", 4, OP_LE},  {">=", 4, OP_GE}, {"<", 4, OP_LT}, {">", 4, OP_GT},
+  {"|",  5, OP_OR},  {"^",  6, OP_XOR}, {"&", 7, OP_AND},
+  {"+",  8, OP_ADD}, {"-",  8, OP_SUB},
+};
+
+typedef struct {
+  const char *s;
+  uint32_t   *code;
+  int         size;
+  int         depth; // Of the evaluation stack
+  bool        error;
+} Compiler;
+
+
+static void Emit(Compiler *c, uint32_t word, int push) {
+  if(c->size == CODE_MAX - 1 || (c->depth += push) > STACK_MAX)
+    c->error = true;
+  else
+    c->code[c->size++] = word;
+}
+
+
+static void SkipSpace(Compiler *c) {
+  while(isspace(*c->s))
+    c->s++;
+}
+
+
+static void CompileExpression(Compiler *c, int minPrec);
+
+
+// number | register | (expr) | [expr] for a 32-bit load | unary operator
+static void CompileUnary(Compiler *c) {
+  SkipSpace(c);
+  char first = *c->s;
+  if(first == '-' || first == '!' || first == '~') {
+    c->s++;
+    CompileUnary(c);
+    Emit(c, first == '-' ? OP_NEG : first == '!' ? OP_NOT : OP_INV, 0);
+  } else if(first == '(' || first == '[') {
+    c->s++;
+    CompileExpression(c, 1);
+    SkipSpace(c);
+    if(*c->s++ != (first == '(' ? ')' : ']'))
+      c->error = true;
+    if(first == '[')
+      Emit(c, OP_LOAD, 0);
+  } else if(isdigit(first)) {
+    char *end;
+    uint32_t value = strtoul(c->s, &end, 0);
+    c->s = end;
+    Emit(c, OP_IMM, 1);
+    Emit(c, value, 0);
+  } else if(isalpha(first)) {
+    char name[8];
+    int n = 0;
+    while(isalnum(c->s[n]) && n < 7)
+      name[n] = c->s[n], n++;
+    name[n] = '\0';
+    c->s += n;
+    int idx = GetRegisterIndex(name);
+    if(idx < 0)
+      c->error = true;
+    Emit(c, OP_REG | idx << 8, 1);
+  } else
+    c->error = true;
+}
+
+
+static void CompileExpression(Compiler *c, int minPrec) {
+  CompileUnary(c);
+  while(!c->error) {
+    SkipSpace(c);
+    unsigned i = 0;
+    while(i < sizeof binaryOps / sizeof *binaryOps &&
+          strncmp(c->s, binaryOps[i].name, strlen(binaryOps[i].name)))
+      i++;
+    if(i == sizeof binaryOps / sizeof *binaryOps || binaryOps[i].prec < minPrec)
+      return;
+    c->s += strlen(binaryOps[i].name);
+    CompileExpression(c, binaryOps[i].prec + 1);
+    Emit(c, binaryOps[i].op, -1);
+  }
+}
+
+
+#define BINARY(EXPR) { uint32_t l = sp[-2], r = sp[-1]; sp--; sp[-1] = (EXPR); } break
+
+static uint32_t Evaluate(const uint32_t *code) {
+  uint32_t stack[STACK_MAX], *sp = stack; // sp[-1] is the top
+  for(;; code++) {
+    switch(*code & 0xFF) {
+    case OP_END:  return sp[-1];
+    case OP_IMM:  *sp++ = *++code;            break;
+    case OP_REG:  *sp++ = reg[*code >> 8];    break;
+    case OP_LOAD: sp[-1] = CPURead32(sp[-1]); break;
+    case OP_NEG:  sp[-1] = -sp[-1];           break;
+    case OP_NOT:  sp[-1] = !sp[-1];           break;
+    case OP_INV:  sp[-1] = ~sp[-1];           break;
+    case OP_ADD:  BINARY(l + r);
+    case OP_SUB:  BINARY(l - r);
+    case OP_AND:  BINARY(l & r);
+    case OP_OR:   BINARY(l | r);
+    case OP_XOR:  BINARY(l ^ r);
+    case OP_EQ:   BINARY(l == r);
+    case OP_NE:   BINARY(l != r);
+    case OP_LT:   BINARY((int32_t)l <  (int32_t)r);
+    case OP_LE:   BINARY((int32_t)l <= (int32_t)r);
+    case OP_GT:   BINARY((int32_t)l >  (int32_t)r);
+    case OP_GE:   BINARY((int32_t)l >= (int32_t)r);
+    case OP_LAND: BINARY(l && r);
+    case OP_LOR:  BINARY(l || r);
+    }
+  }
+}
+
+#undef BINARY
+
+
+static Breakpoint *Find(uint32_t addr) {
+  for(unsigned i = 0; i < numBreakpoints; i++)
+    if(table[i].addr == addr)
+      return &table[i];
+  return NULL;
+}
+
+
+int BreakpointSet(uint32_t addr, uint32_t count, const char *condition) {
+  Breakpoint bp = { addr, count ? count : 1, 0, NULL, {OP_END} };
+  if(condition) {
+    Compiler c = { condition, bp.code, 0, 0, false };
+    CompileExpression(&c, 1);
+    SkipSpace(&c);
+    if(c.error || *c.s)
+      return -1;
+    bp.code[c.size] = OP_END;
+    bp.condition = strdup(condition);
+  }
+
+  Breakpoint *old = Find(addr);
+  if(old)
+    free(old->condition);
+  else {
+    table = realloc(table, (numBreakpoints + 1) * sizeof *table);
+    old = &table[numBreakpoints++];
+  }
+  *old = bp;
+  addr %= MEM_SIZE;
+  breakpoints[addr >> 8] |= 1ull << (addr >> 2 & 63);
+  cpuHooks |= CPU_HOOK_BREAK;
+  return 0;
+}
+
+
+void BreakpointClear(uint32_t addr) {
+  Breakpoint *bp = Find(addr);
+  if(!bp)
+    return;
+  free(bp->condition);
+  *bp = table[--numBreakpoints];
+  // The bit stays while another breakpoint shares it
+  for(unsigned i = 0; i < numBreakpoints; i++)
+    if(table[i].addr % MEM_SIZE == addr % MEM_SIZE)
+      return;
+  addr %= MEM_SIZE;
+  breakpoints[addr >> 8] &= ~(1ull << (addr >> 2 & 63));
+  if(!numBreakpoints)
+    cpuHooks &= ~CPU_HOOK_BREAK;
+}
+
+
+bool BreakpointHit(uint32_t pc) {
+  Breakpoint *bp = Find(pc);
+  return bp && (!bp->condition || Evaluate(bp->code)) && ++bp->hits >= bp->count;
+}
+
+
+// In the syntax of the b command, with the hits as a comment
+void BreakpointReport(FILE *f) {
+  for(unsigned i = 0; i < numBreakpoints; i++) {
+    const Breakpoint *bp = &table[i];
+    fprintf(f, "b +0x%08X", bp->addr);
+    if(bp->count != 1)
+      fprintf(f, " %u", bp->count);
+    if(bp->condition)
+      fprintf(f, " if %s", bp->condition);
+    fprintf(f, "  # %" PRIu64 " hits\n", bp->hits);
+  }
+}
+
+
+unsigned BreakpointRun(unsigned cycles) {
+  if(!cycles)
+    return 0;
+  unsigned hooks = cpuHooks;
+  cpuHooks &= ~CPU_HOOK_BREAK;
+  unsigned remaining = CPUStep(1);
+  cpuHooks = hooks;
+  if(remaining)
+    return cycles;
+  return CPUStep(cycles - 1);
+}
@@ -0,0 +1,30 @@
+#ifndef BREAKPOINT_H
+#define BREAKPOINT_H
+#include "CPU.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// One bit per instruction of RAM. The executor tests it while
+// CPU_HOOK_BREAK is set and only calls BreakpointHit when the bit is set.
+// Breakpoints are on the PC, which may be a virtual address anywhere, so
+// addresses a multiple of MEM_SIZE apart share a bit.
+extern uint64_t breakpoints[MEM_SIZE / 4 / 64];
+
+static inline bool IsBreakpoint(uint32_t addr) {
+  addr %= MEM_SIZE;
+  return breakpoints[addr >> 8] >> (addr >> 2 & 63) & 1;
+}
+
+// Breaks on the count-th time the instruction at addr is reached with the
+// condition true, and every time after. condition may be NULL. Returns -1
+// if it doesn't compile.
+int  BreakpointSet(uint32_t addr, uint32_t count, const char *condition);
+void BreakpointClear(uint32_t addr);
+bool BreakpointHit(uint32_t pc);
+void BreakpointReport(FILE *f);
+
+// CPUStep, except that a breakpoint at the PC is stepped over
+unsigned BreakpointRun(unsigned cycles);
+
+#endif
@@ -0,0 +1,86 @@
+#include "clint.h"
+#include "CPU.h"
+#include "events.h"
+#include "mmio.h"
+
+enum {
+  MSIP     = 0x0000,
+  MTIMECMP = 0x4000,
+  MTIME    = 0xBFF8,
+};
+
+static uint32_t msip;
+static uint64_t mtimecmp = UINT64_MAX;
+static int64_t  skew; // mtime - cpuTime, changed by writes to mtime
+static Event    timer;
+
+
+uint64_t ClintTime() {
+  return cpuTime + skew;
+}
+
+
+// Raises MTIP now, or schedules it for when mtime reaches mtimecmp. After
+// mtime is set back, that can be past the end of cpuTime, and never comes.
+static void Update() {
+  bool due = ClintTime() >= mtimecmp;
+  uint64_t when;
+  CPUInterrupt(MIP_MTIP, due);
+  if(due || __builtin_sub_overflow(mtimecmp, skew, &when))
+    EventCancel(&timer);
+  else
+    EventSchedule(&timer, when);
+}
+
+
+// Replaces size bytes of a 64-bit register at offset within it
+static uint64_t Merge(uint64_t old, uint32_t offset, uint32_t value, unsigned size) {
+  unsigned shift = 8 * (offset & 7);
+  uint64_t mask = (size == 4 ? 0xFFFF'FFFFull : (1ull << 8 * size) - 1) << shift;
+  return (old & ~mask) | ((uint64_t)value << shift & mask);
+}
+
+
+static uint32_t Read(uint32_t offset, [[maybe_unused]] unsigned size) {
+  if(offset < MSIP + 4)
+    return msip >> 8 * offset;
+  if(offset - MTIMECMP < 8)
+    return mtimecmp >> 8 * (offset & 7);
+  if(offset - MTIME < 8)
+    return ClintTime() >> 8 * (offset & 7);
+  return 0;
+}
+
+
+static void Write(uint32_t offset, uint32_t value, unsigned size) {
+  if(offset < MSIP + 4) {
+    msip = Merge(msip, offset, value, size) & 1;
+    CPUInterrupt(MIP_MSIP, msip);
+  } else if(offset - MTIMECMP < 8) {
+    mtimecmp = Merge(mtimecmp, offset, value, size);
+    Update();
+  } else if(offset - MTIME < 8) {
+    skew = Merge(ClintTime(), offset, value, size) - cpuTime;
+    Update();
+  }
+}
+
+
+static const MMIODevice device = {
+  "clint", CLINT_BASE, 0x1'0000, Read, Write
+};
+
+
+int ClintStart() {
+  timer.fire = Update;
+  msip = 0;
+  mtimecmp = UINT64_MAX;
+  skew = 0;
+  return MMIOMap(&device);
+}
+
+
+void ClintStop() {
+  EventCancel(&timer);
+  MMIOUnmap(&device);
+}
@@ -0,0 +1,13 @@
+#ifndef CLINT_H
+#define CLINT_H
+#include <stdint.h>
+
+// The core-local interruptor of hart 0: msip, mtimecmp and mtime, which
+// ticks once per instruction
+#define CLINT_BASE 0x0200'0000
+
+int      ClintStart();
+void     ClintStop();
+uint64_t ClintTime();
+
+#endif
@@ -0,0 +1,336 @@
+#include "debugview.h"
+#include "CPU.h"
+#include "monitor.h"
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+
+#define COLS           68
+#define ROWS           36
+#define SCALE          2  // Glyphs are 8x8 pixels
+#define PUBLISH_PERIOD 33 // Milliseconds between snapshots while running
+#define CODE_ROW       2
+#define CODE_ROWS      16
+#define DUMP_ROW       (CODE_ROW + CODE_ROWS + 1)
+#define PANE_COL       24
+
+SDL_Window   *debugWindow;
+SDL_Renderer *debugRenderer;
+SDL_Texture  *debugFont;
+
+// Printable ASCII, one byte per row with the leftmost pixel in bit 0. From
+// the public domain font8x8_basic.
+static const uint8_t font[95][8] = {
+  {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, // space
+  {0x18, 0x3C, 0x3C, 0x18, 0x18, 0x00, 0x18, 0x00}, // !
+  {0x36, 0x36, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, // "
+  {0x36, 0x36, 0x7F, 0x36, 0x7F, 0x36, 0x36, 0x00}, // #
+  {0x0C, 0x3E, 0x03, 0x1E, 0x30, 0x1F, 0x0C, 0x00}, // $
+  {0x00, 0x63, 0x33, 0x18, 0x0C, 0x66, 0x63, 0x00}, // %
+  {0x1C, 0x36, 0x1C, 0x6E, 0x3B, 0x33, 0x6E, 0x00}, // &
+  {0x06, 0x06, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00}, // '
+  {0x18, 0x0C, 0x06, 0x06, 0x06, 0x0C, 0x18, 0x00}, // (
+  {0x06, 0x0C, 0x18, 0x18, 0x18, 0x0C, 0x06, 0x00}, // )
+  {0x00, 0x66, 0x3C, 0xFF, 0x3C, 0x66, 0x00, 0x00}, // *
+  {0x00, 0x0C, 0x0C, 0x3F, 0x0C, 0x0C, 0x00, 0x00}, // +
+  {0x00, 0x00, 0x00, 0x00, 0x00, 0x0C, 0x0C, 0x06}, // ,
+  {0x00, 0x00, 0x00, 0x3F, 0x00, 0x00, 0x00, 0x00}, // -
+  {0x00, 0x00, 0x00, 0x00, 0x00, 0x0C, 0x0C, 0x00}, // .
+  {0x60, 0x30, 0x18, 0x0C, 0x06, 0x03, 0x01, 0x00}, // /
+  {0x3E, 0x63, 0x73, 0x7B, 0x6F, 0x67, 0x3E, 0x00}, // 0
+  {0x0C, 0x0E, 0x0C, 0x0C, 0x0C, 0x0C, 0x3F, 0x00}, // 1
+  {0x1E, 0x33, 0x30, 0x1C, 0x06, 0x33, 0x3F, 0x00}, // 2
+  {0x1E, 0x33, 0x30, 0x1C, 0x30, 0x33, 0x1E, 0x00}, // 3
+  {0x38, 0x3C, 0x36, 0x33, 0x7F, 0x30, 0x78, 0x00}, // 4
+  {0x3F, 0x03, 0x1F, 0x30, 0x30, 0x33, 0x1E, 0x00}, // 5
+  {0x1C, 0x06, 0x03, 0x1F, 0x33, 0x33, 0x1E, 0x00}, // 6
+  {0x3F, 0x33, 0x30, 0x18, 0x0C, 0x0C, 0x0C, 0x00}, // 7
+  {0x1E, 0x33, 0x33, 0x1E, 0x33, 0x33, 0x1E, 0x00}, // 8
+  {0x1E, 0x33, 0x33, 0x3E, 0x30, 0x18, 0x0E, 0x00}, // 9
+  {0x00, 0x0C, 0x0C, 0x00, 0x00, 0x0C, 0x0C, 0x00}, // :
+  {0x00, 0x0C, 0x0C, 0x00, 0x00, 0x0C, 0x0C, 0x06}, // ;
+  {0x18, 0x0C, 0x06, 0x03, 0x06, 0x0C, 0x18, 0x00}, // <
+  {0x00, 0x00, 0x3F, 0x00, 0x00, 0x3F, 0x00, 0x00}, // =
+  {0x06, 0x0C, 0x18, 0x30, 0x18, 0x0C, 0x06, 0x00}, // >
+  {0x1E, 0x33, 0x30, 0x18, 0x0C, 0x00, 0x0C, 0x00}, // ?
+  {0x3E, 0x63, 0x7B, 0x7B, 0x7B, 0x03, 0x1E, 0x00}, // @
+  {0x0C, 0x1E, 0x33, 0x33, 0x3F, 0x33, 0x33, 0x00}, // A
+  {0x3F, 0x66, 0x66, 0x3E, 0x66, 0x66, 0x3F, 0x00}, // B
+  {0x3C, 0x66, 0x03, 0x03, 0x03, 0x66, 0x3C, 0x00}, // C
+  {0x1F, 0x36, 0x66, 0x66, 0x66, 0x36, 0x1F, 0x00}, // D
+  {0x7F, 0x46, 0x16, 0x1E, 0x16, 0x46, 0x7F, 0x00}, // E
+  {0x7F, 0x46, 0x16, 0x1E, 0x16, 0x06, 0x0F, 0x00}, // F
+  {0x3C, 0x66, 0x03, 0x03, 0x73, 0x66, 0x7C, 0x00}, // G
+  {0x33, 0x33, 0x33, 0x3F, 0x33, 0x33, 0x33, 0x00}, // H
+  {0x1E, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x1E, 0x00}, // I
+  {0x78, 0x30, 0x30, 0x30, 0x33, 0x33, 0x1E, 0x00}, // J
+  {0x67, 0x66, 0x36, 0x1E, 0x36, 0x66, 0x67, 0x00}, // K
+  {0x0F, 0x06, 0x06, 0x06, 0x46, 0x66, 0x7F, 0x00}, // L
+  {0x63, 0x77, 0x7F, 0x7F, 0x6B, 0x63, 0x63, 0x00}, // M
+  {0x63, 0x67, 0x6F, 0x7B, 0x73, 0x63, 0x63, 0x00}, // N
+  {0x1C, 0x36, 0x63, 0x63, 0x63, 0x36, 0x1C, 0x00}, // O
+  {0x3F, 0x66, 0x66, 0x3E, 0x06, 0x06, 0x0F, 0x00}, // P
+  {0x1E, 0x33, 0x33, 0x33, 0x3B, 0x1E, 0x38, 0x00}, // Q
+  {0x3F, 0x66, 0x66, 0x3E, 0x36, 0x66, 0x67, 0x00}, // R
+  {0x1E, 0x33, 0x07, 0x0E, 0x38, 0x33, 0x1E, 0x00}, // S
+  {0x3F, 0x2D, 0x0C, 0x0C, 0x0C, 0x0C, 0x1E, 0x00}, // T
+  {0x33, 0x33, 0x33, 0x33, 0x33, 0x33, 0x3F, 0x00}, // U
+  {0x33, 0x33, 0x33, 0x33, 0x33, 0x1E, 0x0C, 0x00}, // V
+  {0x63, 0x63, 0x63, 0x6B, 0x7F, 0x77, 0x63, 0x00}, // W
+  {0x63, 0x63, 0x36, 0x1C, 0x1C, 0x36, 0x63, 0x00}, // X
+  {0x33, 0x33, 0x33, 0x1E, 0x0C, 0x0C, 0x1E, 0x00}, // Y
+  {0x7F, 0x63, 0x31, 0x18, 0x4C, 0x66, 0x7F, 0x00}, // Z
+  {0x1E, 0x06, 0x06, 0x06, 0x06, 0x06, 0x1E, 0x00}, // [
+  {0x03, 0x06, 0x0C, 0x18, 0x30, 0x60, 0x40, 0x00}, // backslash
+  {0x1E, 0x18, 0x18, 0x18, 0x18, 0x18, 0x1E, 0x00}, // ]
+  {0x08, 0x1C, 0x36, 0x63, 0x00, 0x00, 0x00, 0x00}, // ^
+  {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xFF}, // _
+  {0x0C, 0x0C, 0x18, 0x00, 0x00, 0x00, 0x00, 0x00}, // `
+  {0x00, 0x00, 0x1E, 0x30, 0x3E, 0x33, 0x6E, 0x00}, // a
+  {0x07, 0x06, 0x06, 0x3E, 0x66, 0x66, 0x3B, 0x00}, // b
+  {0x00, 0x00, 0x1E, 0x33, 0x03, 0x33, 0x1E, 0x00}, // c
+  {0x38, 0x30, 0x30, 0x3E, 0x33, 0x33, 0x6E, 0x00}, // d
+  {0x00, 0x00, 0x1E, 0x33, 0x3F, 0x03, 0x1E, 0x00}, // e
+  {0x1C, 0x36, 0x06, 0x0F, 0x06, 0x06, 0x0F, 0x00}, // f
+  {0x00, 0x00, 0x6E, 0x33, 0x33, 0x3E, 0x30, 0x1F}, // g
+  {0x07, 0x06, 0x36, 0x6E, 0x66, 0x66, 0x67, 0x00}, // h
+  {0x0C, 0x00, 0x0E, 0x0C, 0x0C, 0x0C, 0x1E, 0x00}, // i
+  {0x30, 0x00, 0x30, 0x30, 0x30, 0x33, 0x33, 0x1E}, // j
+  {0x07, 0x06, 0x66, 0x36, 0x1E, 0x36, 0x67, 0x00}, // k
+  {0x0E, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x1E, 0x00}, // l
+  {0x00, 0x00, 0x33, 0x7F, 0x7F, 0x6B, 0x63, 0x00}, // m
+  {0x00, 0x00, 0x1F, 0x33, 0x33, 0x33, 0x33, 0x00}, // n
+  {0x00, 0x00, 0x1E, 0x33, 0x33, 0x33, 0x1E, 0x00}, // o
+  {0x00, 0x00, 0x3B, 0x66, 0x66, 0x3E, 0x06, 0x0F}, // p
+  {0x00, 0x00, 0x6E, 0x33, 0x33, 0x3E, 0x30, 0x78}, // q
+  {0x00, 0x00, 0x3B, 0x6E, 0x66, 0x06, 0x0F, 0x00}, // r
+  {0x00, 0x00, 0x3E, 0x03, 0x1E, 0x30, 0x1F, 0x00}, // s
+  {0x08, 0x0C, 0x3E, 0x0C, 0x0C, 0x2C, 0x18, 0x00}, // t
+  {0x00, 0x00, 0x33, 0x33, 0x33, 0x33, 0x6E, 0x00}, // u
+  {0x00, 0x00, 0x33, 0x33, 0x33, 0x1E, 0x0C, 0x00}, // v
+  {0x00, 0x00, 0x63, 0x6B, 0x7F, 0x7F, 0x36, 0x00}, // w
+  {0x00, 0x00, 0x63, 0x36, 0x1C, 0x36, 0x63, 0x00}, // x
+  {0x00, 0x00, 0x33, 0x33, 0x33, 0x3E, 0x30, 0x1F}, // y
+  {0x00, 0x00, 0x3F, 0x19, 0x0C, 0x26, 0x3F, 0x00}, // z
+  {0x38, 0x0C, 0x0C, 0x07, 0x0C, 0x0C, 0x38, 0x00}, // {
+  {0x18, 0x18, 0x18, 0x00, 0x18, 0x18, 0x18, 0x00}, // |
+  {0x07, 0x0C, 0x0C, 0x38, 0x0C, 0x0C, 0x07, 0x00}, // }
+  {0x6E, 0x3B, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, // ~
+};
+
+enum { WHITE, GREY, YELLOW, CYAN, NUM_COLORS };
+
+static const SDL_Color colors[NUM_COLORS] = {
+  {0xE0, 0xE0, 0xE0, 0xFF}, {0x80, 0x80, 0x80, 0xFF}, {0xFF, 0xD0, 0x40, 0xFF}, {0x60, 0xC0, 0xFF, 0xFF},
+};
+
+typedef struct {
+  char    text [ROWS][COLS];
+  uint8_t color[ROWS][COLS];
+} Snapshot;
+
+// The CPU thread formats into pending and copies it to shared under the
+// lock; the render thread copies shared out under the lock. Neither holds
+// the lock for longer than a copy.
+static Snapshot    pending, shared;
+static bool        fresh;
+static SDL_mutex  *lock;
+static atomic_bool running;
+static SDL_Thread *thread;
+
+static uint32_t memAddr;
+static bool     followSP = true;
+static uint64_t lastInstructions;
+static Uint64   lastTicks;
+
+
+static void Put(int row, int col, int color, const char *fmt, ...) {
+  char line[COLS + 1];
+  va_list args;
+  va_start(args, fmt);
+  int n = vsnprintf(line, sizeof line, fmt, args);
+  va_end(args);
+  if(n > COLS - col)
+    n = COLS - col;
+  memcpy(&pending.text[row][col], line, n);
+  memset(&pending.color[row][col], color, n);
+}
+
+
+void DebugViewPublish(uint64_t instructions, bool force) {
+  if(!atomic_load_explicit(&running, memory_order_relaxed))
+    return;
+  Uint64 now = SDL_GetTicks64();
+  if(!force && now - lastTicks < PUBLISH_PERIOD)
+    return;
+  double mips = now > lastTicks ? (instructions - lastInstructions) / ((now - lastTicks) * 1e3) : 0;
+  lastInstructions = instructions;
+  lastTicks = now;
+
+  memset(pending.text, ' ', sizeof pending.text);
+  memset(pending.color, WHITE, sizeof pending.color);
+  Put(0, 0, CYAN, "%9.2f MIPS %16" PRIu64 " instructions", mips, instructions);
+
+  char buf[64];
+  for(int i = 0; i < NUM_REGS; i++)
+    Put(CODE_ROW + i, 0, i == PC ? YELLOW : WHITE, "%s", FormatRegisterByIndex(i, buf));
+
+  // Disassembly from a few instructions before the PC. Only RAM is read,
+  // so that the view has no side effects on devices.
+  char ins[UNASSEMBLE_MAX];
+  for(int i = 0; i < CODE_ROWS; i++) {
+    uint32_t a = reg[PC] + (i - 4) * 4;
+    if(a >= MEM_SIZE - 3 || Unassemble(a, CPURead32(a), ins))
+      strcpy(ins, "");
+    Put(CODE_ROW + i, PANE_COL, a == reg[PC] ? YELLOW : WHITE, "%04X:%04X %s", a >> 16, a & 0xFFFF, ins);
+  }
+
+  uint32_t base = (followSP ? reg[SP] : memAddr) & ~7u;
+  Put(DUMP_ROW - 1, PANE_COL, CYAN, followSP ? "sp" : "memory");
+  for(int i = 0; i < ROWS - DUMP_ROW; i++) {
+    uint32_t a = base + i * 8;
+    char hex[8 * 3 + 1], ascii[9];
+    for(int j = 0; j < 8; j++) {
+      bool inside = a + j < MEM_SIZE;
+      snprintf(&hex[j * 3], 4, inside ? "%02X " : "-- ", inside ? mem[a + j] : 0);
+      ascii[j] = inside && mem[a + j] >= 32 && mem[a + j] < 127 ? mem[a + j] : '.';
+    }
+    ascii[8] = '\0';
+    Put(DUMP_ROW + i, PANE_COL, WHITE, "%04X:%04X %s%s", a >> 16, a & 0xFFFF, hex, ascii);
+  }
+
+  SDL_LockMutex(lock);
+  shared = pending;
+  fresh = true;
+  SDL_UnlockMutex(lock);
+}
+
+
+void DebugViewMemory(uint32_t addr) {
+  memAddr = addr;
+  followSP = false;
+}
+
+
+// An atlas of 16 glyphs per row, white on transparent, tinted per glyph by
+// the vertex colors
+static SDL_Texture *CreateFont(SDL_Renderer *renderer) {
+  static uint32_t pixels[6 * 8][16 * 8];
+  for(int g = 0; g < 95; g++)
+    for(int y = 0; y < 8; y++)
+      for(int x = 0; x < 8; x++)
+        pixels[g / 16 * 8 + y][g % 16 * 8 + x] = font[g][y] >> x & 1 ? 0xFFFF'FFFF : 0;
+  SDL_Texture *texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STATIC,
+                                           16 * 8, 6 * 8);
+  if(texture) {
+    SDL_UpdateTexture(texture, NULL, pixels, sizeof pixels[0]);
+    SDL_SetTextureBlendMode(texture, SDL_BLENDMODE_BLEND);
+  }
+  return texture;
+}
+
+
+// All glyphs of a snapshot go out as quads in a single SDL_RenderGeometry
+static void Draw(const Snapshot *s) {
+  static SDL_Vertex vertices[ROWS * COLS * 4];
+  static int        indices [ROWS * COLS * 6];
+  const float w = 8 * SCALE, du = 1 / 16.0f, dv = 1 / 6.0f;
+  int n = 0;
+  for(int row = 0; row < ROWS; row++) {
+    for(int col = 0; col < COLS; col++) {
+      unsigned g = (uint8_t)s->text[row][col] - 32;
+      if(g == 0 || g >= 95)
+        continue;
+      float x = col * 8 * SCALE, y = row * 8 * SCALE, u = g % 16 / 16.0f, v = g / 16 / 6.0f;
+      SDL_Color c = colors[s->color[row][col]];
+      SDL_Vertex *q = &vertices[n * 4];
+      q[0] = (SDL_Vertex){{x,     y    }, c, {u,      v     }};
+      q[1] = (SDL_Vertex){{x + w, y    }, c, {u + du, v     }};
+      q[2] = (SDL_Vertex){{x,     y + w}, c, {u,      v + dv}};
+      q[3] = (SDL_Vertex){{x + w, y + w}, c, {u + du, v + dv}};
+      int *i = &indices[n * 6];
+      i[0] = n * 4; i[1] = n * 4 + 1; i[2] = n * 4 + 2;
+      i[3] = n * 4 + 1; i[4] = n * 4 + 3; i[5] = n * 4 + 2;
+      n++;
+    }
+  }
+  SDL_SetRenderDrawColor(debugRenderer, 0x10, 0x10, 0x18, 0xFF);
+  SDL_RenderClear(debugRenderer);
+  SDL_RenderGeometry(debugRenderer, debugFont, vertices, n * 4, indices, n * 6);
+  SDL_RenderPresent(debugRenderer);
+}
+
+
+// Owns the window, which is created here so that all rendering stays on
+// this thread. Only new snapshots are drawn.
+static int Render(void *unused) {
+  static Snapshot view;
+  int result = -1;
+  debugWindow = SDL_CreateWindow("R64000 debug", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
+                                 COLS * 8 * SCALE, ROWS * 8 * SCALE, SDL_WINDOW_SHOWN);
+  if(debugWindow)
+    debugRenderer = SDL_CreateRenderer(debugWindow, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
+  if(debugRenderer)
+    debugFont = CreateFont(debugRenderer);
+  if(!debugFont) {
+    fprintf(stderr, "debug view: %s\n", SDL_GetError());
+    atomic_store(&running, false);
+    goto done;
+  }
+
+  while(atomic_load(&running)) {
+    SDL_Event e;
+    while(SDL_PollEvent(&e)) {
+      if(e.type == SDL_QUIT || (e.type == SDL_WINDOWEVENT && e.window.event == SDL_WINDOWEVENT_CLOSE))
+        atomic_store(&running, false);
+    }
+    SDL_LockMutex(lock);
+    bool draw = fresh;
+    if(fresh)
+      view = shared;
+    fresh = false;
+    SDL_UnlockMutex(lock);
+    if(draw)
+      Draw(&view);
+    else
+      SDL_Delay(PUBLISH_PERIOD / 2);
+  }
+  result = 0;
+done:
+  if(debugFont)
+    SDL_DestroyTexture(debugFont);
+  if(debugRenderer)
+    SDL_DestroyRenderer(debugRenderer);
+  if(debugWindow)
+    SDL_DestroyWindow(debugWindow);
+  debugFont = NULL;
+  debugRenderer = NULL;
+  debugWindow = NULL;
+  return result;
+}
+
+
+int DebugViewStart() {
+  if(thread && atomic_load(&running))
+    return 0;
+  DebugViewStop();
+  if(!lock && !(lock = SDL_CreateMutex()))
+    return -1;
+  atomic_store(&running, true);
+  if(!(thread = SDL_CreateThread(Render, "debug view", NULL))) {
+    atomic_store(&running, false);
+    return -1;
+  }
+  return 0;
+}
+
+
+void DebugViewStop() {
+  if(!thread)
+    return;
+  atomic_store(&running, false);
+  SDL_WaitThread(thread, NULL);
+  thread = NULL;
+}
@@ -0,0 +1,22 @@
+#ifndef DEBUGVIEW_H
+#define DEBUGVIEW_H
+#include <SDL.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+extern SDL_Window   *debugWindow;
+extern SDL_Renderer *debugRenderer;
+extern SDL_Texture  *debugFont;
+
+// A window showing the registers, disassembly around the PC and a memory
+// pane, drawn by its own thread from text snapshots published by the
+// monitor. The memory pane follows sp until an address is given.
+int  DebugViewStart();
+void DebugViewStop();
+void DebugViewMemory(uint32_t addr);
+
+// Called with the number of instructions retired so far. Formats and
+// publishes a snapshot if the last one is older than a frame, or if forced.
+void DebugViewPublish(uint64_t instructions, bool force);
+
+#endif
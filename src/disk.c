@@ -0,0 +1,104 @@
+#include "disk.h"
+#include "CPU.h"
+#include "mmio.h"
+#include "plic.h"
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Registers by word
+enum { SECTOR, ADDRESS, COUNT, COMMAND, STATUS, IER, CAPACITY, REGS };
+
+static uint32_t regs[REGS];
+static uint8_t *image;  // The mapping, NULL while stopped
+static size_t   length; // Of the file and the mapping
+static bool     cow;
+
+
+static void Interrupt() {
+  PlicSetLevel(DISK_IRQ, regs[IER] & 1 && regs[STATUS] & DISK_DONE);
+}
+
+
+// Transfers between the mapping and RAM directly. The kernel reads the
+// image in on first touch and, unless copy-on-write, writes it back.
+static void Command(uint32_t command) {
+  uint64_t offset = (uint64_t)regs[SECTOR] * DISK_SECTOR;
+  uint64_t bytes = (uint64_t)regs[COUNT] * DISK_SECTOR;
+  uint32_t addr = regs[ADDRESS];
+  bool ok = offset + bytes <= (uint64_t)regs[CAPACITY] * DISK_SECTOR && addr + bytes <= MEM_SIZE;
+  switch(command) {
+  case DISK_READ:  if(ok) memcpy(&mem[addr], image + offset, bytes); break;
+  case DISK_WRITE: if(ok) memcpy(image + offset, &mem[addr], bytes); break;
+  case DISK_FLUSH: ok = cow || !msync(image, length, MS_SYNC);         break;
+  default:         ok = false;
+  }
+  regs[STATUS] = DISK_DONE | (ok ? 0 : DISK_ERROR);
+  Interrupt();
+}
+
+
+static uint32_t Read(uint32_t offset, [[maybe_unused]] unsigned size) {
+  return offset < sizeof regs ? regs[offset / 4] >> 8 * (offset & 3) : 0;
+}
+
+
+static void Write(uint32_t offset, uint32_t value, unsigned size) {
+  if(offset >= sizeof regs)
+    return;
+  unsigned shift = 8 * (offset & 3);
+  uint32_t mask = (size == 4 ? 0xFFFF'FFFFu : (1u << 8 * size) - 1) << shift;
+  uint32_t bits = value << shift & mask, *r = &regs[offset / 4];
+  switch(offset / 4) {
+  case STATUS:   *r &= ~bits; Interrupt();                   break;
+  case CAPACITY:                                             break;
+  case COMMAND:  *r = (*r & ~mask) | bits; Command(*r);      break;
+  case IER:      *r = (*r & ~mask) | bits; Interrupt();      break;
+  default:       *r = (*r & ~mask) | bits;
+  }
+}
+
+
+static const MMIODevice device = {
+  "disk", DISK_BASE, 0x1000, Read, Write
+};
+
+
+int DiskStart(const char *filename, bool copyOnWrite) {
+  if(image)
+    return -1;
+  int fd = open(filename, copyOnWrite ? O_RDONLY : O_RDWR);
+  if(fd < 0)
+    return -1;
+  struct stat st;
+  if(fstat(fd, &st) || st.st_size < DISK_SECTOR || st.st_size / DISK_SECTOR > UINT32_MAX) {
+    close(fd);
+    return -1;
+  }
+  length = st.st_size;
+  image = mmap(NULL, length, PROT_READ | PROT_WRITE, copyOnWrite ? MAP_PRIVATE : MAP_SHARED, fd, 0);
+  close(fd);
+  if(image == MAP_FAILED || MMIOMap(&device)) {
+    if(image != MAP_FAILED)
+      munmap(image, length);
+    image = NULL;
+    return -1;
+  }
+  cow = copyOnWrite;
+  memset(regs, 0, sizeof regs);
+  regs[CAPACITY] = length / DISK_SECTOR;
+  return 0;
+}
+
+
+void DiskStop() {
+  if(!image)
+    return;
+  PlicSetLevel(DISK_IRQ, false);
+  MMIOUnmap(&device);
+  munmap(image, length);
+  image = NULL;
+}
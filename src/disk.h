@@ -0,0 +1,27 @@
+#ifndef DISK_H
+#define DISK_H
+#include <stdbool.h>
+
+// A block device on a host image file, with word-wide registers at
+// DISK_BASE. The guest sets the sector, a RAM address and a count of
+// sectors, then writes a command; the transfer is done by then, and raises
+// the interrupt if enabled. The image is mapped into the host's memory, so
+// a transfer is a single memcpy.
+//
+// Registers: 0x00 first sector, 0x04 RAM address, 0x08 sectors, 0x0C command
+// (DISK_READ into RAM, DISK_WRITE, DISK_FLUSH to the file), 0x10 status
+// (DISK_DONE, DISK_ERROR; writing a bit clears it), 0x14 interrupt enable
+// (1 for completion) and 0x18 capacity in sectors.
+#define DISK_BASE   0x1000'1000
+#define DISK_IRQ    1   // PLIC source
+#define DISK_SECTOR 512 // Bytes
+
+enum { DISK_READ = 1, DISK_WRITE, DISK_FLUSH };
+enum { DISK_DONE = 1 << 0, DISK_ERROR = 1 << 1 };
+
+// With cow, the image is mapped copy-on-write: the guest's writes are kept
+// in host memory and dropped at exit, leaving the file as it was
+int  DiskStart(const char *filename, bool cow);
+void DiskStop();
+
+#endif
@@ -0,0 +1,101 @@
+#include "dma.h"
+#include "CPU.h"
+#include "mmio.h"
+#include "plic.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+// Registers by word
+enum { SOURCE, DESTINATION, LENGTH, COMMAND, STATUS, IER, REGS };
+
+static uint32_t regs[REGS];
+static bool     busy; // A transfer that reaches these registers can't start another
+
+
+static void Interrupt() {
+  PlicSetLevel(DMA_IRQ, regs[IER] & 1 && regs[STATUS] & DMA_DONE);
+}
+
+
+static bool InRAM(uint32_t addr, uint32_t length) {
+  return addr <= MEM_SIZE && length <= MEM_SIZE - addr;
+}
+
+
+// Copies or fills through CPURead and CPUWrite, for ranges that leave RAM.
+// A copy runs backwards if the destination starts inside the source, as
+// memmove does.
+static void Slow(uint32_t command, uint32_t src, uint32_t dst, uint32_t length) {
+  bool words = !((src | dst | length) & 3);
+  uint32_t step = words ? 4 : 1;
+  bool backwards = command == DMA_COPY && dst - src < length;
+  for(uint32_t n = 0; n < length; n += step) {
+    uint32_t i = backwards ? length - step - n : n;
+    if(command == DMA_FILL && words)
+      CPUWrite32(dst + i, (src & 0xFF) * 0x0101'0101u);
+    else if(command == DMA_FILL)
+      CPUWrite8(dst + i, src);
+    else if(words)
+      CPUWrite32(dst + i, CPURead32(src + i));
+    else
+      CPUWrite8(dst + i, CPURead8(src + i));
+  }
+}
+
+
+static void Command(uint32_t command) {
+  if(busy)
+    return;
+  uint32_t src = regs[SOURCE], dst = regs[DESTINATION], length = regs[LENGTH];
+  bool ok = (command == DMA_COPY || command == DMA_FILL) &&
+            dst + (uint64_t)length <= 1ull << 32 &&
+            (command == DMA_FILL || src + (uint64_t)length <= 1ull << 32);
+  busy = true;
+  if(ok && command == DMA_FILL && InRAM(dst, length))
+    memset(&mem[dst], src, length);
+  else if(ok && command == DMA_COPY && InRAM(src, length) && InRAM(dst, length))
+    memmove(&mem[dst], &mem[src], length);
+  else if(ok)
+    Slow(command, src, dst, length);
+  busy = false;
+  regs[STATUS] = DMA_DONE | (ok ? 0 : DMA_ERROR);
+  Interrupt();
+}
+
+
+static uint32_t Read(uint32_t offset, [[maybe_unused]] unsigned size) {
+  return offset < sizeof regs ? regs[offset / 4] >> 8 * (offset & 3) : 0;
+}
+
+
+static void Write(uint32_t offset, uint32_t value, unsigned size) {
+  if(offset >= sizeof regs)
+    return;
+  unsigned shift = 8 * (offset & 3);
+  uint32_t mask = (size == 4 ? 0xFFFF'FFFFu : (1u << 8 * size) - 1) << shift;
+  uint32_t bits = value << shift & mask, *r = &regs[offset / 4];
+  switch(offset / 4) {
+  case STATUS:  *r &= ~bits; Interrupt();                   break;
+  case COMMAND: *r = (*r & ~mask) | bits; Command(*r);      break;
+  case IER:     *r = (*r & ~mask) | bits; Interrupt();      break;
+  default:      *r = (*r & ~mask) | bits;
+  }
+}
+
+
+static const MMIODevice device = {
+  "dma", DMA_BASE, 0x1000, Read, Write
+};
+
+
+int DMAStart() {
+  memset(regs, 0, sizeof regs);
+  return MMIOMap(&device);
+}
+
+
+void DMAStop() {
+  PlicSetLevel(DMA_IRQ, false);
+  MMIOUnmap(&device);
+}
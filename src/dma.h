@@ -0,0 +1,23 @@
+#ifndef DMA_H
+#define DMA_H
+
+// A DMA controller with word-wide registers at DMA_BASE, for bulk copies
+// and fills. Writing the command does the whole transfer before the store
+// returns, and raises the interrupt if enabled. Transfers within RAM are a
+// host memmove or memset; ones that touch devices go through their
+// registers in the order of the bytes, a word at a time when aligned.
+//
+// Registers: 0x00 source, 0x04 destination, 0x08 length in bytes, 0x0C
+// command (DMA_COPY, or DMA_FILL with the low byte of the source), 0x10
+// status (DMA_DONE, DMA_ERROR; writing a bit clears it) and 0x14 interrupt
+// enable (1 for completion).
+#define DMA_BASE 0x1000'2000
+#define DMA_IRQ  2 // PLIC source
+
+enum { DMA_COPY = 1, DMA_FILL };
+enum { DMA_DONE = 1 << 0, DMA_ERROR = 1 << 1 };
+
+int  DMAStart();
+void DMAStop();
+
+#endif
@@ -0,0 +1,84 @@
+#include "events.h"
+#include "CPU.h"
+#include <stddef.h>
+
+// A binary min-heap on deadlines. There are only a handful of devices, so
+// rescheduling costs a few comparisons.
+static Event   *heap[EVENTS_MAX];
+static unsigned numEvents;
+
+
+static void Place(Event *e, unsigned i) {
+  heap[i] = e;
+  e->slot = i + 1;
+}
+
+
+static void SiftUp(unsigned i) {
+  Event *e = heap[i];
+  while(i && heap[(i - 1) / 2]->when > e->when) {
+    Place(heap[(i - 1) / 2], i);
+    i = (i - 1) / 2;
+  }
+  Place(e, i);
+}
+
+
+static void SiftDown(unsigned i) {
+  Event *e = heap[i];
+  for(;;) {
+    unsigned child = 2 * i + 1;
+    if(child >= numEvents)
+      break;
+    if(child + 1 < numEvents && heap[child + 1]->when < heap[child]->when)
+      child++;
+    if(heap[child]->when >= e->when)
+      break;
+    Place(heap[child], i);
+    i = child;
+  }
+  Place(e, i);
+}
+
+
+void EventCancel(Event *e) {
+  if(!e->slot)
+    return;
+  unsigned i = e->slot - 1;
+  e->slot = 0;
+  Event *last = heap[--numEvents];
+  if(i == numEvents)
+    return;
+  heap[i] = last;
+  SiftUp(i);
+  SiftDown(last->slot - 1);
+}
+
+
+void EventSchedule(Event *e, uint64_t when) {
+  EventCancel(e);
+  if(numEvents == EVENTS_MAX)
+    return;
+  e->when = when;
+  heap[numEvents] = e;
+  SiftUp(numEvents++);
+}
+
+
+uint64_t EventsNext() {
+  return numEvents ? heap[0]->when : UINT64_MAX;
+}
+
+
+const Event *EventsFirst() {
+  return numEvents ? heap[0] : NULL;
+}
+
+
+void EventsRun() {
+  while(numEvents && heap[0]->when <= cpuTime) {
+    Event *e = heap[0];
+    EventCancel(e);
+    e->fire();
+  }
+}
@@ -0,0 +1,28 @@
+#ifndef EVENTS_H
+#define EVENTS_H
+#include <stdbool.h>
+#include <stdint.h>
+
+// Device events on the virtual clock, cpuTime. CPUStep never runs past the
+// earliest deadline, so the executor checks no timers of its own; due
+// events fire between runs, on the CPU thread.
+
+#define EVENTS_MAX 32
+
+typedef struct {
+  uint64_t when;
+  void   (*fire)();
+  unsigned slot; // Position in the heap plus one, 0 while not scheduled
+  bool     host; // Polls host input, so an idle hart waits for it in real time
+} Event;
+
+void     EventSchedule(Event *e, uint64_t when);
+void     EventCancel(Event *e);
+
+// The earliest deadline, or UINT64_MAX if nothing is scheduled
+uint64_t EventsNext();
+// The event with that deadline, or NULL
+const Event *EventsFirst();
+void     EventsRun();
+
+#endif
@@ -0,0 +1,141 @@
+#include "framebuffer.h"
+#include "mmio.h"
+#include <SDL.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#define TILE_SHIFT 5 // Tiles are 32x32 pixels
+#define TILE_SIZE  (1 << TILE_SHIFT)
+#define TILES_X    (FB_WIDTH  / TILE_SIZE)
+#define TILES_Y    (FB_HEIGHT / TILE_SIZE)
+
+// Guest writes store the pixel and then mark its tile dirty. The render
+// thread clears a tile's flag before uploading it, so a write that races
+// with the upload is picked up by the next frame.
+static uint32_t    pixels[FB_WIDTH * FB_HEIGHT];
+static atomic_bool dirty[TILES_Y][TILES_X];
+static atomic_bool running;
+static SDL_Thread *thread;
+
+
+static uint32_t Read(uint32_t offset, unsigned size) {
+  const uint8_t *p = (const uint8_t*)pixels + offset;
+  uint32_t value = 0;
+  for(unsigned i = 0; i < size; i++)
+    value |= (uint32_t)p[i] << (8 * i);
+  return value;
+}
+
+
+static void Write(uint32_t offset, uint32_t value, unsigned size) {
+  uint8_t *p = (uint8_t*)pixels + offset;
+  for(unsigned i = 0; i < size; i++)
+    p[i] = value >> (8 * i);
+  uint32_t x = offset / 4 % FB_WIDTH, y = offset / 4 / FB_WIDTH;
+  atomic_store_explicit(&dirty[y >> TILE_SHIFT][x >> TILE_SHIFT], true, memory_order_release);
+}
+
+
+static const MMIODevice device = {
+  "framebuffer", FB_BASE, sizeof pixels, Read, Write
+};
+
+
+// Uploads runs of dirty tiles in each row of tiles. Returns false if
+// nothing changed.
+static bool Upload(SDL_Texture *texture) {
+  bool changed = false;
+  for(int y = 0; y < TILES_Y; y++) {
+    for(int x0 = 0, x1; x0 < TILES_X; x0 = x1) {
+      x1 = x0 + 1;
+      if(!atomic_exchange_explicit(&dirty[y][x0], false, memory_order_acquire))
+        continue;
+      while(x1 < TILES_X && atomic_exchange_explicit(&dirty[y][x1], false, memory_order_acquire))
+        x1++;
+      SDL_Rect r = { x0 * TILE_SIZE, y * TILE_SIZE, (x1 - x0) * TILE_SIZE, TILE_SIZE };
+      SDL_UpdateTexture(texture, &r, &pixels[r.y * FB_WIDTH + r.x], FB_WIDTH * sizeof *pixels);
+      changed = true;
+    }
+  }
+  return changed;
+}
+
+
+// Owns the window, which is created here so that all rendering stays on
+// this thread. Frames are presented at the display's refresh rate, and only
+// when a tile changed.
+static int Render(void *unused) {
+  int result = -1;
+  SDL_Renderer *renderer = NULL;
+  SDL_Texture *texture = NULL;
+  SDL_Window *window = SDL_CreateWindow("R64000", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
+                                        FB_WIDTH, FB_HEIGHT, SDL_WINDOW_SHOWN);
+  if(window)
+    renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
+  if(renderer)
+    texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING,
+                                FB_WIDTH, FB_HEIGHT);
+  if(!texture) {
+    fprintf(stderr, "framebuffer: %s\n", SDL_GetError());
+    goto done;
+  }
+
+  SDL_DisplayMode mode;
+  Uint32 period = 1000 / 60;
+  if(!SDL_GetCurrentDisplayMode(SDL_GetWindowDisplayIndex(window), &mode) && mode.refresh_rate > 0)
+    period = 1000 / mode.refresh_rate;
+  for(Uint64 next = SDL_GetTicks64(); atomic_load(&running); ) {
+    // Closing the window leaves the device mapped, so the guest can keep
+    // drawing
+    SDL_Event e;
+    while(SDL_PollEvent(&e)) {
+      if(e.type == SDL_QUIT || (e.type == SDL_WINDOWEVENT && e.window.event == SDL_WINDOWEVENT_CLOSE))
+        atomic_store(&running, false);
+    }
+    if(Upload(texture)) {
+      SDL_RenderCopy(renderer, texture, NULL, NULL);
+      SDL_RenderPresent(renderer);
+    }
+    next += period;
+    Uint64 now = SDL_GetTicks64();
+    if(next > now)
+      SDL_Delay(next - now);
+    else
+      next = now;
+  }
+  result = 0;
+done:
+  if(texture)
+    SDL_DestroyTexture(texture);
+  if(renderer)
+    SDL_DestroyRenderer(renderer);
+  if(window)
+    SDL_DestroyWindow(window);
+  return result;
+}
+
+
+int FramebufferStart() {
+  if(thread || MMIOMap(&device))
+    return -1;
+  for(int y = 0; y < TILES_Y; y++)
+    for(int x = 0; x < TILES_X; x++)
+      atomic_store(&dirty[y][x], true);
+  atomic_store(&running, true);
+  if(!(thread = SDL_CreateThread(Render, "framebuffer", NULL))) {
+    MMIOUnmap(&device);
+    return -1;
+  }
+  return 0;
+}
+
+
+void FramebufferStop() {
+  if(!thread)
+    return;
+  atomic_store(&running, false);
+  SDL_WaitThread(thread, NULL);
+  thread = NULL;
+  MMIOUnmap(&device);
+}
@@ -0,0 +1,14 @@
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+#include <stdint.h>
+
+// A 640x480 framebuffer of 0x00RRGGBB pixels, one 32-bit word each, mapped
+// at FB_BASE and shown in its own window
+#define FB_BASE   0x4000'0000
+#define FB_WIDTH  640
+#define FB_HEIGHT 480
+
+int  FramebufferStart();
+void FramebufferStop();
+
+#endif
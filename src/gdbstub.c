@@ -0,0 +1,587 @@
+#include "gdbstub.h"
+#include "CPU.h"
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define PACKET_SIZE 0x4000
+#define MAX_POINTS  64
+#define RUN_CHUNK   (1 << 20) // Instructions between checks for ^C
+#define EBREAK      0x0010'0073
+
+#define GDB_SIGINT  2
+#define GDB_SIGILL  4
+#define GDB_SIGTRAP 5
+
+// Breakpoints and watchpoints, with the type character of their Z packet
+typedef struct {
+  char     type;
+  uint32_t addr;
+  uint32_t len;
+  uint32_t saved;    // Original instruction while an ebreak is patched in
+  bool     inserted;
+} Point;
+
+static Point        points[MAX_POINTS];
+static unsigned     numPoints;
+static const Point *watchHit;
+static uint32_t     watchAddr;
+
+static int     fd = -1;
+static bool    noAck;
+static uint8_t inBuf[4096];
+static size_t  inPos, inLen;
+static char    packet[PACKET_SIZE + 1];
+static char    reply[PACKET_SIZE + 4];
+
+
+bool GdbWatch(uint32_t addr, uint32_t size, bool write) {
+  for(unsigned i = 0; i < numPoints; i++) {
+    const Point *p = &points[i];
+    if(p->type < '2' || (p->type == '2' && !write) || (p->type == '3' && write))
+      continue;
+    if(addr < p->addr + p->len && p->addr < addr + size) {
+      watchHit = p;
+      watchAddr = addr < p->addr ? p->addr : addr;
+      return true;
+    }
+  }
+  return false;
+}
+
+
+static int GetChar() {
+  if(inPos == inLen) {
+    ssize_t n = recv(fd, inBuf, sizeof inBuf, 0);
+    if(n <= 0)
+      return -1;
+    inPos = 0;
+    inLen = n;
+  }
+  return inBuf[inPos++];
+}
+
+
+static int SendAll(const char *data, size_t len) {
+  while(len) {
+    ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+    if(n <= 0)
+      return -1;
+    data += n;
+    len -= n;
+  }
+  return 0;
+}
+
+
+static int HexDigit(int c) {
+  if(c >= '0' && c <= '9') return c - '0';
+  if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+
+static uint32_t ParseHex(const char **s) {
+  uint32_t v = 0;
+  for(int d; (d = HexDigit(**s)) >= 0; (*s)++)
+    v = v << 4 | d;
+  return v;
+}
+
+
+static char *PutHex8(char *out, uint8_t v) {
+  static const char hex[] = "0123456789abcdef";
+  *out++ = hex[v >> 4];
+  *out++ = hex[v & 0xF];
+  return out;
+}
+
+
+// Registers travel as target-endian (little-endian) hex
+static char *PutReg(char *out, uint32_t v) {
+  for(int i = 0; i < 4; i++)
+    out = PutHex8(out, v >> (8 * i));
+  return out;
+}
+
+
+static uint32_t ParseReg(const char **s) {
+  uint32_t v = 0;
+  for(int i = 0; i < 4 && HexDigit((*s)[0]) >= 0 && HexDigit((*s)[1]) >= 0; i++, *s += 2)
+    v |= (uint32_t)(HexDigit((*s)[0]) << 4 | HexDigit((*s)[1])) << (8 * i);
+  return v;
+}
+
+
+// Reads one packet into packet[], acknowledging it unless in no-ack mode.
+// Returns its length, or -1 once the connection is closed.
+static int ReadPacket() {
+  for(;;) {
+    int c;
+    while((c = GetChar()) != '$')
+      if(c < 0)
+        return -1;
+
+    size_t n = 0;
+    uint8_t sum = 0;
+    while((c = GetChar()) != '#') {
+      if(c < 0)
+        return -1;
+      if(n < PACKET_SIZE)
+        packet[n] = c;
+      n++;
+      sum += c;
+    }
+    int hi = GetChar(), lo = GetChar();
+    if(lo < 0)
+      return -1;
+    if(n <= PACKET_SIZE && (noAck || (HexDigit(hi) << 4 | HexDigit(lo)) == sum)) {
+      if(!noAck && SendAll("+", 1))
+        return -1;
+      packet[n] = '\0';
+      return n;
+    }
+    if(SendAll("-", 1))
+      return -1;
+  }
+}
+
+
+static int SendPacket(const char *data, size_t len) {
+  static char frame[sizeof reply + 4];
+  uint8_t sum = 0;
+  frame[0] = '$';
+  for(size_t i = 0; i < len; i++)
+    sum += frame[i + 1] = data[i];
+  frame[len + 1] = '#';
+  PutHex8(&frame[len + 2], sum);
+
+  for(;;) {
+    if(SendAll(frame, len + 4))
+      return -1;
+    if(noAck)
+      return 0;
+    int c;
+    while((c = GetChar()) != '+' && c != '-')
+      if(c < 0)
+        return -1;
+    if(c == '+')
+      return 0;
+  }
+}
+
+
+static int SendString(const char *s) {
+  return SendPacket(s, strlen(s));
+}
+
+
+// Polls the connection for a ^C while the target runs
+static bool Interrupted() {
+  while(inPos < inLen)
+    if(inBuf[inPos++] == 0x03)
+      return true;
+  struct pollfd p = { .fd = fd, .events = POLLIN };
+  if(poll(&p, 1, 0) <= 0)
+    return false;
+  int c = GetChar();
+  return c == 0x03 || c < 0;
+}
+
+
+static const char *TargetXML() {
+  static char xml[4096];
+  if(xml[0])
+    return xml;
+  int n = sprintf(xml,
+      "<?xml version=\"1.0\"?>"
+      "<!DOCTYPE target SYSTEM \"gdb-target.dtd\">"
+      "<target version=\"1.0\">"
+      "<architecture>riscv:rv32</architecture>"
+      "<feature name=\"org.gnu.gdb.riscv.cpu\">");
+  for(int i = 0; i < NUM_REGS; i++) {
+    const char *type = i == RA || i == PC ? "code_ptr" : i == SP ? "data_ptr" : "int";
+    n += sprintf(&xml[n], "<reg name=\"%s\" bitsize=\"32\" type=\"%s\" regnum=\"%d\"/>",
+        reg_anames[i], type, i);
+  }
+  sprintf(&xml[n], "</feature></target>");
+  return xml;
+}
+
+
+// Answers qXfer reads of an in-memory document
+static int SendXfer(const char *doc, const char *args) {
+  uint32_t offset = ParseHex(&args);
+  if(*args++ != ',')
+    return SendString("E01");
+  uint32_t len = ParseHex(&args);
+  size_t size = strlen(doc);
+  if(offset > size)
+    return SendString("E01");
+  if(len > PACKET_SIZE - 1)
+    len = PACKET_SIZE - 1;
+  if(len > size - offset)
+    len = size - offset;
+  reply[0] = offset + len < size ? 'm' : 'l';
+  memcpy(&reply[1], &doc[offset], len);
+  return SendPacket(reply, len + 1);
+}
+
+
+static bool InRange(uint32_t addr, uint32_t len) {
+  return addr < MEM_SIZE && len <= MEM_SIZE - addr;
+}
+
+
+static Point *FindPoint(char type, uint32_t addr, uint32_t len) {
+  for(unsigned i = 0; i < numPoints; i++)
+    if(points[i].type == type && points[i].addr == addr && points[i].len == len)
+      return &points[i];
+  return NULL;
+}
+
+
+static void UpdateWatchHook() {
+  cpuHooks &= ~CPU_HOOK_WATCH;
+  for(unsigned i = 0; i < numPoints; i++)
+    if(points[i].type >= '2')
+      cpuHooks |= CPU_HOOK_WATCH;
+}
+
+
+static int PointCommand(bool insert) {
+  const char *s = &packet[1];
+  char type = *s++;
+  if(type < '0' || type > '4' || *s++ != ',')
+    return SendString("");
+  uint32_t addr = ParseHex(&s);
+  if(*s++ != ',')
+    return SendString("E01");
+  uint32_t len = ParseHex(&s);
+  // Breakpoints are patched ebreaks, so only whole instructions work
+  if(type < '2') {
+    if(addr & 3)
+      return SendString("E01");
+    len = 4;
+  }
+  if(!InRange(addr, len) || len == 0)
+    return SendString("E01");
+
+  Point *p = FindPoint(type, addr, len);
+  if(insert && !p) {
+    if(numPoints == MAX_POINTS)
+      return SendString("E02");
+    points[numPoints++] = (Point){ type, addr, len, 0, false };
+  } else if(!insert && p) {
+    *p = points[--numPoints];
+  }
+  UpdateWatchHook();
+  return SendString("OK");
+}
+
+
+// Breakpoints are only patched into memory while the target runs, so gdb
+// never sees them and memory commands need no shadowing
+static void InsertBreakpoints() {
+  for(unsigned i = 0; i < numPoints; i++) {
+    Point *p = &points[i];
+    if(p->type >= '2')
+      continue;
+    p->saved = CPURead32(p->addr);
+    CPUWrite32(p->addr, EBREAK);
+    p->inserted = true;
+  }
+}
+
+
+static void RemoveBreakpoints() {
+  for(unsigned i = numPoints; i-- > 0; ) {
+    Point *p = &points[i];
+    if(!p->inserted)
+      continue;
+    if(CPURead32(p->addr) == EBREAK)
+      CPUWrite32(p->addr, p->saved);
+    p->inserted = false;
+  }
+}
+
+
+static int StopReply(int sig) {
+  if(sig == GDB_SIGTRAP && watchHit) {
+    static const char *kinds[] = { "watch", "rwatch", "awatch" };
+    sprintf(reply, "T05%s:%x;", kinds[watchHit->type - '2'], watchAddr);
+    return SendString(reply);
+  }
+  if(sig == GDB_SIGTRAP) {
+    for(unsigned i = 0; i < numPoints; i++) {
+      if(points[i].type < '2' && points[i].addr == reg[PC]) {
+        sprintf(reply, "T05%s:;", points[i].type == '0' ? "swbreak" : "hwbreak");
+        return SendString(reply);
+      }
+    }
+  }
+  sprintf(reply, "S%02x", sig);
+  return SendString(reply);
+}
+
+
+// Runs the plain executor in large chunks with breakpoints patched in.
+// Only the first instruction is single-stepped, to move off a breakpoint
+// the target is resuming from.
+static int Resume(bool step) {
+  watchHit = NULL;
+  bool stopped = CPUStep(1) != 0 || watchHit;
+  bool interrupted = false;
+  if(!step && !stopped) {
+    InsertBreakpoints();
+    while(!(stopped = CPUStep(RUN_CHUNK) != 0 || watchHit))
+      if((interrupted = Interrupted()))
+        break;
+    RemoveBreakpoints();
+  }
+  if(interrupted)
+    return StopReply(GDB_SIGINT);
+  if(stopped && !watchHit && CPURead32(reg[PC]) != EBREAK && !FindPoint('0', reg[PC], 4) && !FindPoint('1', reg[PC], 4))
+    return StopReply(GDB_SIGILL);
+  return StopReply(GDB_SIGTRAP);
+}
+
+
+static int ResumeCommand(const char *s, bool step) {
+  // c [addr], C sig[;addr] and the same for s and S
+  if(packet[0] == 'C' || packet[0] == 'S') {
+    ParseHex(&s);
+    if(*s == ';')
+      s++;
+  }
+  if(*s)
+    reg[PC] = ParseHex(&s);
+  return Resume(step);
+}
+
+
+static int ReadRegisters() {
+  char *out = reply;
+  for(int i = 0; i < NUM_REGS; i++)
+    out = PutReg(out, reg[i]);
+  return SendPacket(reply, out - reply);
+}
+
+
+static int WriteRegisters(const char *s) {
+  for(int i = 0; i < NUM_REGS && *s; i++)
+    reg[i] = ParseReg(&s);
+  reg[ZERO] = 0;
+  return SendString("OK");
+}
+
+
+static int ReadMemory(const char *s) {
+  uint32_t addr = ParseHex(&s);
+  if(*s++ != ',')
+    return SendString("E01");
+  uint32_t len = ParseHex(&s);
+  if(len > PACKET_SIZE / 2)
+    len = PACKET_SIZE / 2;
+  if(!InRange(addr, len))
+    return SendString("E01");
+  char *out = reply;
+  for(uint32_t i = 0; i < len; i++)
+    out = PutHex8(out, mem[addr + i]);
+  return SendPacket(reply, out - reply);
+}
+
+
+// M addr,len:hex and X addr,len:binary
+static int WriteMemory(const char *s, size_t size, bool binary) {
+  const char *end = packet + size;
+  uint32_t addr = ParseHex(&s);
+  if(*s++ != ',')
+    return SendString("E01");
+  uint32_t len = ParseHex(&s);
+  if(*s++ != ':' || !InRange(addr, len))
+    return SendString("E01");
+  for(uint32_t i = 0; i < len; i++) {
+    if(binary) {
+      if(s >= end)
+        return SendString("E01");
+      uint8_t c = *s++;
+      if(c == '}' && s < end)
+        c = *s++ ^ 0x20;
+      mem[addr + i] = c;
+    } else {
+      int hi = HexDigit(s[0]), lo;
+      if(hi < 0 || (lo = HexDigit(s[1])) < 0)
+        return SendString("E01");
+      mem[addr + i] = hi << 4 | lo;
+      s += 2;
+    }
+  }
+  return SendString("OK");
+}
+
+
+static int QueryCommand() {
+  if(!strncmp(packet, "qSupported", 10)) {
+    sprintf(reply, "PacketSize=%x;qXfer:features:read+;QStartNoAckMode+;swbreak+;hwbreak+", PACKET_SIZE);
+    return SendString(reply);
+  }
+  if(!strncmp(packet, "qXfer:features:read:target.xml:", 31))
+    return SendXfer(TargetXML(), packet + 31);
+  if(!strcmp(packet, "qAttached"))
+    return SendString("1");
+  if(!strcmp(packet, "qC"))
+    return SendString("QC1");
+  if(!strcmp(packet, "qfThreadInfo"))
+    return SendString("m1");
+  if(!strcmp(packet, "qsThreadInfo"))
+    return SendString("l");
+  if(!strcmp(packet, "QStartNoAckMode")) {
+    int r = SendString("OK");
+    noAck = true;
+    return r;
+  }
+  return SendString("");
+}
+
+
+static int VerboseCommand() {
+  if(!strcmp(packet, "vCont?"))
+    return SendString("vCont;c;C;s;S");
+  if(!strncmp(packet, "vCont;", 6)) {
+    // Single threaded, so the first action applies
+    char action = packet[6];
+    if(action == 'c' || action == 'C')
+      return Resume(false);
+    if(action == 's' || action == 'S')
+      return Resume(true);
+    return SendString("E01");
+  }
+  return SendString("");
+}
+
+
+static int Listen(const char *address) {
+  int s = -1;
+  if(strchr(address, '/')) {
+    struct sockaddr_un sa = { .sun_family = AF_UNIX };
+    if(strlen(address) >= sizeof sa.sun_path)
+      return -1;
+    strcpy(sa.sun_path, address);
+    unlink(address);
+    if((s = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+      return -1;
+    if(bind(s, (struct sockaddr*)&sa, sizeof sa) || listen(s, 1))
+      goto fail;
+    return s;
+  }
+
+  char host[256] = "localhost";
+  const char *port = strrchr(address, ':');
+  if(port) {
+    size_t n = port - address;
+    if(n >= sizeof host)
+      return -1;
+    if(n) {
+      memcpy(host, address, n);
+      host[n] = '\0';
+    }
+    port++;
+  } else {
+    port = address;
+  }
+  struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM, .ai_flags = AI_PASSIVE };
+  struct addrinfo *ai;
+  if(getaddrinfo(host, port, &hints, &ai))
+    return -1;
+  for(struct addrinfo *a = ai; a; a = a->ai_next) {
+    if((s = socket(a->ai_family, a->ai_socktype, a->ai_protocol)) < 0)
+      continue;
+    int one = 1;
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+    if(!bind(s, a->ai_addr, a->ai_addrlen) && !listen(s, 1))
+      break;
+    close(s);
+    s = -1;
+  }
+  freeaddrinfo(ai);
+  return s;
+
+fail:
+  close(s);
+  return -1;
+}
+
+
+int GdbServe(const char *address) {
+  int listener = Listen(address);
+  if(listener < 0)
+    return -1;
+  fprintf(stderr, "waiting for gdb on %s\n", address);
+  fd = accept(listener, NULL, NULL);
+  close(listener);
+  if(fd < 0)
+    return -1;
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+  noAck = false;
+  inPos = inLen = 0;
+
+  int n;
+  while((n = ReadPacket()) >= 0) {
+    const char *args = &packet[1];
+    int r;
+    switch(packet[0]) {
+    case '?': r = StopReply(GDB_SIGTRAP);             break;
+    case 'g': r = ReadRegisters();                    break;
+    case 'G': r = WriteRegisters(args);               break;
+    case 'm': r = ReadMemory(args);                   break;
+    case 'M': r = WriteMemory(args, n, false);        break;
+    case 'X': r = WriteMemory(args, n, true);         break;
+    case 'c':
+    case 'C': r = ResumeCommand(args, false);         break;
+    case 's':
+    case 'S': r = ResumeCommand(args, true);          break;
+    case 'Z': r = PointCommand(true);                 break;
+    case 'z': r = PointCommand(false);                break;
+    case 'q':
+    case 'Q': r = QueryCommand();                     break;
+    case 'v': r = VerboseCommand();                   break;
+    case 'H':
+    case 'T': r = SendString("OK");                   break;
+    case 'p': {
+      uint32_t i = ParseHex(&args);
+      r = i < NUM_REGS ? SendPacket(reply, PutReg(reply, reg[i]) - reply) : SendString("E01");
+    } break;
+    case 'P': {
+      uint32_t i = ParseHex(&args);
+      if(i < NUM_REGS && *args++ == '=') {
+        reg[i] = ParseReg(&args);
+        reg[ZERO] = 0;
+        r = SendString("OK");
+      } else {
+        r = SendString("E01");
+      }
+    } break;
+    case 'D': SendString("OK"); goto done;
+    case 'k': goto done;
+    default:  r = SendString("");                     break;
+    }
+    if(r)
+      break;
+  }
+done:
+  numPoints = 0;
+  UpdateWatchHook();
+  close(fd);
+  fd = -1;
+  return 0;
+}
@@ -0,0 +1,15 @@
+#ifndef GDBSTUB_H
+#define GDBSTUB_H
+#include <stdbool.h>
+#include <stdint.h>
+
+// A gdb remote serial protocol server. The address is a unix socket path if
+// it contains a '/' and [host:]port otherwise. Serves a single connection
+// until gdb detaches or kills the target.
+int GdbServe(const char *address);
+
+// Called by the executor for every access while CPU_HOOK_WATCH is set.
+// Returns true if the access hit a watchpoint.
+bool GdbWatch(uint32_t addr, uint32_t size, bool write);
+
+#endif
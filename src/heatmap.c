@@ -0,0 +1,155 @@
+#include "heatmap.h"
+#include <SDL.h>
+#include <SDL_image.h>
+#include <math.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define MIN_SIZE 512 // Images are scaled up to at least this many pixels wide
+#define PERIOD   100 // Milliseconds between frames of the live view
+
+uint16_t *heat[NUM_HEAT_KINDS];
+unsigned  heatShift;
+
+static unsigned    width, height; // In cells
+static atomic_bool running;
+static SDL_Thread *thread;
+
+
+int HeatmapStart(unsigned shift) {
+  if(shift < 6 || shift > 12)
+    return -1;
+  HeatmapStop();
+  for(int k = 0; k < NUM_HEAT_KINDS; k++) {
+    free(heat[k]);
+    if(!(heat[k] = calloc(MEM_SIZE >> shift, sizeof *heat[k])))
+      return -1;
+  }
+  heatShift = shift;
+  // As square as possible, wider than tall
+  unsigned bits = __builtin_ctz(MEM_SIZE >> shift);
+  width = 1u << (bits + 1) / 2;
+  height = 1u << bits / 2;
+  cpuHooks |= CPU_HOOK_HEAT;
+  return 0;
+}
+
+
+// Stops counting and closes the live view, keeping the counts
+void HeatmapStop() {
+  cpuHooks &= ~CPU_HOOK_HEAT;
+  if(thread) {
+    atomic_store(&running, false);
+    SDL_WaitThread(thread, NULL);
+    thread = NULL;
+  }
+}
+
+
+// Renders the counters into ARGB pixels, one per cell
+static void Render(uint32_t *pixels) {
+  double scale[NUM_HEAT_KINDS];
+  for(int k = 0; k < NUM_HEAT_KINDS; k++) {
+    uint16_t max = 0;
+    for(uint32_t i = 0; i < width * height; i++)
+      if(heat[k][i] > max)
+        max = heat[k][i];
+    scale[k] = max ? 255 / log1p(max) : 0;
+  }
+  for(uint32_t i = 0; i < width * height; i++) {
+    uint32_t r = log1p(heat[HEAT_WRITE][i]) * scale[HEAT_WRITE];
+    uint32_t g = log1p(heat[HEAT_READ][i])  * scale[HEAT_READ];
+    uint32_t b = log1p(heat[HEAT_EXEC][i])  * scale[HEAT_EXEC];
+    pixels[i] = 0xFF00'0000 | r << 16 | g << 8 | b;
+  }
+}
+
+
+static unsigned Zoom() {
+  return width >= MIN_SIZE ? 1 : MIN_SIZE / width;
+}
+
+
+// Owns the live view's window. The counters are read while the CPU updates
+// them, which at worst shows a cell one frame late.
+static int Show(void *unused) {
+  int result = -1;
+  uint32_t *pixels = malloc(width * height * sizeof *pixels);
+  SDL_Renderer *renderer = NULL;
+  SDL_Texture *texture = NULL;
+  SDL_Window *window = SDL_CreateWindow("R64000 heatmap", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
+                                        width * Zoom(), height * Zoom(), SDL_WINDOW_SHOWN);
+  if(window)
+    renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
+  if(renderer)
+    texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, width, height);
+  if(!texture || !pixels) {
+    fprintf(stderr, "heatmap: %s\n", SDL_GetError());
+    goto done;
+  }
+
+  while(atomic_load(&running)) {
+    SDL_Event e;
+    while(SDL_PollEvent(&e)) {
+      if(e.type == SDL_QUIT || (e.type == SDL_WINDOWEVENT && e.window.event == SDL_WINDOWEVENT_CLOSE))
+        atomic_store(&running, false);
+    }
+    Render(pixels);
+    SDL_UpdateTexture(texture, NULL, pixels, width * sizeof *pixels);
+    SDL_RenderCopy(renderer, texture, NULL, NULL);
+    SDL_RenderPresent(renderer);
+    SDL_Delay(PERIOD);
+  }
+  result = 0;
+done:
+  if(texture)
+    SDL_DestroyTexture(texture);
+  if(renderer)
+    SDL_DestroyRenderer(renderer);
+  if(window)
+    SDL_DestroyWindow(window);
+  free(pixels);
+  return result;
+}
+
+
+int HeatmapShow() {
+  if(!heat[0])
+    return -1;
+  if(thread && atomic_load(&running))
+    return 0;
+  if(thread) {
+    SDL_WaitThread(thread, NULL);
+    thread = NULL;
+  }
+  atomic_store(&running, true);
+  if(!(thread = SDL_CreateThread(Show, "heatmap", NULL)))
+    return -1;
+  return 0;
+}
+
+
+int HeatmapWritePNG(const char *filename) {
+  if(!heat[0])
+    return -1;
+  unsigned zoom = Zoom();
+  uint32_t *cells = malloc(width * height * sizeof *cells);
+  uint32_t *pixels = malloc(width * height * zoom * zoom * sizeof *pixels);
+  int result = -1;
+  if(cells && pixels) {
+    Render(cells);
+    for(unsigned y = 0; y < height * zoom; y++)
+      for(unsigned x = 0; x < width * zoom; x++)
+        pixels[y * width * zoom + x] = cells[y / zoom * width + x / zoom];
+    SDL_Surface *surface = SDL_CreateRGBSurfaceWithFormatFrom(pixels, width * zoom, height * zoom, 32,
+                                                              width * zoom * sizeof *pixels, SDL_PIXELFORMAT_ARGB8888);
+    if(surface) {
+      result = IMG_SavePNG(surface, filename);
+      SDL_FreeSurface(surface);
+    }
+  }
+  free(cells);
+  free(pixels);
+  return result;
+}
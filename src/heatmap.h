@@ -0,0 +1,34 @@
+#ifndef HEATMAP_H
+#define HEATMAP_H
+#include "CPU.h"
+#include <stdint.h>
+
+enum {
+  HEAT_READ,
+  HEAT_WRITE,
+  HEAT_EXEC,
+  NUM_HEAT_KINDS
+};
+
+// Saturating access counters per 1 << heatShift bytes of RAM, updated by
+// the instrumented executor while CPU_HOOK_HEAT is set
+extern uint16_t *heat[NUM_HEAT_KINDS];
+extern unsigned  heatShift;
+
+static inline void HeatmapCount(int kind, uint32_t addr) {
+  if(addr < MEM_SIZE) {
+    uint16_t *c = &heat[kind][addr >> heatShift];
+    *c += *c != UINT16_MAX;
+  }
+}
+
+// shift is 6 for cache lines up to 12 for pages
+int  HeatmapStart(unsigned shift);
+void HeatmapStop();
+
+// Reads are green, writes red and execution blue, each scaled
+// logarithmically to its hottest cell
+int  HeatmapShow();
+int  HeatmapWritePNG(const char *filename);
+
+#endif
@@ -0,0 +1,280 @@
+#include "lockstep.h"
+#include "CPU.h"
+#include "breakpoint.h"
+#include "reference.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BLOCK_LIMIT    256
+#define PAGE_SHIFT     12
+#define PAGE_SIZE      (1 << PAGE_SHIFT)
+#define NUM_PAGES      (MEM_SIZE >> PAGE_SHIFT)
+#define CHECK_INTERVAL 4096 // Blocks between dirty page comparisons
+
+static RefHart  ref;
+static MemWrite refWrites[BLOCK_LIMIT];
+static MemWrite engineWrites[BLOCK_LIMIT];
+static unsigned numEngineWrites;
+
+static bool     dirty[NUM_PAGES];
+static uint32_t dirtyList[NUM_PAGES];
+static unsigned numDirty;
+static uint64_t executed;
+static bool     hooked;   // The executor logs its stores and stops at each block
+
+
+int LockstepStart(bool instrumented) {
+  if(!ref.mem && !(ref.mem = malloc(MEM_SIZE)))
+    return -1;
+  memcpy(ref.mem, mem, MEM_SIZE);
+  memcpy(ref.reg, reg, sizeof reg);
+  ref.writes = refWrites;
+  ref.maxWrites = BLOCK_LIMIT;
+  memset(dirty, 0, sizeof dirty);
+  numDirty = 0;
+  executed = 0;
+  hooked = instrumented;
+  if(hooked)
+    cpuHooks |= CPU_HOOK_LOCKSTEP;
+  cpuSyncPoints = true;
+  return 0;
+}
+
+
+void LockstepStop() {
+  cpuHooks &= ~CPU_HOOK_LOCKSTEP;
+  cpuSyncPoints = false;
+}
+
+
+void LockstepWrite(uint32_t addr, uint32_t size, uint32_t value) {
+  // Mirror the executor, which drops out of range stores
+  if(addr >= MEM_SIZE || MEM_SIZE - addr < size || numEngineWrites == BLOCK_LIMIT)
+    return;
+  uint32_t old = 0;
+  for(unsigned i = 0; i < size; i++)
+    old |= (uint32_t)mem[addr + i] << (8 * i);
+  engineWrites[numEngineWrites++] = (MemWrite){ addr, size, old, value & (0xFFFF'FFFFu >> (32 - 8 * size)) };
+}
+
+
+static void MarkDirty(const MemWrite *w, unsigned n) {
+  for(unsigned i = 0; i < n; i++) {
+    for(uint32_t p = w[i].addr >> PAGE_SHIFT; p <= (w[i].addr + w[i].size - 1) >> PAGE_SHIFT; p++) {
+      if(!dirty[p]) {
+        dirty[p] = true;
+        dirtyList[numDirty++] = p;
+      }
+    }
+  }
+}
+
+
+static void Undo(uint8_t *m, const MemWrite *w, unsigned n) {
+  while(n--)
+    for(unsigned i = 0; i < w[n].size; i++)
+      m[w[n].addr + i] = w[n].old >> (8 * i);
+}
+
+
+static uint64_t HashPage(const uint8_t *p) {
+  uint64_t h = 0xCBF2'9CE4'8422'2325u;
+  for(unsigned i = 0; i < PAGE_SIZE; i += 8) {
+    uint64_t v;
+    memcpy(&v, p + i, sizeof v);
+    h = (h ^ v) * 0x0000'0100'0000'01B3u;
+  }
+  return h;
+}
+
+
+static bool SameWrites() {
+  if(numEngineWrites != ref.numWrites)
+    return false;
+  for(unsigned i = 0; i < numEngineWrites; i++)
+    if(engineWrites[i].addr  != refWrites[i].addr ||
+       engineWrites[i].size  != refWrites[i].size ||
+       engineWrites[i].value != refWrites[i].value)
+      return false;
+  return true;
+}
+
+
+// Without the hook the engine's stores aren't known, so the memory the
+// reference stored to must match instead
+static bool SameMemory() {
+  for(unsigned i = 0; i < ref.numWrites; i++)
+    if(memcmp(&mem[refWrites[i].addr], &ref.mem[refWrites[i].addr], refWrites[i].size))
+      return false;
+  return true;
+}
+
+
+// Compares all but the registers in the mask except
+static bool SameState(uint64_t except) {
+  for(int i = 0; i < NUM_REGS; i++)
+    if(!(except >> i & 1) && reg[i] != ref.reg[i])
+      return false;
+  return hooked ? SameWrites() : SameMemory();
+}
+
+
+// The registers a sync point may change that the reference can't follow:
+// the PC, and the rd of the instruction the reference stopped at, if the
+// engine ran it
+static uint64_t SyncChanges(bool ran) {
+  uint32_t pc = ref.reg[PC];
+  uint64_t changes = 1ull << PC;
+  if(ran && pc < MEM_SIZE - 3)
+    changes |= 1ull << (CPURead32(pc) >> 7 & 0x1F);
+  return changes;
+}
+
+
+static void PrintWrites(const char *who, const MemWrite *w, unsigned n) {
+  for(unsigned i = 0; i < n; i++)
+    printf("  %-9s store %u bytes %04X:%04X = %0*X\n", who, w[i].size,
+        w[i].addr >> 16, w[i].addr & 0xFFFF, 2 * w[i].size, w[i].value);
+}
+
+
+static void Report(uint32_t pc, bool engineRan, bool refRan) {
+  uint32_t ins = CPURead32(pc);
+  char buf[UNASSEMBLE_MAX];
+  printf("divergence after %llu instructions\n", (unsigned long long)executed);
+  printf("  %04X:%04X %08X  %s\n", pc >> 16, pc & 0xFFFF, ins,
+      Unassemble(pc, ins, buf) ? "invalid instruction" : buf);
+  if(engineRan != refRan) {
+    printf("  %-9s %s\n", "engine",    engineRan ? "executed" : "stopped");
+    printf("  %-9s %s\n", "reference", refRan    ? "executed" : "stopped");
+  }
+  for(int i = 0; i < NUM_REGS; i++) {
+    if(reg[i] == ref.reg[i])
+      continue;
+    printf("  %-9s %5s/%-5s %04X:%04X\n", "engine", reg_names[i], reg_anames[i],
+        reg[i] >> 16, reg[i] & 0xFFFF);
+    printf("  %-9s %5s/%-5s %04X:%04X\n", "reference", reg_names[i], reg_anames[i],
+        ref.reg[i] >> 16, ref.reg[i] & 0xFFFF);
+  }
+  if(hooked && !SameWrites()) {
+    PrintWrites("engine", engineWrites, numEngineWrites);
+    PrintWrites("reference", refWrites, ref.numWrites);
+  } else if(!hooked && !SameMemory()) {
+    PrintWrites("reference", refWrites, ref.numWrites);
+    for(unsigned i = 0; i < ref.numWrites; i++) {
+      const MemWrite *w = &refWrites[i];
+      uint32_t v = 0;
+      for(unsigned j = 0; j < w->size; j++)
+        v |= (uint32_t)mem[w->addr + j] << (8 * j);
+      printf("  %-9s memory  %u bytes %04X:%04X = %0*X\n", "engine", w->size,
+          w->addr >> 16, w->addr & 0xFFFF, 2 * w->size, v);
+    }
+  }
+}
+
+
+// Rewinds both sides to the start of a block that diverged and steps up to
+// steps instructions one at a time to find the culprit. Without the
+// engine's log, its memory is rewound where the reference stored, which
+// held the same.
+static void Replay(const uint32_t engineStart[NUM_REGS], const uint32_t refStart[NUM_REGS], unsigned steps) {
+  if(hooked)
+    Undo(mem, engineWrites, numEngineWrites);
+  else
+    Undo(mem, refWrites, ref.numWrites);
+  Undo(ref.mem, refWrites, ref.numWrites);
+  memcpy(reg, engineStart, sizeof reg);
+  memcpy(ref.reg, refStart, sizeof ref.reg);
+
+  for(unsigned i = 0; i < steps; i++) {
+    uint32_t pc = reg[PC];
+    numEngineWrites = ref.numWrites = 0;
+    bool engineRan = CPUStep(1) == 0;
+    bool refRan = RefStep(&ref);
+    if(engineRan != refRan || !SameState(0)) {
+      Report(pc, engineRan, refRan);
+      return;
+    }
+    executed++;
+  }
+  printf("divergence in block at %04X:%04X did not reproduce\n",
+      engineStart[PC] >> 16, engineStart[PC] & 0xFFFF);
+}
+
+
+// Compares the pages either side stored to, or without the engine's log
+// every page, since it may have stored anywhere. That hashes all of RAM
+// every CHECK_INTERVAL blocks, some 30 bytes per instruction, which is
+// the price of running the plain executor.
+static bool CheckPages() {
+  bool same = true;
+  if(!hooked)
+    for(uint32_t p = 0; p < NUM_PAGES; p++)
+      if(!dirty[p]) {
+        dirty[p] = true;
+        dirtyList[numDirty++] = p;
+      }
+  for(unsigned i = 0; i < numDirty; i++) {
+    uint32_t p = dirtyList[i];
+    dirty[p] = false;
+    if(!same || HashPage(&mem[p << PAGE_SHIFT]) == HashPage(&ref.mem[p << PAGE_SHIFT]))
+      continue;
+    uint32_t a = p << PAGE_SHIFT;
+    while(mem[a] == ref.mem[a])
+      a++;
+    printf("memory divergence at %04X:%04X: engine %02X, reference %02X\n",
+        a >> 16, a & 0xFFFF, mem[a], ref.mem[a]);
+    same = false;
+  }
+  numDirty = 0;
+  return same;
+}
+
+
+unsigned LockstepRun(unsigned cycles, bool *diverged) {
+  uint32_t engineStart[NUM_REGS], refStart[NUM_REGS];
+  unsigned blocks = 0;
+
+  *diverged = false;
+  while(cycles) {
+    memcpy(engineStart, reg, sizeof reg);
+    memcpy(refStart, ref.reg, sizeof ref.reg);
+    numEngineWrites = ref.numWrites = 0;
+
+    // With CPU_HOOK_LOCKSTEP set the executor returns after each taken
+    // control transfer, so this runs at most one block. Otherwise it runs
+    // the whole budget, unless it stops. Either way it returns at a sync
+    // point, where the reference stops short and then takes the engine's
+    // registers: it has no devices, CSRs or traps.
+    unsigned budget = cycles < BLOCK_LIMIT ? cycles : BLOCK_LIMIT;
+    unsigned ran = budget - CPUStep(budget);
+    bool synced = cpuSynced;
+    unsigned follow = synced && ran ? ran - 1 : ran;
+    unsigned refRan = follow - RefRun(&ref, follow);
+    // The engine stops at a breakpoint the reference knows nothing of
+    bool stopped = ran == 0 && !synced;
+    bool breakpoint = stopped && cpuHooks & CPU_HOOK_BREAK && IsBreakpoint(reg[PC]);
+    if(refRan != follow || !SameState(synced ? SyncChanges(ran) : 0) ||
+       (stopped && !breakpoint && RefStep(&ref))) {
+      Replay(engineStart, refStart, synced ? follow : ran + 1);
+      *diverged = true;
+      return cycles;
+    }
+    if(synced)
+      memcpy(ref.reg, reg, sizeof reg);
+    MarkDirty(engineWrites, numEngineWrites);
+    MarkDirty(refWrites, ref.numWrites);
+    executed += ran;
+    cycles -= ran;
+    if(stopped)
+      break;
+    if(++blocks % CHECK_INTERVAL == 0 && !CheckPages()) {
+      *diverged = true;
+      return cycles;
+    }
+  }
+  if(!CheckPages())
+    *diverged = true;
+  return cycles;
+}
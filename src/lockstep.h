@@ -0,0 +1,27 @@
+#ifndef LOCKSTEP_H
+#define LOCKSTEP_H
+#include <stdbool.h>
+#include <stdint.h>
+
+// Runs the executor and the reference interpreter side by side, comparing
+// registers and stores after every block, and narrows any divergence down
+// to the first instruction that differs.
+//
+// With instrumented, CPU_HOOK_LOCKSTEP makes CPUStep run the instrumented
+// executor, which logs its stores and stops at every block. Otherwise
+// CPUStep picks the executor as it would anyway, the plain or paged one
+// unless other hooks are set, and blocks are a fixed number of
+// instructions. The reference's stores are then checked against the
+// engine's memory, and all of memory is compared now and then.
+//
+// Device accesses, CSRs, traps and interrupts are sync points, which the
+// reference takes from the engine. So the engine doesn't idle, and RAM
+// written by devices isn't mirrored.
+
+int      LockstepStart(bool instrumented);
+void     LockstepStop();
+unsigned LockstepRun(unsigned cycles, bool *diverged);
+
+void LockstepWrite(uint32_t addr, uint32_t size, uint32_t value);
+
+#endif
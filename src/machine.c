@@ -0,0 +1,172 @@
+#include "machine.h"
+#include "CPU.h"
+#include "asm.h"
+#include "mmio.h"
+#include <assert.h>
+#include <elf.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static_assert(MACHINE_PC == PC);
+
+struct Machine {
+  Hart hart; // Stale while the machine is bound
+};
+
+static Machine *bound;
+static Hart     unbound; // The globals while no machine is bound
+static unsigned count;   // Of machines that exist
+
+
+void MachineBind(Machine *m) {
+  if(m == bound)
+    return;
+  CPUSave(bound ? &bound->hart : &unbound);
+  CPURestore(m ? &m->hart : &unbound);
+  bound = m;
+}
+
+
+Machine *MachineCreate() {
+  if(count && MMIOCount())
+    return NULL;
+  Machine *m = malloc(sizeof *m);
+  uint8_t *ram = calloc(1, MEM_SIZE);
+  if(!m || !ram) {
+    free(m);
+    free(ram);
+    return NULL;
+  }
+  m->hart = (Hart){ .mem = ram };
+  Machine *old = bound;
+  MachineBind(m);
+  Reset();
+  MachineBind(old);
+  count++;
+  return m;
+}
+
+
+void MachineDestroy(Machine *m) {
+  if(!m)
+    return;
+  if(m == bound) {
+    CPURestore(&unbound);
+    bound = NULL;
+  }
+  free(m->hart.mem);
+  free(m);
+  count--;
+}
+
+
+static bool InRAM(uint32_t addr, uint32_t size) {
+  return addr <= MEM_SIZE && size <= MEM_SIZE - addr;
+}
+
+
+// Loads the segments of an RV32 executable at their physical addresses and
+// points the PC at its entry
+static int LoadELF(FILE *f) {
+  Elf32_Ehdr eh;
+  if(fseek(f, 0, SEEK_SET) || fread(&eh, sizeof eh, 1, f) != 1 ||
+     eh.e_ident[EI_CLASS] != ELFCLASS32 ||
+     eh.e_ident[EI_DATA] != ELFDATA2LSB ||
+     eh.e_type != ET_EXEC || eh.e_machine != EM_RISCV ||
+     eh.e_phentsize != sizeof(Elf32_Phdr))
+    return -1;
+  for(unsigned i = 0; i < eh.e_phnum; i++) {
+    Elf32_Phdr ph;
+    if(fseek(f, eh.e_phoff + i * sizeof ph, SEEK_SET) || fread(&ph, sizeof ph, 1, f) != 1)
+      return -1;
+    if(ph.p_type != PT_LOAD || !ph.p_memsz)
+      continue;
+    if(ph.p_filesz > ph.p_memsz || !InRAM(ph.p_paddr, ph.p_memsz))
+      return -1;
+    if(fseek(f, ph.p_offset, SEEK_SET) ||
+       fread(&mem[ph.p_paddr], 1, ph.p_filesz, f) != ph.p_filesz)
+      return -1;
+    memset(&mem[ph.p_paddr + ph.p_filesz], 0, ph.p_memsz - ph.p_filesz);
+  }
+  reg[PC] = eh.e_entry;
+  return 0;
+}
+
+
+int MachineLoad(Machine *m, const char *filename, uint32_t addr) {
+  if(addr >= MEM_SIZE)
+    return -1;
+  MachineBind(m);
+  size_t len = strlen(filename);
+  if(len >= 2 && !strcmp(filename + len - 2, ".s")) {
+    AsmImage a;
+    if(AsmFile(filename, addr, &a))
+      return -1;
+    bool fits = InRAM(a.base, a.size);
+    if(fits) {
+      AsmLoad(&a);
+      reg[PC] = a.entry;
+    }
+    AsmFree(&a);
+    return fits ? 0 : -1;
+  }
+
+  FILE *f = fopen(filename, "rb");
+  if(!f)
+    return -1;
+  char magic[SELFMAG];
+  if(fread(magic, 1, SELFMAG, f) == SELFMAG && !memcmp(magic, ELFMAG, SELFMAG)) {
+    int result = LoadELF(f);
+    fclose(f);
+    return result;
+  }
+  rewind(f);
+  fread(&mem[addr], 1, MEM_SIZE - addr, f);
+  bool whole = feof(f) && !ferror(f);
+  fclose(f);
+  if(!whole)
+    return -1;
+  reg[PC] = addr;
+  return 0;
+}
+
+
+unsigned MachineRun(Machine *m, unsigned budget) {
+  if(count > 1 && MMIOCount())
+    return budget;
+  MachineBind(m);
+  return CPUStep(budget);
+}
+
+
+uint32_t MachineReadReg(Machine *m, int index) {
+  MachineBind(m);
+  return index >= 0 && index < NUM_REGS ? reg[index] : 0;
+}
+
+
+// x0 stays zero
+void MachineWriteReg(Machine *m, int index, uint32_t value) {
+  MachineBind(m);
+  if(index > 0 && index < NUM_REGS)
+    reg[index] = value;
+}
+
+
+int MachineReadMemory(Machine *m, uint32_t addr, void *buffer, uint32_t size) {
+  if(!InRAM(addr, size))
+    return -1;
+  MachineBind(m);
+  memcpy(buffer, &mem[addr], size);
+  return 0;
+}
+
+
+int MachineWriteMemory(Machine *m, uint32_t addr, const void *buffer, uint32_t size) {
+  if(!InRAM(addr, size))
+    return -1;
+  MachineBind(m);
+  memcpy(&mem[addr], buffer, size);
+  return 0;
+}
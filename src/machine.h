@@ -0,0 +1,51 @@
+#ifndef MACHINE_H
+#define MACHINE_H
+#include <stdint.h>
+
+// The interface of libr64000: RV32 machines behind an opaque handle, each
+// with its own hart and RAM.
+//
+// This is a single active machine layer over the one emulator core, not a
+// set of independent instances. The core works on the globals of CPU.h,
+// and a machine is a saved copy of them. Every call here binds its machine
+// first, which is free unless another one was used last: then the hart is
+// copied out and in and the MMU flushed. MachineBind does it for code that
+// uses the globals directly. Only the bound machine runs, so machines take
+// turns rather than run side by side, and none of it is thread-safe.
+//
+// The devices and their events, the breakpoints, profiler and stats belong
+// to the process and serve whichever machine runs, so while any device is
+// mapped only one machine may exist.
+
+typedef struct Machine Machine;
+
+// Register indices are 0 to 31 for x0 to x31, then the PC
+#define MACHINE_PC 32
+
+// A machine starts as Reset leaves the hart, with its RAM zeroed. Returns
+// NULL if out of memory, or if devices are mapped and a machine exists.
+// MachineBind(NULL) goes back to the RAM in use before any machine was bound.
+Machine *MachineCreate();
+void     MachineDestroy(Machine *m);
+void     MachineBind(Machine *m);
+
+// Loads an assembly source if the name ends in .s, otherwise a flat image,
+// at addr in RAM, and points the PC at its entry. An RV32 ELF executable
+// loads at the physical addresses of its segments instead, which must be in
+// RAM. Returns -1 on failure.
+int MachineLoad(Machine *m, const char *filename, uint32_t addr);
+
+// Runs up to budget instructions, as CPUStep. Returns what is left of the
+// budget, 0 unless stopped early by an invalid instruction or a breakpoint,
+// or all of it if devices were mapped while several machines exist.
+unsigned MachineRun(Machine *m, unsigned budget);
+
+uint32_t MachineReadReg (Machine *m, int index);
+void     MachineWriteReg(Machine *m, int index, uint32_t value);
+
+// These copy to and from RAM directly, bypassing the MMU and devices.
+// Return -1 if [addr, addr + size) isn't in RAM.
+int MachineReadMemory (Machine *m, uint32_t addr, void *buffer, uint32_t size);
+int MachineWriteMemory(Machine *m, uint32_t addr, const void *buffer, uint32_t size);
+
+#endif
@@ -4,14 +4,21 @@
 #include <ctype.h>
 #include <string.h>
 #include <stddef.h>
+#include <unistd.h>
 #include <SDL.h>
 #include <SDL_image.h>
 #include "CPU.h"
+#include "asm.h"
+#include "clint.h"
+#include "disk.h"
+#include "dma.h"
+#include "framebuffer.h"
+#include "gdbstub.h"
+#include "machine.h"
 #include "monitor.h"
-
-SDL_Window *debugWindow;
-SDL_Renderer *debugRenderer;
-SDL_Texture *debugFont;
+#include "plic.h"
+#include "stats.h"
+#include "uart.h"
 
 void _Noreturn Die() {
   exit(EXIT_FAILURE);
@@ -29,26 +36,40 @@ void _Noreturn Die() {
 #define SDL_LOG() LOG("%s", SDL_GetError())
 #define SDL_LOG_AND(D) LOG_AND(("%s", SDL_GetError()), D)
 
-int CPU_Load(const char *filename, uint32_t baseAddr) {
-  int result = -1;
-  FILE *f = NULL;
+static const char *statsFile;
+
+static void WriteStats() {
+  if(StatsWrite(statsFile))
+    LOG("Could not write '%s'", statsFile);
+}
 
-  f = fopen(filename, "rb");
-  if(!f)
-    LOG_AND(("Could not open '%s'", filename), goto done);
-  int maxSize = MEM_SIZE - baseAddr;
-  if(maxSize <= 0)
-    LOG_AND(("baseAddr is past end of RAM"), goto done);
-  fread(&mem[baseAddr], 1, maxSize, f);
-  if(!feof(f))
-    LOG_AND(("Could not load whole file"), goto done);
-  result = 0;
-done:
-  fclose(f);
-  return result;
+void _Noreturn Usage(const char *argv0) {
+  fprintf(stderr, "usage: %s [-s stats.csv|stats.json] [-g [host:]port|socket] [-o output] [-x script|-] [-f] [-r] [-u stdio|pty] [-d disk.img [-c]] image|source.s\n", argv0);
+  exit(EXIT_FAILURE);
 }
 
 int main(int argc, char *argv[]) {
+  const char *gdbAddress = NULL, *output = NULL, *scriptFile = NULL, *uart = NULL, *disk = NULL;
+  bool framebuffer = false, cow = false;
+  int opt;
+  while((opt = getopt(argc, argv, "s:g:o:x:fru:d:c")) != -1) {
+    switch(opt) {
+    case 'f': framebuffer = true; break;
+    case 'r': cpuRealTime = true; break;
+    case 'u': uart = optarg; break;
+    case 'd': disk = optarg; break;
+    case 'c': cow = true; break;
+    case 'x': scriptFile = optarg; break;
+    case 'o': output = optarg; break;
+    case 's': statsFile = optarg; break;
+    case 'g': gdbAddress = optarg; break;
+    default:  Usage(argv[0]);
+    }
+  }
+  if(optind != argc - 1)
+    Usage(argv[0]);
+
+
   if(SDL_Init(SDL_INIT_VIDEO | SDL_INIT_EVENTS) < 0)
     SDL_LOG_AND(Die());
   {
@@ -57,10 +78,65 @@ int main(int argc, char *argv[]) {
       SDL_LOG_AND(Die());
   }
 
-  Reset();
-  if(CPU_Load(argv[1], 0x0002'0000))
-    exit(EXIT_FAILURE);
-  reg[0] = 0xDEAD'BEEF;
-  reg[PC] = 0x0002'0000;
-  RunMonitor();
+  const char *image = argv[optind];
+  size_t len = strlen(image);
+  // With -o only assemble, writing an ELF or flat image
+  if(output) {
+    AsmImage a;
+    if(len < 2 || strcmp(image + len - 2, ".s"))
+      Usage(argv[0]);
+    if(AsmFile(image, 0x0002'0000, &a))
+      LOG_AND(("Could not assemble '%s'", image), Die());
+    if(AsmWrite(&a, output))
+      LOG_AND(("Could not write '%s'", output), Die());
+    return 0;
+  }
+
+  Machine *machine = MachineCreate();
+  if(!machine)
+    LOG_AND(("Could not allocate the machine"), Die());
+  if(MachineLoad(machine, image, 0x0002'0000))
+    LOG_AND(("Could not load '%s'", image), Die());
+  // The devices and gdb work on the bound machine
+  MachineBind(machine);
+  if(ClintStart() || PlicStart() || DMAStart())
+    LOG_AND(("Could not map the interrupt and DMA controllers"), Die());
+  if(statsFile) {
+    StatsStart();
+    atexit(WriteStats);
+  }
+  if(framebuffer) {
+    if(FramebufferStart())
+      LOG_AND(("Could not start the framebuffer"), Die());
+    atexit(FramebufferStop);
+  }
+  if(uart) {
+    // The guest reads stdin only when the monitor doesn't
+    bool input = strcmp(uart, "stdio") || gdbAddress || (scriptFile && strcmp(scriptFile, "-"));
+    if(UARTStart(uart, input))
+      LOG_AND(("Could not start the UART on '%s'", uart), Die());
+    atexit(UARTStop);
+  }
+  if(disk) {
+    if(DiskStart(disk, cow))
+      LOG_AND(("Could not open the disk image '%s'", disk), Die());
+    atexit(DiskStop);
+  }
+  if(gdbAddress) {
+    if(GdbServe(gdbAddress))
+      LOG_AND(("Could not serve gdb on '%s'", gdbAddress), Die());
+    return 0;
+  }
+  // Commands piped into stdin run as a script too
+  FILE *script = NULL;
+  if(scriptFile && strcmp(scriptFile, "-")) {
+    if(!(script = fopen(scriptFile, "r")))
+      LOG_AND(("Could not open '%s'", scriptFile), Die());
+  } else if(scriptFile || !isatty(STDIN_FILENO))
+    script = stdin;
+  int status = RunMonitor(machine, script);
+  if(script && script != stdin)
+    fclose(script);
+  MachineDestroy(machine);
+  return status;
 }
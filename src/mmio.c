@@ -0,0 +1,64 @@
+#include "mmio.h"
+#include "CPU.h"
+#include <stddef.h>
+
+static const MMIODevice *devices[MMIO_MAX_DEVICES];
+static unsigned          numDevices;
+static const MMIODevice *last; // Devices tend to be accessed in bursts
+
+
+// Fails if the device overlaps RAM or another device
+int MMIOMap(const MMIODevice *device) {
+  if(numDevices == MMIO_MAX_DEVICES || device->base < MEM_SIZE || device->size == 0 ||
+     device->base + (device->size - 1) < device->base)
+    return -1;
+  for(unsigned i = 0; i < numDevices; i++) {
+    const MMIODevice *d = devices[i];
+    if(device->base <= d->base + (d->size - 1) && d->base <= device->base + (device->size - 1))
+      return -1;
+  }
+  devices[numDevices++] = device;
+  return 0;
+}
+
+
+unsigned MMIOCount() {
+  return numDevices;
+}
+
+
+void MMIOUnmap(const MMIODevice *device) {
+  for(unsigned i = 0; i < numDevices; i++) {
+    if(devices[i] == device) {
+      devices[i] = devices[--numDevices];
+      break;
+    }
+  }
+  last = NULL;
+}
+
+
+static const MMIODevice *Find(uint32_t addr, unsigned size) {
+  const MMIODevice *d = last;
+  if(d && addr - d->base < d->size && d->size - (addr - d->base) >= size)
+    return d;
+  for(unsigned i = 0; i < numDevices; i++) {
+    d = devices[i];
+    if(addr - d->base < d->size && d->size - (addr - d->base) >= size)
+      return last = d;
+  }
+  return NULL;
+}
+
+
+uint32_t MMIORead(uint32_t addr, unsigned size) {
+  const MMIODevice *d = Find(addr, size);
+  return d && d->read ? d->read(addr - d->base, size) : 0;
+}
+
+
+void MMIOWrite(uint32_t addr, uint32_t value, unsigned size) {
+  const MMIODevice *d = Find(addr, size);
+  if(d && d->write)
+    d->write(addr - d->base, value & (0xFFFF'FFFFu >> (32 - 8 * size)), size);
+}
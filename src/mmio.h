@@ -0,0 +1,27 @@
+#ifndef MMIO_H
+#define MMIO_H
+#include <stdint.h>
+
+#define MMIO_MAX_DEVICES 16
+
+// A device mapped above RAM. CPURead and CPUWrite fall through to these for
+// addresses past MEM_SIZE; unmapped addresses read as 0 and ignore writes.
+// Accesses are 1, 2 or 4 bytes and lie wholly inside the device.
+typedef struct {
+  const char *name;
+  uint32_t    base;
+  uint32_t    size;
+  uint32_t  (*read) (uint32_t offset, unsigned size);
+  void      (*write)(uint32_t offset, uint32_t value, unsigned size);
+} MMIODevice;
+
+int  MMIOMap  (const MMIODevice *device);
+void MMIOUnmap(const MMIODevice *device);
+
+// The number of devices mapped
+unsigned MMIOCount();
+
+uint32_t MMIORead (uint32_t addr, unsigned size);
+void     MMIOWrite(uint32_t addr, uint32_t value, unsigned size);
+
+#endif
@@ -0,0 +1,71 @@
+#include "mmu.h"
+
+enum {
+  PTE_V = 1 << 0,
+  PTE_R = 1 << 1,
+  PTE_W = 1 << 2,
+  PTE_X = 1 << 3,
+  PTE_U = 1 << 4,
+  PTE_A = 1 << 6,
+  PTE_D = 1 << 7,
+};
+
+TLBEntry tlb[PRIV_S + 1][NUM_ACCESSES][TLB_SIZE];
+
+static const uint32_t pageFaults[NUM_ACCESSES] = {
+  CAUSE_LOAD_PAGE_FAULT, CAUSE_STORE_PAGE_FAULT, CAUSE_FETCH_PAGE_FAULT
+};
+
+
+void MMUFlush() {
+  for(unsigned i = 0; i < sizeof tlb / sizeof(TLBEntry); i++)
+    (&tlb[0][0][0])[i].page = 1;
+}
+
+
+// Walks the page table from satp, setting the accessed and dirty bits as
+// the hardware may, and caches the translation if the page is in RAM. Page
+// tables must be in RAM too.
+uint32_t MMUWalk(uint32_t *addr, unsigned size, unsigned access, unsigned priv) {
+  uint32_t va = *addr;
+  if((va & 0xFFF) > 0x1000 - size)
+    return access == ACCESS_WRITE ? CAUSE_MISALIGNED_STORE : CAUSE_MISALIGNED_LOAD;
+  uint64_t table = (uint64_t)(csr.satp & SATP_PPN) << 12;
+  for(int level = 1; level >= 0; level--) {
+    uint64_t entry = table + 4 * (va >> (12 + 10 * level) & 0x3FF);
+    if(entry > MEM_SIZE - 4)
+      break;
+    uint32_t pte = CPURead32(entry);
+    uint64_t ppn = pte >> 10;
+    if(!(pte & PTE_V) || (pte & (PTE_R | PTE_W)) == PTE_W)
+      break;
+    if(!(pte & (PTE_R | PTE_X))) {
+      table = ppn << 12;
+      continue;
+    }
+
+    // A leaf, which at the first level is a 4 MiB superpage
+    if(level && ppn & 0x3FF)
+      break;
+    bool allowed = access == ACCESS_READ  ? pte & PTE_R || (csr.mstatus & MSTATUS_MXR && pte & PTE_X) :
+                   access == ACCESS_WRITE ? pte & PTE_W : pte & PTE_X;
+    if(priv == PRIV_U ? !(pte & PTE_U) : pte & PTE_U && (access == ACCESS_EXEC || !(csr.mstatus & MSTATUS_SUM)))
+      allowed = false;
+    uint64_t pa = (ppn << 12) + (va & (level ? 0x3F'FFFF : 0xFFF));
+    if(!allowed || pa + size > 1ull << 32)
+      break;
+    uint32_t ad = PTE_A | (access == ACCESS_WRITE ? PTE_D : 0);
+    if((pte & ad) != ad)
+      CPUWrite32(entry, pte | ad);
+
+    uint32_t page = va & ~0xFFFu, frame = pa & ~0xFFFu;
+    if(frame < MEM_SIZE) {
+      TLBEntry *e = &tlb[priv][access][va >> 12 & (TLB_SIZE - 1)];
+      e->page = page;
+      e->offset = frame - page;
+    }
+    *addr = pa;
+    return 0;
+  }
+  return pageFaults[access];
+}
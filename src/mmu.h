@@ -0,0 +1,38 @@
+#ifndef MMU_H
+#define MMU_H
+#include "CPU.h"
+#include <stdint.h>
+
+// Sv32 translation for supervisor and user mode. Each direct-mapped TLB
+// holds the pages of RAM one privilege level may access in one way, with
+// the offset from virtual to physical address, so a hit is a compare and
+// an add. The TLBs are only filled by walks and emptied by MMUFlush, on
+// sfence.vma and on writes to satp that could change a translation.
+// Pages outside RAM are walked on every access.
+#define TLB_SIZE 256 // Entries per TLB, a power of 2
+
+enum { ACCESS_READ, ACCESS_WRITE, ACCESS_EXEC, NUM_ACCESSES };
+
+typedef struct {
+  uint32_t page;   // Virtual address of the page, or 1 while empty
+  uint32_t offset; // Physical minus virtual address
+} TLBEntry;
+
+extern TLBEntry tlb[PRIV_S + 1][NUM_ACCESSES][TLB_SIZE];
+
+uint32_t MMUWalk(uint32_t *addr, unsigned size, unsigned access, unsigned priv);
+void     MMUFlush();
+
+// Translates *addr for an access of size bytes at privilege level priv,
+// below machine mode. Returns 0, or the exception to raise: a page fault,
+// or misaligned for an access that would cross a page.
+static inline uint32_t MMUTranslate(uint32_t *addr, unsigned size, unsigned access, unsigned priv) {
+  const TLBEntry *e = &tlb[priv][access][*addr >> 12 & (TLB_SIZE - 1)];
+  if(e->page == (*addr & ~0xFFFu) && (*addr & 0xFFF) <= 0x1000 - size) {
+    *addr += e->offset;
+    return 0;
+  }
+  return MMUWalk(addr, size, access, priv);
+}
+
+#endif
@@ -1,20 +1,69 @@
 #include "CPU.h"
+#include "asm.h"
+#include "breakpoint.h"
+#include "debugview.h"
+#include "heatmap.h"
 #include "linenoise.h"
+#include "lockstep.h"
 #include "monitor.h"
+#include "profile.h"
+#include "stats.h"
+#include "timing.h"
+#include "symbols.h"
+#include "uart.h"
 #include <ctype.h>
+#include <fcntl.h>
 #include <inttypes.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <unistd.h>
 
 
-char *vlinenoise(const char *fmt, ...) {
+static Machine *machine; // Changed through its calls, viewed in place
+static FILE    *script;  // Commands are read from here instead of linenoise
+static int      status;  // Of the last command, 0 unless it failed
+static uint64_t retired; // Instructions run by g and s, for the debug view
+
+
+// Reads a line of input through linenoise, or plainly from the script
+static char *ReadLine(const char *prompt) {
+  if(!script)
+    return linenoise(prompt);
+  char *line = NULL;
+  size_t cap = 0;
+  ssize_t n = getline(&line, &cap, script);
+  if(n < 0) {
+    free(line);
+    return NULL;
+  }
+  if(n > 0 && line[n - 1] == '\n')
+    line[n - 1] = '\0';
+  return line;
+}
+
+
+// Prints an error and fails the current command
+static void Fail(const char *fmt, ...) {
   va_list args;
   va_start(args, fmt);
   vprintf(fmt, args);
   va_end(args);
-  char *line = linenoise("");
+  status = 1;
+}
+
+
+char *vlinenoise(const char *fmt, ...) {
+  if(!script) {
+    va_list args;
+    va_start(args, fmt);
+    vprintf(fmt, args);
+    va_end(args);
+  }
+  char *line = ReadLine("");
   for(char *c = line; c && *c; c++)
     if(isspace(*c))
       *c = ' ';
@@ -67,68 +116,206 @@ void AssembleCommand(uint32_t s1) {
       CPUWrite32(s1, ins);
       s1 += 4;
     } else
-      printf("syntax error\n");
+      Fail("syntax error\n");
   }
   free(line);
 }
 
 
-void BreakpointCommand(uint32_t s1, bool set) {
-  if(s1 & 0x0000'0003 || s1 >= MEM_SIZE) {
-    printf("b invalid instruction address\n");
+// The address may be virtual, and needn't be mapped yet
+void BreakpointCommand(uint32_t s1, bool set, const char *rest) {
+  if(s1 & 0x0000'0003) {
+    Fail("b invalid instruction address\n");
+    return;
+  }
+  if(!set) {
+    BreakpointClear(s1);
     return;
   }
-  breakpoint[s1 >> 2] = set;
+  uint32_t count = 1;
+  int n = -1;
+  if(sscanf(rest, "%u %n", &count, &n) == 1 && n > 0)
+    rest += n;
+  const char *condition = NULL;
+  if(*rest) {
+    n = -1;
+    sscanf(rest, "if %n", &n);
+    if(n <= 0 || !rest[n]) {
+      Fail("syntax error\n");
+      return;
+    }
+    condition = rest + n;
+  }
+  if(BreakpointSet(s1, count, condition))
+    Fail("invalid condition '%s'\n", condition);
+}
+
+
+// Output of the bulk commands is formatted by hand into this buffer and
+// written with one fwrite whenever it fills, instead of a printf per byte
+static char   outBuf[1 << 20];
+static size_t outSize;
+
+
+static void OutFlush(void) {
+  fwrite(outBuf, 1, outSize, stdout);
+  outSize = 0;
 }
 
 
+// Returns space for at least n more characters
+static char *OutReserve(size_t n) {
+  if(outSize + n > sizeof outBuf)
+    OutFlush();
+  return &outBuf[outSize];
+}
+
+
+static char *OutHex(char *p, uint32_t value, int digits) {
+  static const char hex[] = "0123456789ABCDEF";
+  for(int i = digits - 1; i >= 0; i--)
+    *p++ = hex[value >> (4 * i) & 0xF];
+  return p;
+}
+
+
+// Writes seg:off
+static char *OutAddr(char *p, uint32_t a) {
+  p = OutHex(p, a >> 16, 4);
+  *p++ = ':';
+  return OutHex(p, a & 0xFFFF, 4);
+}
+
+
+// Returns the offset of the first byte that differs, or size. Equal 4 KiB
+// blocks and then 32-byte chunks are skipped with memcmp, which libc
+// vectorizes.
+static uint32_t Mismatch(const uint8_t *a, const uint8_t *b, uint32_t size) {
+  uint32_t i = 0;
+  while(i + 4096 <= size && !memcmp(&a[i], &b[i], 4096))
+    i += 4096;
+  while(i + 32 <= size && !memcmp(&a[i], &b[i], 32))
+    i += 32;
+  while(i < size && a[i] == b[i])
+    i++;
+  return i;
+}
+
+
+// Single differing bytes are listed as before. Longer runs, allowing gaps
+// of up to 16 equal bytes, are summarized on one line.
 void CompareCommand(uint32_t s1, uint32_t s2, uint32_t size) {
-  for(; size && s1 < MEM_SIZE && s2 < MEM_SIZE; size--, s1++, s2++) {
-    if(mem[s1] != mem[s2])
-      printf("c %04X:%04X %02X    %04X:%04X %02X\n",
-          s1 >> 16, s1 & 0xFFFF, mem[s1],
-          s2 >> 16, s2 & 0xFFFF, mem[s2]);
+  uint32_t n = size;
+  if(n > MEM_SIZE - (s1 < MEM_SIZE ? s1 : MEM_SIZE))
+    n = MEM_SIZE - (s1 < MEM_SIZE ? s1 : MEM_SIZE);
+  if(n > MEM_SIZE - (s2 < MEM_SIZE ? s2 : MEM_SIZE))
+    n = MEM_SIZE - (s2 < MEM_SIZE ? s2 : MEM_SIZE);
+
+  const uint8_t *a = &mem[s1 < MEM_SIZE ? s1 : 0], *b = &mem[s2 < MEM_SIZE ? s2 : 0];
+  for(uint32_t i = Mismatch(a, b, n); i < n; ) {
+    uint32_t end = i, differ = 0;
+    for(uint32_t j = i; j < n && j - end <= 16; j++) {
+      if(a[j] != b[j]) {
+        end = j;
+        differ++;
+      }
+    }
+    char *p = OutReserve(80);
+    *p++ = 'c';
+    *p++ = ' ';
+    if(end == i) {
+      p = OutAddr(p, s1 + i);
+      *p++ = ' ';
+      p = OutHex(p, a[i], 2);
+      memcpy(p, "    ", 4);
+      p += 4;
+      p = OutAddr(p, s2 + i);
+      *p++ = ' ';
+      p = OutHex(p, b[i], 2);
+      *p++ = '\n';
+    } else {
+      p = OutAddr(p, s1 + i);
+      *p++ = '-';
+      p = OutAddr(p, s1 + end);
+      *p++ = ' ';
+      p = OutAddr(p, s2 + i);
+      *p++ = '-';
+      p = OutAddr(p, s2 + end);
+      p += sprintf(p, " %u of %u bytes differ\n", differ, end - i + 1);
+    }
+    outSize = p - outBuf;
+    i = end + 1 + Mismatch(&a[end + 1], &b[end + 1], n - end - 1);
   }
-  if(size != 0)
-    printf("out of range");
+  OutFlush();
+  if(n != size)
+    Fail("out of range\n");
 }
 
 
+// Lines repeating the one before are collapsed into a single *, as hexdump
+// does, so that dumps of mostly empty memory stay short
 void DumpCommand(uint32_t s1, uint32_t size) {
-  for(uint32_t a = s1 & 0xFFFF'FFF0; a < MEM_SIZE && a < s1 + size; a += 16) {
-    printf("d %04X:%04X  ", a >> 16, a & 0xFFFF);
-    for(uint32_t b = a, count = 0; count < 16; b++, count++) {
-      if(b < s1 || b >= s1 + size || b >= MEM_SIZE)
-        printf("   ");
-      else
-        printf("%02X ", mem[b]);
-      if(count == 7)
-        printf("  ");
+  uint32_t end = (uint64_t)s1 + size < MEM_SIZE ? s1 + size : MEM_SIZE;
+  bool repeated = false;
+  for(uint32_t a = s1 & 0xFFFF'FFF0; a < end; a += 16) {
+    if(a >= s1 + 16 && a + 16 <= end && !memcmp(&mem[a], &mem[a - 16], 16)) {
+      if(!repeated) {
+        *OutReserve(2) = '*';
+        outBuf[outSize + 1] = '\n';
+        outSize += 2;
+        repeated = true;
+      }
+      while(a + 16 + 4096 <= end && !memcmp(&mem[a + 16], &mem[a], 4096))
+        a += 4096;
+      continue;
     }
-    printf("  |");
+    repeated = false;
+
+    char *p = OutReserve(96);
+    *p++ = 'd';
+    *p++ = ' ';
+    p = OutAddr(p, a);
+    *p++ = ' ';
+    *p++ = ' ';
     for(uint32_t b = a, count = 0; count < 16; b++, count++) {
-      if(b < s1 || b >= s1 + size || b >= MEM_SIZE || !isprint(mem[b]))
-        printf(" ");
-      else
-        printf("%c", mem[b]);
+      if(b < s1 || b >= end) {
+        memcpy(p, "   ", 3);
+        p += 3;
+      } else {
+        p = OutHex(p, mem[b], 2);
+        *p++ = ' ';
+      }
+      if(count == 7) {
+        *p++ = ' ';
+        *p++ = ' ';
+      }
     }
-    printf("|\n");
+    *p++ = ' ';
+    *p++ = ' ';
+    *p++ = '|';
+    for(uint32_t b = a, count = 0; count < 16; b++, count++)
+      *p++ = b < s1 || b >= end || !isprint(mem[b]) ? ' ' : mem[b];
+    *p++ = '|';
+    *p++ = '\n';
+    outSize = p - outBuf;
   }
+  OutFlush();
 }
 
 
 void EnterCommand(uint32_t s1, const char *line) {
   int n = -1, n2;
   sscanf(line, " e %*i %n", &n);
-  if(n < 0)
-    printf("syntax error\n");
-  uint32_t byte;
-  while(n2 = -1, sscanf(line + n, "%2X %n", &byte, &n2), n2 > 0) {
-    if(s1 >= MEM_SIZE) {
-      printf("out of range");
+  if(n < 0) {
+    Fail("syntax error\n");
+    return;
+  }
+  uint8_t byte;
+  while(n2 = -1, sscanf(line + n, "%2hhX %n", &byte, &n2), n2 > 0) {
+    if(MachineWriteMemory(machine, s1, &byte, 1)) {
+      Fail("out of range\n");
       return;
     }
-    mem[s1] = byte;
     n += n2;
     s1++;
   }
@@ -136,58 +323,256 @@ void EnterCommand(uint32_t s1, const char *line) {
 
 
 void FillCommand(uint32_t s1, uint32_t size, uint32_t byte) {
-  for(; s1 < MEM_SIZE && size > 0; s1++, size--)
-    mem[s1] = byte;
-  if(size != 0)
-    printf("out of range");
+  uint32_t n = s1 < MEM_SIZE ? MEM_SIZE - s1 : 0;
+  if(n > size)
+    n = size;
+  memset(&mem[s1 < MEM_SIZE ? s1 : 0], byte, n);
+  if(n != size)
+    Fail("out of range\n");
+}
+
+
+static volatile sig_atomic_t interrupted;
+
+
+static void Interrupt(int sig) {
+  interrupted = 1;
 }
 
 
+// Runs in chunks of the plain executor, or the instrumented one if
+// breakpoints or other hooks are set, until a breakpoint, an invalid
+// instruction or ^C. While the hart translates its fetches, s1 is a virtual
+// address, and a fetch fault is the guest's to handle.
 void GoCommand(uint32_t s1) {
-  if(s1 & 0x0000'0003 || s1 + 3 >= MEM_SIZE) {
-    printf("out of range");
+  enum { GO_CHUNK = 1 << 20 };
+  bool paged = csr.satp & SATP_MODE && csr.priv != PRIV_M;
+  if(s1 & 0x0000'0003 || (!paged && s1 + 3 >= MEM_SIZE)) {
+    Fail("out of range\n");
     return;
   }
-  reg[PC] = s1;
+  MachineWriteReg(machine, MACHINE_PC, s1);
+
+  struct sigaction action = { .sa_handler = Interrupt }, old;
+  sigemptyset(&action.sa_mask);
+  interrupted = 0;
+  sigaction(SIGINT, &action, &old);
+  DebugViewPublish(retired, true);
+  unsigned remaining = BreakpointRun(1);
+  retired += 1 - remaining;
+  while(!remaining && !interrupted) {
+    remaining = MachineRun(machine, GO_CHUNK);
+    retired += GO_CHUNK - remaining;
+    DebugViewPublish(retired, false);
+  }
+  sigaction(SIGINT, &old, NULL);
+  UARTFlush();
+
+  char symbol[64];
+  uint32_t pc = MachineReadReg(machine, MACHINE_PC);
+  printf("%s at %04X:%04X %s\n",
+      interrupted && !remaining ? "interrupted" : IsBreakpoint(pc) ? "break" : "stopped",
+      pc >> 16, pc & 0xFFFF, FormatSymbol(pc, symbol));
+}
+
+
+// Parses a bare, 'single' or "double" quoted filename filling the rest of
+// the line.
+bool ScanFilename(const char *rest, char filename[512]) {
+  int n;
+  return (n = -1, sscanf(rest, " \"%511[^\"]\" %n", filename, &n), n > 0 && !rest[n]) ||
+         (n = -1, sscanf(rest, " '%511[^']' %n", filename, &n), n > 0 && !rest[n]) ||
+         (n = -1, sscanf(rest, " %511s %n", filename, &n), n > 0 && !rest[n]);
+}
+
+
+void AssembleFileCommand(uint32_t s1, const char *rest) {
+  char filename[512];
+  AsmImage image;
+  if(!ScanFilename(rest, filename)) {
+    Fail("syntax error\n");
+    return;
+  }
+  if(AsmFile(filename, s1, &image)) {
+    Fail("can't assemble '%s'\n", filename);
+    return;
+  }
+  AsmLoad(&image);
+  printf("%u bytes, entry %04X:%04X\n", image.size, image.entry >> 16, image.entry & 0xFFFF);
+  AsmFree(&image);
+}
+
+
+void StatsCommand(bool enable) {
+  if(enable)
+    StatsStart();
+  else
+    StatsStop();
+}
+
+
+void StatsWriteCommand(const char *rest) {
+  char filename[512];
+  if(!ScanFilename(rest, filename))
+    Fail("syntax error\n");
+  else if(StatsWrite(filename))
+    Fail("can't write file '%s'\n", filename);
+}
+
+
+// Parses a search pattern: hex bytes with ?? wildcards, w or l followed by
+// a 16 or 32-bit value and an optional & mask, or a "quoted string"
+static int ScanPattern(const char *s, uint8_t pattern[64], uint8_t mask[64]) {
+  int len = 0, n;
+  uint32_t v, m = 0xFFFF'FFFF;
+  while(isspace(*s))
+    s++;
+  if(*s == '"') {
+    for(s++; *s && *s != '"' && len < 64; s++) {
+      if(*s == '\\' && s[1])
+        s++;
+      pattern[len] = *s;
+      mask[len++] = 0xFF;
+    }
+    return *s == '"' && !s[1 + strspn(s + 1, " ")] ? len : -1;
+  }
+  if((*s == 'w' || *s == 'l') && isspace(s[1])) {
+    int size = *s == 'w' ? 2 : 4;
+    n = -1;
+    if(sscanf(s + 1, " %i %n", &v, &n) != 1 || n < 0)
+      return -1;
+    s += 1 + n;
+    if(*s == '&' && (n = -1, sscanf(s + 1, " %i %n", &m, &n), n > 0))
+      s += 1 + n;
+    if(*s)
+      return -1;
+    for(; len < size; len++) {
+      pattern[len] = v >> (8 * len);
+      mask[len] = m >> (8 * len);
+    }
+    return len;
+  }
+  while(*s && len < 64) {
+    if(s[0] == '?' && s[1] == '?') {
+      pattern[len] = mask[len] = 0;
+      n = 2;
+    } else if(n = -1, sscanf(s, "%2X%n", &v, &n), n > 0) {
+      pattern[len] = v;
+      mask[len] = 0xFF;
+    } else
+      return -1;
+    len++;
+    s += n;
+    while(isspace(*s))
+      s++;
+  }
+  return *s ? -1 : len;
+}
+
+
+// memchr finds candidates for one fully specified byte of the pattern,
+// which are then checked against the rest under the mask
+void HuntCommand(uint32_t s1, uint32_t size, const char *rest) {
+  uint8_t pattern[64], mask[64];
+  int len = ScanPattern(rest, pattern, mask);
+  if(len <= 0) {
+    Fail("syntax error\n");
+    return;
+  }
+  if(s1 >= MEM_SIZE || size > MEM_SIZE - s1) {
+    Fail("out of range\n");
+    return;
+  }
+  // Prefer an anchor byte that is not 00 or FF, which are common in memory
+  int anchor = -1;
+  for(int i = 0; i < len; i++) {
+    if(mask[i] != 0xFF)
+      continue;
+    if(anchor < 0 || ((pattern[anchor] == 0x00 || pattern[anchor] == 0xFF) &&
+                      pattern[i] != 0x00 && pattern[i] != 0xFF))
+      anchor = i;
+  }
+
+  enum { MAX_PRINTED = 256 };
+  uint32_t found = 0;
+  const uint8_t *p = &mem[s1], *last = &mem[s1 + size] - len;
+  while(size >= (uint32_t)len && p <= last) {
+    if(anchor >= 0) {
+      const uint8_t *c = memchr(p + anchor, pattern[anchor], last - p + 1);
+      if(!c)
+        break;
+      p = c - anchor;
+    }
+    int i = 0;
+    while(i < len && !((p[i] ^ pattern[i]) & mask[i]))
+      i++;
+    if(i == len) {
+      uint32_t a = p - mem;
+      if(found++ < MAX_PRINTED)
+        printf("h %04X:%04X\n", a >> 16, a & 0xFFFF);
+    }
+    p++;
+  }
+  if(found > MAX_PRINTED)
+    printf("%u more\n", found - MAX_PRINTED);
+  if(!found)
+    Fail("not found\n");
 }
 
 
 void LoadCommand(uint32_t s1, const char *rest) {
   char filename[512];
-  int n;
 
   if(s1 >= MEM_SIZE) {
-    printf("out of range\n");
+    Fail("out of range\n");
     return;
   }
 
-  if((n = -1, sscanf(rest, " \"%511[^\"] %n", filename, &n), n > 0 && !rest[n]) ||
-     (n = -1, sscanf(rest, " '%511[^'] %n", filename, &n), n > 0 && !rest[n]) ||
-     (n = -1, sscanf(rest, " %511s %n", filename, &n), n > 0 && !rest[n])) {
+  if(ScanFilename(rest, filename)) {
     FILE *f = fopen(filename, "rb");
     if(!f) {
-      printf("can't open file '%s'\n", filename);
+      Fail("can't open file '%s'\n", filename);
       return;
     }
     size_t bytes = fread(&mem[s1], 1, MEM_SIZE - s1, f);
     printf("%zu bytes read\n", bytes);
     if(!feof(f))
-      printf("out of range\n");
+      Fail("out of range\n");
     fclose(f);
   } else
-    printf("syntax error\n");
+    Fail("syntax error\n");
 }
 
 
 void MoveCommand(uint32_t s1, uint32_t s2, uint32_t size) {
   if(s1 + size >= MEM_SIZE || s2 + size >= MEM_SIZE) {
-    printf("out of range\n");
+    Fail("out of range\n");
     return;
   }
   memmove(&mem[s1], &mem[s2], size);
 }
 
 
+void ProfileCommand(uint32_t period) {
+  if(period) {
+    ProfileStart(period);
+    printf("profiling every %u instructions\n", period);
+  } else {
+    ProfileStop();
+    printf("profiling stopped\n");
+  }
+}
+
+
+void ProfileWriteCommand(const char *rest) {
+  char filename[512];
+  if(!ScanFilename(rest, filename))
+    Fail("syntax error\n");
+  else if(ProfileWriteFolded(filename))
+    Fail("can't write file '%s'\n", filename);
+}
+
+
 void RegisterCommand1() {
   for(int i = 0, j = NUM_REGS / 2; i < NUM_REGS && j < NUM_REGS; i++, j++) {
     char buf[64];
@@ -202,47 +587,89 @@ void RegisterCommand1() {
 
 void RegisterCommand2(const char *str1) {
   char buf[64];
-  printf("%s\n", FormatRegisterByName(str1, buf));
+  if(GetRegisterIndex(str1) < 0)
+    Fail("invalid register '%s'\n", str1);
+  else
+    printf("%s\n", FormatRegisterByName(str1, buf));
 }
 
 
 void RegisterCommand3(const char *str1, uint32_t s1) {
   int idx = GetRegisterIndex(str1);
   if(idx < 0) {
-    printf("invalid register '%s'\n", str1);
+    Fail("invalid register '%s'\n", str1);
     return;
   }
-  reg[idx] = s1;
+  MachineWriteReg(machine, idx, s1);
   char buf[64];
   printf("%s\n", FormatRegisterByIndex(idx, buf));
 }
 
 
 void StepCommand(uint32_t s1) {
-  unsigned remaining = CPUStep(s1);
+  unsigned remaining = BreakpointRun(s1);
+  retired += s1 - remaining;
+  UARTFlush();
   if(remaining != 0)
     printf("break\n");
 }
 
 
+void SymbolsCommand(const char *rest) {
+  char filename[512];
+  if(!ScanFilename(rest, filename)) {
+    Fail("syntax error\n");
+    return;
+  }
+  int n = SymbolsLoadELF(filename);
+  if(n < 0)
+    Fail("can't read symbols from '%s'\n", filename);
+  else
+    printf("%d symbols read\n", n);
+}
+
+
+void TimingCommand(bool enable) {
+  if(enable)
+    TimingStart();
+  else
+    TimingStop();
+}
+
+
+void TimingCacheCommand(char which, uint32_t size, uint32_t ways, uint32_t line, const char *policy) {
+  if(TimingConfigureCache(which, size, ways, line, policy))
+    Fail("invalid cache geometry\n");
+}
+
+
+void TimingPredictorCommand(const char *kind, uint32_t indexBits, uint32_t historyBits) {
+  if(TimingConfigurePredictor(kind, indexBits, historyBits))
+    Fail("invalid predictor\n");
+}
+
+
 void UnassembleCommand(uint32_t s1, uint32_t size) {
-  int64_t low = s1 - size * 4;
+  int64_t low = (int64_t)s1 - (int64_t)size * 4;
   if(low < 0)
     low = 0;
-  int64_t high = s1 + size * 4;
+  int64_t high = (int64_t)s1 + (int64_t)size * 4;
   if(high >= MEM_SIZE)
     high = MEM_SIZE - 1;
 
   for(uint32_t a = low; a <= high; a += 4) {
     uint32_t ins = CPURead32(a);
-    char buf[64];
+    char buf[UNASSEMBLE_MAX];
+    const Symbol *sym = SymbolLookup(a);
+    if(sym && sym->addr == a)
+      printf("%s:\n", sym->name);
     printf("%04X:%04X ", a >> 16, a & 0xFFFF);
     printf("%08X", ins);
     if(a == reg[PC])
       printf(" > ");
     else
       printf("   ");
-    if(!Unassemble(ins, buf))
+    if(!Unassemble(a, ins, buf))
       printf("%s\n", buf);
     else
       printf("invalid instruction\n");
@@ -250,14 +677,225 @@ void UnassembleCommand(uint32_t s1, uint32_t size) {
 }
 
 
-void RunMonitor() {
+// Writes all of buf at offset in the file, retrying short writes
+static bool WriteAt(int fd, const void *buf, size_t size, off_t offset) {
+  while(size) {
+    ssize_t n = pwrite(fd, buf, size, offset);
+    if(n <= 0)
+      return false;
+    buf = (const char*)buf + n;
+    size -= n;
+    offset += n;
+  }
+  return true;
+}
+
+
+static bool IsZero(const uint8_t *p, size_t size) {
+  return !size || (!p[0] && !memcmp(p, p + 1, size - 1));
+}
+
+
+// Formats an Intel HEX record
+static char *HexRecord(char *p, uint8_t type, uint16_t addr, const uint8_t *data, int size) {
+  uint8_t sum = size + (addr >> 8) + addr + type;
+  *p++ = ':';
+  p = OutHex(p, size, 2);
+  p = OutHex(p, addr, 4);
+  p = OutHex(p, type, 2);
+  for(int i = 0; i < size; i++) {
+    p = OutHex(p, data[i], 2);
+    sum += data[i];
+  }
+  p = OutHex(p, (uint8_t)-sum, 2);
+  *p++ = '\n';
+  return p;
+}
+
+
+// Formats a Motorola S-record with an address of addrBytes bytes
+static char *SRecord(char *p, char type, uint32_t addr, int addrBytes, const uint8_t *data, int size) {
+  uint8_t sum = addrBytes + size + 1;
+  *p++ = 'S';
+  *p++ = type;
+  p = OutHex(p, sum, 2);
+  p = OutHex(p, addr, 2 * addrBytes);
+  for(int i = 0; i < addrBytes; i++)
+    sum += addr >> (8 * i);
+  for(int i = 0; i < size; i++) {
+    p = OutHex(p, data[i], 2);
+    sum += data[i];
+  }
+  p = OutHex(p, (uint8_t)~sum, 2);
+  *p++ = '\n';
+  return p;
+}
+
+
+// Formats [s1, s1 + size) as 32-byte records, leaving out records of zeros
+// if sparse. The start address is the PC. Returns the length of the text.
+static size_t FormatRecords(char *text, bool srec, uint32_t s1, uint32_t size, bool sparse) {
+  const uint8_t pc[4] = {reg[PC] >> 24, reg[PC] >> 16, reg[PC] >> 8, reg[PC]};
+  char *p = text;
+  uint32_t segment = 0;
+  if(srec)
+    p = SRecord(p, '0', 0, 2, (const uint8_t*)"R64000", 6);
+  for(uint32_t a = s1; a < s1 + size; ) {
+    int n = s1 + size - a < 32 ? s1 + size - a : 32;
+    if(a >> 16 != (a + n - 1) >> 16)
+      n = 0x1'0000 - (a & 0xFFFF);
+    if(!sparse || !IsZero(&mem[a], n)) {
+      if(srec)
+        p = SRecord(p, '3', a, 4, &mem[a], n);
+      else {
+        if(a >> 16 != segment) {
+          segment = a >> 16;
+          const uint8_t upper[2] = {segment >> 8, segment};
+          p = HexRecord(p, 0x04, 0, upper, 2);
+        }
+        p = HexRecord(p, 0x00, a, &mem[a], n);
+      }
+    }
+    a += n;
+  }
+  if(srec)
+    p = SRecord(p, '7', reg[PC], 4, NULL, 0);
+  else {
+    p = HexRecord(p, 0x05, 0, pc, 4);
+    p = HexRecord(p, 0x01, 0, NULL, 0);
+  }
+  return p - text;
+}
+
+
+// Writes a raw image with a single write straight from mem, Intel HEX if the
+// file name ends in .hex or .ihex, or S-records if it ends in .srec, .s19,
+// .s28, .s37 or .mot. A sparse raw image leaves holes for zero pages.
+void WriteCommand(uint32_t s1, uint32_t size, const char *rest) {
+  char filename[512];
+  int n = -1, m = -1;
+  sscanf(rest, " sparse%n %n", &n, &m); // A whole word, not sparse.bin
+  bool sparse = n > 0 && m > n && rest[m];
+  if(!ScanFilename(sparse ? rest + m : rest, filename)) {
+    Fail("syntax error\n");
+    return;
+  }
+  if(s1 >= MEM_SIZE || size > MEM_SIZE - s1) {
+    Fail("out of range\n");
+    return;
+  }
+
+  const char *ext = strrchr(filename, '.');
+  ext = ext ? ext + 1 : "";
+  bool hex  = !strcasecmp(ext, "hex") || !strcasecmp(ext, "ihex");
+  bool srec = !strcasecmp(ext, "srec") || !strcasecmp(ext, "s19") || !strcasecmp(ext, "s28") ||
+              !strcasecmp(ext, "s37") || !strcasecmp(ext, "mot");
+
+  int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if(fd < 0) {
+    Fail("can't open file '%s'\n", filename);
+    return;
+  }
+  bool ok = true;
+  if(hex || srec) {
+    // At most 80 characters per record plus one extended address record
+    // per 64 KiB
+    char *text = malloc(((size_t)size / 32 + size / 0x1'0000 + 8) * 80);
+    ok = text && WriteAt(fd, text, FormatRecords(text, srec, s1, size, sparse), 0);
+    free(text);
+  } else if(sparse) {
+    uint32_t start = 0; // Of the current run of non-zero pages
+    for(uint32_t i = 0; ok && i < size; ) {
+      uint32_t page = 4096 - (i & 4095) < size - i ? 4096 - (i & 4095) : size - i;
+      if(IsZero(&mem[s1 + i], page)) {
+        if(start < i)
+          ok = WriteAt(fd, &mem[s1 + start], i - start, start);
+        start = i + page;
+      }
+      i += page;
+    }
+    if(ok && start < size)
+      ok = WriteAt(fd, &mem[s1 + start], size - start, start);
+    ok = ok && !ftruncate(fd, size);
+  } else
+    ok = WriteAt(fd, &mem[s1], size, 0);
+  if(close(fd) || !ok)
+    Fail("can't write file '%s'\n", filename);
+  else
+    printf("%u bytes written\n", size);
+}
+
+
+void HeatmapCommand(bool enable, unsigned shift) {
+  if(!enable)
+    HeatmapStop();
+  else if(HeatmapStart(shift))
+    Fail("granularity must be 6 to 12 bits\n");
+}
+
+
+// Opens the live view, or saves a PNG if given a file name
+void HeatmapShowCommand(const char *rest) {
+  char filename[512];
+  if(!*rest) {
+    if(HeatmapShow())
+      Fail("can't show the heatmap\n");
+  } else if(!ScanFilename(rest, filename))
+    Fail("syntax error\n");
+  else if(!heat[0])
+    Fail("no heatmap, start one with k +\n");
+  else if(HeatmapWritePNG(filename))
+    Fail("can't write file '%s'\n", filename);
+}
+
+
+void ViewCommand(bool start, uint32_t s1) {
+  if(!start)
+    DebugViewStop();
+  else if(DebugViewStart())
+    Fail("can't open the debug view\n");
+  else if(s1 != UINT32_MAX)
+    DebugViewMemory(s1);
+}
+
+
+void LockstepCommand(uint32_t s1) {
+  if(LockstepStart(true)) {
+    Fail("out of memory\n");
+    return;
+  }
+  bool diverged;
+  unsigned remaining = LockstepRun(s1, &diverged);
+  LockstepStop();
+  if(diverged)
+    status = 1;
+  else if(remaining != 0)
+    printf("break\n");
+}
+
+
+// Reads commands interactively, or from input without a prompt or line
+// editing. Returns the status of the last command other than q.
+int RunMonitor(Machine *m, FILE *input) {
   char *line = NULL;
+  machine = m;
+  MachineBind(machine);
+  script = input;
+  status = 0;
   while(1) {
     free(line);
-    line = linenoise("> ");
+    line = ReadLine("> ");
     if(line == NULL)
       break;
-    linenoiseHistoryAdd(line);
+    if(script) {
+      // Scripts may have blank lines and comments
+      const char *c = line + strspn(line, " \t\r");
+      if(!*c || *c == '#')
+        continue;
+    } else
+      linenoiseHistoryAdd(line);
+    int last = status; // q keeps the status of the command before it
+    status = 0;
 
     [[maybe_unused]] char     str[3][64];
     [[maybe_unused]] int64_t  i64[3];
@@ -266,43 +904,86 @@ void RunMonitor() {
     [[maybe_unused]] uint32_t u32[3];
 
     // ? help
-    // a assemble   s1
-    // b break      s1
+    // a assemble   s1 [file]
+    // b break      [+s1 [count] [if condition] | -s1]
     // c compare    s1 s2 size
     // d dump       s1 size
     // e enter      start
     // f fill       s1 size value
-    // g go         start
+    // g go         [start]
+    // h hunt       s1 size bytes|w value|l value [& mask]|"string"
+    // i statistics [+|-|file]
+    // k heatmap    [+ [granularity bits] | - | file.png]
     // l load       address file
     // m move       s1 s2 size
+    // p profile    [period | file]
     // q quit
     // r register   reg [=value]
     // s step       [instructions]
+    // t timing     [+|-]
+    //   t i|d size ways line lru|plru
+    //   t p bimodal|gshare bits [history]
+    //   t l miss mispredict
     // u unassemble s1 size
-    // w write      range file
+    // v view       [- | s1]
+    // w write      s1 size [sparse] file[.hex|.srec]
+    // x lockstep   instructions
+    // y symbols    file
 
     int scann;
          if(WSCAN(line, "a 0x%X",         &u32[0]))                    AssembleCommand   (u32[0]);
-    else if(WSCAN(line, "b +0x%X",        &u32[0]))                    BreakpointCommand (u32[0], true);
-    else if(WSCAN(line, "b -0x%X",        &u32[0]))                    BreakpointCommand (u32[0], false);
+    else if(PSCAN(line, "a 0x%X",         &u32[0]))                    AssembleFileCommand(u32[0], line + scann);
+    else if(WSCAN(line, "b"))                                          BreakpointReport  (stdout);
+    else if(PSCAN(line, "b +0x%X",        &u32[0]))                    BreakpointCommand (u32[0], true, line + scann);
+    else if(WSCAN(line, "b -0x%X",        &u32[0]))                    BreakpointCommand (u32[0], false, "");
     else if(WSCAN(line, "c 0x%X 0x%X %i", &u32[0], &u32[1], &u32[2]))  CompareCommand    (u32[0], u32[1], u32[2]);
     else if(WSCAN(line, "d 0x%X %i",      &u32[0], &u32[1]))           DumpCommand       (u32[0], u32[1]);
     else if(PSCAN(line, "e 0x%X",         &u32[0]))                    EnterCommand      (u32[0], line);
     else if(WSCAN(line, "f 0x%X %i %i",   &u32[0], &u32[1], &u32[2]))  FillCommand       (u32[0], u32[1], u32[2]);
     else if(WSCAN(line, "g"))                                          GoCommand         (reg[PC]);
     else if(WSCAN(line, "g 0x%X",         &u32[0]))                    GoCommand         (u32[0]);
+    else if(PSCAN(line, "h 0x%X %i",      &u32[0], &u32[1]))           HuntCommand       (u32[0], u32[1], line + scann);
+    else if(WSCAN(line, "i"))                                          StatsReport       (stdout, 20);
+    else if(WSCAN(line, "i +"))                                        StatsCommand      (true);
+    else if(WSCAN(line, "i -"))                                        StatsCommand      (false);
+    else if(PSCAN(line, "i"))                                          StatsWriteCommand (line + scann);
+    else if(WSCAN(line, "k +"))                                        HeatmapCommand    (true, 12);
+    else if(WSCAN(line, "k + %u",         &u32[0]))                    HeatmapCommand    (true, u32[0]);
+    else if(WSCAN(line, "k -"))                                        HeatmapCommand    (false, 0);
+    else if(PSCAN(line, "k"))                                          HeatmapShowCommand(line + scann);
     else if(PSCAN(line, "l 0x%X",         &u32[0]))                    LoadCommand       (u32[0], line + scann);
     else if(WSCAN(line, "m 0x%X 0x%X %i", &u32[0], &u32[1], &u32[1]))  MoveCommand       (u32[0], u32[1], u32[2]);
-    else if(WSCAN(line, "q"))                                          return;
+    else if(WSCAN(line, "p"))                                          ProfileReport     (stdout);
+    else if(WSCAN(line, "p %i",           &u32[0]))                    ProfileCommand    (u32[0]);
+    else if(PSCAN(line, "p"))                                          ProfileWriteCommand(line + scann);
+    else if(WSCAN(line, "q"))                                          { status = last; break; }
     else if(WSCAN(line, "r"))                                          RegisterCommand1  ();
     else if(WSCAN(line, "r %[^ =]",       str[0]))                     RegisterCommand2  (str[0]);
     else if(WSCAN(line, "r %[^ =] = %i",  str[0], &u32[0]))            RegisterCommand3  (str[0], u32[0]);
     else if(WSCAN(line, "s"))                                          StepCommand       (1);
     else if(WSCAN(line, "s %i",           &u32[0]))                    StepCommand       (u32[0]);
+    else if(WSCAN(line, "t"))                                          TimingReport      (stdout);
+    else if(WSCAN(line, "t +"))                                        TimingCommand     (true);
+    else if(WSCAN(line, "t -"))                                        TimingCommand     (false);
+    else if(WSCAN(line, "t i %i %i %i %7s", &u32[0], &u32[1], &u32[2], str[0]))  TimingCacheCommand('i', u32[0], u32[1], u32[2], str[0]);
+    else if(WSCAN(line, "t d %i %i %i %7s", &u32[0], &u32[1], &u32[2], str[0]))  TimingCacheCommand('d', u32[0], u32[1], u32[2], str[0]);
+    else if(WSCAN(line, "t p %7s %u",     str[0], &u32[0]))            TimingPredictorCommand(str[0], u32[0], u32[0]);
+    else if(WSCAN(line, "t p %7s %u %u",  str[0], &u32[0], &u32[1]))   TimingPredictorCommand(str[0], u32[0], u32[1]);
+    else if(WSCAN(line, "t l %u %u",      &u32[0], &u32[1]))           TimingConfigureLatency(u32[0], u32[1]);
     else if(WSCAN(line, "u pc %u",        &u32[0]))                    UnassembleCommand (reg[PC], u32[0]);
     else if(WSCAN(line, "u %i %u",        &u32[0], &u32[1]))           UnassembleCommand (u32[0], u32[1]);
-    else                                                               printf("invalid command\n");
+    else if(WSCAN(line, "v"))                                          ViewCommand       (true, UINT32_MAX);
+    else if(WSCAN(line, "v -"))                                        ViewCommand       (false, 0);
+    else if(WSCAN(line, "v 0x%X",         &u32[0]))                    ViewCommand       (true, u32[0]);
+    else if(PSCAN(line, "w 0x%X %i",      &u32[0], &u32[1]))           WriteCommand      (u32[0], u32[1], line + scann);
+    else if(WSCAN(line, "x %i",           &u32[0]))                    LockstepCommand   (u32[0]);
+    else if(PSCAN(line, "y"))                                          SymbolsCommand    (line + scann);
+    else                                                               Fail("invalid command\n");
     #undef S
+    DebugViewPublish(retired, true);
   }
   free(line);
+  DebugViewStop();
+  HeatmapStop();
+  return status;
 }
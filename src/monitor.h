@@ -1,6 +1,11 @@
 #ifndef MONITOR_H
 #define MONITOR_H
+#include "machine.h"
+#include <stdio.h>
 
-void RunMonitor();
+// Reads commands from input, or the terminal if NULL, working on m
+int RunMonitor(Machine *m, FILE *input);
+
+const char *FormatRegisterByIndex(int idx, char str[64]);
 
 #endif
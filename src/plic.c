@@ -0,0 +1,98 @@
+#include "plic.h"
+#include "CPU.h"
+#include "mmio.h"
+#include <stdint.h>
+#include <string.h>
+
+enum {
+  PRIORITY  = 0x00'0000, // A word per source
+  PENDING   = 0x00'1000,
+  ENABLE    = 0x00'2000,
+  THRESHOLD = 0x20'0000,
+  CLAIM     = 0x20'0004,
+};
+
+static uint32_t priority[PLIC_SOURCES];
+static uint32_t levels, pending, enabled, claimed, threshold;
+
+
+// Returns the highest priority source that is pending, enabled and above
+// the threshold, or 0
+static unsigned Best() {
+  unsigned best = 0;
+  for(uint32_t bits = pending & enabled; bits; bits &= bits - 1) {
+    unsigned source = __builtin_ctz(bits);
+    if(priority[source] > threshold && (!best || priority[source] > priority[best]))
+      best = source;
+  }
+  return best;
+}
+
+
+static void Update() {
+  CPUInterrupt(MIP_MEIP, Best() != 0);
+}
+
+
+// A source becomes pending while its level is high, except between its
+// claim and completion
+void PlicSetLevel(unsigned source, bool level) {
+  uint32_t bit = 1u << source;
+  levels = level ? levels | bit : levels & ~bit;
+  if(level && !(claimed & bit))
+    pending |= bit;
+  Update();
+}
+
+
+static uint32_t Read(uint32_t offset, [[maybe_unused]] unsigned size) {
+  switch(offset) {
+  case PENDING:   return pending;
+  case ENABLE:    return enabled;
+  case THRESHOLD: return threshold;
+  case CLAIM: {
+    unsigned source = Best();
+    pending &= ~(1u << source);
+    claimed |= (1u << source) & ~1u;
+    Update();
+    return source;
+  }
+  }
+  if(offset < 4 * PLIC_SOURCES && !(offset & 3))
+    return priority[offset / 4];
+  return 0;
+}
+
+
+static void Write(uint32_t offset, uint32_t value, [[maybe_unused]] unsigned size) {
+  if(offset < 4 * PLIC_SOURCES && !(offset & 3))
+    priority[offset / 4] = offset ? value & 7 : 0;
+  else if(offset == ENABLE)
+    enabled = value & ~1u;
+  else if(offset == THRESHOLD)
+    threshold = value & 7;
+  else if(offset == CLAIM && value && value < PLIC_SOURCES) {
+    claimed &= ~(1u << value);
+    PlicSetLevel(value, levels >> value & 1);
+    return;
+  }
+  Update();
+}
+
+
+static const MMIODevice device = {
+  "plic", PLIC_BASE, 0x400'0000, Read, Write
+};
+
+
+int PlicStart() {
+  memset(priority, 0, sizeof priority);
+  pending = enabled = claimed = threshold = 0;
+  return MMIOMap(&device);
+}
+
+
+void PlicStop() {
+  CPUInterrupt(MIP_MEIP, false);
+  MMIOUnmap(&device);
+}
@@ -0,0 +1,14 @@
+#ifndef PLIC_H
+#define PLIC_H
+#include <stdbool.h>
+
+// A platform-level interrupt controller with one context, hart 0 in machine
+// mode. Sources are level triggered; source 0 doesn't exist.
+#define PLIC_BASE    0x0C00'0000
+#define PLIC_SOURCES 32
+
+int  PlicStart();
+void PlicStop();
+void PlicSetLevel(unsigned source, bool level);
+
+#endif
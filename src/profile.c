@@ -0,0 +1,273 @@
+#include "profile.h"
+#include "CPU.h"
+#include "symbols.h"
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Sampling profiler. The executor counts profileCountdown down and calls
+// ProfileSample when it reaches zero; calls and returns maintain a shadow
+// stack so each sample can be attributed to a full call chain.
+
+uint32_t profileCountdown;
+
+#define NO_LEAF 0xFFFF'FFFF
+
+static uint32_t period;
+static uint32_t jitter = 0x2545'F491;
+static uint64_t totalSamples;
+
+static uint32_t callTarget[PROFILE_MAX_DEPTH];
+static uint32_t callReturn[PROFILE_MAX_DEPTH];
+static unsigned depth;
+
+typedef struct {
+  uint32_t pc;
+  uint32_t count;
+} PCEntry;
+
+typedef struct {
+  uint64_t hash;
+  uint32_t count;
+  uint32_t leaf;
+  uint32_t depth;
+  uint32_t frames; // index into framePool
+} StackEntry;
+
+static PCEntry    *pcTable;
+static unsigned    pcCap, pcUsed;
+static StackEntry *stackTable;
+static unsigned    stackCap, stackUsed;
+static uint32_t   *framePool;
+static unsigned    frameCap, frameUsed;
+
+
+static uint32_t NextCountdown() {
+  // Jitter the period by up to +-1/8 so loops don't alias with it
+  jitter ^= jitter << 13;
+  jitter ^= jitter >> 17;
+  jitter ^= jitter << 5;
+  uint32_t spread = period / 4;
+  uint32_t n = period - period / 8 + (spread ? jitter % spread : 0);
+  return n ? n : 1;
+}
+
+
+static void ProfileClear() {
+  free(pcTable);
+  free(stackTable);
+  free(framePool);
+  pcTable = NULL;
+  stackTable = NULL;
+  framePool = NULL;
+  pcCap = pcUsed = stackCap = stackUsed = frameCap = frameUsed = 0;
+  totalSamples = 0;
+  depth = 0;
+}
+
+
+void ProfileStart(uint32_t p) {
+  ProfileClear();
+  period = p;
+  profileCountdown = NextCountdown();
+  cpuHooks |= CPU_HOOK_PROFILE;
+}
+
+
+void ProfileStop() {
+  cpuHooks &= ~CPU_HOOK_PROFILE;
+}
+
+
+void ProfileCall(uint32_t target, uint32_t ret) {
+  if(depth < PROFILE_MAX_DEPTH) {
+    callTarget[depth] = target;
+    callReturn[depth] = ret;
+  }
+  depth++;
+}
+
+
+void ProfileReturn(uint32_t target) {
+  if(depth == 0)
+    return;
+  if(depth > PROFILE_MAX_DEPTH) {
+    depth--;
+    return;
+  }
+  // Unwind to the matching frame; ignore returns that match nothing
+  // (longjmp-style control flow or a stack the profiler joined midway)
+  for(unsigned d = depth; d > 0; d--) {
+    if(callReturn[d - 1] == target) {
+      depth = d - 1;
+      return;
+    }
+  }
+}
+
+
+static void CountPC(uint32_t pc) {
+  if(pcUsed * 2 >= pcCap) {
+    PCEntry *old = pcTable;
+    unsigned oldCap = pcCap;
+    pcCap = pcCap ? pcCap * 2 : 1024;
+    pcTable = calloc(pcCap, sizeof *pcTable);
+    for(unsigned i = 0; i < oldCap; i++) {
+      if(!old[i].count)
+        continue;
+      unsigned h = (old[i].pc >> 2) * 0x9E37'79B1u & (pcCap - 1);
+      while(pcTable[h].count)
+        h = (h + 1) & (pcCap - 1);
+      pcTable[h] = old[i];
+    }
+    free(old);
+  }
+  unsigned h = (pc >> 2) * 0x9E37'79B1u & (pcCap - 1);
+  while(pcTable[h].count && pcTable[h].pc != pc)
+    h = (h + 1) & (pcCap - 1);
+  if(!pcTable[h].count) {
+    pcTable[h].pc = pc;
+    pcUsed++;
+  }
+  pcTable[h].count++;
+}
+
+
+static bool SameStack(const StackEntry *e, uint64_t hash, uint32_t leaf, unsigned n) {
+  return e->hash == hash && e->leaf == leaf && e->depth == n &&
+    !memcmp(&framePool[e->frames], callTarget, n * sizeof *callTarget);
+}
+
+
+static void CountStack(uint32_t leaf) {
+  unsigned n = depth < PROFILE_MAX_DEPTH ? depth : PROFILE_MAX_DEPTH;
+  uint64_t hash = 0xCBF2'9CE4'8422'2325u ^ leaf;
+  for(unsigned i = 0; i < n; i++)
+    hash = (hash ^ callTarget[i]) * 0x0000'0100'0000'01B3u;
+
+  if(stackUsed * 2 >= stackCap) {
+    StackEntry *old = stackTable;
+    unsigned oldCap = stackCap;
+    stackCap = stackCap ? stackCap * 2 : 256;
+    stackTable = calloc(stackCap, sizeof *stackTable);
+    for(unsigned i = 0; i < oldCap; i++) {
+      if(!old[i].count)
+        continue;
+      unsigned h = old[i].hash & (stackCap - 1);
+      while(stackTable[h].count)
+        h = (h + 1) & (stackCap - 1);
+      stackTable[h] = old[i];
+    }
+    free(old);
+  }
+
+  unsigned h = hash & (stackCap - 1);
+  while(stackTable[h].count && !SameStack(&stackTable[h], hash, leaf, n))
+    h = (h + 1) & (stackCap - 1);
+  StackEntry *e = &stackTable[h];
+  if(!e->count) {
+    if(frameUsed + n > frameCap) {
+      frameCap = (frameUsed + n) * 2;
+      framePool = realloc(framePool, frameCap * sizeof *framePool);
+    }
+    memcpy(&framePool[frameUsed], callTarget, n * sizeof *callTarget);
+    *e = (StackEntry){ hash, 0, leaf, n, frameUsed };
+    frameUsed += n;
+    stackUsed++;
+  }
+  e->count++;
+}
+
+
+void ProfileSample(uint32_t pc) {
+  profileCountdown = NextCountdown();
+  totalSamples++;
+  CountPC(pc);
+
+  // Attribute the sample to the enclosing symbol if there is one, otherwise
+  // to the function the shadow stack says we are in.
+  const Symbol *s = SymbolLookup(pc);
+  unsigned n = depth < PROFILE_MAX_DEPTH ? depth : PROFILE_MAX_DEPTH;
+  CountStack(s ? s->addr : n ? callTarget[n - 1] : NO_LEAF);
+}
+
+
+typedef struct {
+  uint32_t addr;
+  uint64_t count;
+} FlatEntry;
+
+
+static int CompareFlatAddr(const void *a, const void *b) {
+  const FlatEntry *fa = a, *fb = b;
+  return (fa->addr > fb->addr) - (fa->addr < fb->addr);
+}
+
+
+static int CompareFlatCount(const void *a, const void *b) {
+  const FlatEntry *fa = a, *fb = b;
+  return (fa->count < fb->count) - (fa->count > fb->count);
+}
+
+
+void ProfileReport(FILE *f) {
+  if(!totalSamples) {
+    fprintf(f, "no samples\n");
+    return;
+  }
+
+  // Group PCs by enclosing symbol; unsymbolized PCs stand alone
+  FlatEntry *flat = malloc(pcUsed * sizeof *flat);
+  unsigned n = 0;
+  for(unsigned i = 0; i < pcCap; i++) {
+    if(!pcTable[i].count)
+      continue;
+    const Symbol *s = SymbolLookup(pcTable[i].pc);
+    flat[n++] = (FlatEntry){ s ? s->addr : pcTable[i].pc, pcTable[i].count };
+  }
+  qsort(flat, n, sizeof *flat, CompareFlatAddr);
+  unsigned m = 0;
+  for(unsigned i = 0; i < n; i++) {
+    if(m && flat[m - 1].addr == flat[i].addr)
+      flat[m - 1].count += flat[i].count;
+    else
+      flat[m++] = flat[i];
+  }
+  qsort(flat, m, sizeof *flat, CompareFlatCount);
+
+  fprintf(f, "%" PRIu64 " samples, period %u\n", totalSamples, period);
+  fprintf(f, "  self%%  cumul%%    samples  function\n");
+  uint64_t cumulative = 0;
+  for(unsigned i = 0; i < m; i++) {
+    char name[64];
+    cumulative += flat[i].count;
+    fprintf(f, "%6.2f%% %6.2f%% %10" PRIu64 "  %s\n",
+        100.0 * flat[i].count / totalSamples,
+        100.0 * cumulative / totalSamples,
+        flat[i].count, FormatSymbol(flat[i].addr, name));
+  }
+  free(flat);
+}
+
+
+int ProfileWriteFolded(const char *filename) {
+  FILE *f = fopen(filename, "w");
+  if(!f)
+    return -1;
+  for(unsigned i = 0; i < stackCap; i++) {
+    const StackEntry *e = &stackTable[i];
+    if(!e->count)
+      continue;
+    char name[64];
+    const uint32_t *frames = &framePool[e->frames];
+    fprintf(f, "[root]");
+    for(unsigned d = 0; d < e->depth; d++)
+      fprintf(f, ";%s", FormatSymbol(frames[d], name));
+    if(e->leaf != NO_LEAF && (!e->depth || frames[e->depth - 1] != e->leaf))
+      fprintf(f, ";%s", FormatSymbol(e->leaf, name));
+    fprintf(f, " %u\n", e->count);
+  }
+  fclose(f);
+  return 0;
+}
@@ -0,0 +1,19 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+#include <stdint.h>
+#include <stdio.h>
+
+#define PROFILE_MAX_DEPTH 128
+
+extern uint32_t profileCountdown;
+
+void ProfileStart(uint32_t period);
+void ProfileStop();
+void ProfileSample(uint32_t pc);
+void ProfileCall(uint32_t target, uint32_t ret);
+void ProfileReturn(uint32_t target);
+
+void ProfileReport(FILE *f);
+int  ProfileWriteFolded(const char *filename);
+
+#endif
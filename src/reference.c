@@ -0,0 +1,171 @@
+#include "reference.h"
+
+static uint32_t Load(RefHart *h, uint32_t addr, unsigned size) {
+  uint32_t v = 0;
+  if(addr >= MEM_SIZE || MEM_SIZE - addr < size)
+    return 0;
+  for(unsigned i = 0; i < size; i++)
+    v |= (uint32_t)h->mem[addr + i] << (8 * i);
+  return v;
+}
+
+
+static void Store(RefHart *h, uint32_t addr, unsigned size, uint32_t value) {
+  if(addr >= MEM_SIZE || MEM_SIZE - addr < size)
+    return;
+  value &= 0xFFFF'FFFFu >> (32 - 8 * size);
+  if(h->writes && h->numWrites < h->maxWrites)
+    h->writes[h->numWrites++] = (MemWrite){ addr, size, Load(h, addr, size), value };
+  for(unsigned i = 0; i < size; i++)
+    h->mem[addr + i] = value >> (8 * i);
+}
+
+
+static uint32_t SignExtend(uint32_t v, unsigned bits) {
+  uint32_t m = 1u << (bits - 1);
+  return (v ^ m) - m;
+}
+
+
+// Executes one instruction. Returns false, leaving the state untouched, if
+// the instruction is not a valid RV32I encoding the executor implements, or
+// is a jump or taken branch to a misaligned target, which traps.
+bool RefStep(RefHart *h) {
+  uint32_t pc = h->reg[PC];
+  if(pc & 3 || pc >= MEM_SIZE)
+    return false;
+
+  uint32_t ins    = Load(h, pc, 4);
+  uint32_t opcode = ins & 0x7F;
+  uint32_t rd     = (ins >> 7) & 0x1F;
+  uint32_t funct3 = (ins >> 12) & 0x7;
+  uint32_t rs1    = (ins >> 15) & 0x1F;
+  uint32_t rs2    = (ins >> 20) & 0x1F;
+  uint32_t funct7 = ins >> 25;
+  uint32_t a      = h->reg[rs1];
+  uint32_t b      = h->reg[rs2];
+
+  uint32_t immI = SignExtend(ins >> 20, 12);
+  uint32_t immS = SignExtend((ins >> 25) << 5 | ((ins >> 7) & 0x1F), 12);
+  uint32_t immB = SignExtend((ins >> 31) << 12 | ((ins >> 7) & 1) << 11 |
+                             ((ins >> 25) & 0x3F) << 5 | ((ins >> 8) & 0xF) << 1, 13);
+  uint32_t immU = ins & 0xFFFF'F000;
+  uint32_t immJ = SignExtend((ins >> 31) << 20 | ((ins >> 12) & 0xFF) << 12 |
+                             ((ins >> 20) & 1) << 11 | ((ins >> 21) & 0x3FF) << 1, 21);
+
+  uint32_t next = pc + 4;
+  uint32_t result = 0;
+  bool writesRd = true;
+
+  switch(opcode) {
+  case 0x37: // lui
+    result = immU;
+    break;
+  case 0x17: // auipc
+    result = pc + immU;
+    break;
+  case 0x6F: // jal
+    result = pc + 4;
+    next = pc + immJ;
+    break;
+  case 0x67: // jalr
+    if(funct3 != 0)
+      return false;
+    result = pc + 4;
+    next = (a + immI) & ~1u;
+    break;
+  case 0x63: { // branches
+    bool taken;
+    switch(funct3) {
+    case 0: taken = a == b;                   break;
+    case 1: taken = a != b;                   break;
+    case 4: taken = (int32_t)a <  (int32_t)b; break;
+    case 5: taken = (int32_t)a >= (int32_t)b; break;
+    case 6: taken = a <  b;                   break;
+    case 7: taken = a >= b;                   break;
+    default: return false;
+    }
+    if(taken)
+      next = pc + immB;
+    writesRd = false;
+  } break;
+  case 0x03: { // loads
+    uint32_t addr = a + immI;
+    switch(funct3) {
+    case 0: result = SignExtend(Load(h, addr, 1), 8);  break;
+    case 1: result = SignExtend(Load(h, addr, 2), 16); break;
+    case 2: result = Load(h, addr, 4);                 break;
+    case 4: result = Load(h, addr, 1);                 break;
+    case 5: result = Load(h, addr, 2);                 break;
+    default: return false;
+    }
+  } break;
+  case 0x23: // stores
+    if(funct3 > 2)
+      return false;
+    Store(h, a + immS, 1u << funct3, b);
+    writesRd = false;
+    break;
+  case 0x13: { // register-immediate
+    uint32_t shamt = rs2;
+    switch(funct3) {
+    case 0: result = a + immI;                       break;
+    case 2: result = (int32_t)a < (int32_t)immI;     break;
+    case 3: result = a < immI;                       break;
+    case 4: result = a ^ immI;                       break;
+    case 6: result = a | immI;                       break;
+    case 7: result = a & immI;                       break;
+    case 1:
+      if(funct7 != 0)
+        return false;
+      result = a << shamt;
+      break;
+    case 5:
+      if(funct7 == 0x00)
+        result = a >> shamt;
+      else if(funct7 == 0x20)
+        result = (int32_t)a >> shamt;
+      else
+        return false;
+      break;
+    }
+  } break;
+  case 0x33: // register-register
+    switch(funct7 << 3 | funct3) {
+    case 0x000: result = a + b;                          break;
+    case 0x100: result = a - b;                          break;
+    case 0x001: result = a << (b & 0x1F);                break;
+    case 0x002: result = (int32_t)a < (int32_t)b;        break;
+    case 0x003: result = a < b;                          break;
+    case 0x004: result = a ^ b;                          break;
+    case 0x005: result = a >> (b & 0x1F);                break;
+    case 0x105: result = (int32_t)a >> (b & 0x1F);       break;
+    case 0x006: result = a | b;                          break;
+    case 0x007: result = a & b;                          break;
+    default: return false;
+    }
+    break;
+  case 0x0F: // fence and fence.i, which have nothing to order or flush
+    if(funct3 == 0 ? ins >> 28 || rd || rs1 : ins != 0x0000'100F)
+      return false;
+    writesRd = false;
+    break;
+  default:
+    return false;
+  }
+
+  if(next & 3)
+    return false;
+  if(writesRd && rd != 0)
+    h->reg[rd] = result;
+  h->reg[PC] = next;
+  return true;
+}
+
+
+unsigned RefRun(RefHart *h, unsigned cycles) {
+  for(; cycles; cycles--)
+    if(!RefStep(h))
+      break;
+  return cycles;
+}
@@ -0,0 +1,27 @@
+#ifndef REFERENCE_H
+#define REFERENCE_H
+#include "CPU.h"
+
+// A deliberately plain RV32I interpreter written directly from the spec,
+// operating on its own state. It is the oracle the executor is checked
+// against, so it favours obviousness over speed.
+
+typedef struct {
+  uint32_t addr;
+  uint32_t size;
+  uint32_t old;
+  uint32_t value;
+} MemWrite;
+
+typedef struct {
+  uint32_t  reg[NUM_REGS];
+  uint8_t  *mem;        // MEM_SIZE bytes
+  MemWrite *writes;     // Optional log of stores
+  unsigned  numWrites;
+  unsigned  maxWrites;
+} RefHart;
+
+bool     RefStep(RefHart *h);
+unsigned RefRun(RefHart *h, unsigned cycles);
+
+#endif
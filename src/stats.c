@@ -0,0 +1,189 @@
+#include "stats.h"
+#include "CPU.h"
+#include "symbols.h"
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+Stats stats;
+
+const char *stat_names[NUM_STAT_CLASSES] = {
+  "alu", "load", "store", "branch_taken", "branch_not_taken", "jump"
+};
+
+typedef struct {
+  uint32_t pc;
+  uint64_t executions;
+  uint64_t instructions;
+} BlockEntry;
+
+static BlockEntry *blocks;
+static unsigned    blockCap, blockUsed;
+static int         currentBlock = -1;
+static uint64_t    blockStart;
+
+
+static unsigned FindBlock(uint32_t pc) {
+  unsigned h = (pc >> 2) * 0x9E37'79B1u & (blockCap - 1);
+  while(blocks[h].executions && blocks[h].pc != pc)
+    h = (h + 1) & (blockCap - 1);
+  return h;
+}
+
+
+static void GrowBlocks() {
+  BlockEntry *old = blocks;
+  unsigned oldCap = blockCap;
+  blockCap = blockCap ? blockCap * 2 : 1024;
+  blocks = calloc(blockCap, sizeof *blocks);
+  for(unsigned i = 0; i < oldCap; i++)
+    if(old[i].executions)
+      blocks[FindBlock(old[i].pc)] = old[i];
+  if(currentBlock >= 0)
+    currentBlock = FindBlock(old[currentBlock].pc);
+  free(old);
+}
+
+
+void StatsStart() {
+  free(blocks);
+  blocks = NULL;
+  blockCap = blockUsed = 0;
+  currentBlock = -1;
+  memset(&stats, 0, sizeof stats);
+  stats.blockEnd = true;
+  cpuHooks |= CPU_HOOK_STATS;
+}
+
+
+void StatsStop() {
+  cpuHooks &= ~CPU_HOOK_STATS;
+  // Close the block we were in so its instructions are accounted for
+  if(currentBlock >= 0)
+    blocks[currentBlock].instructions += stats.instructions - blockStart;
+  currentBlock = -1;
+  stats.blockEnd = true;
+}
+
+
+void StatsBlock(uint32_t pc) {
+  stats.blockEnd = false;
+  if(currentBlock >= 0)
+    blocks[currentBlock].instructions += stats.instructions - blockStart;
+  if(blockUsed * 2 >= blockCap)
+    GrowBlocks();
+  unsigned h = FindBlock(pc);
+  if(!blocks[h].executions) {
+    blocks[h].pc = pc;
+    blockUsed++;
+  }
+  blocks[h].executions++;
+  currentBlock = h;
+  blockStart = stats.instructions;
+}
+
+
+static int CompareBlocks(const void *a, const void *b) {
+  const BlockEntry *ba = a, *bb = b;
+  if(ba->instructions != bb->instructions)
+    return ba->instructions < bb->instructions ? 1 : -1;
+  return (ba->pc > bb->pc) - (ba->pc < bb->pc);
+}
+
+
+// Returns the blocks sorted hottest first; caller frees
+static BlockEntry *SortedBlocks() {
+  // Account for the block in progress without closing it
+  uint64_t pending = currentBlock >= 0 ? stats.instructions - blockStart : 0;
+  BlockEntry *sorted = malloc((blockUsed + 1) * sizeof *sorted);
+  unsigned n = 0;
+  for(unsigned i = 0; i < blockCap; i++) {
+    if(!blocks[i].executions)
+      continue;
+    sorted[n] = blocks[i];
+    if((int)i == currentBlock)
+      sorted[n].instructions += pending;
+    n++;
+  }
+  qsort(sorted, n, sizeof *sorted, CompareBlocks);
+  return sorted;
+}
+
+
+void StatsReport(FILE *f, unsigned maxBlocks) {
+  fprintf(f, "%" PRIu64 " instructions\n", stats.instructions);
+  for(int i = 0; i < NUM_STAT_CLASSES; i++)
+    fprintf(f, "  %-16s %12" PRIu64 " %6.2f%%\n", stat_names[i], stats.retired[i],
+        stats.instructions ? 100.0 * stats.retired[i] / stats.instructions : 0.0);
+  fprintf(f, "  %-16s %12" PRIu64 "\n", "bytes_read", stats.bytesRead);
+  fprintf(f, "  %-16s %12" PRIu64 "\n", "bytes_written", stats.bytesWritten);
+
+  BlockEntry *sorted = SortedBlocks();
+  unsigned n = blockUsed < maxBlocks ? blockUsed : maxBlocks;
+  fprintf(f, "%u blocks\n", blockUsed);
+  if(n)
+    fprintf(f, "  block       executions instructions  symbol\n");
+  for(unsigned i = 0; i < n; i++) {
+    char sym[64];
+    fprintf(f, "  %04X:%04X %12" PRIu64 " %12" PRIu64 "  %s\n",
+        sorted[i].pc >> 16, sorted[i].pc & 0xFFFF,
+        sorted[i].executions, sorted[i].instructions,
+        FormatSymbol(sorted[i].pc, sym));
+  }
+  free(sorted);
+}
+
+
+static void WriteCSV(FILE *f, const BlockEntry *sorted) {
+  fprintf(f, "type,name,symbol,count,instructions\n");
+  fprintf(f, "total,instructions,,%" PRIu64 ",\n", stats.instructions);
+  for(int i = 0; i < NUM_STAT_CLASSES; i++)
+    fprintf(f, "class,%s,,%" PRIu64 ",\n", stat_names[i], stats.retired[i]);
+  fprintf(f, "bytes,read,,%" PRIu64 ",\n", stats.bytesRead);
+  fprintf(f, "bytes,written,,%" PRIu64 ",\n", stats.bytesWritten);
+  for(unsigned i = 0; i < blockUsed; i++) {
+    char sym[64];
+    // Quoted, with quotes doubled, as a name may hold commas
+    fprintf(f, "block,0x%08X,\"", sorted[i].pc);
+    if(SymbolLookup(sorted[i].pc))
+      for(const char *c = FormatSymbol(sorted[i].pc, sym); *c; c++)
+        fprintf(f, *c == '"' ? "\"%c" : "%c", *c);
+    fprintf(f, "\",%" PRIu64 ",%" PRIu64 "\n", sorted[i].executions, sorted[i].instructions);
+  }
+}
+
+
+static void WriteJSON(FILE *f, const BlockEntry *sorted) {
+  fprintf(f, "{\n  \"instructions\": %" PRIu64 ",\n  \"classes\": {", stats.instructions);
+  for(int i = 0; i < NUM_STAT_CLASSES; i++)
+    fprintf(f, "%s\n    \"%s\": %" PRIu64, i ? "," : "", stat_names[i], stats.retired[i]);
+  fprintf(f, "\n  },\n  \"bytes_read\": %" PRIu64 ",\n  \"bytes_written\": %" PRIu64 ",\n",
+      stats.bytesRead, stats.bytesWritten);
+  fprintf(f, "  \"blocks\": [");
+  for(unsigned i = 0; i < blockUsed; i++) {
+    char sym[64];
+    // Symbol names come from ELF string tables; escape what JSON needs
+    fprintf(f, "%s\n    {\"pc\": %u, \"symbol\": \"", i ? "," : "", sorted[i].pc);
+    if(SymbolLookup(sorted[i].pc))
+      for(const char *c = FormatSymbol(sorted[i].pc, sym); *c; c++)
+        fprintf(f, *c == '"' || *c == '\\' ? "\\%c" : "%c", *c);
+    fprintf(f, "\", \"executions\": %" PRIu64 ", \"instructions\": %" PRIu64 "}",
+        sorted[i].executions, sorted[i].instructions);
+  }
+  fprintf(f, "\n  ]\n}\n");
+}
+
+
+int StatsWrite(const char *filename) {
+  FILE *f = fopen(filename, "w");
+  if(!f)
+    return -1;
+  BlockEntry *sorted = SortedBlocks();
+  const char *ext = strrchr(filename, '.');
+  if(ext && !strcmp(ext, ".json"))
+    WriteJSON(f, sorted);
+  else
+    WriteCSV(f, sorted);
+  free(sorted);
+  return fclose(f);
+}
@@ -0,0 +1,37 @@
+#ifndef STATS_H
+#define STATS_H
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+enum {
+  STAT_ALU,
+  STAT_LOAD,
+  STAT_STORE,
+  STAT_BRANCH_TAKEN,
+  STAT_BRANCH_NOT_TAKEN,
+  STAT_JUMP,
+  NUM_STAT_CLASSES
+};
+
+// Execution counters, updated by the instrumented executor while
+// CPU_HOOK_STATS is set. There is one hart, so there is one set.
+typedef struct {
+  uint64_t instructions;
+  uint64_t retired[NUM_STAT_CLASSES];
+  uint64_t bytesRead;
+  uint64_t bytesWritten;
+  bool     blockEnd;     // Last instruction transferred control
+} Stats;
+
+extern Stats stats;
+extern const char *stat_names[NUM_STAT_CLASSES];
+
+void StatsStart();
+void StatsStop();
+void StatsBlock(uint32_t pc);
+
+void StatsReport(FILE *f, unsigned maxBlocks);
+int  StatsWrite(const char *filename);
+
+#endif
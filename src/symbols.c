@@ -0,0 +1,149 @@
+#include "symbols.h"
+#include <elf.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static Symbol  *symbols;
+static unsigned numSymbols;
+static unsigned capSymbols;
+static bool     sorted = true;
+
+
+void SymbolsClear() {
+  for(unsigned i = 0; i < numSymbols; i++)
+    free(symbols[i].name);
+  free(symbols);
+  symbols = NULL;
+  numSymbols = capSymbols = 0;
+  sorted = true;
+}
+
+
+void SymbolAdd(const char *name, uint32_t addr, uint32_t size) {
+  if(numSymbols == capSymbols) {
+    capSymbols = capSymbols ? capSymbols * 2 : 256;
+    symbols = realloc(symbols, capSymbols * sizeof *symbols);
+  }
+  symbols[numSymbols++] = (Symbol){ addr, size, strdup(name) };
+  sorted = false;
+}
+
+
+static int CompareSymbols(const void *a, const void *b) {
+  const Symbol *sa = a, *sb = b;
+  if(sa->addr != sb->addr)
+    return sa->addr < sb->addr ? -1 : 1;
+  // Prefer sized symbols (functions) over labels at the same address
+  return (sa->size != 0) - (sb->size != 0);
+}
+
+
+const Symbol *SymbolLookup(uint32_t addr) {
+  if(!sorted) {
+    qsort(symbols, numSymbols, sizeof *symbols, CompareSymbols);
+    sorted = true;
+  }
+  // Last symbol with sym.addr <= addr
+  unsigned lo = 0, hi = numSymbols;
+  while(lo < hi) {
+    unsigned mid = lo + (hi - lo) / 2;
+    if(symbols[mid].addr <= addr)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if(lo == 0)
+    return NULL;
+  const Symbol *s = &symbols[lo - 1];
+  if(s->size && addr - s->addr >= s->size)
+    return NULL;
+  return s;
+}
+
+
+const Symbol *SymbolFind(const char *name) {
+  for(unsigned i = 0; i < numSymbols; i++)
+    if(!strcmp(symbols[i].name, name))
+      return &symbols[i];
+  return NULL;
+}
+
+
+const char *FormatSymbol(uint32_t addr, char str[64]) {
+  const Symbol *s = SymbolLookup(addr);
+  if(!s)
+    snprintf(str, 64, "0x%08X", addr);
+  else if(addr == s->addr)
+    snprintf(str, 64, "%.63s", s->name);
+  else
+    snprintf(str, 64, "%.50s+0x%X", s->name, addr - s->addr);
+  return str;
+}
+
+
+int SymbolsLoadELF(const char *filename) {
+  int result = -1;
+  FILE *f = fopen(filename, "rb");
+  Elf32_Shdr *sh = NULL;
+  Elf32_Sym *syms = NULL;
+  char *strtab = NULL;
+
+  if(!f)
+    goto done;
+
+  Elf32_Ehdr eh;
+  if(fread(&eh, sizeof eh, 1, f) != 1 ||
+     memcmp(eh.e_ident, ELFMAG, SELFMAG) ||
+     eh.e_ident[EI_CLASS] != ELFCLASS32 ||
+     eh.e_ident[EI_DATA] != ELFDATA2LSB ||
+     eh.e_shentsize != sizeof(Elf32_Shdr))
+    goto done;
+
+  sh = calloc(eh.e_shnum, sizeof *sh);
+  if(fseek(f, eh.e_shoff, SEEK_SET) ||
+     fread(sh, sizeof *sh, eh.e_shnum, f) != eh.e_shnum)
+    goto done;
+
+  result = 0;
+  for(unsigned i = 0; i < eh.e_shnum; i++) {
+    if(sh[i].sh_type != SHT_SYMTAB || sh[i].sh_link >= eh.e_shnum)
+      continue;
+    const Elf32_Shdr *str = &sh[sh[i].sh_link];
+    unsigned count = sh[i].sh_size / sizeof(Elf32_Sym);
+
+    syms = realloc(syms, sh[i].sh_size);
+    strtab = realloc(strtab, str->sh_size + 1);
+    if(fseek(f, sh[i].sh_offset, SEEK_SET) ||
+       fread(syms, sizeof *syms, count, f) != count ||
+       fseek(f, str->sh_offset, SEEK_SET) ||
+       fread(strtab, 1, str->sh_size, f) != str->sh_size) {
+      result = -1;
+      goto done;
+    }
+    strtab[str->sh_size] = 0;
+
+    for(unsigned j = 0; j < count; j++) {
+      int type = ELF32_ST_TYPE(syms[j].st_info);
+      if(type != STT_FUNC && type != STT_OBJECT && type != STT_NOTYPE)
+        continue;
+      if(syms[j].st_shndx == SHN_UNDEF || syms[j].st_name >= str->sh_size)
+        continue;
+      const char *name = &strtab[syms[j].st_name];
+      // Skip empty names and local assembler labels
+      if(!*name || (name[0] == '.' && name[1] == 'L') || !strncmp(name, "$x", 2))
+        continue;
+      SymbolAdd(name, syms[j].st_value, syms[j].st_size);
+      result++;
+    }
+  }
+
+done:
+  free(strtab);
+  free(syms);
+  free(sh);
+  if(f)
+    fclose(f);
+  return result;
+}
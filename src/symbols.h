@@ -0,0 +1,18 @@
+#ifndef SYMBOLS_H
+#define SYMBOLS_H
+#include <stdint.h>
+
+typedef struct {
+  uint32_t addr;
+  uint32_t size;
+  char    *name;
+} Symbol;
+
+void SymbolsClear();
+int  SymbolsLoadELF(const char *filename);
+void SymbolAdd(const char *name, uint32_t addr, uint32_t size);
+const Symbol *SymbolLookup(uint32_t addr);
+const Symbol *SymbolFind(const char *name);
+const char *FormatSymbol(uint32_t addr, char str[64]);
+
+#endif
@@ -0,0 +1,242 @@
+#include "timing.h"
+#include "CPU.h"
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+  const char *name;
+  unsigned size, ways, lineSize, policy;
+  unsigned sets, lineShift;
+  uint32_t *tags;   // sets * ways line addresses, VALID if filled
+  uint64_t *stamp;  // LRU: last use of each way
+  uint32_t *tree;   // PLRU: ways - 1 tree bits per set
+  uint64_t  clock;
+  uint64_t  accesses, misses;
+} Cache;
+
+typedef struct {
+  unsigned kind, indexBits, historyBits;
+  uint8_t *counters;
+  uint32_t history;
+  uint64_t branches, mispredicts;
+} Predictor;
+
+#define VALID 1
+
+static Cache icache = { "L1I", 16384, 4, 64, CACHE_LRU };
+static Cache dcache = { "L1D", 16384, 4, 64, CACHE_LRU };
+static Predictor predictor = { PREDICT_GSHARE, 12, 12 };
+static unsigned missPenalty = 20, mispredictPenalty = 3;
+static uint64_t instructions;
+
+
+static bool IsPow2(unsigned x) {
+  return x && !(x & (x - 1));
+}
+
+
+static unsigned Log2(unsigned x) {
+  unsigned n = 0;
+  while(x >>= 1)
+    n++;
+  return n;
+}
+
+
+int TimingConfigureCache(char which, unsigned size, unsigned ways, unsigned lineSize, const char *policy) {
+  Cache *c = which == 'i' ? &icache : which == 'd' ? &dcache : NULL;
+  if(!c)
+    return -1;
+  unsigned p;
+  if(!strcmp(policy, "lru"))
+    p = CACHE_LRU;
+  else if(!strcmp(policy, "plru"))
+    p = CACHE_PLRU;
+  else
+    return -1;
+  if(!IsPow2(size) || !IsPow2(ways) || !IsPow2(lineSize) ||
+     lineSize < 4 || ways > 32 || size < ways * lineSize)
+    return -1;
+  c->size = size;
+  c->ways = ways;
+  c->lineSize = lineSize;
+  c->policy = p;
+  return 0;
+}
+
+
+int TimingConfigurePredictor(const char *kind, unsigned indexBits, unsigned historyBits) {
+  unsigned k;
+  if(!strcmp(kind, "bimodal"))
+    k = PREDICT_BIMODAL;
+  else if(!strcmp(kind, "gshare"))
+    k = PREDICT_GSHARE;
+  else
+    return -1;
+  if(indexBits < 1 || indexBits > 24 || historyBits > indexBits)
+    return -1;
+  predictor.kind = k;
+  predictor.indexBits = indexBits;
+  predictor.historyBits = k == PREDICT_GSHARE ? historyBits : 0;
+  return 0;
+}
+
+
+void TimingConfigureLatency(unsigned miss, unsigned mispredict) {
+  missPenalty = miss;
+  mispredictPenalty = mispredict;
+}
+
+
+static void CacheInit(Cache *c) {
+  free(c->tags);
+  free(c->stamp);
+  free(c->tree);
+  c->sets = c->size / (c->ways * c->lineSize);
+  c->lineShift = Log2(c->lineSize);
+  c->tags  = calloc(c->sets * c->ways, sizeof *c->tags);
+  c->stamp = calloc(c->sets * c->ways, sizeof *c->stamp);
+  c->tree  = calloc(c->sets, sizeof *c->tree);
+  c->clock = 0;
+  c->accesses = c->misses = 0;
+}
+
+
+static void PLRUTouch(uint32_t *tree, unsigned ways, unsigned way) {
+  // Point every node on the path away from the way just used
+  for(unsigned node = 0, level = ways >> 1; level; level >>= 1) {
+    unsigned bit = (way & level) != 0;
+    if(bit)
+      *tree &= ~(1u << node);
+    else
+      *tree |= 1u << node;
+    node = 2 * node + 1 + bit;
+  }
+}
+
+
+static unsigned PLRUVictim(uint32_t tree, unsigned ways) {
+  unsigned way = 0;
+  for(unsigned node = 0, level = ways >> 1; level; level >>= 1) {
+    unsigned bit = (tree >> node) & 1;
+    way = way << 1 | bit;
+    node = 2 * node + 1 + bit;
+  }
+  return way;
+}
+
+
+static void CacheAccess(Cache *c, uint32_t addr) {
+  uint32_t line = (addr >> c->lineShift) << 1 | VALID;
+  unsigned set = (addr >> c->lineShift) & (c->sets - 1);
+  uint32_t *tags = &c->tags[set * c->ways];
+  uint64_t *stamp = &c->stamp[set * c->ways];
+  unsigned way;
+
+  c->accesses++;
+  c->clock++;
+  for(way = 0; way < c->ways; way++)
+    if(tags[way] == line)
+      goto hit;
+
+  c->misses++;
+  for(way = 0; way < c->ways; way++)
+    if(!(tags[way] & VALID))
+      goto fill;
+  if(c->policy == CACHE_PLRU)
+    way = PLRUVictim(c->tree[set], c->ways);
+  else {
+    way = 0;
+    for(unsigned w = 1; w < c->ways; w++)
+      if(stamp[w] < stamp[way])
+        way = w;
+  }
+fill:
+  tags[way] = line;
+hit:
+  if(c->policy == CACHE_PLRU)
+    PLRUTouch(&c->tree[set], c->ways, way);
+  else
+    stamp[way] = c->clock;
+}
+
+
+void TimingStart() {
+  CacheInit(&icache);
+  CacheInit(&dcache);
+  free(predictor.counters);
+  // Two-bit counters start weakly not-taken
+  predictor.counters = malloc(1u << predictor.indexBits);
+  memset(predictor.counters, 1, 1u << predictor.indexBits);
+  predictor.history = 0;
+  predictor.branches = predictor.mispredicts = 0;
+  instructions = 0;
+  cpuHooks |= CPU_HOOK_TIMING;
+}
+
+
+void TimingStop() {
+  cpuHooks &= ~CPU_HOOK_TIMING;
+}
+
+
+void TimingFetch(uint32_t pc) {
+  instructions++;
+  CacheAccess(&icache, pc);
+}
+
+
+void TimingData(uint32_t addr) {
+  CacheAccess(&dcache, addr);
+}
+
+
+void TimingBranch(uint32_t pc, bool taken) {
+  Predictor *p = &predictor;
+  uint32_t mask = (1u << p->indexBits) - 1;
+  uint32_t idx = pc >> 2;
+  if(p->kind == PREDICT_GSHARE)
+    idx ^= p->history << (p->indexBits - p->historyBits);
+  idx &= mask;
+
+  uint8_t *ctr = &p->counters[idx];
+  p->branches++;
+  if((*ctr >= 2) != taken)
+    p->mispredicts++;
+  if(taken && *ctr < 3)
+    (*ctr)++;
+  else if(!taken && *ctr > 0)
+    (*ctr)--;
+  if(p->historyBits)
+    p->history = (p->history << 1 | taken) & ((1u << p->historyBits) - 1);
+}
+
+
+static void CacheReport(FILE *f, const Cache *c) {
+  fprintf(f, "%s %u bytes, %u-way, %u-byte lines, %s\n", c->name, c->size,
+      c->ways, c->lineSize, c->policy == CACHE_PLRU ? "plru" : "lru");
+  fprintf(f, "  %12" PRIu64 " accesses %12" PRIu64 " misses %7.3f%% hit rate\n",
+      c->accesses, c->misses,
+      c->accesses ? 100.0 * (c->accesses - c->misses) / c->accesses : 0.0);
+}
+
+
+void TimingReport(FILE *f) {
+  CacheReport(f, &icache);
+  CacheReport(f, &dcache);
+  const Predictor *p = &predictor;
+  fprintf(f, "%s %u index bits, %u history bits\n",
+      p->kind == PREDICT_GSHARE ? "gshare" : "bimodal", p->indexBits, p->historyBits);
+  fprintf(f, "  %12" PRIu64 " branches %12" PRIu64 " mispredicts %7.3f%% accuracy\n",
+      p->branches, p->mispredicts,
+      p->branches ? 100.0 * (p->branches - p->mispredicts) / p->branches : 0.0);
+
+  // One cycle per instruction plus miss and mispredict penalties
+  uint64_t cycles = instructions +
+    (icache.misses + dcache.misses) * missPenalty +
+    p->mispredicts * mispredictPenalty;
+  fprintf(f, "%" PRIu64 " instructions, %" PRIu64 " estimated cycles, CPI %.3f\n",
+      instructions, cycles, instructions ? (double)cycles / instructions : 0.0);
+  fprintf(f, "  miss penalty %u, mispredict penalty %u\n", missPenalty, mispredictPenalty);
+}
@@ -0,0 +1,27 @@
+#ifndef TIMING_H
+#define TIMING_H
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Optional timing model: L1 instruction and data caches and a branch
+// predictor, fed by the instrumented executor while CPU_HOOK_TIMING is set.
+// The plain executor carries none of it.
+
+enum { CACHE_LRU, CACHE_PLRU };
+enum { PREDICT_BIMODAL, PREDICT_GSHARE };
+
+int  TimingConfigureCache(char which, unsigned size, unsigned ways, unsigned lineSize, const char *policy);
+int  TimingConfigurePredictor(const char *kind, unsigned indexBits, unsigned historyBits);
+void TimingConfigureLatency(unsigned missPenalty, unsigned mispredictPenalty);
+
+void TimingStart();
+void TimingStop();
+
+void TimingFetch(uint32_t pc);
+void TimingData(uint32_t addr);
+void TimingBranch(uint32_t pc, bool taken);
+
+void TimingReport(FILE *f);
+
+#endif
@@ -0,0 +1,284 @@
+#define _XOPEN_SOURCE 600 // posix_openpt
+#include "uart.h"
+#include "CPU.h"
+#include "events.h"
+#include "mmio.h"
+#include "plic.h"
+#include <SDL.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define TX_SIZE (1 << 16) // Bytes, a power of 2
+#define RX_SIZE (1 << 12)
+#define PERIOD  10        // Longest time in milliseconds a byte waits in the ring
+#define POLL    10'000    // Instructions between looks for received bytes
+
+// Registers by offset. The divisor latch takes the place of RBR, THR and IER
+// while LCR_DLAB is set.
+enum { RBR, IER, IIR, LCR, MCR, LSR, MSR, SCR };
+enum {
+  IER_RX   = 1 << 0,
+  IER_THRE = 1 << 1,
+  LCR_DLAB = 1 << 7,
+  LSR_DR   = 1 << 0,
+  LSR_THRE = 1 << 5,
+  LSR_TEMT = 1 << 6,
+};
+
+// Single producer, single consumer rings with free running indices. The
+// guest produces tx and the host thread rx, so neither side takes a lock.
+typedef struct {
+  uint8_t     *data;
+  uint32_t     mask;
+  atomic_uint  head, tail;
+} Ring;
+
+static uint8_t     txData[TX_SIZE], rxData[RX_SIZE];
+static Ring        tx = { txData, TX_SIZE - 1 }, rx = { rxData, RX_SIZE - 1 };
+static uint8_t     regs[8], divisor[2];
+static int         inFd = -1, outFd = -1;
+static bool        pty;
+static atomic_bool running;
+static SDL_sem    *wake;
+static SDL_Thread *txThread, *rxThread;
+static Event       rxPoll;
+
+
+static uint32_t Used(Ring *r) {
+  return atomic_load_explicit(&r->head, memory_order_acquire) -
+         atomic_load_explicit(&r->tail, memory_order_acquire);
+}
+
+
+static void Push(Ring *r, uint8_t byte) {
+  uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+  r->data[head & r->mask] = byte;
+  atomic_store_explicit(&r->head, head + 1, memory_order_release);
+}
+
+
+static uint8_t Pop(Ring *r) {
+  uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+  uint8_t byte = r->data[tail & r->mask];
+  atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+  return byte;
+}
+
+
+// Sets the interrupt line from the register state. Like the registers it
+// is only touched on the CPU thread, so received bytes are noticed by
+// polling while their interrupt is enabled.
+static void Interrupt() {
+  PlicSetLevel(UART_IRQ, (regs[IER] & IER_RX && Used(&rx)) || (regs[IER] & IER_THRE && Used(&tx) <= tx.mask));
+}
+
+
+static void Poll() {
+  Interrupt();
+  EventSchedule(&rxPoll, cpuTime + POLL);
+}
+
+
+static uint32_t Register(uint32_t offset) {
+  switch(offset) {
+  case RBR:
+    if(regs[LCR] & LCR_DLAB)
+      return divisor[0];
+    return Used(&rx) ? Pop(&rx) : 0;
+  case IER:
+    return regs[LCR] & LCR_DLAB ? divisor[1] : regs[IER];
+  case IIR:
+    // The highest priority pending interrupt, FIFOs enabled
+    if(regs[IER] & IER_RX && Used(&rx))
+      return 0xC4;
+    if(regs[IER] & IER_THRE && Used(&tx) <= tx.mask)
+      return 0xC2;
+    return 0xC1;
+  case LSR:
+    return (Used(&rx) ? LSR_DR : 0) | (Used(&tx) <= tx.mask ? LSR_THRE : 0) | (Used(&tx) ? 0 : LSR_TEMT);
+  case MSR:
+    return 0xB0; // CTS, DSR and DCD
+  default:
+    return regs[offset];
+  }
+}
+
+
+static uint32_t Read(uint32_t offset, [[maybe_unused]] unsigned size) {
+  uint32_t value = Register(offset);
+  Interrupt();
+  return value;
+}
+
+
+static void Write(uint32_t offset, uint32_t value, [[maybe_unused]] unsigned size) {
+  if(offset <= IER && regs[LCR] & LCR_DLAB)
+    divisor[offset] = value;
+  else if(offset == RBR) {
+    // A guest that ignores LSR_THRE waits for the ring to drain instead of
+    // losing output
+    while(Used(&tx) > tx.mask) {
+      SDL_SemPost(wake);
+      SDL_Delay(1);
+    }
+    Push(&tx, value);
+    if(Used(&tx) == TX_SIZE / 2)
+      SDL_SemPost(wake);
+  } else if(offset != IIR && offset != LSR && offset != MSR)
+    regs[offset] = value;
+  if(offset == IER && regs[IER] & IER_RX)
+    EventSchedule(&rxPoll, cpuTime + POLL);
+  else if(offset == IER)
+    EventCancel(&rxPoll);
+  Interrupt();
+}
+
+
+static const MMIODevice device = {
+  "uart", UART_BASE, sizeof regs, Read, Write
+};
+
+
+// Writes whatever is in the ring, wrapping in at most two writes. Bytes a
+// pty can't take for a whole period, because nobody has it open, are
+// dropped as on a line without flow control.
+static void Drain() {
+  uint32_t used;
+  while((used = Used(&tx))) {
+    uint32_t tail = atomic_load_explicit(&tx.tail, memory_order_relaxed) & tx.mask;
+    if(used > TX_SIZE - tail)
+      used = TX_SIZE - tail;
+    ssize_t n = write(outFd, &txData[tail], used);
+    if(n < 0 && errno == EINTR)
+      continue;
+    if(n < 0 && errno == EAGAIN) {
+      struct pollfd p = { outFd, POLLOUT, 0 };
+      if(poll(&p, 1, PERIOD) > 0)
+        continue;
+    }
+    if(n < 0)
+      n = used;
+    atomic_fetch_add_explicit(&tx.tail, n, memory_order_release);
+  }
+}
+
+
+static int Transmit(void *unused) {
+  while(atomic_load(&running)) {
+    SDL_SemWaitTimeout(wake, PERIOD);
+    Drain();
+  }
+  Drain();
+  return 0;
+}
+
+
+static int Receive(void *unused) {
+  uint8_t buffer[256];
+  while(atomic_load(&running)) {
+    struct pollfd p = { inFd, POLLIN, 0 };
+    if(Used(&rx) + sizeof buffer > RX_SIZE || poll(&p, 1, 50) <= 0) {
+      SDL_Delay(1);
+      continue;
+    }
+    ssize_t n = read(inFd, buffer, sizeof buffer);
+    if(n <= 0 && !(n < 0 && (errno == EINTR || errno == EAGAIN))) {
+      // End of input, or nobody has the pty open. The pty keeps waiting for
+      // someone to open it.
+      if(!pty)
+        break;
+      SDL_Delay(50);
+    }
+    for(ssize_t i = 0; i < n; i++)
+      Push(&rx, buffer[i]);
+  }
+  return 0;
+}
+
+
+static int OpenPTY() {
+  int fd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+  if(fd < 0 || grantpt(fd) || unlockpt(fd)) {
+    if(fd >= 0)
+      close(fd);
+    return -1;
+  }
+  fprintf(stderr, "uart: %s\n", ptsname(fd));
+  return fd;
+}
+
+
+int UARTStart(const char *backend, bool input) {
+  if(txThread)
+    return -1;
+  pty = !strcmp(backend, "pty");
+  if(pty) {
+    if((inFd = outFd = OpenPTY()) < 0)
+      return -1;
+  } else if(!strcmp(backend, "stdio")) {
+    // Keeps what the host prints in order with the guest's output
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    inFd = STDIN_FILENO;
+    outFd = STDOUT_FILENO;
+  } else
+    return -1;
+  memset(regs, 0, sizeof regs);
+  rxPoll.fire = Poll;
+  rxPoll.host = true;
+  if(!(wake = SDL_CreateSemaphore(0)) || MMIOMap(&device))
+    goto fail;
+  atomic_store(&running, true);
+  if(!(txThread = SDL_CreateThread(Transmit, "uart tx", NULL)))
+    goto unmap;
+  if(input && !(rxThread = SDL_CreateThread(Receive, "uart rx", NULL))) {
+    UARTStop();
+    return -1;
+  }
+  return 0;
+unmap:
+  MMIOUnmap(&device);
+fail:
+  if(wake)
+    SDL_DestroySemaphore(wake);
+  wake = NULL;
+  if(pty)
+    close(inFd);
+  return -1;
+}
+
+
+void UARTStop() {
+  if(!txThread)
+    return;
+  atomic_store(&running, false);
+  SDL_SemPost(wake);
+  SDL_WaitThread(txThread, NULL);
+  if(rxThread)
+    SDL_WaitThread(rxThread, NULL);
+  txThread = rxThread = NULL;
+  EventCancel(&rxPoll);
+  PlicSetLevel(UART_IRQ, false);
+  MMIOUnmap(&device);
+  SDL_DestroySemaphore(wake);
+  wake = NULL;
+  if(pty)
+    close(inFd);
+  inFd = outFd = -1;
+}
+
+
+void UARTFlush() {
+  if(!txThread)
+    return;
+  while(Used(&tx)) {
+    SDL_SemPost(wake);
+    SDL_Delay(1);
+  }
+}
@@ -0,0 +1,21 @@
+#ifndef UART_H
+#define UART_H
+#include <stdbool.h>
+
+// A 16550-compatible UART with byte-wide registers at UART_BASE. Transmitted
+// bytes are queued in a ring that a host thread writes out in large chunks,
+// and received bytes are read ahead by another. The interrupt is raised
+// for received data and for room to transmit, as enabled in IER.
+#define UART_BASE 0x1000'0000
+#define UART_IRQ  10 // PLIC source
+
+// backend is "stdio", or "pty" for a new pseudoterminal whose name is
+// printed. Without input, stdin is left to the monitor and the guest
+// receives nothing.
+int  UARTStart(const char *backend, bool input);
+void UARTStop();
+
+// Waits until everything the guest transmitted has been written
+void UARTFlush();
+
+#endif
@@ -0,0 +1,1897 @@
+#include "CPU.h"
+#include "asm.h"
+#include "breakpoint.h"
+#include "clint.h"
+#include "disk.h"
+#include "dma.h"
+#include "lockstep.h"
+#include "machine.h"
+#include "mmio.h"
+#include "mmu.h"
+#include "monitor.h"
+#include "profile.h"
+#include "reference.h"
+#include "symbols.h"
+#include "stats.h"
+#include "timing.h"
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// ISA conformance tests in the style of riscv-tests' rv32ui suite. Each
+// test is generated with Assemble into a small image that reports through
+// the tohost word: 1 for pass, (test number << 1) | 1 for the first failing
+// case. Every test runs once under each execution engine and the final
+// architectural state (registers, tohost and the test's memory) must be
+// identical between engines. Tests of the privileged architecture and the
+// devices run on the engines that model them.
+//
+// These are hand ports. riscv-tests binaries named on the command line run
+// too, on the engines that model machine mode, once linked into RAM: the
+// upstream link.ld puts them at 0x80000000, past its end.
+//
+// Unit tests of the tools and devices follow, which run once from C.
+
+#define TOHOST    0x0001'0000
+#define CODE_BASE 0x0002'0000
+#define DATA_BASE 0x0003'0000
+#define TEST_END  0x0004'0000
+#define PAGES     0x0005'0000 // The page table of the paged engines
+#define BUDGET    1'000'000
+
+typedef struct { uint32_t result, a, b; } RRCase;
+typedef struct { uint32_t result, a; int32_t imm; } ImmCase;
+typedef struct { bool taken; uint32_t a, b; } BranchCase;
+typedef struct { uint32_t result; int32_t offset, base; } LoadCase;
+typedef struct { uint32_t value; int32_t offset; uint32_t loaded; } StoreCase;
+
+static const RRCase addCases[] = {
+  { 0x00000000, 0x00000000, 0x00000000 },
+  { 0x00000002, 0x00000001, 0x00000001 },
+  { 0x0000000A, 0x00000003, 0x00000007 },
+  { 0xFFFF8000, 0x00000000, 0xFFFF8000 },
+  { 0x80000000, 0x80000000, 0x00000000 },
+  { 0x7FFF8000, 0x80000000, 0xFFFF8000 },
+  { 0x80000000, 0x7FFFFFFF, 0x00000001 },
+  { 0x00000000, 0xFFFFFFFF, 0x00000001 },
+  { 0xFFFFFFFE, 0x7FFFFFFF, 0x7FFFFFFF },
+};
+
+static const RRCase subCases[] = {
+  { 0x00000000, 0x00000000, 0x00000000 },
+  { 0x00000000, 0x00000001, 0x00000001 },
+  { 0xFFFFFFFC, 0x00000003, 0x00000007 },
+  { 0x00008000, 0x00000000, 0xFFFF8000 },
+  { 0x80000000, 0x80000000, 0x00000000 },
+  { 0x80008000, 0x80000000, 0xFFFF8000 },
+  { 0x00000001, 0x00000000, 0xFFFFFFFF },
+  { 0xFFFFFFFE, 0xFFFFFFFF, 0x00000001 },
+  { 0x80000000, 0x7FFFFFFF, 0xFFFFFFFF },
+};
+
+static const RRCase xorCases[] = {
+  { 0xF00FF00F, 0xFF00FF00, 0x0F0F0F0F },
+  { 0xFF00FF00, 0x0FF00FF0, 0xF0F0F0F0 },
+  { 0x0FF00FF0, 0x00FF00FF, 0x0F0F0F0F },
+  { 0x00FF00FF, 0xF00FF00F, 0xF0F0F0F0 },
+  { 0x00000000, 0x00000000, 0x00000000 },
+  { 0xEDCBA987, 0xFFFFFFFF, 0x12345678 },
+};
+
+static const RRCase orCases[] = {
+  { 0xFF0FFF0F, 0xFF00FF00, 0x0F0F0F0F },
+  { 0xFFF0FFF0, 0x0FF00FF0, 0xF0F0F0F0 },
+  { 0x0FFF0FFF, 0x00FF00FF, 0x0F0F0F0F },
+  { 0xF0FFF0FF, 0xF00FF00F, 0xF0F0F0F0 },
+  { 0x00000000, 0x00000000, 0x00000000 },
+};
+
+static const RRCase andCases[] = {
+  { 0x0F000F00, 0xFF00FF00, 0x0F0F0F0F },
+  { 0x00F000F0, 0x0FF00FF0, 0xF0F0F0F0 },
+  { 0x000F000F, 0x00FF00FF, 0x0F0F0F0F },
+  { 0xF000F000, 0xF00FF00F, 0xF0F0F0F0 },
+  { 0x12345678, 0xFFFFFFFF, 0x12345678 },
+};
+
+static const RRCase sllCases[] = {
+  { 0x00000001, 0x00000001, 0x00000000 },
+  { 0x00000002, 0x00000001, 0x00000001 },
+  { 0x00000080, 0x00000001, 0x00000007 },
+  { 0x00004000, 0x00000001, 0x0000000E },
+  { 0x80000000, 0x00000001, 0x0000001F },
+  { 0xFFFFFFFF, 0xFFFFFFFF, 0x00000000 },
+  { 0x80000000, 0xFFFFFFFF, 0x0000001F },
+  { 0x90909080, 0x21212121, 0x00000007 },
+  { 0x21212121, 0x21212121, 0xFFFFFFE0 },
+  { 0x80000000, 0x21212121, 0xFFFFFFFF },
+};
+
+static const RRCase srlCases[] = {
+  { 0x80000000, 0x80000000, 0x00000000 },
+  { 0x40000000, 0x80000000, 0x00000001 },
+  { 0x01000000, 0x80000000, 0x00000007 },
+  { 0x00000001, 0x80000000, 0x0000001F },
+  { 0x0003FFFF, 0xFFFFFFFF, 0x0000000E },
+  { 0x10909090, 0x21212121, 0x00000001 },
+  { 0x21212121, 0x21212121, 0xFFFFFFE0 },
+  { 0x00000000, 0x21212121, 0xFFFFFFFF },
+};
+
+static const RRCase sraCases[] = {
+  { 0x80000000, 0x80000000, 0x00000000 },
+  { 0xC0000000, 0x80000000, 0x00000001 },
+  { 0xFF000000, 0x80000000, 0x00000007 },
+  { 0xFFFFFFFF, 0x80000000, 0x0000001F },
+  { 0x3FFFFFFF, 0x7FFFFFFF, 0x00000001 },
+  { 0xFFFE0606, 0x81818181, 0x0000000E },
+  { 0x81818181, 0x81818181, 0xFFFFFFE0 },
+  { 0xFFFFFFFF, 0x81818181, 0xFFFFFFFF },
+};
+
+static const RRCase sltCases[] = {
+  { 0x00000000, 0x00000000, 0x00000000 },
+  { 0x00000000, 0x00000001, 0x00000001 },
+  { 0x00000001, 0x00000003, 0x00000007 },
+  { 0x00000000, 0x00000007, 0x00000003 },
+  { 0x00000000, 0x00000000, 0xFFFF8000 },
+  { 0x00000001, 0x80000000, 0x00000000 },
+  { 0x00000001, 0x80000000, 0x7FFFFFFF },
+  { 0x00000000, 0x7FFFFFFF, 0x80000000 },
+  { 0x00000001, 0xFFFFFFFF, 0x00000001 },
+  { 0x00000000, 0x00000001, 0xFFFFFFFF },
+};
+
+static const RRCase sltuCases[] = {
+  { 0x00000000, 0x00000000, 0x00000000 },
+  { 0x00000000, 0x00000001, 0x00000001 },
+  { 0x00000001, 0x00000003, 0x00000007 },
+  { 0x00000000, 0x00000007, 0x00000003 },
+  { 0x00000001, 0x00000000, 0xFFFF8000 },
+  { 0x00000000, 0x80000000, 0x00000000 },
+  { 0x00000000, 0x80000000, 0x7FFFFFFF },
+  { 0x00000001, 0x7FFFFFFF, 0x80000000 },
+  { 0x00000000, 0xFFFFFFFF, 0x00000001 },
+  { 0x00000001, 0x00000001, 0xFFFFFFFF },
+};
+
+static const ImmCase addiCases[] = {
+  { 0x00000000, 0x00000000,      0 },
+  { 0x00000002, 0x00000001,      1 },
+  { 0x0000000A, 0x00000003,      7 },
+  { 0xFFFFF800, 0x00000000,  -2048 },
+  { 0x80000000, 0x80000000,      0 },
+  { 0x7FFFF800, 0x80000000,  -2048 },
+  { 0x800007FE, 0x7FFFFFFF,   2047 },
+  { 0x00000000, 0xFFFFFFFF,      1 },
+  { 0x80000000, 0x7FFFFFFF,      1 },
+};
+
+static const ImmCase xoriCases[] = {
+  { 0xFF00F00F, 0x00FF0F00,   -241 },
+  { 0x0FF00F00, 0x0FF00FF0,    240 },
+  { 0x00FF0FF0, 0x00FF08FF,   1807 },
+  { 0xF00FF0FF, 0xF00FF00F,    240 },
+  { 0x00000000, 0x00000000,      0 },
+  { 0xEDCBA987, 0x12345678,     -1 },
+};
+
+static const ImmCase oriCases[] = {
+  { 0xFFFFFF0F, 0xFF00FF00,   -241 },
+  { 0x0FF00FF0, 0x0FF00FF0,    240 },
+  { 0x00FF07FF, 0x00FF00FF,   1807 },
+  { 0xF00FF0FF, 0xF00FF00F,    240 },
+};
+
+static const ImmCase andiCases[] = {
+  { 0xFF00FF00, 0xFF00FF00,   -241 },
+  { 0x000000F0, 0x0FF00FF0,    240 },
+  { 0x0000000F, 0x00FF00FF,   1807 },
+  { 0x00000000, 0xF00FF00F,    240 },
+};
+
+static const ImmCase slliCases[] = {
+  { 0x00000001, 0x00000001,      0 },
+  { 0x00000002, 0x00000001,      1 },
+  { 0x00000080, 0x00000001,      7 },
+  { 0x80000000, 0x00000001,     31 },
+  { 0xFFFFFFFF, 0xFFFFFFFF,      0 },
+  { 0x80000000, 0xFFFFFFFF,     31 },
+  { 0x90909080, 0x21212121,      7 },
+  { 0x48484000, 0x21212121,     14 },
+};
+
+static const ImmCase srliCases[] = {
+  { 0x80000000, 0x80000000,      0 },
+  { 0x40000000, 0x80000000,      1 },
+  { 0x01000000, 0x80000000,      7 },
+  { 0x00000001, 0x80000000,     31 },
+  { 0x0003FFFF, 0xFFFFFFFF,     14 },
+  { 0x10909090, 0x21212121,      1 },
+  { 0x00000000, 0x21212121,     31 },
+};
+
+static const ImmCase sraiCases[] = {
+  { 0x80000000, 0x80000000,      0 },
+  { 0xC0000000, 0x80000000,      1 },
+  { 0xFF000000, 0x80000000,      7 },
+  { 0xFFFFFFFF, 0x80000000,     31 },
+  { 0x3FFFFFFF, 0x7FFFFFFF,      1 },
+  { 0xFFFE0606, 0x81818181,     14 },
+  { 0xFFFFFFFF, 0x81818181,     31 },
+};
+
+static const ImmCase sltiCases[] = {
+  { 0x00000000, 0x00000000,      0 },
+  { 0x00000000, 0x00000001,      1 },
+  { 0x00000001, 0x00000003,      7 },
+  { 0x00000000, 0x00000007,      3 },
+  { 0x00000000, 0x00000000,  -2048 },
+  { 0x00000001, 0x80000000,      0 },
+  { 0x00000001, 0x80000000,   2047 },
+  { 0x00000000, 0x7FFFFFFF,  -2048 },
+  { 0x00000001, 0xFFFFFFFF,      1 },
+  { 0x00000000, 0x00000001,     -1 },
+};
+
+static const ImmCase sltiuCases[] = {
+  { 0x00000000, 0x00000000,      0 },
+  { 0x00000000, 0x00000001,      1 },
+  { 0x00000001, 0x00000003,      7 },
+  { 0x00000000, 0x00000007,      3 },
+  { 0x00000001, 0x00000000,  -2048 },
+  { 0x00000000, 0x80000000,      0 },
+  { 0x00000000, 0x80000000,   2047 },
+  { 0x00000001, 0x7FFFFFFF,  -2048 },
+  { 0x00000000, 0xFFFFFFFF,      1 },
+  { 0x00000001, 0x00000001,     -1 },
+};
+
+static const BranchCase beqCases[] = {
+  { true , 0x00000000, 0x00000000 },
+  { true , 0x00000001, 0x00000001 },
+  { true , 0xFFFFFFFF, 0xFFFFFFFF },
+  { false, 0x00000000, 0x00000001 },
+  { false, 0x00000001, 0x00000000 },
+  { false, 0xFFFFFFFF, 0x00000001 },
+  { false, 0x00000001, 0xFFFFFFFF },
+  { false, 0x80000000, 0x7FFFFFFF },
+  { false, 0x7FFFFFFF, 0x80000000 },
+  { false, 0xFFFFFFFE, 0xFFFFFFFF },
+};
+
+static const BranchCase bneCases[] = {
+  { false, 0x00000000, 0x00000000 },
+  { false, 0x00000001, 0x00000001 },
+  { false, 0xFFFFFFFF, 0xFFFFFFFF },
+  { true , 0x00000000, 0x00000001 },
+  { true , 0x00000001, 0x00000000 },
+  { true , 0xFFFFFFFF, 0x00000001 },
+  { true , 0x00000001, 0xFFFFFFFF },
+  { true , 0x80000000, 0x7FFFFFFF },
+  { true , 0x7FFFFFFF, 0x80000000 },
+  { true , 0xFFFFFFFE, 0xFFFFFFFF },
+};
+
+static const BranchCase bltCases[] = {
+  { false, 0x00000000, 0x00000000 },
+  { false, 0x00000001, 0x00000001 },
+  { false, 0xFFFFFFFF, 0xFFFFFFFF },
+  { true , 0x00000000, 0x00000001 },
+  { false, 0x00000001, 0x00000000 },
+  { true , 0xFFFFFFFF, 0x00000001 },
+  { false, 0x00000001, 0xFFFFFFFF },
+  { true , 0x80000000, 0x7FFFFFFF },
+  { false, 0x7FFFFFFF, 0x80000000 },
+  { true , 0xFFFFFFFE, 0xFFFFFFFF },
+};
+
+static const BranchCase bgeCases[] = {
+  { true , 0x00000000, 0x00000000 },
+  { true , 0x00000001, 0x00000001 },
+  { true , 0xFFFFFFFF, 0xFFFFFFFF },
+  { false, 0x00000000, 0x00000001 },
+  { true , 0x00000001, 0x00000000 },
+  { false, 0xFFFFFFFF, 0x00000001 },
+  { true , 0x00000001, 0xFFFFFFFF },
+  { false, 0x80000000, 0x7FFFFFFF },
+  { true , 0x7FFFFFFF, 0x80000000 },
+  { false, 0xFFFFFFFE, 0xFFFFFFFF },
+};
+
+static const BranchCase bltuCases[] = {
+  { false, 0x00000000, 0x00000000 },
+  { false, 0x00000001, 0x00000001 },
+  { false, 0xFFFFFFFF, 0xFFFFFFFF },
+  { true , 0x00000000, 0x00000001 },
+  { false, 0x00000001, 0x00000000 },
+  { false, 0xFFFFFFFF, 0x00000001 },
+  { true , 0x00000001, 0xFFFFFFFF },
+  { false, 0x80000000, 0x7FFFFFFF },
+  { true , 0x7FFFFFFF, 0x80000000 },
+  { true , 0xFFFFFFFE, 0xFFFFFFFF },
+};
+
+static const BranchCase bgeuCases[] = {
+  { true , 0x00000000, 0x00000000 },
+  { true , 0x00000001, 0x00000001 },
+  { true , 0xFFFFFFFF, 0xFFFFFFFF },
+  { false, 0x00000000, 0x00000001 },
+  { true , 0x00000001, 0x00000000 },
+  { true , 0xFFFFFFFF, 0x00000001 },
+  { false, 0x00000001, 0xFFFFFFFF },
+  { true , 0x80000000, 0x7FFFFFFF },
+  { false, 0x7FFFFFFF, 0x80000000 },
+  { false, 0xFFFFFFFE, 0xFFFFFFFF },
+};
+
+static const uint8_t tdat[] = {
+  0xFF, 0x00, 0xF0, 0x0F, 0xFF, 0x00, 0x00, 0xFF, 0xF0, 0x0F, 0x0F, 0xF0, 0xFF, 0x00, 0xFF, 0x00, 0x00, 0xFF, 0x00, 0xFF, 0xF0, 0x0F, 0xF0, 0x0F, 0x0F, 0xF0, 0x0F, 0xF0
+};
+
+static const LoadCase lbCases[] = {
+  { 0xFFFFFFFF,   0,  0 },
+  { 0x00000000,   1,  0 },
+  { 0xFFFFFFF0,   2,  0 },
+  { 0x0000000F,   3,  0 },
+  { 0x0000000F,   0,  3 },
+  { 0xFFFFFFF0,  -1,  3 },
+  { 0x00000000,  -2,  3 },
+  { 0xFFFFFFFF,  -3,  3 },
+};
+
+static const LoadCase lbuCases[] = {
+  { 0x000000FF,   0,  0 },
+  { 0x00000000,   1,  0 },
+  { 0x000000F0,   2,  0 },
+  { 0x0000000F,   3,  0 },
+  { 0x0000000F,   0,  3 },
+  { 0x000000F0,  -1,  3 },
+  { 0x00000000,  -2,  3 },
+  { 0x000000FF,  -3,  3 },
+};
+
+static const LoadCase lhCases[] = {
+  { 0x000000FF,   0,  4 },
+  { 0xFFFFFF00,   2,  4 },
+  { 0x00000FF0,   4,  4 },
+  { 0xFFFFF00F,   6,  4 },
+  { 0xFFFFF00F,   0, 10 },
+  { 0x00000FF0,  -2, 10 },
+  { 0xFFFFFF00,  -4, 10 },
+  { 0x000000FF,  -6, 10 },
+};
+
+static const LoadCase lhuCases[] = {
+  { 0x000000FF,   0,  4 },
+  { 0x0000FF00,   2,  4 },
+  { 0x00000FF0,   4,  4 },
+  { 0x0000F00F,   6,  4 },
+  { 0x0000F00F,   0, 10 },
+  { 0x00000FF0,  -2, 10 },
+  { 0x0000FF00,  -4, 10 },
+  { 0x000000FF,  -6, 10 },
+};
+
+static const LoadCase lwCases[] = {
+  { 0x00FF00FF,   0, 12 },
+  { 0xFF00FF00,   4, 12 },
+  { 0x0FF00FF0,   8, 12 },
+  { 0xF00FF00F,  12, 12 },
+  { 0xF00FF00F,   0, 24 },
+  { 0x0FF00FF0,  -4, 24 },
+  { 0xFF00FF00,  -8, 24 },
+  { 0x00FF00FF, -12, 24 },
+};
+
+static const StoreCase sbCases[] = {
+  { 0x000000AA,   0, 0xFFFFFFAA },
+  { 0x00000000,   1, 0x00000000 },
+  { 0xFFFFEFA0,   2, 0xFFFFFFA0 },
+  { 0x0000000A,   3, 0x0000000A },
+  { 0x000000AA,  -3, 0xFFFFFFAA },
+  { 0x00000000,  -2, 0x00000000 },
+  { 0x000000A0,  -1, 0xFFFFFFA0 },
+};
+
+static const StoreCase shCases[] = {
+  { 0x000000AA,   0, 0x000000AA },
+  { 0xFFFFAA00,   2, 0xFFFFAA00 },
+  { 0xBEEF0AA0,   4, 0x00000AA0 },
+  { 0xFFFFA00A,   6, 0xFFFFA00A },
+  { 0x000000AA,  -6, 0x000000AA },
+  { 0xFFFFAA00,  -4, 0xFFFFAA00 },
+  { 0x00000AA0,  -2, 0x00000AA0 },
+};
+
+static const StoreCase swCases[] = {
+  { 0x00AA00AA,   0, 0x00AA00AA },
+  { 0xAA00AA00,   4, 0xAA00AA00 },
+  { 0x0AA00AA0,   8, 0x0AA00AA0 },
+  { 0xA00AA00A,  12, 0xA00AA00A },
+  { 0x12345678, -12, 0x12345678 },
+  { 0x58213098,  -8, 0x58213098 },
+  { 0x89ABCDEF,  -4, 0x89ABCDEF },
+};
+
+
+static uint32_t pc;
+static uint32_t failAddr;
+static uint32_t passAddr;
+static int      testNum;
+
+
+static void Emit(const char *fmt, ...) {
+  char line[128];
+  va_list args;
+  va_start(args, fmt);
+  vsnprintf(line, sizeof line, fmt, args);
+  va_end(args);
+  uint32_t ins = Assemble(line);
+  if(!ins) {
+    fprintf(stderr, "can't assemble '%s'\n", line);
+    exit(EXIT_FAILURE);
+  }
+  CPUWrite32(pc, ins);
+  pc += 4;
+}
+
+
+static void Li(const char *rd, uint32_t v) {
+  // addi sign-extends its immediate, so round the upper part to compensate
+  Emit("lui %s, 0x%X", rd, ((v + 0x800) >> 12) & 0xF'FFFF);
+  Emit("addi %s, %s, %d", rd, rd, (int32_t)(v << 20) >> 20);
+}
+
+
+static void Jump(uint32_t target) {
+  Emit("jal zero, %d", (int32_t)(target - pc));
+}
+
+
+static void Begin(int n) {
+  testNum = n;
+  Li("gp", n);
+}
+
+
+static void Check(const char *testreg, uint32_t expected) {
+  Li("x7", expected);
+  Emit("beq %s, x7, 8", testreg);
+  Jump(failAddr);
+}
+
+
+static void Prologue() {
+  // Jump over the fail and pass handlers, patched in once they are laid out
+  pc = CODE_BASE + 4;
+  failAddr = pc;
+  Emit("add gp, gp, gp");
+  Emit("ori gp, gp, 1");
+  Li("t0", TOHOST);
+  Emit("sw gp, 0(t0)");
+  Emit("ebreak");
+  passAddr = pc;
+  Emit("addi gp, zero, 1");
+  Li("t0", TOHOST);
+  Emit("sw gp, 0(t0)");
+  Emit("ebreak");
+  uint32_t start = pc;
+  pc = CODE_BASE;
+  Jump(start);
+  pc = start;
+  testNum = 1;
+}
+
+
+static void Epilogue() {
+  Jump(passAddr);
+}
+
+
+static void TestRR(const char *op, const RRCase *c, size_t n) {
+  for(size_t i = 0; i < n; i++) {
+    Begin(testNum + 1);
+    Li("x1", c[i].a);
+    Li("x2", c[i].b);
+    Emit("%s x14, x1, x2", op);
+    Check("x14", c[i].result);
+  }
+  // Destination aliasing either source, and x0 as destination
+  Begin(testNum + 1);
+  Li("x1", c[1].a);
+  Li("x2", c[1].b);
+  Emit("%s x1, x1, x2", op);
+  Check("x1", c[1].result);
+  Begin(testNum + 1);
+  Li("x1", c[2].a);
+  Li("x2", c[2].b);
+  Emit("%s x2, x1, x2", op);
+  Check("x2", c[2].result);
+  Begin(testNum + 1);
+  Li("x1", c[3].a);
+  Li("x2", c[3].b);
+  Emit("%s x0, x1, x2", op);
+  Check("x0", 0);
+}
+
+
+static void TestImm(const char *op, const ImmCase *c, size_t n) {
+  for(size_t i = 0; i < n; i++) {
+    Begin(testNum + 1);
+    Li("x1", c[i].a);
+    Emit("%s x14, x1, %d", op, c[i].imm);
+    Check("x14", c[i].result);
+  }
+  Begin(testNum + 1);
+  Li("x1", c[1].a);
+  Emit("%s x1, x1, %d", op, c[1].imm);
+  Check("x1", c[1].result);
+  Begin(testNum + 1);
+  Li("x1", c[2].a);
+  Emit("%s x0, x1, %d", op, c[2].imm);
+  Check("x0", 0);
+}
+
+
+static void TestBranch(const char *op, const BranchCase *c, size_t n) {
+  for(size_t i = 0; i < n; i++) {
+    Begin(testNum + 1);
+    Li("x1", c[i].a);
+    Li("x2", c[i].b);
+    if(c[i].taken) {
+      Emit("%s x1, x2, 8", op);
+      Jump(failAddr);
+    } else {
+      Emit("%s x1, x2, 12", op);
+      Emit("jal zero, 8");
+      Jump(failAddr);
+    }
+  }
+  // Backward taken branch
+  for(size_t i = 0; i < n; i++) {
+    if(!c[i].taken)
+      continue;
+    Begin(testNum + 1);
+    Li("x1", c[i].a);
+    Li("x2", c[i].b);
+    Emit("jal zero, 8");
+    Emit("jal zero, 12");
+    Emit("%s x1, x2, -4", op);
+    Jump(failAddr);
+    break;
+  }
+}
+
+
+static void TestLoad(const char *op, const LoadCase *c, size_t n) {
+  memcpy(&mem[DATA_BASE], tdat, sizeof tdat);
+  for(size_t i = 0; i < n; i++) {
+    Begin(testNum + 1);
+    Li("x1", DATA_BASE + c[i].base);
+    Emit("%s x14, %d(x1)", op, c[i].offset);
+    Check("x14", c[i].result);
+  }
+  // Base register as destination
+  Begin(testNum + 1);
+  Li("x1", DATA_BASE + c[0].base);
+  Emit("%s x1, %d(x1)", op, c[0].offset);
+  Check("x1", c[0].result);
+}
+
+
+static void TestStore(const char *op, const char *load, const StoreCase *c, size_t n) {
+  // Positive offsets from the start of the area, negative from its end
+  const uint32_t area = DATA_BASE + 0x100;
+  for(size_t i = 0; i < n; i++) {
+    Begin(testNum + 1);
+    Li("x1", c[i].offset < 0 ? area + 12 : area);
+    Li("x2", c[i].value);
+    Emit("%s x2, %d(x1)", op, c[i].offset);
+    Emit("%s x14, %d(x1)", load, c[i].offset);
+    Check("x14", c[i].loaded);
+  }
+}
+
+
+#define RR(OP)  static void Test_##OP() { Prologue(); TestRR (#OP, OP##Cases, sizeof OP##Cases / sizeof *OP##Cases); Epilogue(); }
+#define IMM(OP) static void Test_##OP() { Prologue(); TestImm(#OP, OP##Cases, sizeof OP##Cases / sizeof *OP##Cases); Epilogue(); }
+#define BR(OP)  static void Test_##OP() { Prologue(); TestBranch(#OP, OP##Cases, sizeof OP##Cases / sizeof *OP##Cases); Epilogue(); }
+#define LD(OP)  static void Test_##OP() { Prologue(); TestLoad(#OP, OP##Cases, sizeof OP##Cases / sizeof *OP##Cases); Epilogue(); }
+#define ST(OP, LOAD) static void Test_##OP() { Prologue(); TestStore(#OP, #LOAD, OP##Cases, sizeof OP##Cases / sizeof *OP##Cases); Epilogue(); }
+RR(add) RR(sub) RR(xor) RR(or) RR(and) RR(sll) RR(srl) RR(sra) RR(slt) RR(sltu)
+IMM(addi) IMM(xori) IMM(ori) IMM(andi) IMM(slli) IMM(srli) IMM(srai) IMM(slti) IMM(sltiu)
+BR(beq) BR(bne) BR(blt) BR(bge) BR(bltu) BR(bgeu)
+LD(lb) LD(lbu) LD(lh) LD(lhu) LD(lw)
+ST(sb, lb) ST(sh, lh) ST(sw, lw)
+#undef ST
+#undef LD
+#undef BR
+#undef IMM
+#undef RR
+
+
+static void Test_lui() {
+  static const uint32_t values[] = { 0x00000, 0xFFFFF, 0x7FFFF, 0x80000, 0x12345 };
+  Prologue();
+  for(size_t i = 0; i < sizeof values / sizeof *values; i++) {
+    Begin(testNum + 1);
+    Emit("lui x14, 0x%X", values[i]);
+    Check("x14", values[i] << 12);
+  }
+  Begin(testNum + 1);
+  Emit("lui x0, 0x80000");
+  Check("x0", 0);
+  Epilogue();
+}
+
+
+static void Test_auipc() {
+  static const uint32_t values[] = { 0x00000, 0x00001, 0xFFFFF, 0x80000 };
+  Prologue();
+  for(size_t i = 0; i < sizeof values / sizeof *values; i++) {
+    Begin(testNum + 1);
+    uint32_t at = pc;
+    Emit("auipc x14, 0x%X", values[i]);
+    Check("x14", at + (values[i] << 12));
+  }
+  Epilogue();
+}
+
+
+static void Test_jal() {
+  Prologue();
+  Begin(testNum + 1);
+  uint32_t at = pc;
+  Emit("jal x1, 8");
+  Jump(failAddr);
+  Check("x1", at + 4);
+
+  // Backward jump; rd = x0 must not be written
+  Begin(testNum + 1);
+  Emit("jal zero, 12");
+  Emit("jal zero, 16");
+  Jump(failAddr);
+  at = pc;
+  Emit("jal x1, -8");
+  Jump(failAddr);
+  Check("x1", at + 4);
+  Check("x0", 0);
+  Epilogue();
+}
+
+
+static void Test_jalr() {
+  Prologue();
+  Begin(testNum + 1);
+  Li("t0", pc + 16);
+  uint32_t at = pc;
+  Emit("jalr x1, 0(t0)");
+  Jump(failAddr);
+  Check("x1", at + 4);
+
+  // Negative offset, and the low bit of the target is ignored
+  Begin(testNum + 1);
+  Li("t0", pc + 16 + 4 + 1);
+  Emit("jalr x1, -4(t0)");
+  Jump(failAddr);
+
+  // rs1 is read before rd is written
+  Begin(testNum + 1);
+  Li("x1", pc + 16);
+  at = pc;
+  Emit("jalr x1, 0(x1)");
+  Jump(failAddr);
+  Check("x1", at + 4);
+  Epilogue();
+}
+
+
+static void Test_simple() {
+  Prologue();
+  Epilogue();
+}
+
+
+// Fences have nothing to order, and code stored over runs as stored
+static void Test_fence_i() {
+  Prologue();
+  Begin(testNum + 1);
+  Emit("addi x14, zero, 1");
+  Emit("fence iorw, iorw");
+  Emit("fence rw, w");
+  Li("x15", Assemble("addi x14, x14, 2"));
+  Emit("auipc x16, 0");
+  Emit("sw x15, 12(x16)");
+  Emit("fence.i");
+  Emit("addi x14, x14, 100");
+  Check("x14", 3);
+  Epilogue();
+}
+
+
+// Privileged tests in the style of rv32mi and rv32si. Their prologue adds a
+// trap handler for each mode, which records the cause in s0, the trap value
+// in s1 and the status in s3, and counts traps in s2 for machine mode and
+// s4 for supervisor mode. Exceptions return past the faulting instruction;
+// interrupts disable themselves in mie or sie and return to it. An ecall
+// with a7 set returns in machine mode.
+static void SystemPrologue() {
+  Prologue();
+  // Jump over the handlers, patched in once they are laid out
+  uint32_t start = pc;
+  pc += 4;
+  uint32_t mtrap = pc;
+  Emit("csrrs s0, mcause, zero");
+  Emit("csrrs s1, mtval, zero");
+  Emit("csrrs s3, mstatus, zero");
+  Emit("addi s2, s2, 1");
+  Emit("beq a7, zero, 16");
+  Li("t0", MSTATUS_MPP);
+  Emit("csrrs zero, mstatus, t0");
+  Emit("blt s0, zero, 20");
+  Emit("csrrs t0, mepc, zero");
+  Emit("addi t0, t0, 4");
+  Emit("csrrw zero, mepc, t0");
+  Emit("mret");
+  Emit("csrrw zero, mie, zero");
+  Emit("mret");
+  uint32_t strap = pc;
+  Emit("csrrs s0, scause, zero");
+  Emit("csrrs s1, stval, zero");
+  Emit("csrrs s3, sstatus, zero");
+  Emit("addi s4, s4, 1");
+  Emit("blt s0, zero, 20");
+  Emit("csrrs t0, sepc, zero");
+  Emit("addi t0, t0, 4");
+  Emit("csrrw zero, sepc, t0");
+  Emit("sret");
+  Emit("csrrw zero, sie, zero");
+  Emit("sret");
+  uint32_t body = pc;
+  pc = start;
+  Jump(body);
+  pc = body;
+  Li("t0", mtrap);
+  Emit("csrrw zero, mtvec, t0");
+  Li("t0", strap);
+  Emit("csrrw zero, stvec, t0");
+  Emit("addi s2, zero, 0");
+  Emit("addi s4, zero, 0");
+  Emit("addi a7, zero, 0");
+}
+
+
+// Drops from machine mode to priv at the next instruction
+static void EnterMode(unsigned priv) {
+  Li("t0", MSTATUS_MPP);
+  Emit("csrrc zero, mstatus, t0");
+  Li("t0", priv << 11);
+  Emit("csrrs zero, mstatus, t0");
+  Emit("auipc t0, 0");
+  Emit("addi t0, t0, 16");
+  Emit("csrrw zero, mepc, t0");
+  Emit("mret");
+}
+
+
+// Returns to machine mode through its trap handler, which counts the ecall
+static void ToMachine() {
+  Emit("addi a7, zero, 1");
+  Emit("ecall");
+  Emit("addi a7, zero, 0");
+}
+
+
+static void Test_clint() {
+  SystemPrologue();
+  Li("a0", CLINT_BASE);          // msip
+  Li("a1", CLINT_BASE + 0x4000); // mtimecmp
+  Li("a2", CLINT_BASE + 0xBFF8); // mtime
+
+  // msip raises MSIP, which traps once enabled
+  Begin(testNum + 1);
+  Emit("addi t1, zero, 1");
+  Emit("sw t1, 0(a0)");
+  Emit("csrrs t1, mip, zero");
+  Emit("andi t1, t1, %d", MIP_MSIP);
+  Check("t1", MIP_MSIP);
+  Begin(testNum + 1);
+  Emit("addi t1, zero, %d", MIP_MSIP);
+  Emit("csrrw zero, mie, t1");
+  Emit("csrrsi zero, mstatus, %d", MSTATUS_MIE);
+  Check("s0", CAUSE_INTERRUPT | 3);
+  Check("s2", 1);
+  Emit("sw zero, 0(a0)");
+  Emit("csrrs t1, mip, zero");
+  Check("t1", 0);
+
+  // Setting mtime back below a distant mtimecmp raises nothing
+  Begin(testNum + 1);
+  Emit("addi t1, zero, -1");
+  Emit("sw t1, 0(a1)");
+  Emit("sw t1, 4(a1)");
+  Emit("sw zero, 0(a2)");
+  Emit("sw zero, 4(a2)");
+  Emit("addi t1, zero, 100");
+  Emit("addi t1, t1, -1");
+  Emit("bne t1, zero, -4");
+  Emit("csrrs t1, mip, zero");
+  Check("t1", 0);
+
+  // mtimecmp raises MTIP when mtime reaches it, which traps once enabled
+  Begin(testNum + 1);
+  Emit("lw t1, 0(a2)");
+  Emit("addi t1, t1, 200");
+  Emit("sw t1, 0(a1)");
+  Emit("sw zero, 4(a1)");
+  Emit("addi t1, zero, %d", MIP_MTIP);
+  Emit("csrrw zero, mie, t1");
+  Emit("csrrsi zero, mstatus, %d", MSTATUS_MIE);
+  Emit("addi t1, zero, 1");
+  Emit("beq s2, t1, 0");
+  Check("s0", CAUSE_INTERRUPT | 7);
+  Check("s2", 2);
+  Emit("csrrs t1, mip, zero");
+  Check("t1", MIP_MTIP);
+  Begin(testNum + 1);
+  Emit("addi t1, zero, -1");
+  Emit("sw t1, 4(a1)");
+  Emit("csrrs t1, mip, zero");
+  Check("t1", 0);
+  Epilogue();
+}
+
+
+static void Test_ma_fetch() {
+  SystemPrologue();
+
+  // A jump to a misaligned target traps at the jump, which doesn't link
+  Begin(testNum + 1);
+  Emit("addi ra, zero, 0");
+  uint32_t at = pc;
+  Emit("jal ra, 6");
+  Check("s0", CAUSE_MISALIGNED_FETCH);
+  Check("s1", at + 6);
+  Check("s2", 1);
+  Check("ra", 0);
+  Begin(testNum + 1);
+  Li("t1", CODE_BASE + 2);
+  Emit("jalr ra, 0(t1)");
+  Check("s1", CODE_BASE + 2);
+  Check("s2", 2);
+  Check("ra", 0);
+
+  // jalr clears the low bit first
+  Begin(testNum + 1);
+  Li("t1", pc + 8 + 8 + 1);
+  at = pc;
+  Emit("jalr ra, 0(t1)");
+  Jump(failAddr);
+  Check("s2", 2);
+  Check("ra", at + 4);
+
+  // So does a taken branch, but not one that falls through
+  Begin(testNum + 1);
+  at = pc;
+  Emit("beq zero, zero, 6");
+  Check("s0", CAUSE_MISALIGNED_FETCH);
+  Check("s1", at + 6);
+  Check("s2", 3);
+  Begin(testNum + 1);
+  Emit("bne zero, zero, 6");
+  Check("s2", 3);
+  Epilogue();
+}
+
+
+// The Sv32 tests map RAM to itself with a superpage for supervisor mode,
+// and again at SUPER without execute. VM is mapped by TABLE as below, and
+// by TABLE2 under ROOT2. PAGE0 to PAGE2 start with words that tell them
+// apart, and RETURN_PAGE with a return to ra.
+enum {
+  PTE_V = 1 << 0, PTE_R = 1 << 1, PTE_W = 1 << 2, PTE_X = 1 << 3,
+  PTE_U = 1 << 4, PTE_A = 1 << 6, PTE_D = 1 << 7,
+};
+
+#define VM          0x0040'0000
+#define SUPER       0x0080'0000
+#define ROOT        (DATA_BASE + 0x8000)
+#define TABLE       (DATA_BASE + 0x9000)
+#define PAGE0       (DATA_BASE + 0xA000)
+#define PAGE1       (DATA_BASE + 0xB000)
+#define PAGE2       (DATA_BASE + 0xC000)
+#define RETURN_PAGE (DATA_BASE + 0xD000)
+#define ROOT2       (DATA_BASE + 0xE000)
+#define TABLE2      (DATA_BASE + 0xF000)
+
+static uint32_t Pte(uint32_t pa, uint32_t flags) {
+  return pa >> 12 << 10 | flags | PTE_V;
+}
+
+static void MapPages() {
+  static const struct { uint32_t pa, flags; } pages[] = {
+    { PAGE0,       PTE_R | PTE_W                         }, // VM, A and D clear
+    { PAGE1,       PTE_R | PTE_W | PTE_U | PTE_A | PTE_D }, // + 0x1000
+    { PAGE2,       PTE_X | PTE_A                         }, // + 0x2000
+    { PAGE0,       PTE_R | PTE_A                         }, // + 0x3000
+    { 0,           0                                     }, // + 0x4000, invalid
+    { RETURN_PAGE, PTE_X | PTE_A                         }, // + 0x5000
+    { PAGE1,       PTE_R | PTE_W | PTE_A | PTE_D         }, // + 0x6000
+  };
+  for(size_t i = 0; i < sizeof pages / sizeof *pages; i++)
+    CPUWrite32(TABLE + 4 * i, pages[i].flags ? Pte(pages[i].pa, pages[i].flags) : 0);
+  CPUWrite32(TABLE2 + 4 * 6, Pte(PAGE2, PTE_R | PTE_A));
+  for(uint32_t root = ROOT; root <= ROOT2; root += ROOT2 - ROOT) {
+    CPUWrite32(root, Pte(0, PTE_R | PTE_W | PTE_X | PTE_A | PTE_D));
+    CPUWrite32(root + 4 * (VM >> 22), Pte(root == ROOT ? TABLE : TABLE2, 0));
+  }
+  CPUWrite32(ROOT + 4 * (SUPER >> 22), Pte(0, PTE_R | PTE_W | PTE_A | PTE_D));
+  CPUWrite32(PAGE0, 0x1111'1111);
+  CPUWrite32(PAGE1, 0x2222'2222);
+  CPUWrite32(PAGE2, 0x3333'3333);
+  CPUWrite32(RETURN_PAGE, Assemble("jalr zero, 0(ra)"));
+}
+
+
+// Turns on paging from root and drops to supervisor mode
+static void EnterPaging(uint32_t root) {
+  Li("t0", SATP_MODE | root >> 12);
+  Emit("csrrw zero, satp, t0");
+  EnterMode(PRIV_S);
+}
+
+
+static void Test_vm() {
+  SystemPrologue();
+  MapPages();
+  EnterPaging(ROOT);
+
+  // The walk goes through both levels, or stops at a superpage
+  Begin(testNum + 1);
+  Li("a0", VM);
+  Emit("lw t1, 0(a0)");
+  Check("t1", 0x1111'1111);
+  Li("a1", SUPER + PAGE1);
+  Emit("lw t1, 0(a1)");
+  Check("t1", 0x2222'2222);
+
+  // A load sets the accessed bit, a store the dirty bit too
+  Begin(testNum + 1);
+  Li("a2", TABLE);
+  Emit("lw t1, 0(a2)");
+  Emit("andi t1, t1, %d", PTE_A | PTE_D);
+  Check("t1", PTE_A);
+  Emit("sw a2, 0(a0)");
+  Emit("lw t1, 0(a2)");
+  Emit("andi t1, t1, %d", PTE_A | PTE_D);
+  Check("t1", PTE_A | PTE_D);
+  Li("a1", PAGE0);
+  Emit("lw t1, 0(a1)");
+  Check("t1", TABLE);
+
+  // Each kind of access has its page fault, with the address in mtval
+  Begin(testNum + 1);
+  Li("a3", VM + 0x4000);
+  Emit("lw t1, 0(a3)");
+  Check("s0", CAUSE_LOAD_PAGE_FAULT);
+  Check("s1", VM + 0x4000);
+  Li("a3", VM + 0x3000);
+  Emit("lw t1, 0(a3)");
+  Check("t1", TABLE);
+  Emit("sw zero, 0(a3)");
+  Check("s0", CAUSE_STORE_PAGE_FAULT);
+  Check("s1", VM + 0x3000);
+  Li("t1", VM + 0x4FFC);
+  Emit("jalr ra, 0(t1)");
+  Check("s0", CAUSE_FETCH_PAGE_FAULT);
+  Check("s1", VM + 0x4FFC);
+  Check("s2", 3);
+
+  // Cached translations go on sfence.vma, and on writes to satp
+  Begin(testNum + 1);
+  Li("a4", VM + 0x6000);
+  Emit("lw t1, 0(a4)");
+  Check("t1", 0x2222'2222);
+  Li("t1", Pte(PAGE0, PTE_R | PTE_A));
+  Emit("sw t1, %d(a2)", 4 * 6);
+  Emit("sfence.vma zero, zero");
+  Emit("lw t1, 0(a4)");
+  Check("t1", TABLE);
+  Li("t1", SATP_MODE | ROOT2 >> 12);
+  Emit("csrrw zero, satp, t1");
+  Emit("lw t1, 0(a4)");
+  Check("t1", 0x3333'3333);
+  ToMachine();
+  Epilogue();
+}
+
+
+static void Test_sum_mxr() {
+  SystemPrologue();
+  MapPages();
+  EnterPaging(ROOT);
+
+  // Supervisor mode reaches user pages only with SUM
+  Begin(testNum + 1);
+  Li("a0", VM + 0x1000);
+  Emit("lw t1, 0(a0)");
+  Check("s0", CAUSE_LOAD_PAGE_FAULT);
+  Check("s1", VM + 0x1000);
+  Li("t0", MSTATUS_SUM);
+  Emit("csrrs zero, sstatus, t0");
+  Emit("lw t1, 0(a0)");
+  Check("t1", 0x2222'2222);
+  Emit("sw t1, 0(a0)");
+  Check("s2", 1);
+  Li("t0", MSTATUS_SUM);
+  Emit("csrrc zero, sstatus, t0");
+  Emit("sw zero, 0(a0)");
+  Check("s0", CAUSE_STORE_PAGE_FAULT);
+  Check("s2", 2);
+
+  // It reads execute-only pages only with MXR
+  Begin(testNum + 1);
+  Li("a1", VM + 0x2000);
+  Emit("lw t1, 0(a1)");
+  Check("s0", CAUSE_LOAD_PAGE_FAULT);
+  Check("s1", VM + 0x2000);
+  Li("t0", MSTATUS_MXR);
+  Emit("csrrs zero, sstatus, t0");
+  Emit("lw t1, 0(a1)");
+  Check("t1", 0x3333'3333);
+  Check("s2", 3);
+  ToMachine();
+  Epilogue();
+}
+
+
+static void Test_deleg() {
+  SystemPrologue();
+  MapPages();
+
+  // Delegated exceptions from user and supervisor mode go to supervisor
+  // mode, the rest to machine mode, which also takes its own
+  Begin(testNum + 1);
+  Li("t0", 1 << CAUSE_ILLEGAL | 1 << CAUSE_LOAD_PAGE_FAULT);
+  Emit("csrrw zero, medeleg, t0");
+  EnterMode(PRIV_U);
+  Emit("csrrs t1, mstatus, zero");
+  Check("s0", CAUSE_ILLEGAL);
+  Check("s4", 1);
+  ToMachine();
+  Check("s0", CAUSE_ECALL_U);
+  Emit("csrrw zero, cycle, zero");
+  Check("s0", CAUSE_ILLEGAL);
+  Check("s2", 2);
+  Begin(testNum + 1);
+  EnterPaging(ROOT);
+  Li("a0", VM + 0x4000);
+  Emit("lw t1, 0(a0)");
+  Check("s0", CAUSE_LOAD_PAGE_FAULT);
+  Check("s1", VM + 0x4000);
+  Check("s4", 2);
+  Emit("andi t1, s3, %d", MSTATUS_SPP);
+  Check("t1", MSTATUS_SPP);
+  Emit("sw zero, 0(a0)");
+  Check("s0", CAUSE_STORE_PAGE_FAULT);
+  Check("s2", 3);
+  ToMachine();
+
+  // Delegated interrupts go to supervisor mode while sstatus.SIE enables
+  // them. The rest go to machine mode, always enabled below it.
+  Begin(testNum + 1);
+  Emit("csrrw zero, satp, zero");
+  Emit("csrrwi zero, mideleg, %d", MIP_SSIP);
+  Emit("csrrwi zero, mie, %d", MIP_MSIP);
+  EnterMode(PRIV_S);
+  Emit("csrrsi zero, sie, %d", MIP_SSIP);
+  Emit("csrrsi zero, sip, %d", MIP_SSIP);
+  Check("s4", 2);
+  Emit("csrrsi zero, sstatus, %d", MSTATUS_SIE);
+  Check("s0", CAUSE_INTERRUPT | 1);
+  Check("s4", 3);
+  Emit("csrrci zero, sip, %d", MIP_SSIP);
+  Li("a0", CLINT_BASE);
+  Emit("addi t1, zero, 1");
+  Emit("sw t1, 0(a0)");
+  Check("s0", CAUSE_INTERRUPT | 3);
+  Check("s2", 5);
+  Emit("sw zero, 0(a0)");
+  ToMachine();
+  Epilogue();
+}
+
+
+// Emits an sret to the next instruction
+static void SRet() {
+  Emit("auipc t0, 0");
+  Emit("addi t0, t0, 16");
+  Emit("csrrw zero, sepc, t0");
+  Emit("sret");
+}
+
+
+static void Test_priv() {
+  SystemPrologue();
+
+  // mret drops to the level in MPP, which ecall reports
+  Begin(testNum + 1);
+  EnterMode(PRIV_S);
+  ToMachine();
+  Check("s0", CAUSE_ECALL_U + PRIV_S);
+  Emit("srli t1, s3, 11");
+  Check("t1", PRIV_S);
+  EnterMode(PRIV_U);
+  ToMachine();
+  Check("s0", CAUSE_ECALL_U);
+  Emit("srli t1, s3, 11");
+  Emit("andi t1, t1, 3");
+  Check("t1", PRIV_U);
+
+  // sret drops to the level in SPP
+  Begin(testNum + 1);
+  EnterMode(PRIV_S);
+  Li("t0", MSTATUS_SPP);
+  Emit("csrrc zero, sstatus, t0");
+  SRet();
+  ToMachine();
+  Check("s0", CAUSE_ECALL_U);
+  EnterMode(PRIV_S);
+  Li("t0", MSTATUS_SPP);
+  Emit("csrrs zero, sstatus, t0");
+  SRet();
+  ToMachine();
+  Check("s0", CAUSE_ECALL_U + PRIV_S);
+
+  // Neither returns from below its level
+  Begin(testNum + 1);
+  EnterMode(PRIV_S);
+  Emit("mret");
+  Check("s0", CAUSE_ILLEGAL);
+  ToMachine();
+  EnterMode(PRIV_U);
+  Emit("sret");
+  Check("s0", CAUSE_ILLEGAL);
+  ToMachine();
+  Check("s2", 8);
+  Epilogue();
+}
+
+
+// Engines that model the whole machine, for tests of its CSRs and devices.
+// The reference implements RV32I alone, and the paged engines run the
+// tests in supervisor mode. Lockstep takes what the reference can't do
+// from the engine, except translation, which tests of paging need.
+#define MACHINE_ENGINES 0b11011
+#define PAGING_ENGINES  0b00011
+
+typedef struct {
+  const char *name;
+  void (*build)();
+  unsigned engines; // A mask of the engines it runs on, all if 0
+  const char *elf;  // An executable run in place of build, if set
+  uint32_t tohost;  // Its tohost symbol
+} Test;
+
+#define T(OP) { "rv32ui-"#OP, Test_##OP }
+#define M(OP) { "rv32mi-"#OP, Test_##OP, MACHINE_ENGINES }
+#define S(OP) { "rv32si-"#OP, Test_##OP, MACHINE_ENGINES }
+#define V(OP) { "rv32si-"#OP, Test_##OP, PAGING_ENGINES }
+static const Test tests[] = {
+  T(simple), T(fence_i),
+  T(lui), T(auipc), T(jal), T(jalr),
+  T(beq), T(bne), T(blt), T(bge), T(bltu), T(bgeu),
+  T(lb), T(lh), T(lw), T(lbu), T(lhu), T(sb), T(sh), T(sw),
+  T(addi), T(slti), T(sltiu), T(xori), T(ori), T(andi), T(slli), T(srli), T(srai),
+  T(add), T(sub), T(sll), T(slt), T(sltu), T(xor), T(srl), T(sra), T(or), T(and),
+  M(clint), M(ma_fetch),
+  V(vm), V(sum_mxr), S(deleg), S(priv),
+};
+#undef V
+#undef S
+#undef M
+#undef T
+
+
+// An engine runs the loaded image from reg[PC]. The plain executor runs
+// when no hooks are set; enabling every hook selects its instrumented copy.
+// The paged engines run in supervisor mode with RAM mapped to itself by
+// superpages, which selects the paged executors. Engines with their own
+// run function replace CPUStep.
+typedef struct {
+  const char *name;
+  void (*enter)();
+  void (*leave)();
+  unsigned (*run)(unsigned cycles);
+} Engine;
+
+static void EnterInstrumented() {
+  ProfileStart(7);
+  StatsStart();
+  TimingStart();
+}
+
+static void LeaveInstrumented() {
+  TimingStop();
+  StatsStop();
+  ProfileStop();
+}
+
+static void EnterPaged() {
+  for(uint32_t a = 0; a < MEM_SIZE; a += 1 << 22)
+    CPUWrite32(PAGES + 4 * (a >> 22), a >> 12 << 10 | 0xCF); // DAXWRV
+  csr.satp = SATP_MODE | PAGES >> 12;
+  csr.priv = PRIV_S;
+  MMUFlush();
+}
+
+static unsigned RunReference(unsigned cycles) {
+  RefHart h = { .mem = mem };
+  memcpy(h.reg, reg, sizeof reg);
+  cycles = RefRun(&h, cycles);
+  memcpy(reg, h.reg, sizeof reg);
+  return cycles;
+}
+
+static unsigned Lockstep(unsigned cycles, bool instrumented) {
+  bool diverged;
+  if(LockstepStart(instrumented))
+    return cycles;
+  cycles = LockstepRun(cycles, &diverged);
+  LockstepStop();
+  return cycles;
+}
+
+static unsigned RunLockstep(unsigned cycles)      { return Lockstep(cycles, true);  }
+static unsigned RunLockstepPlain(unsigned cycles) { return Lockstep(cycles, false); }
+
+static const Engine engines[] = {
+  { "switch",         NULL,              NULL,              NULL             },
+  { "instrumented",   EnterInstrumented, LeaveInstrumented, NULL             },
+  { "reference",      NULL,              NULL,              RunReference     },
+  { "lockstep",       NULL,              NULL,              RunLockstep      },
+  { "lockstep-plain", NULL,              NULL,              RunLockstepPlain },
+  { "paged",          EnterPaged,        NULL,              NULL             },
+  { "lockstep-paged", EnterPaged,        NULL,              RunLockstepPlain },
+};
+
+#define NUM_ENGINES (sizeof engines / sizeof *engines)
+
+
+typedef struct {
+  uint32_t reg[NUM_REGS];
+  uint32_t tohost;
+  uint64_t memHash;
+} State;
+
+
+static uint64_t HashMemory(uint32_t lo, uint32_t hi) {
+  uint64_t h = 0xCBF2'9CE4'8422'2325u;
+  for(uint32_t a = lo; a < hi; a++)
+    h = (h ^ mem[a]) * 0x0000'0100'0000'01B3u;
+  return h;
+}
+
+
+// An executable runs on a machine of its own, which it loads into
+static bool RunEngine(const Test *t, const Engine *e, State *s) {
+  Machine *m = NULL;
+  if(t->elf) {
+    if(!(m = MachineCreate()) || MachineLoad(m, t->elf, 0)) {
+      MachineDestroy(m);
+      return false;
+    }
+    MachineBind(m);
+  } else {
+    memset(&mem[TOHOST], 0, TEST_END - TOHOST);
+    t->build();
+    Reset();
+    reg[PC] = CODE_BASE;
+  }
+
+  if(e->enter)
+    e->enter();
+  (e->run ? e->run : CPUStep)(BUDGET);
+  if(e->leave)
+    e->leave();
+
+  memcpy(s->reg, reg, sizeof reg);
+  s->tohost = CPURead32(t->elf ? t->tohost : TOHOST);
+  s->memHash = t->elf ? HashMemory(0, MEM_SIZE) : HashMemory(TOHOST, TEST_END);
+  MachineDestroy(m);
+  return true;
+}
+
+
+static bool RunTest(const Test *t, bool verbose) {
+  State state[NUM_ENGINES];
+  bool ok = true;
+
+  for(size_t i = 0; i < NUM_ENGINES; i++) {
+    if(t->engines && !(t->engines >> i & 1))
+      continue;
+    State *s = &state[i];
+    if(!RunEngine(t, &engines[i], s)) {
+      printf("%-16s FAIL can't load '%s'\n", t->name, t->elf);
+      return false;
+    }
+    if(s->tohost == 1)
+      ;
+    else if(s->tohost & 1) {
+      printf("%-16s %-14s FAIL test %u\n", t->name, engines[i].name, s->tohost >> 1);
+      ok = false;
+    } else {
+      printf("%-16s %-14s FAIL no signature, pc %08X\n", t->name, engines[i].name, s->reg[PC]);
+      ok = false;
+    }
+
+    if(i == 0)
+      continue;
+    for(int r = 0; r < NUM_REGS; r++) {
+      if(s->reg[r] != state[0].reg[r]) {
+        printf("%-16s %-14s DIVERGE %s %08X, %s has %08X\n", t->name, engines[i].name,
+            reg_names[r], s->reg[r], engines[0].name, state[0].reg[r]);
+        ok = false;
+      }
+    }
+    if(s->memHash != state[0].memHash) {
+      printf("%-16s %-14s DIVERGE memory\n", t->name, engines[i].name);
+      ok = false;
+    }
+  }
+  if(ok && verbose)
+    printf("%-16s pass\n", t->name);
+  return ok;
+}
+
+// Runs a riscv-tests executable, which reports through its tohost symbol
+static bool RunELF(const char *path, bool verbose) {
+  const char *name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+  SymbolsClear();
+  const Symbol *tohost = SymbolsLoadELF(path) > 0 ? SymbolFind("tohost") : NULL;
+  if(!tohost || tohost->addr > MEM_SIZE - 4) {
+    printf("%-16s FAIL no tohost in RAM\n", name);
+    SymbolsClear();
+    return false;
+  }
+  Test t = { name, NULL, MACHINE_ENGINES, path, tohost->addr };
+  SymbolsClear();
+  return RunTest(&t, verbose);
+}
+
+// Unit tests report each failed expectation and carry on
+static const char *unitName;
+static bool        unitOk;
+
+#define EXPECT(C) do {\
+    if(!(C)) {\
+      printf("%-16s FAIL line %d: %s\n", unitName, __LINE__, #C);\
+      unitOk = false;\
+    }\
+  } while(0)
+
+
+// Calls visit with words over a sweep of the fields that select an
+// instruction
+static void SweepEncodings(void (*visit)(uint32_t ins)) {
+  static const uint8_t f7s[] = { 0x00, 0x01, 0x08, 0x09, 0x18, 0x20, 0x21, 0x7F };
+  static const uint8_t rs2s[] = { 0, 1, 2, 5, 31 };
+  static const uint8_t others[] = { 0, 1, 31 };
+  for(uint32_t opc = 0b11; opc < 0x80; opc += 4)
+  for(uint32_t f3 = 0; f3 < 8; f3++)
+  for(size_t f7 = 0; f7 < sizeof f7s; f7++)
+  for(size_t rs2 = 0; rs2 < sizeof rs2s; rs2++)
+  for(size_t rs1 = 0; rs1 < sizeof others; rs1++)
+  for(size_t rd = 0; rd < sizeof others; rd++)
+    visit(opc | others[rd] << 7 | f3 << 12 | others[rs1] << 15 |
+          rs2s[rs2] << 20 | (uint32_t)f7s[f7] << 25);
+}
+
+
+static const char *const mnemonics[] = {
+    "lui", "auipc", "jal", "jalr", "beq", "bne", "blt", "bge", "bltu", "bgeu",
+    "lb", "lh", "lw", "lbu", "lhu", "sb", "sh", "sw",
+    "addi", "slti", "sltiu", "xori", "ori", "andi", "slli", "srli", "srai",
+    "add", "sub", "sll", "slt", "sltu", "xor", "srl", "sra", "or", "and",
+    "fence", "fence.i",
+    "ecall", "ebreak", "mret", "wfi", "sret", "sfence.vma",
+  "csrrw", "csrrs", "csrrc", "csrrwi", "csrrsi", "csrrci",
+};
+enum { NUM_MNEMONICS = sizeof mnemonics / sizeof *mnemonics };
+static bool     seen[NUM_MNEMONICS];
+static unsigned failures;
+
+static void RoundTrip(uint32_t ins) {
+  char text[UNASSEMBLE_MAX];
+  if(Unassemble(CODE_BASE, ins, text))
+    return;
+  uint32_t again = Assemble(text);
+  if(again != ins && failures++ < 8)
+    printf("%-16s FAIL %08X is '%s', which assembles to %08X\n", unitName, ins, text, again);
+  size_t len = strcspn(text, " ");
+  for(int i = 0; i < NUM_MNEMONICS; i++)
+    if(strlen(mnemonics[i]) == len && !strncmp(text, mnemonics[i], len))
+      seen[i] = true;
+}
+
+// A device that counts its reads
+static unsigned probeReads;
+
+static uint32_t ProbeRead([[maybe_unused]] uint32_t offset, [[maybe_unused]] unsigned size) {
+  probeReads++;
+  return 0;
+}
+
+static void ProbeWrite([[maybe_unused]] uint32_t offset, [[maybe_unused]] uint32_t value,
+                       [[maybe_unused]] unsigned size) {
+}
+
+static const MMIODevice probe = { "probe", 0x1000'F000, 0x1000, ProbeRead, ProbeWrite };
+
+// Every word the disassembler accepts assembles back to itself, and
+// together they cover every mnemonic
+static void Test_roundtrip() {
+  failures = 0;
+  SweepEncodings(RoundTrip);
+  EXPECT(failures == 0);
+  for(int i = 0; i < NUM_MNEMONICS; i++)
+    if(!seen[i]) {
+      printf("%-16s FAIL %s never decoded\n", unitName, mnemonics[i]);
+      unitOk = false;
+    }
+
+  // Looking back for an auipc doesn't read devices
+  char text[UNASSEMBLE_MAX];
+  EXPECT(!MMIOMap(&probe));
+  probeReads = 0;
+  EXPECT(!Unassemble(probe.base + 4, Assemble("lw a0, 0(a0)"), text) && !probeReads);
+  MMIOUnmap(&probe);
+}
+
+
+// Whether ins jumps to a misaligned target, which traps, as Agree sets the
+// registers. Bit 1 of the offset is bit 21 of jal and jalr, and bit 8 of a
+// branch.
+static bool MisalignedJump(uint32_t ins) {
+  uint32_t a = ins >> 15 & 31 ? DATA_BASE : 0, b = ins >> 20 & 31 ? DATA_BASE : 0;
+  unsigned f3 = ins >> 12 & 7;
+  switch(ins & 0x7F) {
+  case 0b1101111:
+  case 0b1100111: return ins >> 21 & 1;
+  case 0b1100011: return ins >> 8 & 1 && (f3 >> 2 ? a < b : a == b) != (f3 & 1);
+  }
+  return false;
+}
+
+
+// Outside the system opcode, whose CSRs and returns depend on the state,
+// the executor and the reference run exactly what the disassembler accepts,
+// except jumps that trap
+static void Agree(uint32_t ins) {
+  if((ins & 0x7F) == 0b1110011)
+    return;
+  Reset();
+  for(int r = 1; r < NUM_BASE_REGS; r++)
+    reg[r] = DATA_BASE;
+  reg[PC] = CODE_BASE;
+  CPUWrite32(CODE_BASE, ins);
+  char text[UNASSEMBLE_MAX];
+  bool valid = !Unassemble(CODE_BASE, ins, text) && !MisalignedJump(ins);
+  RefHart h = { .mem = mem };
+  memcpy(h.reg, reg, sizeof reg);
+  bool refRan = RefStep(&h);
+  bool ran = CPUStep(1) == 0;
+  if((ran != valid || refRan != valid) && failures++ < 8)
+    printf("%-16s FAIL %08X is %s, executor %s, reference %s\n", unitName, ins,
+        valid ? "valid" : "invalid", ran ? "ran" : "stopped", refRan ? "ran" : "stopped");
+}
+
+static void Test_decode() {
+  failures = 0;
+  SweepEncodings(Agree);
+  EXPECT(failures == 0);
+}
+
+
+static uint32_t DiskReg(unsigned offset)                 { return CPURead32(DISK_BASE + offset); }
+static void     SetDiskReg(unsigned offset, uint32_t v)  { CPUWrite32(DISK_BASE + offset, v); }
+
+// Reads, writes and flushes through the registers of a disk on a scratch
+// image of four sectors
+static void Test_disk() {
+  enum { SECTORS = 4 };
+  static uint8_t data[SECTORS * DISK_SECTOR];
+  for(size_t i = 0; i < sizeof data; i++)
+    data[i] = i * 7 + i / DISK_SECTOR;
+  char path[] = "/tmp/r64000-check-XXXXXX";
+  int fd = mkstemp(path);
+  EXPECT(fd >= 0);
+  if(fd < 0)
+    return;
+  EXPECT(write(fd, data, sizeof data) == sizeof data);
+  close(fd);
+  EXPECT(!DiskStart(path, false));
+
+  EXPECT(DiskReg(0x18) == SECTORS);
+  SetDiskReg(0x00, 1);
+  SetDiskReg(0x04, DATA_BASE);
+  SetDiskReg(0x08, 2);
+  SetDiskReg(0x0C, DISK_READ);
+  EXPECT(DiskReg(0x10) == DISK_DONE);
+  EXPECT(!memcmp(&mem[DATA_BASE], &data[DISK_SECTOR], 2 * DISK_SECTOR));
+  SetDiskReg(0x10, DISK_DONE);
+  EXPECT(DiskReg(0x10) == 0);
+
+  memset(&mem[DATA_BASE], 0xA5, DISK_SECTOR);
+  SetDiskReg(0x00, 3);
+  SetDiskReg(0x08, 1);
+  SetDiskReg(0x0C, DISK_WRITE);
+  EXPECT(DiskReg(0x10) == DISK_DONE);
+  SetDiskReg(0x0C, DISK_FLUSH);
+  EXPECT(DiskReg(0x10) == DISK_DONE);
+  uint8_t sector[DISK_SECTOR];
+  fd = open(path, O_RDONLY);
+  EXPECT(pread(fd, sector, sizeof sector, 3 * DISK_SECTOR) == sizeof sector);
+  close(fd);
+  EXPECT(sector[0] == 0xA5 && !memcmp(sector, sector + 1, sizeof sector - 1));
+
+  // Past the end of the image, past the end of RAM, and an unknown command
+  SetDiskReg(0x08, 2);
+  SetDiskReg(0x0C, DISK_READ);
+  EXPECT(DiskReg(0x10) == (DISK_DONE | DISK_ERROR));
+  SetDiskReg(0x00, 0);
+  SetDiskReg(0x04, MEM_SIZE - DISK_SECTOR);
+  SetDiskReg(0x0C, DISK_READ);
+  EXPECT(DiskReg(0x10) == (DISK_DONE | DISK_ERROR));
+  SetDiskReg(0x0C, 9);
+  EXPECT(DiskReg(0x10) == (DISK_DONE | DISK_ERROR));
+  SetDiskReg(0x10, DISK_ERROR);
+  EXPECT(DiskReg(0x10) == DISK_DONE);
+
+  DiskStop();
+  unlink(path);
+}
+
+
+static uint32_t DMAReg(unsigned offset)                 { return CPURead32(DMA_BASE + offset); }
+static void     SetDMAReg(unsigned offset, uint32_t v)  { CPUWrite32(DMA_BASE + offset, v); }
+
+static void Transfer(uint32_t command, uint32_t src, uint32_t dst, uint32_t length) {
+  SetDMAReg(0x10, DMA_DONE | DMA_ERROR);
+  SetDMAReg(0x00, src);
+  SetDMAReg(0x04, dst);
+  SetDMAReg(0x08, length);
+  SetDMAReg(0x0C, command);
+}
+
+static void Test_dma() {
+  uint8_t *a = &mem[DATA_BASE], *b = &mem[DATA_BASE + 0x1000];
+  for(int i = 0; i < 256; i++)
+    a[i] = i;
+  memset(b, 0, 256);
+  Transfer(DMA_COPY, DATA_BASE, DATA_BASE + 0x1000, 256);
+  EXPECT(DMAReg(0x10) == DMA_DONE);
+  EXPECT(!memcmp(a, b, 256));
+
+  Transfer(DMA_FILL, 0x1234'56C3, DATA_BASE + 0x1001, 7);
+  EXPECT(DMAReg(0x10) == DMA_DONE);
+  EXPECT(b[0] == 0 && b[1] == 0xC3 && b[7] == 0xC3 && b[8] == 8);
+
+  // Overlapping both ways behaves as memmove
+  Transfer(DMA_COPY, DATA_BASE, DATA_BASE + 3, 64);
+  EXPECT(a[3] == 0 && a[66] == 63);
+  Transfer(DMA_COPY, DATA_BASE + 3, DATA_BASE, 64);
+  for(int i = 0; i < 64; i++)
+    EXPECT(a[i] == i);
+
+  // Also when the destination leaves RAM, which takes the slow path
+  for(int i = 0; i < 16; i++)
+    mem[MEM_SIZE - 16 + i] = i;
+  Transfer(DMA_COPY, MEM_SIZE - 16, MEM_SIZE - 12, 16);
+  EXPECT(DMAReg(0x10) == DMA_DONE);
+  for(int i = 0; i < 12; i++)
+    EXPECT(mem[MEM_SIZE - 12 + i] == i);
+
+  // An unknown command, and a range past the end of the address space
+  Transfer(3, DATA_BASE, DATA_BASE + 0x1000, 4);
+  EXPECT(DMAReg(0x10) == (DMA_DONE | DMA_ERROR));
+  Transfer(DMA_FILL, 0, 0xFFFF'FFF0, 0x20);
+  EXPECT(DMAReg(0x10) == (DMA_DONE | DMA_ERROR));
+  SetDMAReg(0x10, DMA_ERROR);
+  EXPECT(DMAReg(0x10) == DMA_DONE);
+}
+
+
+// Jump and branch targets are addresses, as listings show them, and
+// character literals may be commas
+static void Test_asm() {
+  AsmImage image;
+  EXPECT(!AsmSource("  beq  zero, zero, 0x20010\n"
+                    "  j    0x20000\n"
+                    "  addi a0, zero, ','  # ','\n"
+                    "  .byte ',', '#', 1\n", "asm", CODE_BASE, &image));
+  uint32_t ins[3] = {0};
+  if(image.textSize == 15)
+    memcpy(ins, image.data, sizeof ins);
+  EXPECT(image.textSize == 15);
+  EXPECT(ins[0] == Assemble("beq zero, zero, 16"));
+  EXPECT(ins[1] == Assemble("jal zero, -4"));
+  EXPECT(ins[2] == Assemble("addi a0, zero, 44"));
+  EXPECT(image.textSize == 15 && !memcmp(&image.data[12], ",#\1", 3));
+  AsmFree(&image);
+
+  // fence alone orders everything
+  EXPECT(!AsmSource("  fence\n  fence r, rw\n", "asm", CODE_BASE, &image));
+  if(image.textSize == 8)
+    memcpy(ins, image.data, 8);
+  EXPECT(ins[0] == 0x0FF0'000F && ins[1] == 0x0230'000F);
+  AsmFree(&image);
+}
+
+
+// A program in the style of riscv-tests' p environment, whose ecall ends
+// in a loop writing gp to tohost
+static const char elfProgram[] =
+  "_start:\n"
+  "  j     reset\n"
+  "trap:\n"
+  "  la    t5, tohost\n"
+  "write:\n"
+  "  sw    gp, 0(t5)\n"
+  "  j     write\n"
+  "reset:\n"
+  "  la    t0, trap\n"
+  "  csrw  mtvec, t0\n"
+  "  csrr  a0, mhartid\n"
+  "  li    gp, 2\n"
+  "  li    t1, 5\n"
+  "  addi  t1, t1, -2\n"
+  "  li    t2, 3\n"
+  "  bne   t1, t2, fail\n"
+  "  fence\n"
+  "  li    gp, 1\n"
+  "  ecall\n"
+  "fail:\n"
+  "  slli  gp, gp, 1\n"
+  "  ori   gp, gp, 1\n"
+  "  ecall\n"
+  "  .data\n"
+  "tohost:\n"
+  "  .word 0\n";
+
+static void Test_elf() {
+  char path[] = "/tmp/r64000-check-XXXXXX.elf";
+  int fd = mkstemps(path, 4);
+  EXPECT(fd >= 0);
+  if(fd < 0)
+    return;
+  close(fd);
+  AsmImage image;
+  EXPECT(!AsmSource(elfProgram, "elf", CODE_BASE, &image) && !AsmWrite(&image, path));
+  AsmFree(&image);
+  EXPECT(RunELF(path, false));
+  unlink(path);
+}
+
+
+// A breakpoint stops the engine alone, which isn't a divergence
+static void Test_lockstep() {
+  pc = CODE_BASE;
+  Emit("addi a0, zero, 1");
+  Emit("addi a0, a0, 1");
+  Emit("addi a0, a0, 1");
+  Emit("ebreak");
+  EXPECT(!BreakpointSet(CODE_BASE + 8, 1, NULL));
+  for(int instrumented = 0; instrumented < 2; instrumented++) {
+    bool diverged = true;
+    Reset();
+    reg[PC] = CODE_BASE;
+    EXPECT(!LockstepStart(instrumented));
+    EXPECT(LockstepRun(100, &diverged) && !diverged);
+    LockstepStop();
+    EXPECT(reg[PC] == CODE_BASE + 8 && reg[A0] == 2);
+  }
+  BreakpointClear(CODE_BASE + 8);
+}
+
+
+// Runs a monitor script with the output discarded, returning its status
+static int ScriptOn(Machine *m, const char *commands) {
+  FILE *f = fmemopen((void*)commands, strlen(commands), "r");
+  if(!f)
+    return -1;
+  fflush(stdout);
+  int out = dup(STDOUT_FILENO), null = open("/dev/null", O_WRONLY);
+  dup2(null, STDOUT_FILENO);
+  int status = RunMonitor(m, f);
+  fflush(stdout);
+  dup2(out, STDOUT_FILENO);
+  close(out);
+  close(null);
+  fclose(f);
+  return status;
+}
+
+static int Script(const char *commands) {
+  Machine *m = MachineCreate();
+  int status = m ? ScriptOn(m, commands) : -1;
+  MachineDestroy(m);
+  return status;
+}
+
+// A script's status is that of its last command, which q doesn't change
+static void Test_monitor() {
+  EXPECT(Script("r\n") == 0);
+  EXPECT(Script("bogus\n") == 1);
+  EXPECT(Script("bogus\nr\n") == 0);
+  EXPECT(Script("bogus\nq\n") == 1);
+  EXPECT(Script("r\nq\n") == 0);
+  EXPECT(Script("bogus\n# comment\n\nq\n") == 1);
+  EXPECT(Script("q\nbogus\n") == 0);
+
+  // Breakpoints take any aligned address, as the PC may be virtual, and
+  // share their bits with those a multiple of MEM_SIZE away
+  EXPECT(Script("b +0xC0000000\nb -0xC0000000\n") == 0);
+  EXPECT(Script("b +0xC0000002\n") == 1);
+  BreakpointSet(CODE_BASE + MEM_SIZE, 1, NULL);
+  BreakpointSet(CODE_BASE, 1, NULL);
+  BreakpointClear(CODE_BASE + MEM_SIZE);
+  EXPECT(IsBreakpoint(CODE_BASE) && BreakpointHit(CODE_BASE));
+  EXPECT(IsBreakpoint(CODE_BASE + MEM_SIZE) && !BreakpointHit(CODE_BASE + MEM_SIZE));
+  BreakpointClear(CODE_BASE);
+  EXPECT(!IsBreakpoint(CODE_BASE) && !(cpuHooks & CPU_HOOK_BREAK));
+
+  // Registers and memory change through the Machine calls, so x0 stays 0
+  Machine *m = MachineCreate();
+  uint8_t bytes[2];
+  EXPECT(ScriptOn(m, "r zero = 5\nr a0 = 7\ne 0x100 12 34\n") == 0);
+  EXPECT(MachineReadReg(m, ZERO) == 0 && MachineReadReg(m, A0) == 7);
+  EXPECT(!MachineReadMemory(m, 0x100, bytes, 2) && bytes[0] == 0x12 && bytes[1] == 0x34);
+  EXPECT(ScriptOn(m, "e 0xFFFFFFFF 12\n") == 1);
+  MachineDestroy(m);
+
+  // g runs from RAM only, unless fetches are translated. Then it stops at
+  // the zero word CODE_BASE is mapped at.
+  EXPECT(Script("g 0xFFFFFFF0\n") == 1);
+  EXPECT(Script("g 0x20002\n") == 1);
+  m = MachineCreate();
+  MachineBind(m);
+  CPUWrite32(PAGES + 4 * (0xC000'0000 >> 22), 0xCF); // 0 up, DAXWRV
+  csr.satp = SATP_MODE | PAGES >> 12;
+  csr.priv = PRIV_S;
+  MMUFlush();
+  EXPECT(ScriptOn(m, "g 0xC0020000\n") == 0 && reg[PC] == 0xC002'0000);
+  MachineDestroy(m);
+
+  // sparse is an option only as a word of its own
+  char dir[] = "/tmp/r64000-check-XXXXXX", cwd[512];
+  EXPECT(mkdtemp(dir) && getcwd(cwd, sizeof cwd) && !chdir(dir));
+  EXPECT(Script("w 0x20000 0x10 sparse.bin\n") == 0);
+  EXPECT(!access("sparse.bin", F_OK) && access(".bin", F_OK));
+  EXPECT(Script("w 0x20000 0x10 sparse  zeros\n") == 0);
+  EXPECT(!access("zeros", F_OK));
+  unlink("sparse.bin");
+  unlink(".bin");
+  unlink("zeros");
+  EXPECT(!chdir(cwd) && !rmdir(dir));
+}
+
+
+// Loads a loop that adds step to a0 and stores it, swaps it with mscratch
+// into a1, and reads minstret into a2
+static void LoadCounter(Machine *m, int step) {
+  const char *const loop[] = {
+    "addi a0, a0, %d", "sw a0, 0x100(zero)", "csrrw a1, mscratch, a0",
+    "csrrs a2, minstret, zero", "jal zero, -16",
+  };
+  for(int i = 0; i < 5; i++) {
+    char line[64];
+    snprintf(line, sizeof line, loop[i], step);
+    uint32_t ins = Assemble(line);
+    MachineWriteMemory(m, CODE_BASE + 4 * i, &ins, 4);
+  }
+  MachineWriteReg(m, A0, 0);
+  MachineWriteReg(m, MACHINE_PC, CODE_BASE);
+}
+
+// Two machines bound in turns get back their own registers, CSRs, clock
+// and RAM. Devices serve whichever machine runs, so with any mapped a
+// second can't be created, or run if it already exists.
+static void Test_machines() {
+  ClintStop();
+  DMAStop();
+  Machine *a = MachineCreate(), *b = MachineCreate();
+  EXPECT(a && b);
+  LoadCounter(a, 1);
+  LoadCounter(b, 2);
+  for(int i = 0; i < 2; i++) {
+    MachineRun(a, 125);
+    MachineRun(b, 150);
+  }
+  uint32_t stored[2];
+  EXPECT(!MachineReadMemory(a, 0x100, &stored[0], 4) && !MachineReadMemory(b, 0x100, &stored[1], 4));
+  EXPECT(MachineReadReg(a, A0) == 50 && MachineReadReg(a, A1) == 49 && stored[0] == 50);
+  EXPECT(MachineReadReg(b, A0) == 120 && MachineReadReg(b, A1) == 118 && stored[1] == 120);
+  EXPECT(MachineReadReg(a, A2) == 248 && MachineReadReg(b, A2) == 298);
+
+  EXPECT(ClintStart() == 0);
+  EXPECT(MachineRun(a, 10) == 10);
+  EXPECT(!MachineCreate());
+  MachineDestroy(b);
+  EXPECT(MachineRun(a, 10) == 0);
+  EXPECT(!MachineCreate());
+  MachineDestroy(a);
+  EXPECT(DMAStart() == 0);
+}
+
+
+typedef struct {
+  const char *name;
+  void (*run)();
+} UnitTest;
+
+#define U(NAME) { #NAME, Test_##NAME }
+static const UnitTest unitTests[] = {
+  U(roundtrip), U(decode), U(monitor), U(disk), U(dma), U(asm), U(elf), U(lockstep), U(machines),
+};
+#undef U
+
+
+static bool RunUnitTest(const UnitTest *t, bool verbose) {
+  unitName = t->name;
+  unitOk = true;
+  t->run();
+  if(unitOk && verbose)
+    printf("%-16s pass\n", t->name);
+  return unitOk;
+}
+
+
+int main(int argc, char *argv[]) {
+  bool verbose = false;
+  const char *only = NULL;
+  int opt;
+  while((opt = getopt(argc, argv, "vt:")) != -1) {
+    switch(opt) {
+    case 'v': verbose = true;  break;
+    case 't': only = optarg;   break;
+    default:
+      fprintf(stderr, "usage: %s [-v] [-t test] [executable...]\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if(ClintStart() || DMAStart()) {
+    fprintf(stderr, "can't map the devices\n");
+    return EXIT_FAILURE;
+  }
+  int run = 0, failed = 0;
+  for(size_t i = 0; i < sizeof tests / sizeof *tests; i++) {
+    if(only && strcmp(only, tests[i].name))
+      continue;
+    run++;
+    if(!RunTest(&tests[i], verbose))
+      failed++;
+  }
+  for(int i = optind; i < argc; i++) {
+    run++;
+    if(!RunELF(argv[i], verbose))
+      failed++;
+  }
+  printf("%d of %d tests passed on %zu engines\n", run - failed, run, NUM_ENGINES);
+
+  int unitRun = 0, unitFailed = 0;
+  for(size_t i = 0; i < sizeof unitTests / sizeof *unitTests; i++) {
+    if(only && strcmp(only, unitTests[i].name))
+      continue;
+    unitRun++;
+    if(!RunUnitTest(&unitTests[i], verbose))
+      unitFailed++;
+  }
+  printf("%d of %d unit tests passed\n", unitRun - unitFailed, unitRun);
+  return failed || unitFailed ? EXIT_FAILURE : EXIT_SUCCESS;
+}